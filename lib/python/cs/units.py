@@ -198,7 +198,7 @@ def parse(s, scale, offset=0):
 
       Parameters:
       * `s`: the string to parse.
-      * `scale`: a scale array of (factor, unit_name).
+      * `scale`: a scale array of `UnitStep`s (factor, unit, max_width).
       * `offset`: starting position for parse.
   '''
   offset = skipwhite(s, offset)
@@ -214,7 +214,7 @@ def parse(s, scale, offset=0):
     if vunit:
       vunit0 = vunit
       vunit = vunit.lower()
-      for factor, unit in scale:
+      for factor, unit, _ in scale:
         if unit.lower() == vunit:
           break
         if not factor:
@@ -228,7 +228,7 @@ def multiparse(s, scales, offset=0):
 
       Parameters:
       * `s`: the string to parse.
-      * `scales`: an iterable of scale arrays of (factor, unit_name).
+      * `scales`: an iterable of scale arrays of `UnitStep`s.
       * `offset`: starting position for parse.
   '''
   for scale in scales:
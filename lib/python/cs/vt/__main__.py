@@ -47,18 +47,23 @@ import cs.x
 from cs.x import X
 from . import common, defaults, DEFAULT_CONFIG_PATH
 from .archive import Archive, FileOutputArchive, CopyModes
-from .blockify import blocked_chunks_of
+from .bench import (
+    bench_inputs, bench_report, bench_scan, BENCH_BUFSIZES, BENCH_SIZE
+)
+from .blockify import blocked_chunks_of, new_scanner
 from .compose import get_store_spec
 from .config import Config, Store
-from .convert import expand_path
+from .convert import expand_path, scaled_value
 from .datafile import DataRecord, DataFilePushable
 from .debug import dump_chunk, dump_Block
 from .dir import Dir
+from .estimate import DedupeEstimate, estimate_paths, estimate_report
 from .hash import DEFAULT_HASHCLASS, HASHCLASS_BY_NAME
 from .index import LMDBIndex
 from .merge import merge
 from .parsers import scanner_from_filename
 from .paths import OSDir, OSFile, path_resolve
+from .scan import DEFAULT_MIN_RUN
 from .server import serve_tcp, serve_socket
 from .store import ProxyStore, DataDirStore
 from .transcribe import parse
@@ -173,7 +178,7 @@ class VTCmd(BaseCommand):
         * `argv`: the command line arguments after the command name
     '''
     options = self.options
-    cmd = self.cmd
+    cmd = options.cmd
     config = options.config
     runstate = options.runstate
     progress = options.progress
@@ -212,7 +217,8 @@ class VTCmd(BaseCommand):
                       config=config):
         # redo these because defaults is already initialised
         with stackattrs(defaults, runstate=runstate, progress=progress):
-          if cmd in ("config", "dump", "init", "profile", "scan", "test"):
+          if cmd in ("bench", "config", "dump", "estimate", "init", "profile",
+                     "scan", "test"):
             yield
           else:
             # open the default Store
@@ -297,6 +303,68 @@ class VTCmd(BaseCommand):
     P.print_stats(sort='cumulative')
     return xit
 
+  def cmd_bench(self, argv):
+    ''' Usage: {cmd} scan [-P] [-b bufsizes] [-n size] [-c chunking]
+              [-r rolling_hash] [paths...]
+          Benchmark the block scanners over random, zero filled and
+          text data and over the start of the files in paths,
+          reporting the rates in MB/s for scanbuf, the C and Python
+          Scanners and blocked_chunks_of, and the block sizes.
+          -P            Do not time the pure Python scanners.
+          -b bufsizes   Comma separated sizes of the buffers fed to
+                        the scanners.
+          -n size       The amount of each input to scan.
+          -c chunking   The chunking mode.
+          -r rolling_hash The rolling hash.
+    '''
+    if not argv:
+      raise GetoptError("missing bench subcommand")
+    subcmd = argv.pop(0)
+    with Pfx(subcmd):
+      if subcmd != 'scan':
+        raise GetoptError("unrecognised subcommand")
+      python = True
+      bufsizes = BENCH_BUFSIZES
+      size = BENCH_SIZE
+      scan_settings = {}
+      opts, argv = getopt(argv, 'Pb:c:n:r:')
+      for opt, val in opts:
+        with Pfx(opt):
+          if opt == '-P':
+            python = False
+          elif opt == '-b':
+            try:
+              bufsizes = [scaled_value(field) for field in val.split(',')]
+            except ValueError as e:
+              raise GetoptError("invalid bufsizes %r: %s" % (val, e))
+          elif opt == '-c':
+            scan_settings.update(chunking=val)
+          elif opt == '-n':
+            try:
+              size = scaled_value(val)
+            except ValueError as e:
+              raise GetoptError("invalid size %r: %s" % (val, e))
+          elif opt == '-r':
+            scan_settings.update(rolling_hash=val)
+          else:
+            raise RuntimeError("unhandled option")
+      results = []
+      for name, data, scanner in bench_inputs(size, argv):
+        with Pfx(name):
+          if not data:
+            warning("no data, skipped")
+            continue
+          for bufsize in bufsizes:
+            try:
+              result = bench_scan(
+                  data, bufsize, scanner, python=python, **scan_settings
+              )
+            except ValueError as e:
+              raise GetoptError(str(e))
+            results.append((name, bufsize, result))
+      bench_report(results, sys.stdout, python=python)
+    return 0
+
   def cmd_cat(self, argv):
     ''' Usage: {cmd} filerefs...
           Concatentate the contents of the supplied filerefs to stdout.
@@ -356,6 +424,74 @@ class VTCmd(BaseCommand):
           warning("unsupported file type: %r", path)
     return xit
 
+  def cmd_estimate(self, argv):
+    ''' Usage: {cmd} [-j threads] [-s bits|-H bits] [-a avg_block]
+              [-c chunking] [-m max_block] [-r rolling_hash] [-R min_run]
+              paths...
+          Estimate the deduplication of the files in or under paths
+          by blocking and hashing them as they would be stored,
+          without storing anything. Report the unique data size,
+          block counts, dedupe ratio, index size and block sizes.
+          The hashclass comes from the main -h option.
+          -j threads    Examine this many files in parallel.
+          -s bits       Sample the blocks whose hashcodes start with
+                        this many zero bits.
+          -H bits       Count the unique blocks with a HyperLogLog
+                        sketch of 2**bits registers.
+          -a avg_block, -c chunking, -m max_block, -r rolling_hash,
+          -R min_run    Block boundary settings.
+    '''
+    threads = None
+    sample_bits = 0
+    hll_bits = None
+    scan_settings = dict(min_run=DEFAULT_MIN_RUN)
+    opts, argv = getopt(argv, 'H:R:a:c:j:m:r:s:')
+    for opt, val in opts:
+      with Pfx(opt):
+        try:
+          if opt == '-H':
+            hll_bits = int(val)
+          elif opt == '-R':
+            scan_settings.update(min_run=scaled_value(val))
+          elif opt == '-a':
+            scan_settings.update(avg_block=scaled_value(val))
+          elif opt == '-c':
+            scan_settings.update(chunking=val)
+          elif opt == '-j':
+            threads = int(val)
+            if threads < 1:
+              raise ValueError("threads should be at least 1")
+          elif opt == '-m':
+            scan_settings.update(max_block=scaled_value(val))
+          elif opt == '-r':
+            scan_settings.update(rolling_hash=val)
+          elif opt == '-s':
+            sample_bits = int(val)
+          else:
+            raise RuntimeError("unhandled option")
+        except ValueError as e:
+          raise GetoptError("invalid value %r: %s" % (val, e))
+    if not argv:
+      raise GetoptError("missing paths")
+    try:
+      # check the settings before examining any files
+      new_scanner(**scan_settings)
+      DedupeEstimate(
+          self.options.hashclass, sample_bits=sample_bits, hll_bits=hll_bits
+      )
+    except ValueError as e:
+      raise GetoptError(str(e))
+    estimate = estimate_paths(
+        argv,
+        self.options.hashclass,
+        threads=threads,
+        sample_bits=sample_bits,
+        hll_bits=hll_bits,
+        **scan_settings,
+    )
+    estimate_report(estimate, sys.stdout)
+    return 0
+
   def cmd_fsck(self, argv):
     ''' Usage: {cmd} objects...
           Data structure inspection/repair.
@@ -454,9 +590,9 @@ class VTCmd(BaseCommand):
           error("merge failed")
           xit = 1
       elif isfilepath(srcpath):
-        src = OSFile(srcpath)
         if dst is None or dst.isfile:
-          D.file_fromchunks(srcbase, src.datafrom())
+          with open(srcpath, 'rb') as f:
+            D.file_fromfd(srcbase, f.fileno())
         else:
           error("name %r already imported: %s", srcbase, dst)
           xit = 1
@@ -1,107 +1,5575 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <structmember.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+/*
+ * The rolling hash keeps 28 bits, 7 from each of the last 4 bytes,
+ * so the hash at any position depends only on the 4 bytes ending there.
+ * That lets the vector kernels compute the hash for many positions
+ * independently, seeding only the first 3 positions from the prior state.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define SCAN_X86 1
+#  include <immintrin.h>
+#  include <cpuid.h>
+#endif
+#if defined(__aarch64__) || (defined(__ARM_NEON) && defined(__ARM_ARCH) && __ARM_ARCH >= 7)
+#  define SCAN_NEON 1
+#  include <arm_neon.h>
+#endif
+#ifndef _WIN32
+#  define SCAN_THREADS 1
+#  include <pthread.h>
+#  include <unistd.h>
+#  define SCAN_MMAP 1
+#  include <errno.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#endif
+
+/* the contribution of a single byte to the rolling hash */
+#define SCAN_OCTET(b)       ( ( (b) & 0x7f ) ^ ( ( (b) & 0x80 ) >> 7 ) )
+/* advance the rolling hash by one byte */
+#define SCAN_STEP(h, b)     ( ( ( (h) & 0x001fffff ) << 7 ) | SCAN_OCTET(b) )
+
+/* the boundary condition: hash_value % SCAN_DIVISOR == SCAN_REMAINDER */
+#define SCAN_DIVISOR        4093
+#define SCAN_REMAINDER      4091
+/* a Scanner divisor d is odd, up to SCAN_MAX_DIVISOR, with remainder d-2 */
+#define SCAN_MAX_DIVISOR    ((1 << 24) + 1)
+
+/* the default target block size for normalised chunking */
+#define SCAN_NORMALISED_TARGET  4096
+/* normalised chunking searches for the first hit in pieces of this size */
+#define SCAN_NORMALISED_PIECE   2048
+
+/* automatic threading gives each thread at least this much data */
+#define SCAN_THREAD_MIN_SEGMENT (512 * 1024)
+#define SCAN_MAX_THREADS        64
 
 static char module_docstring[] =
     "Buffer scanning code.";
 
-static char scanbuf_docstring[] =
-    "Scan buffer with rolling hash, return offsets and new hash.";
+static char scanbuf_docstring[] =
+    "scanbuf(hash_value, data, kernel=None, threads=None)\n"
+    "Scan buffer with rolling hash, return offsets and new hash.\n"
+    "The optional kernel names one of the entries in kernels,\n"
+    "default the fastest kernel supported by this CPU.\n"
+    "The optional threads is the number of threads to use;\n"
+    "if None or 0 this is chosen from the buffer size and CPU count.\n"
+    "The data may be any contiguous buffer; it is not copied.";
+
+static char scanbuf_array_docstring[] =
+    "scanbuf_array(hash_value, data, out=None, kernel=None, threads=None)\n"
+    "Scan buffer with rolling hash like scanbuf, but return the offsets\n"
+    "compactly: if out is None, return (hash_value, array('Q') of offsets).\n"
+    "Otherwise out is a writable buffer which is filled with as many\n"
+    "native uint64 offsets as fit in it, and (hash_value, count) is\n"
+    "returned where count is the total number of offsets found;\n"
+    "if count exceeds len(out)//8 the excess offsets were discarded.";
+
+static char scanbuf_v_docstring[] =
+    "scanbuf_v(hash_value, buffers, per_buffer=False, kernel=None, threads=None)\n"
+    "Scan a sequence of buffers with rolling hash as successive parts\n"
+    "of one stream in a single call, releasing the GIL once for them all.\n"
+    "Return (hash_value, offsets, ends) where offsets is an array('Q').\n"
+    "If per_buffer is false the offsets are relative to the start of\n"
+    "the first buffer and ends is None; otherwise they are relative to\n"
+    "the start of each buffer and ends is an array('Q') where ends[i]\n"
+    "is the index in offsets after the last offset in buffers[i].\n"
+    "The kernel and threads are as for scanbuf, threads applying to\n"
+    "each buffer.";
+
+static char digest_chunks_docstring[] =
+    "digest_chunks(hashname, chunks, threads=None)\n"
+    "Compute the digest of each of a sequence of buffers with the hash\n"
+    "function hashname, one of digests, in a single call.\n"
+    "Return the digests concatenated in a bytes object.\n"
+    "The buffers are hashed in parallel without the GIL;\n"
+    "the optional threads is the number of threads to use,\n"
+    "if None or 0 this is chosen from the data size and CPU count.";
+
+static char digests_sort_docstring[] =
+    "digests_sort(digests, hashlen, threads=None)\n"
+    "Sort the packed digests of hashlen bytes each in the buffer digests\n"
+    "and remove the duplicates, returning a bytes object.\n"
+    "Pieces are sorted in parallel without the GIL and then merged;\n"
+    "the optional threads is the number of threads to use,\n"
+    "if None or 0 this is chosen from the data size and CPU count.";
+
+static char digests_bisect_docstring[] =
+    "digests_bisect(digests, hashlen, key, right=False)\n"
+    "Return the index of the first of the sorted packed digests\n"
+    "which is not less than key, or which is greater than key if right.";
+
+static char digests_union_docstring[] =
+    "digests_union(digests1, digests2, hashlen)\n"
+    "Return the union of two sorted packed digest arrays as bytes.";
+
+static char digests_difference_docstring[] =
+    "digests_difference(digests1, digests2, hashlen)\n"
+    "Return the digests of the sorted packed digests1 not in digests2 as bytes.";
+
+static char digests_intersection_docstring[] =
+    "digests_intersection(digests1, digests2, hashlen)\n"
+    "Return the digests in both sorted packed digest arrays as bytes.";
+
+static char data_records_docstring[] =
+    "data_records(blocks, level=-1, threads=None)\n"
+    "Prepare the .vtd DataFile records for a sequence of data blocks,\n"
+    "return a list of (record, data_offset, data_length, flags)\n"
+    "where record is the serialised DataRecord, data_offset the offset\n"
+    "of the stored data within it, data_length the stored data length\n"
+    "and flags the DataRecord flags.\n"
+    "Blocks of 16 bytes or more are zlib compressed at the given level\n"
+    "and the compressed form is kept if it is less than 90% of the original.\n"
+    "The blocks are compressed in parallel without the GIL;\n"
+    "the optional threads is the number of threads to use,\n"
+    "if None or 0 this is chosen from the data size and CPU count.";
+
+static char scan_prefixes_docstring[] =
+    "scan_prefixes(data, prefixes, at_start=True)\n"
+    "Find the lines in data which start with any of the bytes prefixes,\n"
+    "return (offsets, pending) where offsets is an array('Q') of the\n"
+    "offsets of those lines. If at_start is false, data[0] is within a line\n"
+    "and the first line considered starts after the first newline.\n"
+    "pending is None or the offset of a line start which cannot be decided\n"
+    "because data ends before a match is complete, including a line start\n"
+    "at len(data); the caller should rescan from there with more data.\n"
+    "The scan is done without the GIL.";
+
+static char scan_boxes_docstring[] =
+    "scan_boxes(data, base, pos, ends=())\n"
+    "Walk the ISO14496 (MP4) box headers in data, whose first byte is at\n"
+    "stream offset base, starting with the header at stream offset pos\n"
+    "and descending into the container boxes; ends is the stack of the\n"
+    "end offsets of the enclosing containers.\n"
+    "Return (offsets, pos, ends) where offsets is an array('Q') of the\n"
+    "box start offsets found and pos and ends are the state for the next\n"
+    "call: if pos < base+len(data) the header at pos is incomplete,\n"
+    "otherwise pos is the offset of the next header in later data.\n"
+    "pos is None if the remaining data cannot be walked,\n"
+    "after a box extending to the end of the data or an invalid box size.";
+
+static char scan_mp3_frames_docstring[] =
+    "scan_mp3_frames(data, base, pos)\n"
+    "Walk the MP3 frames and ID3 tags in data, whose first byte is at\n"
+    "stream offset base, starting at stream offset pos.\n"
+    "Audio frame lengths are computed from their headers;\n"
+    "after an invalid header the scan resynchronises on the next\n"
+    "frame sync word.\n"
+    "Return (offsets, pos) where offsets is an array('Q') of the frame\n"
+    "and tag start offsets found and pos is the state for the next call:\n"
+    "if pos < base+len(data) the header at pos is incomplete,\n"
+    "otherwise pos is the offset of the next frame in later data.";
+
+static char scan_vtd_records_docstring[] =
+    "scan_vtd_records(data, base, pos)\n"
+    "Walk the .vtd DataRecord framing in data, whose first byte is at\n"
+    "stream offset base, starting with the record at stream offset pos.\n"
+    "Return (offsets, pos) where offsets is an array('Q') of the record\n"
+    "start offsets found and pos is the state for the next call:\n"
+    "if pos < base+len(data) the record header at pos is incomplete,\n"
+    "otherwise pos is the offset of the next record in later data.\n"
+    "pos is None if the framing is invalid.";
+
+static char scan_vtd_file_docstring[] =
+    "scan_vtd_file(fd, start=0, end=None, hashname=None, threads=None)\n"
+    "Walk the DataRecords of the .vtd file fd from offset start to end,\n"
+    "default the file size, by memory mapping the file and decoding only\n"
+    "the record framing. Return\n"
+    "(offsets, data_offsets, data_lengths, flags, post_offset, digests)\n"
+    "where the first four are array('Q')s with the record start offsets,\n"
+    "the file offsets and lengths of the stored data and the record flags,\n"
+    "and post_offset is the offset after the last complete record.\n"
+    "If hashname, one of digests, is supplied then digests holds the\n"
+    "digests of the uncompressed data of each record, computed in\n"
+    "parallel; otherwise it is None. The optional threads is the number\n"
+    "of threads to use, if None or 0 this is chosen from the data size\n"
+    "and CPU count. The scan is done without the GIL.\n"
+    "Raises ValueError for invalid framing or unsupported flags.";
+
+/*
+ * Division free test for hash_value % divisor == remainder.
+ * For an odd divisor d with inverse i (d*i == 1 mod 2**32),
+ * x is a multiple of d if and only if x*i (mod 2**32) <= (2**32-1)/d.
+ * Adding (divisor - remainder) turns the remainder test into a multiple test.
+ * This requires hash_value + bias < 2**32, true for our 28 bit hash.
+ */
+typedef struct {
+    uint32_t    bias;       /* divisor - remainder */
+    uint32_t    inverse;    /* multiplicative inverse of divisor mod 2**32 */
+    uint32_t    limit;      /* UINT32_MAX / divisor */
+} scan_test;
+
+static void scan_test_init(scan_test *test, uint32_t divisor, uint32_t remainder) {
+    uint32_t    inverse = divisor;
+
+    /* Newton's iteration: each round doubles the number of correct bits */
+    for (int i = 0; i < 5; i++) {
+        inverse *= 2 - divisor * inverse;
+    }
+    test->bias = divisor - remainder;
+    test->inverse = inverse;
+    test->limit = UINT32_MAX / divisor;
+}
+
+#define SCAN_HIT(test, h) \
+    ( (uint32_t)( ( (h) + (test)->bias ) * (test)->inverse ) <= (test)->limit )
+
+static scan_test default_test;
+
+/* recompute the hash after buf[pos-1] from the 4 bytes ending there */
+static inline uint32_t scan_hash_at(const unsigned char *buf, size_t pos) {
+    return ( (uint32_t)SCAN_OCTET(buf[pos - 4]) << 21 )
+         | ( (uint32_t)SCAN_OCTET(buf[pos - 3]) << 14 )
+         | ( (uint32_t)SCAN_OCTET(buf[pos - 2]) << 7 )
+         |   (uint32_t)SCAN_OCTET(buf[pos - 1]);
+}
+
+/*
+ * A growable vector of boundary offsets.
+ * Hits are rare (about 1 in 4093 bytes for random data) so this is
+ * far smaller than a worst case array of one offset per input byte.
+ * If an allocation fails, failed is set and further offsets are dropped;
+ * the caller checks failed once the scan is complete.
+ */
+typedef struct {
+    uint64_t    *offsets;
+    size_t      n;
+    size_t      cap;
+    int         failed;
+} scan_offsets;
+
+#define SCAN_OFFSETS_INIT   { NULL, 0, 0, 0 }
+
+/* ensure room for at least cap offsets, return 0 on allocation failure */
+static int scan_offsets_reserve(scan_offsets *ov, size_t cap) {
+    if (cap <= ov->cap) {
+        return 1;
+    }
+    if (ov->failed || cap > SIZE_MAX / sizeof(uint64_t)) {
+        ov->failed = 1;
+        return 0;
+    }
+    uint64_t    *offsets = realloc(ov->offsets, cap * sizeof(uint64_t));
+    if (offsets == NULL) {
+        ov->failed = 1;
+        return 0;
+    }
+    ov->offsets = offsets;
+    ov->cap = cap;
+    return 1;
+}
+
+static inline void scan_offsets_add(scan_offsets *ov, uint64_t offset) {
+    if (ov->n == ov->cap
+     && !scan_offsets_reserve(ov, ov->cap < 32 ? 64 : ov->cap * 2)) {
+        return;
+    }
+    ov->offsets[ov->n++] = offset;
+}
+
+/* append the offsets from src to ov */
+static void scan_offsets_extend(scan_offsets *ov, const scan_offsets *src) {
+    if (src->failed) {
+        ov->failed = 1;
+    }
+    if (src->n == 0 || !scan_offsets_reserve(ov, ov->n + src->n)) {
+        return;
+    }
+    memcpy(ov->offsets + ov->n, src->offsets, src->n * sizeof(uint64_t));
+    ov->n += src->n;
+}
+
+static void scan_offsets_free(scan_offsets *ov) {
+    free(ov->offsets);
+    ov->offsets = NULL;
+    ov->n = ov->cap = 0;
+}
+
+/*
+ * A scan kernel scans buf[start:end] advancing *hashp,
+ * appending the offsets of boundary hits to ov.
+ */
+typedef void (*scan_kernel_fn)(
+    uint32_t *hashp, const unsigned char *buf, size_t start, size_t end,
+    const scan_test *test, scan_offsets *ov);
+
+static void scan_scalar(
+    uint32_t *hashp, const unsigned char *buf, size_t start, size_t end,
+    const scan_test *test, scan_offsets *ov)
+{
+    uint32_t    hash_value = *hashp;
+
+    for (size_t offset = start; offset < end; offset++) {
+        hash_value = SCAN_STEP(hash_value, buf[offset]);
+        if (SCAN_HIT(test, hash_value)) {
+            scan_offsets_add(ov, offset);
+        }
+    }
+    *hashp = hash_value;
+}
+
+#ifdef SCAN_X86
+
+/* record the offsets for the set bits of a lane hit mask */
+#define SCAN_MASK_OFFSETS(mask, base) \
+    while (mask) { \
+        scan_offsets_add(ov, (base) + __builtin_ctz(mask)); \
+        mask &= mask - 1; \
+    }
+
+/*
+ * AVX2: broadcast the 16 bytes from pos-3 into both lanes,
+ * apply the octet transform bytewise, then shuffle the overlapping
+ * 4 byte windows for positions pos..pos+7 into 32 bit words
+ * (newest byte lowest) and pack the 7 bit fields with two multiply-adds.
+ */
+__attribute__((target("avx2")))
+static void scan_avx2(
+    uint32_t *hashp, const unsigned char *buf, size_t start, size_t end,
+    const scan_test *test, scan_offsets *ov)
+{
+    /* the first 3 positions need the incoming hash state */
+    size_t      pos = start + 3 < end ? start + 3 : end;
+
+    scan_scalar(hashp, buf, start, pos, test, ov);
+    /* each step reads 16 bytes from pos-3 */
+    if (pos + 13 > end) {
+        scan_scalar(hashp, buf, pos, end, test, ov);
+        return;
+    }
+    const __m256i   m7f = _mm256_set1_epi8(0x7f);
+    const __m256i   m01 = _mm256_set1_epi8(0x01);
+    const __m256i   windows = _mm256_setr_epi8(
+                        3, 2, 1, 0,  4, 3, 2, 1,  5, 4, 3, 2,  6, 5, 4, 3,
+                        7, 6, 5, 4,  8, 7, 6, 5,  9, 8, 7, 6,  10, 9, 8, 7);
+    const __m256i   pack7 = _mm256_set1_epi16((short)(1 | (128 << 8)));
+    const __m256i   pack14 = _mm256_set1_epi32(1 | (16384 << 16));
+    const __m256i   bias = _mm256_set1_epi32((int)test->bias);
+    const __m256i   inverse = _mm256_set1_epi32((int)test->inverse);
+    const __m256i   limit = _mm256_set1_epi32((int)test->limit);
+    for (; pos + 13 <= end; pos += 8) {
+        __m256i b = _mm256_broadcastsi128_si256(
+                        _mm_loadu_si128((const __m128i *)(buf + pos - 3)));
+        __m256i t = _mm256_xor_si256(
+                        _mm256_and_si256(b, m7f),
+                        _mm256_and_si256(_mm256_srli_epi16(b, 7), m01));
+        __m256i w = _mm256_shuffle_epi8(t, windows);
+        /* t0 + t1*128 and t2 + t3*128 in 16 bits, then combine */
+        __m256i h = _mm256_madd_epi16(_mm256_maddubs_epi16(pack7, w), pack14);
+        __m256i q = _mm256_mullo_epi32(_mm256_add_epi32(h, bias), inverse);
+        __m256i hit = _mm256_cmpeq_epi32(_mm256_min_epu32(q, limit), q);
+        unsigned mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(hit));
+        SCAN_MASK_OFFSETS(mask, pos);
+    }
+    *hashp = scan_hash_at(buf, pos);
+    scan_scalar(hashp, buf, pos, end, test, ov);
+}
+
+/* SSE4.1: as for AVX2, with the 8 windows split across two shuffles */
+__attribute__((target("sse4.1")))
+static void scan_sse41(
+    uint32_t *hashp, const unsigned char *buf, size_t start, size_t end,
+    const scan_test *test, scan_offsets *ov)
+{
+    /* the first 3 positions need the incoming hash state */
+    size_t      pos = start + 3 < end ? start + 3 : end;
+
+    scan_scalar(hashp, buf, start, pos, test, ov);
+    /* each step reads 16 bytes from pos-3 */
+    if (pos + 13 > end) {
+        scan_scalar(hashp, buf, pos, end, test, ov);
+        return;
+    }
+    const __m128i   m7f = _mm_set1_epi8(0x7f);
+    const __m128i   m01 = _mm_set1_epi8(0x01);
+    const __m128i   windows_lo = _mm_setr_epi8(
+                        3, 2, 1, 0,  4, 3, 2, 1,  5, 4, 3, 2,  6, 5, 4, 3);
+    const __m128i   windows_hi = _mm_setr_epi8(
+                        7, 6, 5, 4,  8, 7, 6, 5,  9, 8, 7, 6,  10, 9, 8, 7);
+    const __m128i   pack7 = _mm_set1_epi16((short)(1 | (128 << 8)));
+    const __m128i   pack14 = _mm_set1_epi32(1 | (16384 << 16));
+    const __m128i   bias = _mm_set1_epi32((int)test->bias);
+    const __m128i   inverse = _mm_set1_epi32((int)test->inverse);
+    const __m128i   limit = _mm_set1_epi32((int)test->limit);
+    for (; pos + 13 <= end; pos += 8) {
+        __m128i b = _mm_loadu_si128((const __m128i *)(buf + pos - 3));
+        __m128i t = _mm_xor_si128(
+                        _mm_and_si128(b, m7f),
+                        _mm_and_si128(_mm_srli_epi16(b, 7), m01));
+        __m128i h_lo = _mm_madd_epi16(
+                        _mm_maddubs_epi16(pack7, _mm_shuffle_epi8(t, windows_lo)),
+                        pack14);
+        __m128i h_hi = _mm_madd_epi16(
+                        _mm_maddubs_epi16(pack7, _mm_shuffle_epi8(t, windows_hi)),
+                        pack14);
+        __m128i q_lo = _mm_mullo_epi32(_mm_add_epi32(h_lo, bias), inverse);
+        __m128i q_hi = _mm_mullo_epi32(_mm_add_epi32(h_hi, bias), inverse);
+        __m128i hit_lo = _mm_cmpeq_epi32(_mm_min_epu32(q_lo, limit), q_lo);
+        __m128i hit_hi = _mm_cmpeq_epi32(_mm_min_epu32(q_hi, limit), q_hi);
+        unsigned mask = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(hit_lo))
+                      | (unsigned)_mm_movemask_ps(_mm_castsi128_ps(hit_hi)) << 4;
+        SCAN_MASK_OFFSETS(mask, pos);
+    }
+    *hashp = scan_hash_at(buf, pos);
+    scan_scalar(hashp, buf, pos, end, test, ov);
+}
+
+#endif /* SCAN_X86 */
+
+#ifdef SCAN_NEON
+
+static void scan_neon(
+    uint32_t *hashp, const unsigned char *buf, size_t start, size_t end,
+    const scan_test *test, scan_offsets *ov)
+{
+    /* the first 3 positions need the incoming hash state */
+    size_t      pos = start + 3 < end ? start + 3 : end;
+
+    scan_scalar(hashp, buf, start, pos, test, ov);
+    if (pos + 8 > end) {
+        scan_scalar(hashp, buf, pos, end, test, ov);
+        return;
+    }
+    const uint16x8_t    m7f = vdupq_n_u16(0x7f);
+    const uint32x4_t    bias = vdupq_n_u32(test->bias);
+    const uint32x4_t    inverse = vdupq_n_u32(test->inverse);
+    const uint32x4_t    limit = vdupq_n_u32(test->limit);
+    for (; pos + 8 <= end; pos += 8) {
+        uint16x8_t  t0, t1, t2, t3;
+        uint16x8_t  b;
+#define NEON_OCTETS(t, p) \
+        b = vmovl_u8(vld1_u8(p)); \
+        t = veorq_u16(vandq_u16(b, m7f), vshrq_n_u16(b, 7));
+        NEON_OCTETS(t0, buf + pos)
+        NEON_OCTETS(t1, buf + pos - 1)
+        NEON_OCTETS(t2, buf + pos - 2)
+        NEON_OCTETS(t3, buf + pos - 3)
+#undef NEON_OCTETS
+        for (int half = 0; half < 2; half++) {
+            uint32x4_t  h;
+            if (half == 0) {
+                h = vorrq_u32(
+                      vorrq_u32(vshlq_n_u32(vmovl_u16(vget_low_u16(t3)), 21),
+                                vshlq_n_u32(vmovl_u16(vget_low_u16(t2)), 14)),
+                      vorrq_u32(vshlq_n_u32(vmovl_u16(vget_low_u16(t1)), 7),
+                                vmovl_u16(vget_low_u16(t0))));
+            } else {
+                h = vorrq_u32(
+                      vorrq_u32(vshlq_n_u32(vmovl_u16(vget_high_u16(t3)), 21),
+                                vshlq_n_u32(vmovl_u16(vget_high_u16(t2)), 14)),
+                      vorrq_u32(vshlq_n_u32(vmovl_u16(vget_high_u16(t1)), 7),
+                                vmovl_u16(vget_high_u16(t0))));
+            }
+            uint32x4_t  q = vmulq_u32(vaddq_u32(h, bias), inverse);
+            uint32x4_t  hit = vcleq_u32(q, limit);
+            uint32_t    lanes[4];
+            vst1q_u32(lanes, hit);
+            for (int lane = 0; lane < 4; lane++) {
+                if (lanes[lane]) {
+                    scan_offsets_add(ov, pos + half * 4 + lane);
+                }
+            }
+        }
+    }
+    *hashp = scan_hash_at(buf, pos);
+    scan_scalar(hashp, buf, pos, end, test, ov);
+}
+
+#endif /* SCAN_NEON */
+
+typedef struct {
+    const char      *name;
+    scan_kernel_fn  kernel;
+} scan_kernel_entry;
+
+/* the kernels supported by this CPU, fastest first, scalar last */
+static scan_kernel_entry    scan_kernels[4];
+static int                  scan_nkernels = 0;
+
+static void scan_kernels_init(void) {
+    scan_nkernels = 0;
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_kernels[scan_nkernels++] = (scan_kernel_entry){"avx2", scan_avx2};
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+        scan_kernels[scan_nkernels++] = (scan_kernel_entry){"sse4.1", scan_sse41};
+    }
+#endif
+#ifdef SCAN_NEON
+    scan_kernels[scan_nkernels++] = (scan_kernel_entry){"neon", scan_neon};
+#endif
+    scan_kernels[scan_nkernels++] = (scan_kernel_entry){"scalar", scan_scalar};
+}
+
+/* locate a kernel by name, or NULL */
+static const scan_kernel_entry *scan_kernel_named(const char *name) {
+    for (int i = 0; i < scan_nkernels; i++) {
+        if (strcmp(scan_kernels[i].name, name) == 0) {
+            return &scan_kernels[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Rolling hash algorithms.
+ *
+ * The hash at any position depends only on the last window bytes.
+ * A stream is treated as though preceded by window zero bytes, so the
+ * hash before the first byte is the hash of that many zero bytes.
+ * Scanning a range needs the incoming hash and, for algorithms which
+ * remove the byte leaving the window, the window bytes preceding buf[0]
+ * in hist. The boundary test applies to a fingerprint of the hash:
+ * the 28 bit vt28 hash itself, or the top 31 bits of the others.
+ */
+
+/* the largest window of any algorithm */
+#define SCAN_MAX_WINDOW     64
+
+#define SCAN_ROTL64(x, n)   ( ( (x) << (n) ) | ( (x) >> ( 64 - (n) ) ) )
+
+typedef struct scan_algorithm scan_algorithm;
+
+/*
+ * Scan buf[start:end] advancing *hashp, appending boundary hits to ov.
+ * If test is NULL just advance the hash.
+ * kernel selects a vector kernel for algorithms which have them,
+ * NULL for the default.
+ */
+typedef void (*scan_algorithm_fn)(
+    const scan_algorithm *alg, scan_kernel_fn kernel,
+    uint64_t *hashp, const unsigned char *hist,
+    const unsigned char *buf, size_t start, size_t end,
+    const scan_test *test, scan_offsets *ov);
+
+struct scan_algorithm {
+    const char          *name;
+    size_t              window;     /* bytes of history the hash depends on */
+    uint64_t            initial;    /* the hash of window zero bytes */
+    scan_algorithm_fn   scan;
+};
+
+/* vt28: the original 28 bit hash, using the vector kernels */
+static void scan_alg_vt28(
+    const scan_algorithm *alg, scan_kernel_fn kernel,
+    uint64_t *hashp, const unsigned char *hist,
+    const unsigned char *buf, size_t start, size_t end,
+    const scan_test *test, scan_offsets *ov)
+{
+    uint32_t    hash_value = (uint32_t)*hashp;
+
+    if (test == NULL) {
+        for (size_t offset = start; offset < end; offset++) {
+            hash_value = SCAN_STEP(hash_value, buf[offset]);
+        }
+    } else {
+        (kernel == NULL ? scan_kernels[0].kernel : kernel)(
+            &hash_value, buf, start, end, test, ov);
+    }
+    *hashp = hash_value;
+}
+
+/*
+ * Define a scalar scan function for an algorithm
+ * given its window and step and fingerprint macros.
+ * The first window positions take their outgoing bytes from hist.
+ */
+#define SCAN_ALGORITHM_FN(fname, WINDOW, STEP, FINGERPRINT) \
+static void fname( \
+    const scan_algorithm *alg, scan_kernel_fn kernel, \
+    uint64_t *hashp, const unsigned char *hist, \
+    const unsigned char *buf, size_t start, size_t end, \
+    const scan_test *test, scan_offsets *ov) \
+{ \
+    uint64_t    h = *hashp; \
+    size_t      pos = start; \
+\
+    for (; pos < end && pos < (WINDOW); pos++) { \
+        h = STEP(h, buf[pos], hist[pos]); \
+        if (test != NULL && SCAN_HIT(test, FINGERPRINT(h))) { \
+            scan_offsets_add(ov, pos); \
+        } \
+    } \
+    if (test == NULL) { \
+        for (; pos < end; pos++) { \
+            h = STEP(h, buf[pos], buf[pos - (WINDOW)]); \
+        } \
+    } else { \
+        for (; pos < end; pos++) { \
+            h = STEP(h, buf[pos], buf[pos - (WINDOW)]); \
+            if (SCAN_HIT(test, FINGERPRINT(h))) { \
+                scan_offsets_add(ov, pos); \
+            } \
+        } \
+    } \
+    *hashp = h; \
+}
+
+#define SCAN_FINGERPRINT64(h)   ( (uint32_t)( (h) >> 33 ) )
+
+/* Gear: shift and add a random value per byte, the window is the 64 bit width */
+#define GEAR_WINDOW         64
+#define GEAR_SEED           0x67656172
+static uint64_t             gear_table[256];
+#define GEAR_STEP(h, in, out)   ( ( (h) << 1 ) + gear_table[in] )
+SCAN_ALGORITHM_FN(scan_alg_gear, GEAR_WINDOW, GEAR_STEP, SCAN_FINGERPRINT64)
+
+/* Buzhash: cyclic polynomial over a 48 byte window */
+#define BUZHASH_WINDOW      48
+#define BUZHASH_SEED        0x62757a68
+static uint64_t             buzhash_table[256];
+static uint64_t             buzhash_out_table[256];    /* table rotated by the window */
+#define BUZHASH_STEP(h, in, out) \
+    ( SCAN_ROTL64(h, 1) ^ buzhash_out_table[out] ^ buzhash_table[in] )
+SCAN_ALGORITHM_FN(scan_alg_buzhash, BUZHASH_WINDOW, BUZHASH_STEP, SCAN_FINGERPRINT64)
+
+/*
+ * Rabin: fingerprint modulo an irreducible polynomial of degree 53
+ * over a 64 byte window, using the table driven method of LBFS and restic.
+ */
+#define RABIN_WINDOW        64
+#define RABIN_POLYNOMIAL    UINT64_C(0x3DA3358B4DC173)
+#define RABIN_DEGREE        53
+static uint64_t             rabin_mod_table[256];
+static uint64_t             rabin_out_table[256];
+static inline uint64_t rabin_append(uint64_t h, unsigned char b) {
+    unsigned    top = (unsigned)( h >> ( RABIN_DEGREE - 8 ) );
+    return ( ( h << 8 ) | b ) ^ rabin_mod_table[top];
+}
+#define RABIN_STEP(h, in, out)  rabin_append( (h) ^ rabin_out_table[out], in )
+#define RABIN_FINGERPRINT(h)    ( (uint32_t)( (h) >> ( RABIN_DEGREE - 31 ) ) )
+SCAN_ALGORITHM_FN(scan_alg_rabin, RABIN_WINDOW, RABIN_STEP, RABIN_FINGERPRINT)
+
+/* the rolling hash algorithms, the default first */
+static scan_algorithm       scan_algorithms[] = {
+    {"vt28", 4, 0, scan_alg_vt28},
+    {"gear", GEAR_WINDOW, 0, scan_alg_gear},
+    {"buzhash", BUZHASH_WINDOW, 0, scan_alg_buzhash},
+    {"rabin", RABIN_WINDOW, 0, scan_alg_rabin},
+};
+#define SCAN_NALGORITHMS    ( sizeof(scan_algorithms) / sizeof(scan_algorithms[0]) )
+
+/* window zero bytes, the history before the start of a stream */
+static const unsigned char  scan_zeros[SCAN_MAX_WINDOW];
+
+/* the SplitMix64 generator, for reproducible hash tables */
+static uint64_t scan_splitmix64(uint64_t *state) {
+    uint64_t    z = ( *state += UINT64_C(0x9E3779B97F4A7C15) );
+
+    z = ( z ^ ( z >> 30 ) ) * UINT64_C(0xBF58476D1CE4E5B9);
+    z = ( z ^ ( z >> 27 ) ) * UINT64_C(0x94D049BB133111EB);
+    return z ^ ( z >> 31 );
+}
+
+/* the remainder of x modulo the Rabin polynomial */
+static uint64_t rabin_mod(uint64_t x) {
+    for (int bit = 63; bit >= RABIN_DEGREE; bit--) {
+        if (x & ( UINT64_C(1) << bit )) {
+            x ^= RABIN_POLYNOMIAL << ( bit - RABIN_DEGREE );
+        }
+    }
+    return x;
+}
+
+static void scan_algorithms_init(void) {
+    uint64_t    state;
+
+    state = GEAR_SEED;
+    for (int b = 0; b < 256; b++) {
+        gear_table[b] = scan_splitmix64(&state);
+    }
+    state = BUZHASH_SEED;
+    for (int b = 0; b < 256; b++) {
+        buzhash_table[b] = scan_splitmix64(&state);
+        buzhash_out_table[b] = SCAN_ROTL64(buzhash_table[b], BUZHASH_WINDOW);
+    }
+    for (int b = 0; b < 256; b++) {
+        uint64_t    t = (uint64_t)b << RABIN_DEGREE;
+        rabin_mod_table[b] = rabin_mod(t) | t;
+    }
+    for (int b = 0; b < 256; b++) {
+        /* b times x**(8*(window-1)) modulo the polynomial */
+        uint64_t    h = (uint64_t)b;
+        for (int i = 0; i < RABIN_WINDOW - 1; i++) {
+            h = rabin_mod(h << 8);
+        }
+        rabin_out_table[b] = h;
+    }
+    /* the hash of a window of zero bytes */
+    for (size_t i = 0; i < SCAN_NALGORITHMS; i++) {
+        scan_algorithm  *alg = &scan_algorithms[i];
+        uint64_t        h = 0;
+        if (alg->scan == scan_alg_buzhash) {
+            /* buzhash removes outgoing bytes, so sum the window directly */
+            for (size_t j = 0; j < alg->window; j++) {
+                h ^= SCAN_ROTL64(buzhash_table[0], j);
+            }
+        } else {
+            alg->scan(alg, NULL, &h, scan_zeros, scan_zeros, 0, alg->window, NULL, NULL);
+        }
+        alg->initial = h;
+    }
+}
+
+/* locate an algorithm by name, or NULL */
+static const scan_algorithm *scan_algorithm_named(const char *name) {
+    for (size_t i = 0; i < SCAN_NALGORITHMS; i++) {
+        if (strcmp(scan_algorithms[i].name, name) == 0) {
+            return &scan_algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * The hash after buf[pos-1], computed from the window bytes before pos;
+ * hist holds the window bytes before buf[0].
+ */
+static uint64_t scan_resync(
+    const scan_algorithm *alg, const unsigned char *hist,
+    const unsigned char *buf, size_t pos)
+{
+    const size_t        window = alg->window;
+    unsigned char       bytes[SCAN_MAX_WINDOW];
+    const unsigned char *src = buf + pos - window;
+    uint64_t            h = alg->initial;
+
+    if (pos < window) {
+        memcpy(bytes, hist + pos, window - pos);
+        memcpy(bytes + window - pos, buf, pos);
+        src = bytes;
+    }
+    alg->scan(alg, NULL, &h, scan_zeros, src, 0, window, NULL, NULL);
+    return h;
+}
+
+/* update hist, the window bytes before a buffer, to follow buf[0:buflen] */
+static void scan_history_advance(
+    const scan_algorithm *alg, unsigned char *hist,
+    const unsigned char *buf, size_t buflen)
+{
+    const size_t    window = alg->window;
+
+    if (buflen >= window) {
+        memcpy(hist, buf + buflen - window, window);
+    } else {
+        memmove(hist, hist + buflen, window - buflen);
+        memcpy(hist + window - buflen, buf, buflen);
+    }
+}
+
+/* the number of online CPUs, used for the automatic thread count */
+static int                  scan_ncpus = 1;
+
+/*
+ * Choose the number of threads for a buffer of buflen bytes.
+ * A requested count of 0 means automatic.
+ * Every segment must have at least window bytes so that the following
+ * segment can seed its hash from the window bytes preceeding it.
+ */
+static int scan_nthreads(size_t buflen, long requested, size_t window) {
+    size_t      nthreads;
+
+    if (requested > 0) {
+        nthreads = (size_t)requested;
+    } else {
+        nthreads = buflen / SCAN_THREAD_MIN_SEGMENT;
+        if (nthreads > (size_t)scan_ncpus) {
+            nthreads = (size_t)scan_ncpus;
+        }
+    }
+    if (nthreads > SCAN_MAX_THREADS) {
+        nthreads = SCAN_MAX_THREADS;
+    }
+    if (nthreads > buflen / window) {
+        nthreads = buflen / window;
+    }
+    return nthreads < 1 ? 1 : (int)nthreads;
+}
+
+typedef struct {
+    const scan_algorithm *alg;
+    scan_kernel_fn      kernel;
+    const unsigned char *hist;
+    const unsigned char *buf;
+    size_t              start;
+    size_t              end;
+    const scan_test     *test;
+    uint64_t            hash_value;
+    scan_offsets        ov;
+} scan_segment;
+
+static void *scan_segment_run(void *arg) {
+    scan_segment    *seg = arg;
+
+    seg->alg->scan(seg->alg, seg->kernel, &seg->hash_value, seg->hist,
+                   seg->buf, seg->start, seg->end, seg->test, &seg->ov);
+    return NULL;
+}
+
+/*
+ * Scan buf[0:buflen] with the algorithm alg using nthreads threads,
+ * appending offsets to ov; hist holds the window bytes before buf[0].
+ * The hash depends only on the last window bytes, so each segment after
+ * the first seeds its hash from the window bytes before it and the
+ * merged offsets are identical to a serial scan.
+ * Each segment collects its hits in its own vector; these are
+ * appended to ov in order once all the segments are done.
+ * The caller must not hold the GIL if nthreads > 1.
+ */
+static void scan_parallel(
+    const scan_algorithm *alg, scan_kernel_fn kernel, uint64_t *hashp,
+    const unsigned char *hist, const unsigned char *buf, size_t buflen,
+    const scan_test *test, scan_offsets *ov, int nthreads)
+{
+    if (nthreads <= 1) {
+        alg->scan(alg, kernel, hashp, hist, buf, 0, buflen, test, ov);
+        return;
+    }
+    scan_segment    segs[SCAN_MAX_THREADS];
+#ifdef SCAN_THREADS
+    pthread_t       tids[SCAN_MAX_THREADS];
+    int             started[SCAN_MAX_THREADS];
+#endif
+    size_t          seglen = buflen / nthreads;
+
+    for (int i = 0; i < nthreads; i++) {
+        scan_segment    *seg = &segs[i];
+
+        seg->alg = alg;
+        seg->kernel = kernel;
+        seg->buf = buf;
+        seg->start = i * seglen;
+        seg->end = i == nthreads - 1 ? buflen : seg->start + seglen;
+        seg->test = test;
+        seg->ov = (scan_offsets)SCAN_OFFSETS_INIT;
+        if (i == 0) {
+            seg->hist = hist;
+            seg->hash_value = *hashp;
+        } else {
+            /* the segment's history is within buf, so it need not be hist */
+            seg->hist = buf + seg->start - alg->window;
+            seg->hash_value = scan_resync(alg, hist, buf, seg->start);
+        }
+    }
+    /* dispatch segments 1.. to threads, scan segment 0 ourselves */
+    for (int i = 1; i < nthreads; i++) {
+#ifdef SCAN_THREADS
+        started[i] = pthread_create(&tids[i], NULL, scan_segment_run, &segs[i]) == 0;
+        if (!started[i])
+#endif
+        {
+            scan_segment_run(&segs[i]);
+        }
+    }
+    /* segment 0 appends directly to the caller's offsets */
+    alg->scan(alg, kernel, &segs[0].hash_value, hist, buf,
+              segs[0].start, segs[0].end, test, ov);
+    for (int i = 1; i < nthreads; i++) {
+#ifdef SCAN_THREADS
+        if (started[i]) {
+            pthread_join(tids[i], NULL);
+        }
+#endif
+        scan_offsets_extend(ov, &segs[i].ov);
+        scan_offsets_free(&segs[i].ov);
+    }
+    *hashp = segs[nthreads - 1].hash_value;
+}
+
+/*
+ * BLAKE3: the input is split into 1KiB chunks, each hashed with a
+ * 7 round compression function over its 64 byte blocks, and the chunk
+ * chaining values are merged up a binary tree of parent nodes.
+ * Whole chunks are independent, so many are hashed at once: in the
+ * lanes of a vector, 8 with AVX2 and otherwise 4 with the GCC vector
+ * extensions (SSE2 or NEON), and across threads for large inputs.
+ * Only the unkeyed hash with a 32 byte output is implemented.
+ */
+
+#define BLAKE3_OUT_LEN      32
+#define BLAKE3_BLOCK_LEN    64
+#define BLAKE3_CHUNK_LEN    1024
+#define BLAKE3_MAX_DEPTH    54
+
+/* the domain separation flags */
+#define BLAKE3_CHUNK_START  1
+#define BLAKE3_CHUNK_END    2
+#define BLAKE3_PARENT       4
+#define BLAKE3_ROOT         8
+
+/* whole chunks are hashed in batches of up to this many */
+#define BLAKE3_BATCH_CHUNKS 16384
+/* automatic threading gives each thread at least this much data to hash */
+#define BLAKE3_THREAD_MIN   (256 * 1024)
+
+static const uint32_t blake3_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/* the message word order for each round */
+static const uint8_t blake3_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+static inline uint32_t blake3_load_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+         | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void blake3_store_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+/*
+ * The round function, for scalar uint32_t state words
+ * or for vectors of them with a chunk in each lane.
+ */
+#define BLAKE3_ROTR(x, n)   ( ( (x) >> (n) ) | ( (x) << (32 - (n)) ) )
+#define BLAKE3_G(s, a, b, c, d, x, y) do { \
+    s[a] = s[a] + s[b] + (x); s[d] = BLAKE3_ROTR(s[d] ^ s[a], 16); \
+    s[c] = s[c] + s[d];       s[b] = BLAKE3_ROTR(s[b] ^ s[c], 12); \
+    s[a] = s[a] + s[b] + (y); s[d] = BLAKE3_ROTR(s[d] ^ s[a], 8); \
+    s[c] = s[c] + s[d];       s[b] = BLAKE3_ROTR(s[b] ^ s[c], 7); \
+} while (0)
+#define BLAKE3_ROUNDS(s, m) do { \
+    for (int r = 0; r < 7; r++) { \
+        const uint8_t   *w = blake3_schedule[r]; \
+        BLAKE3_G(s, 0, 4, 8, 12, m[w[0]], m[w[1]]); \
+        BLAKE3_G(s, 1, 5, 9, 13, m[w[2]], m[w[3]]); \
+        BLAKE3_G(s, 2, 6, 10, 14, m[w[4]], m[w[5]]); \
+        BLAKE3_G(s, 3, 7, 11, 15, m[w[6]], m[w[7]]); \
+        BLAKE3_G(s, 0, 5, 10, 15, m[w[8]], m[w[9]]); \
+        BLAKE3_G(s, 1, 6, 11, 12, m[w[10]], m[w[11]]); \
+        BLAKE3_G(s, 2, 7, 8, 13, m[w[12]], m[w[13]]); \
+        BLAKE3_G(s, 3, 4, 9, 14, m[w[14]], m[w[15]]); \
+    } \
+} while (0)
+
+/* compress the message words m into the chaining value cv */
+static void blake3_compress_words(
+    uint32_t cv[8], const uint32_t m[16], uint32_t block_len,
+    uint64_t counter, uint32_t flags)
+{
+    uint32_t        s[16];
+
+    memcpy(s, cv, 8 * sizeof(uint32_t));
+    memcpy(s + 8, blake3_iv, 4 * sizeof(uint32_t));
+    s[12] = (uint32_t)counter;
+    s[13] = (uint32_t)(counter >> 32);
+    s[14] = block_len;
+    s[15] = flags;
+    BLAKE3_ROUNDS(s, m);
+    for (int i = 0; i < 8; i++) {
+        cv[i] = s[i] ^ s[i + 8];
+    }
+}
+
+/* compress the 64 byte block into the chaining value cv */
+static void blake3_compress(
+    uint32_t cv[8], const unsigned char *block, uint32_t block_len,
+    uint64_t counter, uint32_t flags)
+{
+    uint32_t        m[16];
+
+    for (int i = 0; i < 16; i++) {
+        m[i] = blake3_load_le32(block + 4 * i);
+    }
+    blake3_compress_words(cv, m, block_len, counter, flags);
+}
+
+/* the chaining value of the whole chunk at chunk with index counter */
+static void blake3_chunk_cv(const unsigned char *chunk, uint64_t counter, unsigned char *out) {
+    uint32_t        cv[8];
+
+    memcpy(cv, blake3_iv, sizeof cv);
+    for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) {
+        uint32_t    flags = b == 0 ? BLAKE3_CHUNK_START
+                          : b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? BLAKE3_CHUNK_END
+                          : 0;
+        blake3_compress(cv, chunk + b * BLAKE3_BLOCK_LEN, BLAKE3_BLOCK_LEN, counter, flags);
+    }
+    for (int i = 0; i < 8; i++) {
+        blake3_store_le32(out + 4 * i, cv[i]);
+    }
+}
+
+/*
+ * Hash LANES whole chunks from chunks at once, the chunk in lane j having
+ * index counter+j, writing their chaining values to out.
+ */
+#define BLAKE3_CHUNKS_FN(fname, VEC, LANES) \
+static void fname(const unsigned char *chunks, uint64_t counter, unsigned char *out) \
+{ \
+    VEC         cv[8]; \
+    VEC         m[16]; \
+    VEC         s[16]; \
+    VEC         counter_lo; \
+    VEC         counter_hi; \
+\
+    for (int i = 0; i < 8; i++) { \
+        cv[i] = (VEC){0} + blake3_iv[i]; \
+    } \
+    for (int j = 0; j < (LANES); j++) { \
+        counter_lo[j] = (uint32_t)(counter + j); \
+        counter_hi[j] = (uint32_t)((counter + j) >> 32); \
+    } \
+    for (int b = 0; b < BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN; b++) { \
+        uint32_t    flags = b == 0 ? BLAKE3_CHUNK_START \
+                          : b == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1 ? BLAKE3_CHUNK_END \
+                          : 0; \
+        for (int j = 0; j < (LANES); j++) { \
+            const unsigned char *block = chunks + j * BLAKE3_CHUNK_LEN + b * BLAKE3_BLOCK_LEN; \
+            for (int i = 0; i < 16; i++) { \
+                m[i][j] = blake3_load_le32(block + 4 * i); \
+            } \
+        } \
+        for (int i = 0; i < 8; i++) { \
+            s[i] = cv[i]; \
+        } \
+        for (int i = 0; i < 4; i++) { \
+            s[8 + i] = (VEC){0} + blake3_iv[i]; \
+        } \
+        s[12] = counter_lo; \
+        s[13] = counter_hi; \
+        s[14] = (VEC){0} + (uint32_t)BLAKE3_BLOCK_LEN; \
+        s[15] = (VEC){0} + flags; \
+        BLAKE3_ROUNDS(s, m); \
+        for (int i = 0; i < 8; i++) { \
+            cv[i] = s[i] ^ s[i + 8]; \
+        } \
+    } \
+    for (int j = 0; j < (LANES); j++) { \
+        for (int i = 0; i < 8; i++) { \
+            blake3_store_le32(out + j * BLAKE3_OUT_LEN + 4 * i, cv[i][j]); \
+        } \
+    } \
+}
+
+#if defined(__GNUC__)
+typedef uint32_t blake3_vec4 __attribute__((vector_size(16)));
+BLAKE3_CHUNKS_FN(blake3_chunks4, blake3_vec4, 4)
+#endif
+#ifdef SCAN_X86
+typedef uint32_t blake3_vec8 __attribute__((vector_size(32)));
+__attribute__((target("avx2")))
+BLAKE3_CHUNKS_FN(blake3_chunks_avx2, blake3_vec8, 8)
+#endif
+
+typedef void (*blake3_chunks_fn)(const unsigned char *chunks, uint64_t counter, unsigned char *out);
+
+/* the widest vector chunk hasher for this CPU and its lane count */
+static blake3_chunks_fn     blake3_chunks_impl = NULL;
+static int                  blake3_lanes = 1;
+static const char           *blake3_impl = "portable";
+
+static void blake3_init_impl(void) {
+#if defined(__GNUC__)
+    blake3_chunks_impl = blake3_chunks4;
+    blake3_lanes = 4;
+    blake3_impl = "vec4";
+#endif
+#ifdef SCAN_X86
+    if (__builtin_cpu_supports("avx2")) {
+        blake3_chunks_impl = blake3_chunks_avx2;
+        blake3_lanes = 8;
+        blake3_impl = "avx2";
+    }
+#endif
+}
+
+/* the chaining values of nchunks whole chunks from chunks, the first with index counter */
+static void blake3_chunks_cvs(
+    const unsigned char *chunks, size_t nchunks, uint64_t counter, unsigned char *out)
+{
+    size_t          i = 0;
+
+    if (blake3_chunks_impl != NULL) {
+        for (; i + blake3_lanes <= nchunks; i += blake3_lanes) {
+            blake3_chunks_impl(chunks + i * BLAKE3_CHUNK_LEN, counter + i, out + i * BLAKE3_OUT_LEN);
+        }
+    }
+    for (; i < nchunks; i++) {
+        blake3_chunk_cv(chunks + i * BLAKE3_CHUNK_LEN, counter + i, out + i * BLAKE3_OUT_LEN);
+    }
+}
+
+typedef struct {
+    const unsigned char *chunks;
+    size_t              nchunks;
+    uint64_t            counter;
+    unsigned char       *out;
+} blake3_chunks_run;
+
+static void *blake3_chunks_run_cvs(void *arg) {
+    blake3_chunks_run   *run = arg;
+
+    blake3_chunks_cvs(run->chunks, run->nchunks, run->counter, run->out);
+    return NULL;
+}
+
+/*
+ * The chaining values of nchunks whole chunks as for blake3_chunks_cvs
+ * using up to nthreads threads.
+ * The caller must not hold the GIL if nthreads > 1.
+ */
+static void blake3_chunks_parallel(
+    const unsigned char *chunks, size_t nchunks, uint64_t counter,
+    unsigned char *out, int nthreads)
+{
+    blake3_chunks_run   runs[SCAN_MAX_THREADS];
+#ifdef SCAN_THREADS
+    pthread_t       tids[SCAN_MAX_THREADS];
+    int             started[SCAN_MAX_THREADS];
+#endif
+
+    if ((size_t)nthreads > nchunks) {
+        nthreads = (int)nchunks;
+    }
+    if (nthreads <= 1) {
+        blake3_chunks_cvs(chunks, nchunks, counter, out);
+        return;
+    }
+    /* whole vectors of chunks per thread, any remainder to the last */
+    size_t          per = nchunks / nthreads / blake3_lanes * blake3_lanes;
+    if (per == 0) {
+        per = nchunks / nthreads;
+    }
+    for (int t = 0; t < nthreads; t++) {
+        blake3_chunks_run   *run = &runs[t];
+        size_t              first = per * t;
+
+        run->chunks = chunks + first * BLAKE3_CHUNK_LEN;
+        run->nchunks = t == nthreads - 1 ? nchunks - first : per;
+        run->counter = counter + first;
+        run->out = out + first * BLAKE3_OUT_LEN;
+    }
+    for (int t = 1; t < nthreads; t++) {
+#ifdef SCAN_THREADS
+        started[t] = pthread_create(&tids[t], NULL, blake3_chunks_run_cvs, &runs[t]) == 0;
+        if (!started[t])
+#endif
+        {
+            blake3_chunks_run_cvs(&runs[t]);
+        }
+    }
+    blake3_chunks_run_cvs(&runs[0]);
+#ifdef SCAN_THREADS
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+#endif
+}
+
+/*
+ * An incremental BLAKE3 hasher: the state of the current chunk
+ * and the stack of the chaining values of completed subtrees.
+ * The current chunk is only finished when more input arrives,
+ * because the last chunk of the input is flagged differently.
+ */
+typedef struct {
+    uint32_t        cv[8];                  /* the current chunk's chaining value */
+    uint64_t        chunk_counter;          /* the index of the current chunk */
+    unsigned char   block[BLAKE3_BLOCK_LEN];    /* a partial block */
+    uint8_t         block_len;              /* bytes in block */
+    uint8_t         blocks_compressed;      /* blocks of the current chunk compressed */
+    uint8_t         cv_stack_len;
+    uint32_t        cv_stack[BLAKE3_MAX_DEPTH + 1][8];
+} blake3_hasher;
+
+static void blake3_hasher_init(blake3_hasher *h) {
+    memcpy(h->cv, blake3_iv, sizeof h->cv);
+    h->chunk_counter = 0;
+    h->block_len = 0;
+    h->blocks_compressed = 0;
+    h->cv_stack_len = 0;
+}
+
+static size_t blake3_chunk_len(const blake3_hasher *h) {
+    return (size_t)h->blocks_compressed * BLAKE3_BLOCK_LEN + h->block_len;
+}
+
+static uint32_t blake3_chunk_start_flag(const blake3_hasher *h) {
+    return h->blocks_compressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+/* add data to the current chunk, which must have room for it */
+static void blake3_chunk_update(blake3_hasher *h, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        if (h->block_len == BLAKE3_BLOCK_LEN) {
+            blake3_compress(h->cv, h->block, BLAKE3_BLOCK_LEN, h->chunk_counter,
+                            blake3_chunk_start_flag(h));
+            h->blocks_compressed++;
+            h->block_len = 0;
+        }
+        size_t      take = BLAKE3_BLOCK_LEN - h->block_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(h->block + h->block_len, data, take);
+        h->block_len += (uint8_t)take;
+        data += take;
+        len -= take;
+    }
+}
+
+/* the output of the current chunk: its chaining value, or the root with BLAKE3_ROOT */
+static void blake3_chunk_output(const blake3_hasher *h, uint32_t extra_flags, uint32_t cv[8]) {
+    unsigned char   block[BLAKE3_BLOCK_LEN];
+
+    memcpy(block, h->block, h->block_len);
+    memset(block + h->block_len, 0, BLAKE3_BLOCK_LEN - h->block_len);
+    memcpy(cv, h->cv, 8 * sizeof(uint32_t));
+    blake3_compress(cv, block, h->block_len,
+                    extra_flags & BLAKE3_ROOT ? 0 : h->chunk_counter,
+                    blake3_chunk_start_flag(h) | BLAKE3_CHUNK_END | extra_flags);
+}
+
+/* the chaining value of the parent of left and right, or the root with BLAKE3_ROOT */
+static void blake3_parent_cv(
+    const uint32_t left[8], const uint32_t right[8], uint32_t extra_flags, uint32_t cv[8])
+{
+    uint32_t        m[16];
+
+    memcpy(m, left, 8 * sizeof(uint32_t));
+    memcpy(m + 8, right, 8 * sizeof(uint32_t));
+    memcpy(cv, blake3_iv, 8 * sizeof(uint32_t));
+    blake3_compress_words(cv, m, BLAKE3_BLOCK_LEN, 0, BLAKE3_PARENT | extra_flags);
+}
+
+/*
+ * Push the chaining value of a completed chunk, total_chunks being
+ * the number of chunks so far, merging the completed subtrees:
+ * there is one for each 1 bit of total_chunks.
+ */
+static void blake3_push_cv(blake3_hasher *h, const uint32_t chunk_cv[8], uint64_t total_chunks) {
+    uint32_t        cv[8];
+
+    memcpy(cv, chunk_cv, sizeof cv);
+    while ((total_chunks & 1) == 0) {
+        blake3_parent_cv(h->cv_stack[--h->cv_stack_len], cv, 0, cv);
+        total_chunks >>= 1;
+    }
+    memcpy(h->cv_stack[h->cv_stack_len++], cv, sizeof cv);
+}
+
+/* start the next chunk after finishing the current one */
+static void blake3_next_chunk(blake3_hasher *h) {
+    uint32_t        cv[8];
+
+    blake3_chunk_output(h, 0, cv);
+    blake3_push_cv(h, cv, h->chunk_counter + 1);
+    memcpy(h->cv, blake3_iv, sizeof h->cv);
+    h->chunk_counter++;
+    h->block_len = 0;
+    h->blocks_compressed = 0;
+}
+
+/*
+ * Add data to the hash. Whole chunks which are not the last of the data
+ * are hashed in batches using up to nthreads threads.
+ * The caller must not hold the GIL if nthreads > 1.
+ */
+static void blake3_update(blake3_hasher *h, const unsigned char *data, size_t len, int nthreads) {
+    unsigned char   local_cvs[BLAKE3_OUT_LEN * 16];
+
+    while (len > 0) {
+        if (blake3_chunk_len(h) == BLAKE3_CHUNK_LEN) {
+            blake3_next_chunk(h);
+        }
+        if (blake3_chunk_len(h) == 0 && len > BLAKE3_CHUNK_LEN) {
+            /* whole chunks, keeping at least one byte for the current chunk */
+            size_t          nchunks = (len - 1) / BLAKE3_CHUNK_LEN;
+            unsigned char   *cvs = NULL;
+            if (nchunks > 16) {
+                if (nchunks > BLAKE3_BATCH_CHUNKS) {
+                    nchunks = BLAKE3_BATCH_CHUNKS;
+                }
+                cvs = malloc(nchunks * BLAKE3_OUT_LEN);
+            }
+            if (cvs == NULL) {
+                if (nchunks > 16) {
+                    nchunks = 16;
+                }
+                cvs = local_cvs;
+            }
+            blake3_chunks_parallel(data, nchunks, h->chunk_counter, cvs, nthreads);
+            for (size_t i = 0; i < nchunks; i++) {
+                uint32_t    cv[8];
+                for (int j = 0; j < 8; j++) {
+                    cv[j] = blake3_load_le32(cvs + i * BLAKE3_OUT_LEN + 4 * j);
+                }
+                blake3_push_cv(h, cv, h->chunk_counter + i + 1);
+            }
+            if (cvs != local_cvs) {
+                free(cvs);
+            }
+            h->chunk_counter += nchunks;
+            data += nchunks * BLAKE3_CHUNK_LEN;
+            len -= nchunks * BLAKE3_CHUNK_LEN;
+            continue;
+        }
+        size_t      take = BLAKE3_CHUNK_LEN - blake3_chunk_len(h);
+        if (take > len) {
+            take = len;
+        }
+        blake3_chunk_update(h, data, take);
+        data += take;
+        len -= take;
+    }
+}
+
+/* write the 32 byte hash of the data so far to out; h is not modified */
+static void blake3_final(const blake3_hasher *h, unsigned char *out) {
+    uint32_t        cv[8];
+
+    if (h->cv_stack_len == 0) {
+        blake3_chunk_output(h, BLAKE3_ROOT, cv);
+    } else {
+        blake3_chunk_output(h, 0, cv);
+        for (int i = h->cv_stack_len - 1; i >= 0; i--) {
+            blake3_parent_cv(h->cv_stack[i], cv, i == 0 ? BLAKE3_ROOT : 0, cv);
+        }
+    }
+    for (int i = 0; i < 8; i++) {
+        blake3_store_le32(out + 4 * i, cv[i]);
+    }
+}
+
+/*
+ * Block digests: SHA-1, SHA-256 and BLAKE3, computed by a Scanner for
+ * each block it cuts so that the data are hashed in the same native call
+ * which scans them, without the GIL and while they are still in the cache.
+ * On x86 CPUs with the SHA extensions the SHA compression functions use
+ * them, otherwise portable C.
+ */
+
+#define SCAN_DIGEST_MAX     32
+
+typedef void (*scan_digest_blocks_fn)(
+    uint32_t *state, const unsigned char *data, size_t nblocks);
+
+typedef struct {
+    const char              *name;          /* the hashlib name */
+    size_t                  digest_size;    /* 20 or 32 bytes */
+    int                     nstate;         /* 5 or 8 state words */
+    const uint32_t          *initial;       /* the initial state */
+    scan_digest_blocks_fn   blocks;         /* the compression function */
+    int                     blake3;         /* BLAKE3, using the ctx's hasher */
+} scan_digest_algorithm;
+
+/* the state of a SHA digest */
+typedef struct {
+    uint32_t        state[8];
+    uint64_t        length;                 /* bytes hashed */
+    unsigned char   block[64];              /* a partial block */
+    size_t          nblock;                 /* bytes in block */
+} scan_sha_ctx;
+
+typedef union {
+    scan_sha_ctx    sha;
+    blake3_hasher   b3;
+} scan_digest_ctx;
+
+#define SCAN_ROTL32(x, n)   ( ( (x) << (n) ) | ( (x) >> (32 - (n)) ) )
+#define SCAN_ROTR32(x, n)   ( ( (x) >> (n) ) | ( (x) << (32 - (n)) ) )
+
+static inline uint32_t scan_load_be32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+         | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void scan_store_be32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static const uint32_t sha1_initial[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static void sha1_blocks(uint32_t *state, const unsigned char *data, size_t nblocks) {
+    for (; nblocks > 0; nblocks--, data += 64) {
+        uint32_t    w[80];
+        uint32_t    a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+
+        for (int i = 0; i < 16; i++) {
+            w[i] = scan_load_be32(data + 4 * i);
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = SCAN_ROTL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        for (int i = 0; i < 80; i++) {
+            uint32_t    f, k;
+
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t    t = SCAN_ROTL32(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = SCAN_ROTL32(b, 30);
+            b = a;
+            a = t;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+    }
+}
+
+static const uint32_t sha256_initial[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static void sha256_blocks(uint32_t *state, const unsigned char *data, size_t nblocks) {
+    for (; nblocks > 0; nblocks--, data += 64) {
+        uint32_t    w[64];
+        uint32_t    a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t    e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 16; i++) {
+            w[i] = scan_load_be32(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t    s0 = SCAN_ROTR32(w[i - 15], 7) ^ SCAN_ROTR32(w[i - 15], 18)
+                           ^ (w[i - 15] >> 3);
+            uint32_t    s1 = SCAN_ROTR32(w[i - 2], 17) ^ SCAN_ROTR32(w[i - 2], 19)
+                           ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        for (int i = 0; i < 64; i++) {
+            uint32_t    S1 = SCAN_ROTR32(e, 6) ^ SCAN_ROTR32(e, 11) ^ SCAN_ROTR32(e, 25);
+            uint32_t    ch = (e & f) ^ (~e & g);
+            uint32_t    t1 = h + S1 + ch + sha256_k[i] + w[i];
+            uint32_t    S0 = SCAN_ROTR32(a, 2) ^ SCAN_ROTR32(a, 13) ^ SCAN_ROTR32(a, 22);
+            uint32_t    maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t    t2 = S0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#ifdef SCAN_X86
+
+/*
+ * The SHA extension versions, after Intel's reference code.
+ * The message words are loaded byte swapped; SHA-1 keeps ABCD in one
+ * register with A in the top lane and E separately, SHA-256 keeps
+ * the state as ABEF and CDGH.
+ */
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(uint32_t *state, const unsigned char *data, size_t nblocks) {
+    const __m128i   mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    __m128i         abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+    __m128i         e0 = _mm_set_epi32((int)state[4], 0, 0, 0);
+
+    for (; nblocks > 0; nblocks--, data += 64) {
+        __m128i     abcd_save = abcd;
+        __m128i     e0_save = e0;
+        __m128i     e1;
+        __m128i     msg[4];
+
+        for (int g = 0; g < 20; g++) {
+            __m128i     *m = &msg[g & 3];
+
+            if (g < 4) {
+                *m = _mm_shuffle_epi8(
+                        _mm_loadu_si128((const __m128i *)(data + 16 * g)), mask);
+            }
+            /* the next 4 rounds, alternating between e0 and e1 */
+            if (g == 0) {
+                e0 = _mm_add_epi32(e0, *m);
+                e1 = abcd;
+                abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+            } else if (g & 1) {
+                e1 = _mm_sha1nexte_epu32(e1, *m);
+                e0 = abcd;
+                switch (g / 5) {
+                    case 0: abcd = _mm_sha1rnds4_epu32(abcd, e1, 0); break;
+                    case 1: abcd = _mm_sha1rnds4_epu32(abcd, e1, 1); break;
+                    case 2: abcd = _mm_sha1rnds4_epu32(abcd, e1, 2); break;
+                    default: abcd = _mm_sha1rnds4_epu32(abcd, e1, 3); break;
+                }
+            } else {
+                e0 = _mm_sha1nexte_epu32(e0, *m);
+                e1 = abcd;
+                switch (g / 5) {
+                    case 0: abcd = _mm_sha1rnds4_epu32(abcd, e0, 0); break;
+                    case 1: abcd = _mm_sha1rnds4_epu32(abcd, e0, 1); break;
+                    case 2: abcd = _mm_sha1rnds4_epu32(abcd, e0, 2); break;
+                    default: abcd = _mm_sha1rnds4_epu32(abcd, e0, 3); break;
+                }
+            }
+            /* advance the message schedule; surplus updates are harmless */
+            if (g >= 3) {
+                msg[(g + 1) & 3] = _mm_sha1msg2_epu32(msg[(g + 1) & 3], *m);
+            }
+            if (g >= 2) {
+                msg[(g + 2) & 3] = _mm_xor_si128(msg[(g + 2) & 3], *m);
+            }
+            if (g >= 1) {
+                msg[(g + 3) & 3] = _mm_sha1msg1_epu32(msg[(g + 3) & 3], *m);
+            }
+        }
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+    }
+    _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+    state[4] = (uint32_t)_mm_extract_epi32(e0, 3);
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani(uint32_t *state, const unsigned char *data, size_t nblocks) {
+    const __m128i   mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i         tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+    __m128i         state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+    __m128i         state0 = _mm_alignr_epi8(tmp, state1, 8);   /* ABEF */
+
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);                /* CDGH */
+    for (; nblocks > 0; nblocks--, data += 64) {
+        __m128i     abef_save = state0;
+        __m128i     cdgh_save = state1;
+        __m128i     w[16];
+
+        for (int g = 0; g < 16; g++) {
+            if (g < 4) {
+                w[g] = _mm_shuffle_epi8(
+                        _mm_loadu_si128((const __m128i *)(data + 16 * g)), mask);
+            } else {
+                w[g] = _mm_sha256msg2_epu32(
+                        _mm_add_epi32(_mm_sha256msg1_epu32(w[g - 4], w[g - 3]),
+                                      _mm_alignr_epi8(w[g - 1], w[g - 2], 4)),
+                        w[g - 1]);
+            }
+            __m128i     msg = _mm_add_epi32(
+                            w[g], _mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0e));
+        }
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1b);                      /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xb1);                   /* DCHG */
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xf0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+
+/* whether the CPU has the SHA extensions */
+static int scan_cpu_has_sha(void) {
+    unsigned int    eax, ebx, ecx, edx;
+
+    if (!__builtin_cpu_supports("sse4.1")) {
+        return 0;
+    }
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return 0;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx >> 29) & 1;
+}
+
+#endif /* SCAN_X86 */
+
+static scan_digest_algorithm scan_digests[] = {
+    {"sha1", 20, 5, sha1_initial, sha1_blocks, 0},
+    {"sha256", 32, 8, sha256_initial, sha256_blocks, 0},
+    {"blake3", 32, 8, blake3_iv, NULL, 1},
+};
+#define SCAN_NDIGESTS (sizeof(scan_digests) / sizeof(scan_digests[0]))
+
+/* the name of the digest implementation in use */
+static const char *scan_digest_impl = "portable";
+
+static void scan_digests_init(void) {
+#ifdef SCAN_X86
+    if (scan_cpu_has_sha()) {
+        scan_digests[0].blocks = sha1_blocks_shani;
+        scan_digests[1].blocks = sha256_blocks_shani;
+        scan_digest_impl = "sha-ni";
+    }
+#endif
+}
+
+static const scan_digest_algorithm *scan_digest_named(const char *name) {
+    for (size_t i = 0; i < SCAN_NDIGESTS; i++) {
+        if (strcmp(scan_digests[i].name, name) == 0) {
+            return &scan_digests[i];
+        }
+    }
+    return NULL;
+}
+
+static void scan_digest_init(scan_digest_ctx *ctx, const scan_digest_algorithm *dalg) {
+    if (dalg->blake3) {
+        blake3_hasher_init(&ctx->b3);
+        return;
+    }
+    memcpy(ctx->sha.state, dalg->initial, dalg->nstate * sizeof(uint32_t));
+    ctx->sha.length = 0;
+    ctx->sha.nblock = 0;
+}
+
+static void scan_digest_update(
+    scan_digest_ctx *ctx, const scan_digest_algorithm *dalg,
+    const unsigned char *data, size_t len)
+{
+    if (dalg->blake3) {
+        blake3_update(&ctx->b3, data, len, 1);
+        return;
+    }
+    ctx->sha.length += len;
+    if (ctx->sha.nblock > 0) {
+        size_t      n = 64 - ctx->sha.nblock;
+
+        if (n > len) {
+            n = len;
+        }
+        memcpy(ctx->sha.block + ctx->sha.nblock, data, n);
+        ctx->sha.nblock += n;
+        data += n;
+        len -= n;
+        if (ctx->sha.nblock < 64) {
+            return;
+        }
+        dalg->blocks(ctx->sha.state, ctx->sha.block, 1);
+        ctx->sha.nblock = 0;
+    }
+    if (len >= 64) {
+        dalg->blocks(ctx->sha.state, data, len / 64);
+        data += len & ~(size_t)63;
+        len &= 63;
+    }
+    memcpy(ctx->sha.block, data, len);
+    ctx->sha.nblock = len;
+}
+
+/* write the digest of the data in ctx to out; ctx is not modified */
+static void scan_digest_final(
+    const scan_digest_ctx *ctx, const scan_digest_algorithm *dalg, unsigned char *out)
+{
+    if (dalg->blake3) {
+        blake3_final(&ctx->b3, out);
+        return;
+    }
+    scan_sha_ctx    fin = ctx->sha;
+    uint64_t        bits = fin.length * 8;
+
+    fin.block[fin.nblock++] = 0x80;
+    if (fin.nblock > 56) {
+        memset(fin.block + fin.nblock, 0, 64 - fin.nblock);
+        dalg->blocks(fin.state, fin.block, 1);
+        fin.nblock = 0;
+    }
+    memset(fin.block + fin.nblock, 0, 56 - fin.nblock);
+    scan_store_be32(fin.block + 56, (uint32_t)(bits >> 32));
+    scan_store_be32(fin.block + 60, (uint32_t)bits);
+    dalg->blocks(fin.state, fin.block, 1);
+    for (int i = 0; i < dalg->nstate; i++) {
+        scan_store_be32(out + 4 * i, fin.state[i]);
+    }
+}
+
+typedef struct {
+    const scan_digest_algorithm *dalg;
+    const unsigned char *buf;
+    const uint64_t      *cuts;          /* block i is buf[cuts[i-1]:cuts[i]] */
+    size_t              first;          /* the first block to hash */
+    size_t              end;            /* the block after the last to hash */
+    unsigned char       *digests;       /* digest i at digests[i*digest_size] */
+} scan_digest_run;
+
+static void *scan_digest_run_blocks(void *arg) {
+    scan_digest_run *run = arg;
+    scan_digest_ctx ctx;
+
+    for (size_t i = run->first; i < run->end; i++) {
+        size_t      start = i == 0 ? 0 : run->cuts[i - 1];
+
+        scan_digest_init(&ctx, run->dalg);
+        scan_digest_update(&ctx, run->dalg, run->buf + start, run->cuts[i] - start);
+        scan_digest_final(&ctx, run->dalg, run->digests + i * run->dalg->digest_size);
+    }
+    return NULL;
+}
+
+/*
+ * Compute the digests of the whole blocks buf[cuts[i-1]:cuts[i]]
+ * for i in 1..ncuts-1 using up to nthreads threads.
+ * The caller must not hold the GIL if nthreads > 1.
+ */
+static void scan_digest_parallel(
+    const scan_digest_algorithm *dalg, const unsigned char *buf,
+    const uint64_t *cuts, size_t ncuts, unsigned char *digests, int nthreads)
+{
+    scan_digest_run runs[SCAN_MAX_THREADS];
+#ifdef SCAN_THREADS
+    pthread_t       tids[SCAN_MAX_THREADS];
+    int             started[SCAN_MAX_THREADS];
+#endif
+
+    if (ncuts < 2) {
+        return;
+    }
+    if ((size_t)nthreads > ncuts - 1) {
+        nthreads = (int)(ncuts - 1);
+    }
+    if (nthreads < 1) {
+        nthreads = 1;
+    }
+    /* divide the blocks into runs of about equal data size */
+    size_t          total = cuts[ncuts - 1] - cuts[0];
+    size_t          i = 1;
+    for (int t = 0; t < nthreads; t++) {
+        scan_digest_run *run = &runs[t];
+        size_t      upto = cuts[0] + total / nthreads * (t + 1);
+
+        run->dalg = dalg;
+        run->buf = buf;
+        run->cuts = cuts;
+        run->digests = digests;
+        run->first = i;
+        if (t == nthreads - 1) {
+            i = ncuts;
+        } else {
+            while (i < ncuts && cuts[i] <= upto) {
+                i++;
+            }
+        }
+        run->end = i;
+    }
+    for (int t = 1; t < nthreads; t++) {
+#ifdef SCAN_THREADS
+        started[t] = pthread_create(&tids[t], NULL, scan_digest_run_blocks, &runs[t]) == 0;
+        if (!started[t])
+#endif
+        {
+            scan_digest_run_blocks(&runs[t]);
+        }
+    }
+    scan_digest_run_blocks(&runs[0]);
+#ifdef SCAN_THREADS
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+#endif
+}
+
+/*
+ * digest_chunks: the digests of many separate buffers in one call,
+ * divided into runs of about equal data size hashed in parallel.
+ */
+
+/* automatic threading gives each thread at least this much data to hash */
+#define SCAN_DIGEST_THREAD_MIN      (256 * 1024)
+
+typedef struct {
+    const scan_digest_algorithm *dalg;
+    const Py_buffer     *views;         /* the buffers to hash */
+    size_t              first;          /* the first buffer to hash */
+    size_t              end;            /* the buffer after the last to hash */
+    unsigned char       *digests;       /* digest i at digests[i*digest_size] */
+} scan_digest_views_run;
+
+static void *scan_digest_run_views(void *arg) {
+    scan_digest_views_run *run = arg;
+    scan_digest_ctx ctx;
+
+    for (size_t i = run->first; i < run->end; i++) {
+        scan_digest_init(&ctx, run->dalg);
+        scan_digest_update(&ctx, run->dalg, run->views[i].buf, (size_t)run->views[i].len);
+        scan_digest_final(&ctx, run->dalg, run->digests + i * run->dalg->digest_size);
+    }
+    return NULL;
+}
+
+/*
+ * Compute the digests of the views[0:nviews], whose lengths sum to total,
+ * using up to nthreads threads.
+ * The caller must not hold the GIL if nthreads > 1.
+ */
+static void scan_digest_views_parallel(
+    const scan_digest_algorithm *dalg, const Py_buffer *views, size_t nviews,
+    size_t total, unsigned char *digests, int nthreads)
+{
+    scan_digest_views_run runs[SCAN_MAX_THREADS];
+#ifdef SCAN_THREADS
+    pthread_t       tids[SCAN_MAX_THREADS];
+    int             started[SCAN_MAX_THREADS];
+#endif
+
+    if ((size_t)nthreads > nviews) {
+        nthreads = (int)nviews;
+    }
+    if (nthreads < 1) {
+        return;
+    }
+    size_t          i = 0;
+    size_t          sofar = 0;
+    for (int t = 0; t < nthreads; t++) {
+        scan_digest_views_run *run = &runs[t];
+        size_t      upto = total / nthreads * (t + 1);
+
+        run->dalg = dalg;
+        run->views = views;
+        run->digests = digests;
+        run->first = i;
+        if (t == nthreads - 1) {
+            i = nviews;
+        } else {
+            while (i < nviews && sofar + (size_t)views[i].len <= upto) {
+                sofar += (size_t)views[i++].len;
+            }
+        }
+        run->end = i;
+    }
+    for (int t = 1; t < nthreads; t++) {
+#ifdef SCAN_THREADS
+        started[t] = pthread_create(&tids[t], NULL, scan_digest_run_views, &runs[t]) == 0;
+        if (!started[t])
+#endif
+        {
+            scan_digest_run_views(&runs[t]);
+        }
+    }
+    scan_digest_run_views(&runs[0]);
+#ifdef SCAN_THREADS
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+#endif
+}
+
+/*
+ * Sorted digest arrays: the digests of a set of hashcodes packed end to end
+ * in a bytes object, hashlen bytes each, in ascending byte order without
+ * duplicates, for cs.vt.hash.HashCodeArray.
+ * digests_sort sorts and deduplicates a packed array, sorting pieces in
+ * parallel and merging them; digests_union, digests_difference and
+ * digests_intersection combine two sorted arrays in a single merge pass.
+ */
+
+/* automatic threading gives each thread at least this many digests to sort */
+#define DIGESTS_THREAD_MIN      (64 * 1024)
+/* runs of this many digests are insertion sorted before merging */
+#define DIGESTS_INSERTION_RUN   16
+
+/* the merge operations */
+#define DIGESTS_MERGE           0       /* keep everything, a first on ties */
+#define DIGESTS_UNION           1       /* keep one of each digest */
+#define DIGESTS_DIFFERENCE      2       /* keep the digests of a not in b */
+#define DIGESTS_INTERSECTION    3       /* keep the digests in both */
+
+/*
+ * Merge the sorted digests a[0:na] and b[0:nb] into out according to op.
+ * Return the number of digests written.
+ */
+static size_t digests_merge(
+    const unsigned char *a, size_t na, const unsigned char *b, size_t nb,
+    size_t hashlen, int op, unsigned char *out)
+{
+    const unsigned char *a_end = a + na * hashlen;
+    const unsigned char *b_end = b + nb * hashlen;
+    unsigned char   *o = out;
+
+    while (a < a_end && b < b_end) {
+        int         cmp = memcmp(a, b, hashlen);
+
+        if (cmp < 0 || (cmp == 0 && op == DIGESTS_MERGE)) {
+            if (op != DIGESTS_INTERSECTION) {
+                memcpy(o, a, hashlen);
+                o += hashlen;
+            }
+            a += hashlen;
+        } else if (cmp > 0) {
+            if (op == DIGESTS_MERGE || op == DIGESTS_UNION) {
+                memcpy(o, b, hashlen);
+                o += hashlen;
+            }
+            b += hashlen;
+        } else {
+            if (op != DIGESTS_DIFFERENCE) {
+                memcpy(o, a, hashlen);
+                o += hashlen;
+            }
+            a += hashlen;
+            b += hashlen;
+        }
+    }
+    if (a < a_end && op != DIGESTS_INTERSECTION) {
+        memcpy(o, a, (size_t)(a_end - a));
+        o += a_end - a;
+    }
+    if (b < b_end && (op == DIGESTS_MERGE || op == DIGESTS_UNION)) {
+        memcpy(o, b, (size_t)(b_end - b));
+        o += b_end - b;
+    }
+    return (size_t)(o - out) / hashlen;
+}
+
+/* remove the adjacent duplicates from the sorted digests d[0:n], return the new count */
+static size_t digests_dedupe(unsigned char *d, size_t n, size_t hashlen) {
+    size_t          kept = n ? 1 : 0;
+
+    for (size_t i = 1; i < n; i++) {
+        if (memcmp(d + i * hashlen, d + (kept - 1) * hashlen, hashlen) != 0) {
+            if (kept != i) {
+                memcpy(d + kept * hashlen, d + i * hashlen, hashlen);
+            }
+            kept++;
+        }
+    }
+    return kept;
+}
+
+/*
+ * Sort the digests d[0:n] in place and remove the duplicates,
+ * using tmp[0:n] as work space. Return the number of digests kept.
+ */
+static size_t digests_sort_run(unsigned char *d, size_t n, size_t hashlen, unsigned char *tmp) {
+    /* insertion sort short runs */
+    for (size_t start = 0; start < n; start += DIGESTS_INSERTION_RUN) {
+        size_t      end = start + DIGESTS_INSERTION_RUN < n ? start + DIGESTS_INSERTION_RUN : n;
+
+        for (size_t i = start + 1; i < end; i++) {
+            size_t  j = i;
+
+            memcpy(tmp, d + i * hashlen, hashlen);
+            while (j > start && memcmp(d + (j - 1) * hashlen, tmp, hashlen) > 0) {
+                memcpy(d + j * hashlen, d + (j - 1) * hashlen, hashlen);
+                j--;
+            }
+            memcpy(d + j * hashlen, tmp, hashlen);
+        }
+    }
+    /* then merge pairs of runs, back and forth between d and tmp */
+    unsigned char   *src = d;
+    unsigned char   *dst = tmp;
+    for (size_t width = DIGESTS_INSERTION_RUN; width < n; width *= 2) {
+        for (size_t start = 0; start < n; start += 2 * width) {
+            size_t  mid = start + width < n ? start + width : n;
+            size_t  end = mid + width < n ? mid + width : n;
+
+            digests_merge(src + start * hashlen, mid - start,
+                          src + mid * hashlen, end - mid,
+                          hashlen, DIGESTS_MERGE, dst + start * hashlen);
+        }
+        unsigned char   *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != d) {
+        memcpy(d, src, n * hashlen);
+    }
+    return digests_dedupe(d, n, hashlen);
+}
+
+typedef struct {
+    unsigned char       *digests;       /* the digests to sort */
+    size_t              n;              /* the number of digests */
+    unsigned char       *tmp;           /* work space for n digests */
+    size_t              hashlen;
+    size_t              kept;           /* the number kept after sorting */
+} digests_sort_piece;
+
+static void *digests_sort_run_piece(void *arg) {
+    digests_sort_piece *piece = arg;
+
+    piece->kept = digests_sort_run(piece->digests, piece->n, piece->hashlen, piece->tmp);
+    return NULL;
+}
+
+/*
+ * Sort the digests d[0:n] in place and remove the duplicates,
+ * using tmp[0:n] as work space and up to nthreads threads.
+ * Return the number of digests kept.
+ * The caller must not hold the GIL if nthreads > 1.
+ */
+static size_t digests_sort_parallel(
+    unsigned char *d, size_t n, size_t hashlen, unsigned char *tmp, int nthreads)
+{
+    digests_sort_piece pieces[SCAN_MAX_THREADS];
+#ifdef SCAN_THREADS
+    pthread_t       tids[SCAN_MAX_THREADS];
+    int             started[SCAN_MAX_THREADS];
+#endif
+
+    if ((size_t)nthreads > n / DIGESTS_INSERTION_RUN) {
+        nthreads = (int)(n / DIGESTS_INSERTION_RUN);
+    }
+    if (nthreads <= 1) {
+        return digests_sort_run(d, n, hashlen, tmp);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        size_t      first = n / nthreads * t;
+        size_t      end = t == nthreads - 1 ? n : n / nthreads * (t + 1);
+
+        pieces[t].digests = d + first * hashlen;
+        pieces[t].n = end - first;
+        pieces[t].tmp = tmp + first * hashlen;
+        pieces[t].hashlen = hashlen;
+    }
+    for (int t = 1; t < nthreads; t++) {
+#ifdef SCAN_THREADS
+        started[t] = pthread_create(&tids[t], NULL, digests_sort_run_piece, &pieces[t]) == 0;
+        if (!started[t])
+#endif
+        {
+            digests_sort_run_piece(&pieces[t]);
+        }
+    }
+    digests_sort_run_piece(&pieces[0]);
+#ifdef SCAN_THREADS
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+#endif
+    /* merge the sorted pieces pairwise, back and forth between d and tmp */
+    unsigned char   *src = d;
+    unsigned char   *dst = tmp;
+    int             npieces = nthreads;
+    while (npieces > 1) {
+        int         merged = 0;
+
+        for (int p = 0; p < npieces; p += 2) {
+            digests_sort_piece *left = &pieces[p];
+            unsigned char   *out = dst + (left->digests - src);
+
+            if (p + 1 < npieces) {
+                digests_sort_piece *right = &pieces[p + 1];
+                left->kept = digests_merge(left->digests, left->kept,
+                                           right->digests, right->kept,
+                                           hashlen, DIGESTS_UNION, out);
+            } else {
+                memcpy(out, left->digests, left->kept * hashlen);
+            }
+            left->digests = out;
+            pieces[merged++] = *left;
+        }
+        npieces = merged;
+        unsigned char   *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != d) {
+        memcpy(d, src, pieces[0].kept * hashlen);
+    }
+    return pieces[0].kept;
+}
+
+/*
+ * The index of the first digest in the sorted digests d[0:n] which is
+ * greater than or equal to key, or greater than key if right.
+ */
+static size_t digests_bisect(
+    const unsigned char *d, size_t n, size_t hashlen, const unsigned char *key, int right)
+{
+    size_t          lo = 0;
+    size_t          hi = n;
+
+    while (lo < hi) {
+        size_t      mid = lo + (hi - lo) / 2;
+        int         cmp = memcmp(d + mid * hashlen, key, hashlen);
+
+        if (cmp < 0 || (right && cmp == 0)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * DataRecords: the serialised form of a block in a .vtd DataFile,
+ * a BSUInt flags value and then the data as a BSUInt length and the bytes.
+ * As in cs.vt.datafile.DataRecord, blocks of 16 bytes or more are
+ * zlib compressed and the compressed form kept if it is less than 90%
+ * of the original size.
+ * data_records prepares the records for many blocks at once,
+ * compressing them in parallel without the GIL.
+ */
+
+#define SCAN_RECORD_COMPRESSED      0x01
+#define SCAN_RECORD_MIN_COMPRESS    16
+/* a record header: 1 octet of flags and up to 10 octets of BSUInt length */
+#define SCAN_RECORD_HEADER_MAX      11
+/* automatic threading gives each thread at least this much data to compress */
+#define SCAN_RECORD_THREAD_MIN      (64 * 1024)
+
+typedef struct {
+    const unsigned char *data;
+    size_t              len;
+    unsigned char       *out;           /* header space and then the data */
+    size_t              record_offset;  /* the record starts at out[record_offset] */
+    size_t              record_len;
+    size_t              data_offset;    /* the data offset within the record */
+    size_t              data_length;    /* the stored data length */
+    int                 flags;
+    int                 zstatus;        /* zlib status, Z_OK unless compress2 failed */
+} scan_record;
+
+typedef struct {
+    scan_record         *records;
+    size_t              first;
+    size_t              end;
+    int                 level;
+} scan_record_run;
+
+/* the number of octets in the BSUInt encoding of n */
+static size_t scan_bsuint_len(uint64_t n) {
+    size_t      len = 1;
+
+    while (n >>= 7) {
+        len++;
+    }
+    return len;
+}
+
+/* write the BSUInt encoding of n, which has len octets, to p */
+static void scan_bsuint_put(unsigned char *p, uint64_t n, size_t len) {
+    for (size_t i = len; i > 0; i--) {
+        p[i - 1] = (n & 0x7f) | (i < len ? 0x80 : 0);
+        n >>= 7;
+    }
+}
+
+/*
+ * Prepare the record for rec->data, placing the data after the
+ * header space in rec->out and then the header just before it.
+ */
+static void scan_record_prepare(scan_record *rec, int level) {
+    unsigned char   *dst = rec->out + SCAN_RECORD_HEADER_MAX;
+    size_t          stored = rec->len;
+
+    rec->flags = 0;
+    rec->zstatus = Z_OK;
+    if (rec->len >= SCAN_RECORD_MIN_COMPRESS) {
+        uLongf      zlen = compressBound(rec->len);
+
+        rec->zstatus = compress2(dst, &zlen, rec->data, rec->len, level);
+        if (rec->zstatus != Z_OK) {
+            return;
+        }
+        if ((double)zlen < (double)rec->len * 0.9) {
+            rec->flags = SCAN_RECORD_COMPRESSED;
+            stored = zlen;
+        }
+    }
+    if (!rec->flags) {
+        memcpy(dst, rec->data, rec->len);
+    }
+    size_t          lenlen = scan_bsuint_len(stored);
+
+    rec->data_offset = 1 + lenlen;
+    rec->data_length = stored;
+    rec->record_offset = SCAN_RECORD_HEADER_MAX - rec->data_offset;
+    rec->record_len = rec->data_offset + stored;
+    rec->out[rec->record_offset] = rec->flags;
+    scan_bsuint_put(rec->out + rec->record_offset + 1, stored, lenlen);
+}
+
+static void *scan_record_run_records(void *arg) {
+    scan_record_run *run = arg;
+
+    for (size_t i = run->first; i < run->end; i++) {
+        scan_record_prepare(&run->records[i], run->level);
+    }
+    return NULL;
+}
+
+/*
+ * Prepare the records[0:nrecords] using up to nthreads threads,
+ * dividing them into runs of about equal data size.
+ * The caller must not hold the GIL if nthreads > 1.
+ */
+static void scan_record_parallel(
+    scan_record *records, size_t nrecords, size_t total, int level, int nthreads)
+{
+    scan_record_run runs[SCAN_MAX_THREADS];
+#ifdef SCAN_THREADS
+    pthread_t       tids[SCAN_MAX_THREADS];
+    int             started[SCAN_MAX_THREADS];
+#endif
+
+    if ((size_t)nthreads > nrecords) {
+        nthreads = (int)nrecords;
+    }
+    if (nthreads < 1) {
+        return;
+    }
+    size_t          i = 0;
+    size_t          sofar = 0;
+    for (int t = 0; t < nthreads; t++) {
+        scan_record_run *run = &runs[t];
+        size_t      upto = total / nthreads * (t + 1);
+
+        run->records = records;
+        run->level = level;
+        run->first = i;
+        if (t == nthreads - 1) {
+            i = nrecords;
+        } else {
+            while (i < nrecords && sofar + records[i].len <= upto) {
+                sofar += records[i++].len;
+            }
+        }
+        run->end = i;
+    }
+    for (int t = 1; t < nthreads; t++) {
+#ifdef SCAN_THREADS
+        started[t] = pthread_create(&tids[t], NULL, scan_record_run_records, &runs[t]) == 0;
+        if (!started[t])
+#endif
+        {
+            scan_record_run_records(&runs[t]);
+        }
+    }
+    scan_record_run_records(&runs[0]);
+#ifdef SCAN_THREADS
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+#endif
+}
+
+/*
+ * Line prefixes for cs.vt.parsers.scan_text.
+ * The prefixes are compiled into a trie whose nodes are kept in one
+ * array, each node linking its first child and its next sibling.
+ * Newlines are found with memchr and a table of the octets which can
+ * start a prefix rejects most lines without walking the trie.
+ */
+typedef struct {
+    uint32_t        child;      /* index of the first child, 0 for none */
+    uint32_t        sibling;    /* index of the next sibling, 0 for none */
+    unsigned char   octet;      /* the octet leading to this node */
+    unsigned char   accept;     /* a prefix ends at this node */
+} scan_trie_node;
+
+typedef struct {
+    scan_trie_node  *nodes;     /* nodes[0] is the root */
+    size_t          n;
+    unsigned char   first[256]; /* octets with an edge from the root */
+} scan_trie;
+
+/* prepare the trie for prefixes totalling up to total octets, return 0 on failure */
+static int scan_trie_init(scan_trie *trie, size_t total) {
+    if (total >= UINT32_MAX) {
+        return 0;
+    }
+    trie->nodes = calloc(total + 1, sizeof(scan_trie_node));
+    if (trie->nodes == NULL) {
+        return 0;
+    }
+    trie->n = 1;
+    memset(trie->first, 0, sizeof(trie->first));
+    return 1;
+}
+
+/* add a prefix to the trie; the nodes were sized by scan_trie_init */
+static void scan_trie_add(scan_trie *trie, const unsigned char *prefix, size_t len) {
+    uint32_t    node = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        uint32_t    child = trie->nodes[node].child;
+
+        while (child != 0 && trie->nodes[child].octet != prefix[i]) {
+            child = trie->nodes[child].sibling;
+        }
+        if (child == 0) {
+            child = (uint32_t)trie->n++;
+            trie->nodes[child].octet = prefix[i];
+            trie->nodes[child].sibling = trie->nodes[node].child;
+            trie->nodes[node].child = child;
+        }
+        node = child;
+    }
+    trie->nodes[node].accept = 1;
+    if (len > 0) {
+        trie->first[prefix[0]] = 1;
+    }
+}
+
+/*
+ * Match the trie against p[0:len].
+ * Return 1 if some prefix matches, 0 if none can,
+ * -1 if the data ends before this can be decided.
+ */
+static inline int scan_trie_match(const scan_trie *trie, const unsigned char *p, size_t len) {
+    uint32_t    node = 0;
+
+    for (size_t i = 0; ; i++) {
+        if (trie->nodes[node].accept) {
+            return 1;
+        }
+        uint32_t    child = trie->nodes[node].child;
+        if (child == 0) {
+            return 0;
+        }
+        if (i == len) {
+            return -1;
+        }
+        while (child != 0 && trie->nodes[child].octet != p[i]) {
+            child = trie->nodes[child].sibling;
+        }
+        if (child == 0) {
+            return 0;
+        }
+        node = child;
+    }
+}
+
+/*
+ * Append to ov the offsets of the lines in buf[0:len] starting with a prefix.
+ * Return the offset of an undecided line start, or SIZE_MAX if there is none.
+ */
+static size_t scan_prefixes_buffer(const scan_trie *trie, const unsigned char *buf,
+                                   size_t len, int at_start, scan_offsets *ov) {
+    int         any = trie->nodes[0].accept;
+    size_t      pos = 0;
+
+    if (!at_start) {
+        const unsigned char *nl = memchr(buf, '\n', len);
+        if (nl == NULL) {
+            return SIZE_MAX;
+        }
+        pos = (size_t)(nl - buf) + 1;
+    }
+    for (;;) {
+        if (pos == len) {
+            return pos;
+        }
+        if (any || trie->first[buf[pos]]) {
+            int     matched = scan_trie_match(trie, buf + pos, len - pos);
+            if (matched > 0) {
+                scan_offsets_add(ov, pos);
+            } else if (matched < 0) {
+                return pos;
+            }
+        }
+        const unsigned char *nl = memchr(buf + pos, '\n', len - pos);
+        if (nl == NULL) {
+            return SIZE_MAX;
+        }
+        pos = (size_t)(nl - buf) + 1;
+    }
+}
+
+/*
+ * Media boundary scanners for cs.vt.parsers.scan_mp4 and scan_mp3.
+ * These walk the box or frame headers and skip over the bodies,
+ * never building objects. Offsets are stream offsets: buf[0] is at
+ * stream offset base, and the walk state is the offset of the next
+ * header plus, for boxes, the end offsets of the open containers.
+ */
+
+/* how deeply container boxes are followed */
+#define SCAN_BOX_DEPTH  32
+
+/* the box types whose bodies are boxes, sorted for bsearch */
+static const char scan_box_containers[][4] = {
+    {'d','i','n','f'}, {'e','d','t','s'}, {'m','d','i','a'}, {'m','e','t','a'},
+    {'m','f','r','a'}, {'m','i','n','f'}, {'m','o','o','f'}, {'m','o','o','v'},
+    {'m','v','e','x'}, {'s','c','h','i'}, {'s','i','n','f'}, {'s','t','b','l'},
+    {'t','r','a','f'}, {'t','r','a','k'}, {'t','r','e','f'}, {'u','d','t','a'},
+};
+
+static int scan_box_type_cmp(const void *a, const void *b) {
+    return memcmp(a, b, 4);
+}
+
+static inline uint32_t scan_be32(const unsigned char *p) {
+    return ( (uint32_t)p[0] << 24 ) | ( (uint32_t)p[1] << 16 )
+         | ( (uint32_t)p[2] << 8 ) | (uint32_t)p[3];
+}
+
+/*
+ * Walk the boxes in buf[0:len] from *posp, appending their start offsets.
+ * Return 0 if the walk should stop, otherwise 1 with *posp and the
+ * container ends updated for the next buffer.
+ */
+static int scan_boxes_buffer(const unsigned char *buf, size_t len, uint64_t base,
+                             uint64_t *posp, uint64_t *ends, int *nendsp,
+                             scan_offsets *ov) {
+    uint64_t    pos = *posp;
+    uint64_t    limit = base + len;
+    int         nends = *nendsp;
+    int         ok = 1;
+
+    for (;;) {
+        /* leave the containers which end here, or which a child overran */
+        if (nends > 0 && pos >= ends[nends - 1]) {
+            pos = ends[--nends];
+            continue;
+        }
+        if (pos >= limit || limit - pos < 8) {
+            break;
+        }
+        const unsigned char *p = buf + (pos - base);
+        uint64_t    size = scan_be32(p);
+        uint64_t    header = 8;
+
+        if (size == 1) {
+            if (limit - pos < 16) {
+                break;
+            }
+            size = ( (uint64_t)scan_be32(p + 8) << 32 ) | scan_be32(p + 12);
+            header = 16;
+        } else if (size == 0) {
+            /* the box extends to the end of its container or of the data */
+            if (nends == 0) {
+                scan_offsets_add(ov, pos);
+                ok = 0;
+                break;
+            }
+            size = ends[nends - 1] - pos;
+        }
+        if (size < header || size > UINT64_MAX - pos) {
+            /* invalid: resume after the container or give up */
+            if (nends == 0) {
+                ok = 0;
+                break;
+            }
+            pos = ends[--nends];
+            continue;
+        }
+        if (nends < SCAN_BOX_DEPTH
+         && bsearch(p + 4, scan_box_containers,
+                    sizeof(scan_box_containers) / sizeof(scan_box_containers[0]),
+                    4, scan_box_type_cmp) != NULL) {
+            /* an ISO meta box is a full box: 4 zero bytes of version and flags */
+            if (memcmp(p + 4, "meta", 4) == 0) {
+                if (limit - pos < header + 4) {
+                    break;
+                }
+                if (scan_be32(p + header) == 0) {
+                    header += 4;
+                }
+            }
+            scan_offsets_add(ov, pos);
+            ends[nends++] = pos + size;
+            pos += header;
+        } else {
+            scan_offsets_add(ov, pos);
+            pos += size;
+        }
+    }
+    *posp = pos;
+    *nendsp = nends;
+    return ok;
+}
+
+/* MPEG audio bitrates in kbps by [MPEG1?][layer-1][index], MPEG2 and 2.5 alike */
+static const uint16_t scan_mp3_bitrates[2][3][16] = {
+    {
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+    },
+    {
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},
+    },
+};
+
+/* MPEG audio sample rates in Hz by [version field][index] */
+static const uint32_t scan_mp3_samplerates[4][4] = {
+    {11025, 12000, 8000, 0},    /* MPEG 2.5 */
+    {0, 0, 0, 0},               /* reserved */
+    {22050, 24000, 16000, 0},   /* MPEG 2 */
+    {44100, 48000, 32000, 0},   /* MPEG 1 */
+};
+
+/* the length of the MPEG audio frame with the header at p, 0 if invalid */
+static size_t scan_mp3_frame_length(const unsigned char *p) {
+    if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0) {
+        return 0;
+    }
+    int         version = (p[1] >> 3) & 3;
+    int         layer = 4 - ((p[1] >> 1) & 3);
+    int         mpeg1 = version == 3;
+    uint32_t    kbps = layer > 3 ? 0 : scan_mp3_bitrates[mpeg1][layer - 1][p[2] >> 4];
+    uint32_t    rate = scan_mp3_samplerates[version][(p[2] >> 2) & 3];
+    size_t      padding = (p[2] >> 1) & 1;
+
+    if (kbps == 0 || rate == 0) {
+        return 0;
+    }
+    if (layer == 1) {
+        return (12 * kbps * 1000 / rate + padding) * 4;
+    }
+    if (layer == 3 && !mpeg1) {
+        return 72 * kbps * 1000 / rate + padding;
+    }
+    return 144 * kbps * 1000 / rate + padding;
+}
+
+/*
+ * Walk the MP3 frames in buf[0:len] from *posp, appending their start offsets.
+ * On return *posp is an incomplete header within buf or the next frame after it.
+ */
+static void scan_mp3_buffer(const unsigned char *buf, size_t len, uint64_t base,
+                            uint64_t *posp, scan_offsets *ov) {
+    uint64_t    pos = *posp;
+    uint64_t    limit = base + len;
+
+    while (pos < limit) {
+        const unsigned char *p = buf + (pos - base);
+        size_t      avail = limit - pos;
+        uint64_t    length = 0;
+
+        if (avail < 4) {
+            break;
+        }
+        if (memcmp(p, "TAG+", 4) == 0) {
+            length = 227;
+        } else if (memcmp(p, "TAG", 3) == 0) {
+            length = 128;
+        } else if (memcmp(p, "ID3", 3) == 0) {
+            if (avail < 10) {
+                break;
+            }
+            if (((p[6] | p[7] | p[8] | p[9]) & 0x80) == 0) {
+                /* a syncsafe size, excluding the header and any footer */
+                length = 10 + ( ((uint64_t)p[6] << 21) | ((uint64_t)p[7] << 14)
+                              | ((uint64_t)p[8] << 7) | (uint64_t)p[9] )
+                       + ( (p[5] & 0x10) ? 10 : 0 );
+            }
+        } else {
+            length = scan_mp3_frame_length(p);
+        }
+        if (length > 0) {
+            scan_offsets_add(ov, pos);
+            pos += length;
+            continue;
+        }
+        /* resynchronise on the next sync word */
+        const unsigned char *q = p + 1;
+        const unsigned char *end = buf + len;
+        for (;;) {
+            q = memchr(q, 0xff, (size_t)(end - q));
+            if (q == NULL) {
+                q = end;
+                break;
+            }
+            if (end - q < 4 || scan_mp3_frame_length(q) > 0) {
+                break;
+            }
+            q++;
+        }
+        pos = base + (uint64_t)(q - buf);
+    }
+    *posp = pos;
+}
+
+/*
+ * DataRecord framing, for rescanning .vtd files and for
+ * cs.vt.parsers.scan_vtd. Only the BSUInt flags and length of each
+ * record are decoded; the data are skipped, or for scan_vtd_file
+ * optionally decompressed and hashed in parallel.
+ */
+
+/*
+ * Decode the BSUInt at p[0:len] into *valuep.
+ * Return its length, 0 if it is incomplete or -1 if it overflows 64 bits.
+ */
+static int scan_bsuint_get(const unsigned char *p, size_t len, uint64_t *valuep) {
+    uint64_t    value = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (value > (UINT64_MAX >> 7)) {
+            return -1;
+        }
+        value = (value << 7) | (p[i] & 0x7f);
+        if (!(p[i] & 0x80)) {
+            *valuep = value;
+            return (int)i + 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Walk the records in buf[0:len], whose first byte is at stream offset base,
+ * from the record at *posp, appending each record's start offset to
+ * offsets and, if data_offsets is not NULL, its data offset, data length
+ * and flags to the other vectors.
+ * If whole, only records whose data are all in buf are taken and *posp
+ * is left at the first incomplete record; otherwise a record is taken
+ * once its header is complete and *posp may be beyond the buffer.
+ * Return 0, or -1 with *posp at a record whose framing is invalid.
+ */
+static int scan_vtd_buffer(const unsigned char *buf, size_t len, uint64_t base,
+                           uint64_t *posp, int whole, scan_offsets *offsets,
+                           scan_offsets *data_offsets, scan_offsets *data_lengths,
+                           scan_offsets *flags) {
+    uint64_t    pos = *posp;
+    uint64_t    limit = base + len;
+    int         status = 0;
+
+    while (pos < limit) {
+        const unsigned char *p = buf + (pos - base);
+        size_t      avail = limit - pos;
+        uint64_t    record_flags;
+        uint64_t    length;
+        int         flags_len = scan_bsuint_get(p, avail, &record_flags);
+        int         length_len = flags_len <= 0 ? flags_len
+                               : scan_bsuint_get(p + flags_len, avail - flags_len, &length);
+
+        if (flags_len < 0 || length_len < 0) {
+            status = -1;
+            break;
+        }
+        if (length_len == 0) {
+            break;
+        }
+        uint64_t    data_offset = pos + flags_len + length_len;
+
+        if (length > UINT64_MAX - data_offset) {
+            status = -1;
+            break;
+        }
+        if (whole && data_offset + length > limit) {
+            break;
+        }
+        scan_offsets_add(offsets, pos);
+        if (data_offsets != NULL) {
+            scan_offsets_add(data_offsets, data_offset);
+            scan_offsets_add(data_lengths, length);
+            scan_offsets_add(flags, record_flags);
+        }
+        pos = data_offset + length;
+    }
+    *posp = pos;
+    return status;
+}
+
+/* decompress and hash records in parallel, in pieces of this size */
+#define SCAN_VTD_INFLATE_PIECE  (64 * 1024)
+
+typedef struct {
+    const scan_digest_algorithm *dalg;
+    const unsigned char *buf;           /* the data at stream offset base */
+    uint64_t            base;
+    const uint64_t      *data_offsets;
+    const uint64_t      *data_lengths;
+    const uint64_t      *flags;
+    size_t              first;          /* the first record to hash */
+    size_t              end;            /* the record after the last to hash */
+    unsigned char       *digests;       /* digest i at digests[i*digest_size] */
+    int                 zstatus;        /* zlib status, Z_OK unless inflate failed */
+    size_t              zfailed;        /* the record which failed */
+} scan_vtd_run;
+
+static void *scan_vtd_run_records(void *arg) {
+    scan_vtd_run    *run = arg;
+    z_stream        zs;
+    int             zinit = 0;
+    unsigned char   *out = NULL;
+    scan_digest_ctx ctx;
+
+    memset(&zs, 0, sizeof(zs));
+    run->zstatus = Z_OK;
+    for (size_t i = run->first; i < run->end; i++) {
+        const unsigned char *data = run->buf + (run->data_offsets[i] - run->base);
+        uint64_t    length = run->data_lengths[i];
+
+        scan_digest_init(&ctx, run->dalg);
+        if (run->flags[i] & SCAN_RECORD_COMPRESSED) {
+            int     zstatus;
+
+            if (!zinit) {
+                out = malloc(SCAN_VTD_INFLATE_PIECE);
+                zstatus = out == NULL ? Z_MEM_ERROR : inflateInit(&zs);
+                zinit = zstatus == Z_OK;
+            } else {
+                zstatus = inflateReset(&zs);
+            }
+            if (zstatus == Z_OK && length > UINT_MAX) {
+                zstatus = Z_DATA_ERROR;
+            }
+            if (zstatus == Z_OK) {
+                zs.next_in = (Bytef *)data;
+                zs.avail_in = (uInt)length;
+                do {
+                    zs.next_out = out;
+                    zs.avail_out = SCAN_VTD_INFLATE_PIECE;
+                    zstatus = inflate(&zs, Z_NO_FLUSH);
+                    scan_digest_update(&ctx, run->dalg, out, SCAN_VTD_INFLATE_PIECE - zs.avail_out);
+                } while (zstatus == Z_OK);
+                /* running out of input before the end is a truncated stream */
+                zstatus = zstatus == Z_STREAM_END ? Z_OK
+                        : zstatus == Z_BUF_ERROR ? Z_DATA_ERROR : zstatus;
+            }
+            if (zstatus != Z_OK) {
+                run->zstatus = zstatus;
+                run->zfailed = i;
+                break;
+            }
+        } else {
+            scan_digest_update(&ctx, run->dalg, data, (size_t)length);
+        }
+        scan_digest_final(&ctx, run->dalg, run->digests + i * run->dalg->digest_size);
+    }
+    if (zinit) {
+        inflateEnd(&zs);
+    }
+    free(out);
+    return NULL;
+}
+
+/*
+ * Hash the uncompressed data of the records[0:nrecords] using up to
+ * nthreads threads, dividing them into runs of about equal data size.
+ * Return the zlib status of the first failed record, in *zfailedp, or Z_OK.
+ * The caller must not hold the GIL if nthreads > 1.
+ */
+static int scan_vtd_digest_parallel(
+    const scan_digest_algorithm *dalg, const unsigned char *buf, uint64_t base,
+    const scan_offsets *data_offsets, const scan_offsets *data_lengths,
+    const scan_offsets *flags, unsigned char *digests, int nthreads, size_t *zfailedp)
+{
+    scan_vtd_run    runs[SCAN_MAX_THREADS];
+#ifdef SCAN_THREADS
+    pthread_t       tids[SCAN_MAX_THREADS];
+    int             started[SCAN_MAX_THREADS];
+#endif
+    size_t          nrecords = data_offsets->n;
+
+    if ((size_t)nthreads > nrecords) {
+        nthreads = (int)nrecords;
+    }
+    if (nthreads < 1) {
+        return Z_OK;
+    }
+    uint64_t        total = 0;
+    for (size_t i = 0; i < nrecords; i++) {
+        total += data_lengths->offsets[i];
+    }
+    size_t          i = 0;
+    uint64_t        sofar = 0;
+    for (int t = 0; t < nthreads; t++) {
+        scan_vtd_run    *run = &runs[t];
+        uint64_t    upto = total / nthreads * (t + 1);
+
+        run->dalg = dalg;
+        run->buf = buf;
+        run->base = base;
+        run->data_offsets = data_offsets->offsets;
+        run->data_lengths = data_lengths->offsets;
+        run->flags = flags->offsets;
+        run->digests = digests;
+        run->first = i;
+        if (t == nthreads - 1) {
+            i = nrecords;
+        } else {
+            while (i < nrecords && sofar + data_lengths->offsets[i] <= upto) {
+                sofar += data_lengths->offsets[i++];
+            }
+        }
+        run->end = i;
+    }
+    for (int t = 1; t < nthreads; t++) {
+#ifdef SCAN_THREADS
+        started[t] = pthread_create(&tids[t], NULL, scan_vtd_run_records, &runs[t]) == 0;
+        if (!started[t])
+#endif
+        {
+            scan_vtd_run_records(&runs[t]);
+        }
+    }
+    scan_vtd_run_records(&runs[0]);
+#ifdef SCAN_THREADS
+    for (int t = 1; t < nthreads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        }
+    }
+#endif
+    for (int t = 0; t < nthreads; t++) {
+        if (runs[t].zstatus != Z_OK) {
+            *zfailedp = runs[t].zfailed;
+            return runs[t].zstatus;
+        }
+    }
+    return Z_OK;
+}
+
+/*
+ * The per-module state. The module uses multi-phase initialisation
+ * (PEP 489) so that each interpreter which imports it has its own
+ * state and Scanner type; the C tables are shared and read only.
+ */
+typedef struct {
+    PyObject    *array_type;    /* array.array, for the offsets arrays */
+    PyObject    *scanner_type;  /* the Scanner heap type */
+    PyObject    *blake3_type;   /* the blake3 heap type */
+} scan_module_state;
+
+/* a new array('Q') holding the offsets in ov */
+static PyObject *scan_offsets_array(PyObject *array_type, const scan_offsets *ov) {
+    PyObject    *array = PyObject_CallFunction(array_type, "s", "Q");
+    if (array == NULL || ov->n == 0) {
+        return array;
+    }
+    PyObject    *mv = PyMemoryView_FromMemory(
+                        (char *)ov->offsets, ov->n * sizeof(uint64_t), PyBUF_READ);
+    if (mv == NULL) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    PyObject    *result = PyObject_CallMethod(array, "frombytes", "O", mv);
+    Py_DECREF(mv);
+    if (result == NULL) {
+        Py_DECREF(array);
+        return NULL;
+    }
+    Py_DECREF(result);
+    return array;
+}
+
+/*
+ * Scanner: the block boundary logic of cs.vt.blockify.blocked_chunks_of.
+ *
+ * A Scanner is fed successive chunks of a data stream along with any
+ * offsets suggested by a parser for that stream. It keeps the rolling
+ * hash, the stream offset, the offset of the latest cut and the parser
+ * offsets not yet used. For each chunk it returns the positions within
+ * the chunk where blocks end, honouring min_block and max_block.
+ *
+ * Candidate edges are considered in ascending order. A candidate is
+ * used if it lies beyond the current position and at least min_block
+ * past the latest cut; smaller candidates are discarded. If the first
+ * usable candidate lies beyond the chunk end it is also discarded,
+ * as the Python heap based implementation did. A block is cut
+ * unconditionally when it reaches max_block.
+ *
+ * In normalised mode (after FastCDC) the hash is not examined until
+ * min_block bytes past the latest cut. Up to the target block size
+ * a stricter divisor (4 times the target) is used, and after it a
+ * looser one (a quarter of the target), which narrows the block size
+ * distribution and reduces the number of forced cuts. Parser offsets
+ * are kept until used or passed, and the cuts do not depend on how the
+ * stream is divided into chunks.
+ *
+ * In classic mode the divisor sets the rolling hash hit rate and thus
+ * the average block size (about min_block + divisor); it defaults
+ * to SCAN_DIVISOR.
+ *
+ * If a hashname is supplied the Scanner also computes the digest of
+ * each block it cuts, keeping a running digest of the pending data.
+ *
+ * With a min_run the Scanner cuts out each run of at least min_run
+ * repeats of one octet as a block of its own, for blockify to emit as an
+ * RLEBlock instead of hashing and storing it. A run is cut where it
+ * starts, regardless of min_block, and where it ends, regardless of
+ * max_block, with no cuts or hashing within it. A run is recognised once
+ * it is min_run bytes long; if it began in an earlier chunk it is cut
+ * from the start of the current chunk, so run boundaries depend on how
+ * the stream is divided into chunks.
+ *
+ * The rolling hash algorithm is chosen by name from scan_algorithms.
+ */
+typedef struct {
+    PyObject_HEAD
+    const scan_algorithm *alg;          /* the rolling hash algorithm */
+    unsigned long long  hash_value;
+    unsigned char       hist[SCAN_MAX_WINDOW];  /* the stream bytes before offset */
+    Py_ssize_t          min_block;
+    Py_ssize_t          max_block;
+    unsigned long long  offset;         /* stream offset of the next byte */
+    unsigned long long  last_offset;    /* stream offset of the latest cut */
+    unsigned long long  nforced;        /* cuts forced by max_block */
+    char                normalised;     /* normalised chunking mode */
+    Py_ssize_t          target;         /* normalised target block size */
+    Py_ssize_t          divisor;        /* classic divisor */
+    scan_test           classic;        /* classic test */
+    scan_test           strict;         /* normalised test below target */
+    scan_test           loose;          /* normalised test from target */
+    scan_offsets        parser_offsets; /* min-heap of parser offsets */
+    scan_offsets        hits;           /* rolling hash hits in the current chunk */
+    scan_offsets        cuts;           /* cuts in the current chunk */
+    const scan_digest_algorithm *dalg;  /* the block digest, or NULL */
+    scan_digest_ctx     pending;        /* digest of the data after last_offset */
+    unsigned char       *digests;       /* digests of the blocks cut in the current chunk */
+    size_t              digests_cap;    /* the capacity of digests in bytes */
+    Py_ssize_t          min_run;        /* the shortest run to cut out, or 0 */
+    char                in_run;         /* the pending data are a run of run_octet */
+    unsigned char       run_octet;      /* the octet of the run or streak at offset */
+    uint64_t            streak;         /* repeats of run_octet before offset */
+    scan_offsets        runs;           /* run blocks cut in the latest call: index << 8 | octet */
+    int                 busy;           /* a call is using the Scanner */
+} ScannerObject;
+
+/*
+ * A Scanner may be shared between threads, which may run without the GIL
+ * in free-threaded builds. Each call which uses or changes its stream
+ * state claims it first, failing with RuntimeError if it is in use.
+ */
+static int scan_claim(int *busy, const char *what) {
+#if defined(__GNUC__)
+    int         idle = 0;
+
+    if (!__atomic_compare_exchange_n(busy, &idle, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+#else
+    if (*busy) {
+#endif
+        PyErr_Format(PyExc_RuntimeError, "%s in use", what);
+        return -1;
+    }
+#if !defined(__GNUC__)
+    *busy = 1;
+#endif
+    return 0;
+}
+
+static void scan_release(int *busy) {
+#if defined(__GNUC__)
+    __atomic_store_n(busy, 0, __ATOMIC_RELEASE);
+#else
+    *busy = 0;
+#endif
+}
+
+/*
+ * Validate an optional threads argument into *threadsp:
+ * None gives 0 (automatic), otherwise a non-negative int.
+ * Return 0 on success, or -1 with an exception set.
+ */
+static int scan_threads_arg(PyObject *threads_obj, long *threadsp) {
+    long            threads = 0;
+    if (threads_obj != Py_None) {
+        threads = PyLong_AsLong(threads_obj);
+        if (threads == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        if (threads < 0) {
+            PyErr_Format(PyExc_ValueError, "threads < 0: %ld", threads);
+            return -1;
+        }
+    }
+    *threadsp = threads;
+    return 0;
+}
+
+static int scanner_claim(ScannerObject *self) {
+    return scan_claim(&self->busy, "Scanner");
+}
+
+static void scanner_release(ScannerObject *self) {
+    scan_release(&self->busy);
+}
+
+/* the array.array type from the module state of the Scanner's type */
+static PyObject *scanner_array_type(ScannerObject *self) {
+    scan_module_state   *state = PyType_GetModuleState(Py_TYPE(self));
+
+    return state->array_type;
+}
+
+static void scanner_heap_push(scan_offsets *heap, uint64_t offset) {
+    scan_offsets_add(heap, offset);
+    if (heap->failed) {
+        return;
+    }
+    size_t      i = heap->n - 1;
+    while (i > 0) {
+        size_t  parent = (i - 1) / 2;
+        if (heap->offsets[parent] <= offset) {
+            break;
+        }
+        heap->offsets[i] = heap->offsets[parent];
+        i = parent;
+    }
+    heap->offsets[i] = offset;
+}
+
+static uint64_t scanner_heap_pop(scan_offsets *heap) {
+    uint64_t    top = heap->offsets[0];
+    uint64_t    offset = heap->offsets[--heap->n];
+    size_t      i = 0;
+
+    for (;;) {
+        size_t  child = 2 * i + 1;
+        if (child >= heap->n) {
+            break;
+        }
+        if (child + 1 < heap->n && heap->offsets[child + 1] < heap->offsets[child]) {
+            child++;
+        }
+        if (offset <= heap->offsets[child]) {
+            break;
+        }
+        heap->offsets[i] = heap->offsets[child];
+        i = child;
+    }
+    if (heap->n > 0) {
+        heap->offsets[i] = offset;
+    }
+    return top;
+}
+
+/*
+ * Choose the cuts for the next buflen bytes of the stream
+ * from the hash hits and the parser offsets.
+ * Does not need the GIL.
+ */
+static void scanner_cut(ScannerObject *sc, size_t buflen) {
+    const uint64_t      start = sc->offset;
+    const uint64_t      end = start + buflen;
+    const uint64_t      min_block = (uint64_t)sc->min_block;
+    const uint64_t      max_block = (uint64_t)sc->max_block;
+    uint64_t            pos = start;
+    uint64_t            last = sc->last_offset;
+    scan_offsets        *heap = &sc->parser_offsets;
+    const scan_offsets  *hits = &sc->hits;
+    size_t              hit_ndx = 0;
+
+    while (pos < end) {
+        uint64_t    edge = 0;
+        int         found = 0;
+        /* the next usable candidate from the hits and the parser offsets */
+        for (;;) {
+            if (hit_ndx < hits->n
+             && (heap->n == 0 || start + hits->offsets[hit_ndx] <= heap->offsets[0])) {
+                edge = start + hits->offsets[hit_ndx++];
+            } else if (heap->n > 0) {
+                edge = scanner_heap_pop(heap);
+            } else {
+                break;
+            }
+            if (edge > pos && edge >= last + min_block) {
+                found = 1;
+                break;
+            }
+        }
+        uint64_t    take_to = found && edge <= end ? edge : end;
+        while (take_to - last >= max_block) {
+            last += max_block;
+            scan_offsets_add(&sc->cuts, last - start);
+            sc->nforced++;
+        }
+        pos = take_to;
+        if (found && edge <= end && pos > last) {
+            last = pos;
+            scan_offsets_add(&sc->cuts, last - start);
+        }
+    }
+    sc->offset = end;
+    sc->last_offset = last;
+}
+
+/*
+ * Return the stream offset of the first hash hit in [from:upto),
+ * or UINT64_MAX if none. These offsets lie within the current chunk buf,
+ * which starts at stream offset start.
+ */
+static uint64_t scanner_first_hit(
+    ScannerObject *sc, const unsigned char *buf, uint64_t start,
+    uint64_t from, uint64_t upto, const scan_test *test)
+{
+    const scan_algorithm *alg = sc->alg;
+    size_t          pos = (size_t)(from - start);
+    const size_t    end = (size_t)(upto - start);
+
+    while (pos < end) {
+        size_t      piece_end = end - pos > SCAN_NORMALISED_PIECE
+                                ? pos + SCAN_NORMALISED_PIECE : end;
+        uint64_t    hash_value = scan_resync(alg, sc->hist, buf, pos);
+        sc->hits.n = 0;
+        alg->scan(alg, NULL, &hash_value, sc->hist, buf, pos, piece_end,
+                  test, &sc->hits);
+        if (sc->hits.n > 0) {
+            return start + sc->hits.offsets[0];
+        }
+        if (sc->hits.failed) {
+            break;
+        }
+        pos = piece_end;
+    }
+    return UINT64_MAX;
+}
+
+/*
+ * Choose the normalised cuts for the next buflen bytes of the stream
+ * from buf and the parser offsets.
+ * Does not need the GIL.
+ */
+static void scanner_cut_normalised(
+    ScannerObject *sc, const unsigned char *buf, size_t buflen)
+{
+    const uint64_t      start = sc->offset;
+    const uint64_t      end = start + buflen;
+    const uint64_t      min_block = (uint64_t)sc->min_block;
+    const uint64_t      max_block = (uint64_t)sc->max_block;
+    const uint64_t      target = (uint64_t)sc->target;
+    uint64_t            pos = start;
+    uint64_t            last = sc->last_offset;
+    scan_offsets        *heap = &sc->parser_offsets;
+
+    while (pos < end) {
+        /* discard parser offsets already passed or too close to the latest cut */
+        while (heap->n > 0
+            && (heap->offsets[0] < pos || heap->offsets[0] < last + min_block)) {
+            scanner_heap_pop(heap);
+        }
+        /* the cut to make if the hash offers nothing sooner */
+        uint64_t    limit = last + max_block;
+        int         parser_cut = 0;
+        if (heap->n > 0 && heap->offsets[0] <= limit) {
+            limit = heap->offsets[0];
+            parser_cut = 1;
+        }
+        uint64_t    from = pos > last + min_block ? pos : last + min_block;
+        uint64_t    upto = limit < end ? limit : end;
+        uint64_t    edge = UINT64_MAX;
+        uint64_t    mid = last + target;
+        if (from < upto && from < mid) {
+            edge = scanner_first_hit(sc, buf, start,
+                                     from, mid < upto ? mid : upto, &sc->strict);
+        }
+        if (edge == UINT64_MAX && mid < upto) {
+            edge = scanner_first_hit(sc, buf, start,
+                                     from > mid ? from : mid, upto, &sc->loose);
+        }
+        if (sc->hits.failed) {
+            return;
+        }
+        if (edge == UINT64_MAX) {
+            if (limit > end) {
+                break;
+            }
+            edge = limit;
+            if (parser_cut) {
+                scanner_heap_pop(heap);
+            } else {
+                sc->nforced++;
+            }
+        }
+        last = pos = edge;
+        scan_offsets_add(&sc->cuts, last - start);
+    }
+    sc->offset = end;
+    sc->last_offset = last;
+    sc->hash_value = scan_resync(sc->alg, sc->hist, buf, buflen);
+}
+
+static char Scanner_docstring[] =
+    "Scanner(min_block, max_block, normalised=False, target=None, algorithm=None,\n"
+    "        divisor=None, hashname=None, min_run=0)\n"
+    "Stateful block boundary scanner for a data stream.\n"
+    "Each call to scan(data, offsets=None) consumes the next chunk of the\n"
+    "stream and returns an array('Q') of the positions within data where\n"
+    "blocks end. The optional offsets are desirable boundaries (stream\n"
+    "offsets) from a parser, such as those following data in the parse queue.\n"
+    "Data after the last cut is pending; the caller flushes it at end of input.\n"
+    "If normalised is true, use normalised chunking aiming for blocks\n"
+    "of size target, default 4096 limited to the range min_block..max_block/2.\n"
+    "Otherwise the rolling hash indicates an edge where its value modulo\n"
+    "divisor is divisor-2; divisor is odd, default 4093.\n"
+    "The algorithm names the rolling hash, one of algorithms, default vt28.\n"
+    "The optional hashname, one of digests, names the digest to compute\n"
+    "for each block; see scan_digests().\n"
+    "If min_run is not 0, runs of at least min_run repeats of one octet\n"
+    "are cut out as blocks of their own. After each scan, runs() returns\n"
+    "(index, octet) for the cuts which end runs, and pending_run() returns\n"
+    "the octet if the pending data are a run, otherwise None.";
+
+static int Scanner_init(ScannerObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"min_block", "max_block", "normalised", "target",
+                                 "algorithm", "divisor", "hashname", "min_run", NULL};
+    Py_ssize_t      min_block, max_block;
+    int             normalised = 0;
+    PyObject        *target_obj = Py_None;
+    const char      *algorithm_name = NULL;
+    PyObject        *divisor_obj = Py_None;
+    const char      *hashname = NULL;
+    Py_ssize_t      min_run = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "nn|pOzOzn", kwlist,
+                                     &min_block, &max_block,
+                                     &normalised, &target_obj,
+                                     &algorithm_name, &divisor_obj,
+                                     &hashname, &min_run)) {
+        return -1;
+    }
+    if (min_run < 0 || min_run == 1) {
+        PyErr_Format(PyExc_ValueError, "min_run should be 0 or at least 2: %zd", min_run);
+        return -1;
+    }
+    const scan_digest_algorithm *dalg = NULL;
+    if (hashname != NULL) {
+        dalg = scan_digest_named(hashname);
+        if (dalg == NULL) {
+            PyErr_Format(PyExc_ValueError, "unsupported hashname: %s", hashname);
+            return -1;
+        }
+    }
+    const scan_algorithm *alg = &scan_algorithms[0];
+    if (algorithm_name != NULL) {
+        alg = scan_algorithm_named(algorithm_name);
+        if (alg == NULL) {
+            PyErr_Format(PyExc_ValueError, "unknown algorithm: %s", algorithm_name);
+            return -1;
+        }
+    }
+    if (min_block < 1) {
+        PyErr_Format(PyExc_ValueError, "min_block < 1: %zd", min_block);
+        return -1;
+    }
+    if (min_block >= max_block) {
+        PyErr_Format(PyExc_ValueError, "min_block:%zd >= max_block:%zd",
+                     min_block, max_block);
+        return -1;
+    }
+    Py_ssize_t      target = 0;
+    if (normalised) {
+        if (target_obj == Py_None) {
+            target = SCAN_NORMALISED_TARGET;
+            if (target > max_block / 2) {
+                target = max_block / 2;
+            }
+            if (target < min_block) {
+                target = min_block;
+            }
+        } else {
+            target = PyLong_AsSsize_t(target_obj);
+            if (target == -1 && PyErr_Occurred()) {
+                return -1;
+            }
+            if (target < min_block || target >= max_block) {
+                PyErr_Format(PyExc_ValueError,
+                             "target:%zd not in min_block:%zd..max_block:%zd",
+                             target, min_block, max_block);
+                return -1;
+            }
+        }
+        /* 4*target fits comfortably in the 28 bit hash range */
+        if (target > (1 << 24)) {
+            PyErr_Format(PyExc_ValueError, "target too large: %zd", target);
+            return -1;
+        }
+    } else if (target_obj != Py_None) {
+        PyErr_SetString(PyExc_ValueError, "target requires normalised mode");
+        return -1;
+    }
+    Py_ssize_t      divisor = 0;
+    if (divisor_obj != Py_None) {
+        if (normalised) {
+            PyErr_SetString(PyExc_ValueError, "divisor requires classic mode");
+            return -1;
+        }
+        divisor = PyLong_AsSsize_t(divisor_obj);
+        if (divisor == -1 && PyErr_Occurred()) {
+            return -1;
+        }
+        if (divisor < 3 || divisor > SCAN_MAX_DIVISOR || !(divisor & 1)) {
+            PyErr_Format(PyExc_ValueError,
+                         "divisor:%zd should be odd and in the range 3..%d",
+                         divisor, SCAN_MAX_DIVISOR);
+            return -1;
+        }
+    } else if (!normalised) {
+        divisor = SCAN_DIVISOR;
+    }
+    if (scanner_claim(self) < 0) {
+        return -1;
+    }
+    self->alg = alg;
+    self->normalised = normalised;
+    self->target = target;
+    if (normalised) {
+        uint32_t    strict = ((uint32_t)target << 2) | 1;
+        uint32_t    loose = ((uint32_t)target >> 2) | 1;
+        if (loose < 3) {
+            loose = 3;
+        }
+        scan_test_init(&self->strict, strict, strict - 2);
+        scan_test_init(&self->loose, loose, loose - 2);
+    } else {
+        scan_test_init(&self->classic, (uint32_t)divisor, (uint32_t)divisor - 2);
+    }
+    self->divisor = divisor;
+    self->dalg = dalg;
+    if (dalg != NULL) {
+        scan_digest_init(&self->pending, dalg);
+    }
+    self->min_block = min_block;
+    self->max_block = max_block;
+    self->hash_value = alg->initial;
+    memset(self->hist, 0, sizeof(self->hist));
+    self->offset = 0;
+    self->last_offset = 0;
+    self->nforced = 0;
+    self->parser_offsets.n = 0;
+    self->min_run = min_run;
+    self->in_run = 0;
+    self->run_octet = 0;
+    self->streak = 0;
+    self->runs.n = 0;
+    scanner_release(self);
+    return 0;
+}
+
+static void Scanner_dealloc(ScannerObject *self) {
+    scan_offsets_free(&self->parser_offsets);
+    scan_offsets_free(&self->hits);
+    scan_offsets_free(&self->cuts);
+    scan_offsets_free(&self->runs);
+    free(self->digests);
+    PyTypeObject    *tp = Py_TYPE(self);
+    tp->tp_free((PyObject *)self);
+    Py_DECREF(tp);
+}
+
+/* push the parser offsets from the iterable offsets_obj onto the heap */
+static int scanner_add_offsets(ScannerObject *self, PyObject *offsets_obj) {
+    PyObject    *it = PyObject_GetIter(offsets_obj);
+    PyObject    *item;
+
+    if (it == NULL) {
+        return -1;
+    }
+    while ((item = PyIter_Next(it)) != NULL) {
+        int                 overflow;
+        long long           offset = PyLong_AsLongLongAndOverflow(item, &overflow);
+        Py_DECREF(item);
+        if (offset == -1 && PyErr_Occurred()) {
+            Py_DECREF(it);
+            return -1;
+        }
+        /* offsets before the stream start can never be used */
+        if (overflow < 0 || offset < 0) {
+            continue;
+        }
+        scanner_heap_push(&self->parser_offsets,
+                          overflow > 0 ? UINT64_MAX : (uint64_t)offset);
+        if (self->parser_offsets.failed) {
+            Py_DECREF(it);
+            self->parser_offsets.failed = 0;
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    Py_DECREF(it);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/*
+ * Make room in self->digests for the digests of all the cuts in self->cuts.
+ * Return 0 on success or -1 if the digest storage could not be allocated.
+ */
+static int scanner_digests_reserve(ScannerObject *self) {
+    size_t          digest_size = self->dalg->digest_size;
+    size_t          ncuts = self->cuts.n;
+
+    if (ncuts > SIZE_MAX / 2 / digest_size) {
+        return -1;
+    }
+    if (ncuts * digest_size > self->digests_cap) {
+        size_t          cap = ncuts * digest_size * 2;
+        unsigned char   *digests = realloc(self->digests, cap);
+
+        if (digests == NULL) {
+            return -1;
+        }
+        self->digests = digests;
+        self->digests_cap = cap;
+    }
+    return 0;
+}
+
+/*
+ * Compute the digests of the blocks ending at the cuts from cuts[first]
+ * on, which lie in buf[from:to], and add the data after the last of them
+ * to the pending digest. The first block includes the pending data.
+ * Return 0 on success or -1 if the digest storage could not be allocated.
+ * Does not need the GIL.
+ */
+static int scanner_digest(
+    ScannerObject *self, const unsigned char *buf, size_t from, size_t to, size_t first)
+{
+    const scan_digest_algorithm *dalg = self->dalg;
+    const uint64_t  *cuts = self->cuts.offsets + first;
+    size_t          ncuts = self->cuts.n - first;
+    size_t          tail = from;
+
+    if (ncuts > 0) {
+        if (scanner_digests_reserve(self) < 0) {
+            return -1;
+        }
+        unsigned char   *digests = self->digests + first * dalg->digest_size;
+
+        scan_digest_update(&self->pending, dalg, buf + from, cuts[0] - from);
+        scan_digest_final(&self->pending, dalg, digests);
+        scan_digest_parallel(dalg, buf, cuts, ncuts, digests,
+                             scan_nthreads(to - from, 0, 1));
+        scan_digest_init(&self->pending, dalg);
+        tail = cuts[ncuts - 1];
+    }
+    scan_digest_update(&self->pending, dalg, buf + tail, to - tail);
+    return 0;
+}
+
+/*
+ * Cut at the current offset, at pos in the current chunk.
+ * If run, the block is a run of run_octet: record it in self->runs
+ * and give it an all zero digest; otherwise its digest is the pending digest.
+ * Return 0 on success or -1 if a memory allocation failed.
+ */
+static int scanner_cut_here(ScannerObject *self, size_t pos, int run) {
+    self->last_offset = self->offset;
+    scan_offsets_add(&self->cuts, pos);
+    if (run) {
+        scan_offsets_add(&self->runs, ((uint64_t)(self->cuts.n - 1) << 8) | self->run_octet);
+    }
+    if (self->cuts.failed || self->runs.failed) {
+        return -1;
+    }
+    if (self->dalg != NULL) {
+        if (scanner_digests_reserve(self) < 0) {
+            return -1;
+        }
+        unsigned char   *digest = self->digests + (self->cuts.n - 1) * self->dalg->digest_size;
+
+        if (run) {
+            memset(digest, 0, self->dalg->digest_size);
+        } else {
+            scan_digest_final(&self->pending, self->dalg, digest);
+            scan_digest_init(&self->pending, self->dalg);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Return the start of the first run of at least min_run repeats of one
+ * octet in buf[pos:end], with its octet in *octetp, or end if there is
+ * none, in which case *octetp and *streakp describe the repeats ending at end.
+ * On entry they describe the repeats before pos; a run continuing them
+ * is reported as starting at pos.
+ * If min_run is 0 there are no runs.
+ */
+static size_t scan_run_find(
+    const unsigned char *buf, size_t pos, size_t end, size_t min_run,
+    unsigned char *octetp, uint64_t *streakp)
+{
+    unsigned char   octet = *octetp;
+    uint64_t        streak = *streakp;
+    size_t          i = pos;
+
+    if (min_run == 0) {
+        return end;
+    }
+    if (streak > 0) {
+        while (i < end && buf[i] == octet) {
+            i++;
+            if (++streak >= min_run) {
+                return pos;
+            }
+        }
+        if (i == end) {
+            *streakp = streak;
+            return end;
+        }
+    }
+    /*
+     * Here buf[i] differs from the octet before it. Any run of min_run
+     * starting in [i:i+min_run) includes buf[i+min_run-1], so examine
+     * only the repeats around that octet; if they are too short the
+     * next run can only start after them.
+     */
+    while (end - i >= min_run) {
+        size_t      j = i + min_run - 1;
+        size_t      b = j;
+        size_t      e = j + 1;
+
+        octet = buf[j];
+        while (b > i && buf[b - 1] == octet) {
+            b--;
+        }
+        while (e < end && e - b < min_run && buf[e] == octet) {
+            e++;
+        }
+        if (e - b >= min_run) {
+            *octetp = octet;
+            return b;
+        }
+        if (e == end) {
+            *octetp = octet;
+            *streakp = e - b;
+            return end;
+        }
+        i = e;
+    }
+    streak = 0;
+    if (i < end) {
+        size_t      b = end - 1;
+
+        octet = buf[b];
+        while (b > i && buf[b - 1] == octet) {
+            b--;
+        }
+        streak = end - b;
+    }
+    *octetp = octet;
+    *streakp = streak;
+    return end;
+}
+
+/*
+ * Scan buf[from:to], the next part of the stream, which holds no runs,
+ * adding its cuts to self->cuts, relative to buf, and their digests.
+ * Return 0 on success or -1 if a memory allocation failed.
+ * Does not need the GIL.
+ */
+static int scanner_scan_segment(
+    ScannerObject *self, const unsigned char *buf, size_t from, size_t to)
+{
+    const unsigned char *seg = buf + from;
+    size_t          seglen = to - from;
+    size_t          first = self->cuts.n;
+
+    self->hits.n = 0;
+    if (self->normalised) {
+        scanner_cut_normalised(self, seg, seglen);
+    } else {
+        uint64_t    hash_value = self->hash_value;
+
+        if (seglen > 0) {
+            scan_parallel(self->alg, NULL, &hash_value, self->hist, seg, seglen,
+                          &self->classic, &self->hits,
+                          scan_nthreads(seglen, 0, self->alg->window));
+        }
+        if (self->hits.failed) {
+            return -1;
+        }
+        scanner_cut(self, seglen);
+        self->hash_value = hash_value;
+    }
+    scan_history_advance(self->alg, self->hist, seg, seglen);
+    if (self->hits.failed || self->cuts.failed) {
+        return -1;
+    }
+    for (size_t i = first; i < self->cuts.n; i++) {
+        self->cuts.offsets[i] += from;
+    }
+    if (self->dalg != NULL) {
+        return scanner_digest(self, buf, from, to, first);
+    }
+    return 0;
+}
+
+/*
+ * Scan buf[0:buflen] as the next chunk of the stream, leaving the cuts
+ * in self->cuts, the run blocks among them in self->runs and,
+ * if there is a digest, their digests in self->digests.
+ * Return 0 on success or -1 if a memory allocation failed.
+ * This does not use the Python API; it is called without the GIL.
+ */
+static int scanner_scan_buffer(ScannerObject *self, const unsigned char *buf, size_t buflen) {
+    size_t          pos = 0;
+    int             status = 0;
+
+    self->cuts.n = 0;
+    self->runs.n = 0;
+    for (;;) {
+        if (self->in_run) {
+            size_t      e = pos;
+
+            while (e < buflen && buf[e] == self->run_octet) {
+                e++;
+            }
+            scan_history_advance(self->alg, self->hist, buf + pos, e - pos);
+            self->offset += e - pos;
+            if (e == buflen) {
+                break;
+            }
+            /* the run ends at e: cut, and resume hashing after it */
+            if (scanner_cut_here(self, e, 1) < 0) {
+                status = -1;
+                break;
+            }
+            self->in_run = 0;
+            self->streak = 0;
+            self->hash_value = scan_resync(self->alg, self->hist, buf + e, 0);
+            pos = e;
+        }
+        size_t      run_start = scan_run_find(buf, pos, buflen, (size_t)self->min_run,
+                                              &self->run_octet, &self->streak);
+        if (scanner_scan_segment(self, buf, pos, run_start) < 0) {
+            status = -1;
+            break;
+        }
+        if (run_start == buflen) {
+            break;
+        }
+        /* a run starts at run_start: cut before it */
+        if (self->offset > self->last_offset && scanner_cut_here(self, run_start, 0) < 0) {
+            status = -1;
+            break;
+        }
+        self->in_run = 1;
+        pos = run_start;
+    }
+    if (status < 0) {
+        self->hits.failed = self->cuts.failed = self->runs.failed = 0;
+    }
+    return status;
+}
+
+/*
+ * Scan the next chunk, the common code for scan() and scan_digests().
+ * Return the cuts as an array('Q') and, if digestsp is not NULL,
+ * the block digests as a bytes object in *digestsp.
+ */
+static PyObject *scanner_scan_chunk(
+    ScannerObject *self, PyObject *args, PyObject *kwargs, PyObject **digestsp)
+{
+    static char     *kwlist[] = {"data", "offsets", NULL};
+    Py_buffer       view;
+    PyObject        *offsets_obj = Py_None;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*|O", kwlist,
+                                     &view, &offsets_obj)) {
+        return NULL;
+    }
+    if (scanner_claim(self) < 0) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    PyObject        *cuts = NULL;
+    int             status;
+    if (self->max_block < 1) {
+        PyErr_SetString(PyExc_RuntimeError, "Scanner not initialised");
+        goto done;
+    }
+    if (digestsp != NULL && self->dalg == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Scanner has no hashname");
+        goto done;
+    }
+    if (offsets_obj != Py_None && scanner_add_offsets(self, offsets_obj) < 0) {
+        goto done;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    status = scanner_scan_buffer(self, view.buf, (size_t)view.len);
+    Py_END_ALLOW_THREADS
+    if (status < 0) {
+        /* the stream state is unreliable after a failed allocation */
+        self->max_block = 0;
+        PyErr_NoMemory();
+        goto done;
+    }
+    /* the results are copied out before the Scanner is released */
+    cuts = scan_offsets_array(scanner_array_type(self), &self->cuts);
+    if (cuts != NULL && digestsp != NULL) {
+        *digestsp = PyBytes_FromStringAndSize(
+                        (const char *)self->digests, self->cuts.n * self->dalg->digest_size);
+        if (*digestsp == NULL) {
+            Py_CLEAR(cuts);
+        }
+    }
+
+  done:
+    scanner_release(self);
+    PyBuffer_Release(&view);
+    return cuts;
+}
+
+static PyObject *Scanner_scan(ScannerObject *self, PyObject *args, PyObject *kwargs) {
+    return scanner_scan_chunk(self, args, kwargs, NULL);
+}
+
+static PyObject *Scanner_scan_digests(ScannerObject *self, PyObject *args, PyObject *kwargs) {
+    PyObject    *digests = NULL;
+    PyObject    *cuts;
+
+    cuts = scanner_scan_chunk(self, args, kwargs, &digests);
+    if (cuts == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", cuts, digests);
+}
+
+static PyObject *Scanner_pending_digest(ScannerObject *self, PyObject *unused) {
+    unsigned char   digest[SCAN_DIGEST_MAX];
+    size_t          digest_size;
+
+    if (scanner_claim(self) < 0) {
+        return NULL;
+    }
+    if (self->dalg == NULL) {
+        scanner_release(self);
+        PyErr_SetString(PyExc_ValueError, "Scanner has no hashname");
+        return NULL;
+    }
+    scan_digest_final(&self->pending, self->dalg, digest);
+    digest_size = self->dalg->digest_size;
+    scanner_release(self);
+    return PyBytes_FromStringAndSize((const char *)digest, digest_size);
+}
+
+/*
+ * scan_file scans a file range in pieces of SCAN_FILE_CHUNK bytes,
+ * the same as DEFAULT_SCAN_SIZE in cs.vt.blockify, so its cuts match
+ * those of a scan of the file read in pieces of that size.
+ * It maps at most SCAN_FILE_MAP bytes of the file at a time.
+ */
+#define SCAN_FILE_CHUNK     (1024 * 1024)
+#define SCAN_FILE_MAP       (64 * SCAN_FILE_CHUNK)
+
+/*
+ * Scan the range [start:end) of the file fd, the common code for
+ * scan_file() and scan_file_digests().
+ * Return the cuts, relative to start, as an array('Q') and,
+ * if digestsp is not NULL, the block digests as a bytes object in *digestsp.
+ */
+static PyObject *scanner_scan_file(
+    ScannerObject *self, PyObject *args, PyObject *kwargs, PyObject **digestsp)
+{
+    static char     *kwlist[] = {"fd", "start", "end", NULL};
+    int             fd;
+    long long       start = 0;
+    PyObject        *end_obj = Py_None;
+    long long       end;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|LO", kwlist,
+                                     &fd, &start, &end_obj)) {
+        return NULL;
+    }
+    if (start < 0) {
+        PyErr_Format(PyExc_ValueError, "start < 0: %lld", start);
+        return NULL;
+    }
+#ifndef SCAN_MMAP
+    (void)end_obj;
+    (void)end;
+    (void)digestsp;
+    PyErr_SetString(PyExc_NotImplementedError, "scan_file requires mmap");
+    return NULL;
+#else
+    struct stat     st;
+
+    if (fstat(fd, &st) < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (end_obj == Py_None) {
+        end = st.st_size;
+    } else {
+        end = PyLong_AsLongLong(end_obj);
+        if (end == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    if (end < start) {
+        PyErr_Format(PyExc_ValueError, "end:%lld < start:%lld", end, start);
+        return NULL;
+    }
+    /* a mapping beyond the end of the file would fault */
+    if (end > (long long)st.st_size) {
+        PyErr_Format(PyExc_ValueError, "end:%lld > file size:%lld",
+                     end, (long long)st.st_size);
+        return NULL;
+    }
+
+    if (scanner_claim(self) < 0) {
+        return NULL;
+    }
+    if (self->max_block < 1) {
+        scanner_release(self);
+        PyErr_SetString(PyExc_RuntimeError, "Scanner not initialised");
+        return NULL;
+    }
+    if (digestsp != NULL && self->dalg == NULL) {
+        scanner_release(self);
+        PyErr_SetString(PyExc_ValueError, "Scanner has no hashname");
+        return NULL;
+    }
+
+    scan_offsets    cuts = SCAN_OFFSETS_INIT;
+    scan_offsets    runs = SCAN_OFFSETS_INIT;
+    size_t          digest_size = self->dalg == NULL ? 0 : self->dalg->digest_size;
+    unsigned char   *digests = NULL;
+    size_t          digests_len = 0;
+    size_t          digests_cap = 0;
+    long            pagesize = sysconf(_SC_PAGESIZE);
+    long long       pos = start;
+    int             status = 0;
+    int             map_errno = 0;
+    int             scanned = 0;
+
+    if (pagesize < 1) {
+        pagesize = 4096;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    while (status == 0 && pos < end) {
+        long long   map_start = pos - pos % pagesize;
+        long long   map_end = end - pos > SCAN_FILE_MAP ? pos + SCAN_FILE_MAP : end;
+        size_t      map_len = (size_t)(map_end - map_start);
+        void        *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, (off_t)map_start);
+
+        if (map == MAP_FAILED) {
+            map_errno = errno;
+            status = -1;
+            break;
+        }
+        madvise(map, map_len, MADV_SEQUENTIAL);
+        while (pos < map_end) {
+            size_t      n = map_end - pos > SCAN_FILE_CHUNK ? SCAN_FILE_CHUNK : (size_t)(map_end - pos);
+
+            scanned = 1;
+            if (scanner_scan_buffer(self, (const unsigned char *)map + (pos - map_start), n) < 0) {
+                status = -1;
+                break;
+            }
+            for (size_t i = 0; i < self->runs.n; i++) {
+                scan_offsets_add(&runs, self->runs.offsets[i] + ((uint64_t)cuts.n << 8));
+            }
+            for (size_t i = 0; i < self->cuts.n; i++) {
+                scan_offsets_add(&cuts, (uint64_t)(pos - start) + self->cuts.offsets[i]);
+            }
+            if (cuts.failed || runs.failed) {
+                status = -1;
+                break;
+            }
+            if (digestsp != NULL && self->cuts.n > 0) {
+                size_t      len = self->cuts.n * digest_size;
+
+                if (digests_len + len > digests_cap) {
+                    size_t          cap = (digests_len + len) * 2;
+                    unsigned char   *newdigests = realloc(digests, cap);
+
+                    if (newdigests == NULL) {
+                        status = -1;
+                        break;
+                    }
+                    digests = newdigests;
+                    digests_cap = cap;
+                }
+                memcpy(digests + digests_len, self->digests, len);
+                digests_len += len;
+            }
+            pos += n;
+        }
+        munmap(map, map_len);
+    }
+    Py_END_ALLOW_THREADS
+    if (status < 0 && scanned) {
+        /* the stream state is unreliable after a partial scan */
+        self->max_block = 0;
+    }
+    /* the runs of the whole range are the runs of this call */
+    scan_offsets    call_runs = self->runs;
+    self->runs = runs;
+    runs = call_runs;
+    if (status < 0) {
+        self->runs.n = 0;
+    }
+    scanner_release(self);
+
+    PyObject        *result = NULL;
+    if (status < 0) {
+        if (map_errno != 0) {
+            errno = map_errno;
+            PyErr_SetFromErrno(PyExc_OSError);
+        } else {
+            PyErr_NoMemory();
+        }
+    } else {
+        result = scan_offsets_array(scanner_array_type(self), &cuts);
+        if (result != NULL && digestsp != NULL) {
+            *digestsp = PyBytes_FromStringAndSize((const char *)digests, digests_len);
+            if (*digestsp == NULL) {
+                Py_CLEAR(result);
+            }
+        }
+    }
+    scan_offsets_free(&cuts);
+    scan_offsets_free(&runs);
+    free(digests);
+    return result;
+#endif
+}
+
+static PyObject *Scanner_scan_file(ScannerObject *self, PyObject *args, PyObject *kwargs) {
+    return scanner_scan_file(self, args, kwargs, NULL);
+}
+
+static PyObject *Scanner_scan_file_digests(ScannerObject *self, PyObject *args, PyObject *kwargs) {
+    PyObject    *digests = NULL;
+    PyObject    *cuts;
+
+    cuts = scanner_scan_file(self, args, kwargs, &digests);
+    if (cuts == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("(NN)", cuts, digests);
+}
+
+static PyObject *Scanner_runs(ScannerObject *self, PyObject *unused) {
+    if (scanner_claim(self) < 0) {
+        return NULL;
+    }
+    PyObject    *runs = PyTuple_New((Py_ssize_t)self->runs.n);
+    if (runs != NULL) {
+        for (size_t i = 0; i < self->runs.n; i++) {
+            uint64_t    run = self->runs.offsets[i];
+            PyObject    *item = Py_BuildValue("(KI)", (unsigned long long)(run >> 8),
+                                              (unsigned)(run & 0xff));
+            if (item == NULL) {
+                Py_CLEAR(runs);
+                break;
+            }
+            PyTuple_SET_ITEM(runs, (Py_ssize_t)i, item);
+        }
+    }
+    scanner_release(self);
+    return runs;
+}
+
+static PyObject *Scanner_pending_run(ScannerObject *self, PyObject *unused) {
+    int         in_run;
+    int         octet;
+
+    if (scanner_claim(self) < 0) {
+        return NULL;
+    }
+    in_run = self->in_run;
+    octet = self->run_octet;
+    scanner_release(self);
+    if (!in_run) {
+        Py_RETURN_NONE;
+    }
+    return PyLong_FromLong(octet);
+}
+
+static PyMethodDef Scanner_methods[] = {
+    {"scan", (PyCFunction)(void(*)(void))Scanner_scan,
+        METH_VARARGS | METH_KEYWORDS,
+        "scan(data, offsets=None): scan the next chunk, return the cut positions."},
+    {"scan_digests", (PyCFunction)(void(*)(void))Scanner_scan_digests,
+        METH_VARARGS | METH_KEYWORDS,
+        "scan_digests(data, offsets=None): scan the next chunk like scan(),\n"
+        "return (cuts, digests) where digests holds the concatenated digests\n"
+        "of the blocks ending at the cuts, hashed in the same pass."},
+    {"pending_digest", (PyCFunction)Scanner_pending_digest, METH_NOARGS,
+        "pending_digest(): the digest of the data after the latest cut."},
+    {"runs", (PyCFunction)Scanner_runs, METH_NOARGS,
+        "runs(): the blocks which are runs among the cuts from the latest scan\n"
+        "call, a tuple of (index, octet) where index indexes the cuts;\n"
+        "their digests are all zero bytes."},
+    {"pending_run", (PyCFunction)Scanner_pending_run, METH_NOARGS,
+        "pending_run(): the octet if the data after the latest cut are a run,\n"
+        "otherwise None."},
+    {"scan_file", (PyCFunction)(void(*)(void))Scanner_scan_file,
+        METH_VARARGS | METH_KEYWORDS,
+        "scan_file(fd, start=0, end=None): scan the range [start:end) of the\n"
+        "file fd as the next part of the stream, end defaulting to the file size.\n"
+        "The file is memory mapped and scanned in 1MiB pieces without copying\n"
+        "it into Python objects; return the cut positions relative to start.\n"
+        "The file must not be truncated during the scan."},
+    {"scan_file_digests", (PyCFunction)(void(*)(void))Scanner_scan_file_digests,
+        METH_VARARGS | METH_KEYWORDS,
+        "scan_file_digests(fd, start=0, end=None): scan a file range like\n"
+        "scan_file(), return (cuts, digests) like scan_digests()."},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyMemberDef Scanner_members[] = {
+    {"hash_value", T_ULONGLONG, offsetof(ScannerObject, hash_value), READONLY,
+        "The current rolling hash value."},
+    {"min_block", T_PYSSIZET, offsetof(ScannerObject, min_block), READONLY,
+        "The minimum block size."},
+    {"max_block", T_PYSSIZET, offsetof(ScannerObject, max_block), READONLY,
+        "The maximum block size."},
+    {"offset", T_ULONGLONG, offsetof(ScannerObject, offset), READONLY,
+        "The stream offset after the data scanned so far."},
+    {"last_offset", T_ULONGLONG, offsetof(ScannerObject, last_offset), READONLY,
+        "The stream offset of the latest cut."},
+    {"nforced", T_ULONGLONG, offsetof(ScannerObject, nforced), READONLY,
+        "The number of cuts forced by max_block."},
+    {"normalised", T_BOOL, offsetof(ScannerObject, normalised), READONLY,
+        "Whether this Scanner uses normalised chunking."},
+    {"target", T_PYSSIZET, offsetof(ScannerObject, target), READONLY,
+        "The target block size for normalised chunking, or 0."},
+    {"divisor", T_PYSSIZET, offsetof(ScannerObject, divisor), READONLY,
+        "The rolling hash divisor for classic chunking, or 0."},
+    {"min_run", T_PYSSIZET, offsetof(ScannerObject, min_run), READONLY,
+        "The shortest run of one octet cut out as a block, or 0."},
+    {NULL, 0, 0, 0, NULL},
+};
+
+static PyObject *Scanner_get_algorithm(ScannerObject *self, void *closure) {
+    if (self->alg == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(self->alg->name);
+}
+
+static PyObject *Scanner_get_hashname(ScannerObject *self, void *closure) {
+    if (self->dalg == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_FromString(self->dalg->name);
+}
+
+static PyGetSetDef Scanner_getset[] = {
+    {"algorithm", (getter)Scanner_get_algorithm, NULL,
+        "The name of the rolling hash algorithm.", NULL},
+    {"hashname", (getter)Scanner_get_hashname, NULL,
+        "The name of the block digest, or None.", NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static PyType_Slot Scanner_slots[] = {
+    {Py_tp_doc, (void *)Scanner_docstring},
+    {Py_tp_new, PyType_GenericNew},
+    {Py_tp_init, (void *)Scanner_init},
+    {Py_tp_dealloc, (void *)Scanner_dealloc},
+    {Py_tp_methods, Scanner_methods},
+    {Py_tp_members, Scanner_members},
+    {Py_tp_getset, Scanner_getset},
+    {0, NULL},
+};
+
+static PyType_Spec Scanner_spec = {
+    .name = "cs.vt._scan.Scanner",
+    .basicsize = sizeof(ScannerObject),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = Scanner_slots,
+};
+
+/*
+ * blake3: a hashlib style hash object computing BLAKE3,
+ * for cs.vt.hash.Hash_BLAKE3.HASHFUNC.
+ */
+
+/* updates of at least this many bytes release the GIL, as hashlib does */
+#define BLAKE3_GIL_MINSIZE  2048
+
+static char BLAKE3_docstring[] =
+    "blake3(data=b'', *, threads=None)\n"
+    "A hashlib style BLAKE3 hash object with a 32 byte digest.\n"
+    "Large updates are hashed without the GIL, the whole chunks in the\n"
+    "lanes of SIMD vectors and in parallel on up to threads threads;\n"
+    "if threads is None or 0 this is chosen from the data size and CPU count.";
+
+typedef struct {
+    PyObject_HEAD
+    blake3_hasher       hasher;
+    long                threads;        /* 0 for automatic */
+    int                 busy;           /* a call is using the hasher */
+} BLAKE3Object;
+
+/* add the buffer view to the hash */
+static int BLAKE3_add(BLAKE3Object *self, Py_buffer *view) {
+    size_t          len = (size_t)view->len;
+    size_t          nthreads = (size_t)self->threads;
+
+    if (scan_claim(&self->busy, "blake3") < 0) {
+        return -1;
+    }
+    if (nthreads == 0) {
+        nthreads = len / BLAKE3_THREAD_MIN;
+        if (nthreads > (size_t)scan_ncpus) {
+            nthreads = scan_ncpus;
+        }
+    }
+    if (nthreads > SCAN_MAX_THREADS) {
+        nthreads = SCAN_MAX_THREADS;
+    }
+    if (len >= BLAKE3_GIL_MINSIZE) {
+        Py_BEGIN_ALLOW_THREADS
+        blake3_update(&self->hasher, view->buf, len, nthreads < 1 ? 1 : (int)nthreads);
+        Py_END_ALLOW_THREADS
+    } else {
+        blake3_update(&self->hasher, view->buf, len, 1);
+    }
+    scan_release(&self->busy);
+    return 0;
+}
+
+static PyObject *BLAKE3_new(PyTypeObject *type, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"data", "threads", NULL};
+    Py_buffer       view = {NULL, NULL};
+    PyObject        *threads_obj = Py_None;
+    long            threads = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|y*$O", kwlist, &view, &threads_obj)) {
+        return NULL;
+    }
+    if (scan_threads_arg(threads_obj, &threads) < 0) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    BLAKE3Object    *self = (BLAKE3Object *)type->tp_alloc(type, 0);
+    if (self == NULL) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    blake3_hasher_init(&self->hasher);
+    self->threads = threads;
+    self->busy = 0;
+    if (view.obj != NULL) {
+        int         status = BLAKE3_add(self, &view);
+        PyBuffer_Release(&view);
+        if (status < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    return (PyObject *)self;
+}
+
+static void BLAKE3_dealloc(BLAKE3Object *self) {
+    PyTypeObject    *tp = Py_TYPE(self);
+    tp->tp_free((PyObject *)self);
+    Py_DECREF(tp);
+}
+
+static PyObject *BLAKE3_update(BLAKE3Object *self, PyObject *data) {
+    Py_buffer       view;
+
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    int             status = BLAKE3_add(self, &view);
+    PyBuffer_Release(&view);
+    if (status < 0) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+/* the digest of the data so far into out */
+static int BLAKE3_final(BLAKE3Object *self, unsigned char *out) {
+    if (scan_claim(&self->busy, "blake3") < 0) {
+        return -1;
+    }
+    blake3_final(&self->hasher, out);
+    scan_release(&self->busy);
+    return 0;
+}
+
+static PyObject *BLAKE3_digest(BLAKE3Object *self, PyObject *unused) {
+    unsigned char   digest[BLAKE3_OUT_LEN];
+
+    if (BLAKE3_final(self, digest) < 0) {
+        return NULL;
+    }
+    return PyBytes_FromStringAndSize((const char *)digest, BLAKE3_OUT_LEN);
+}
+
+static PyObject *BLAKE3_hexdigest(BLAKE3Object *self, PyObject *unused) {
+    static const char   hexdigits[] = "0123456789abcdef";
+    unsigned char   digest[BLAKE3_OUT_LEN];
+    char            hex[BLAKE3_OUT_LEN * 2];
+
+    if (BLAKE3_final(self, digest) < 0) {
+        return NULL;
+    }
+    for (int i = 0; i < BLAKE3_OUT_LEN; i++) {
+        hex[2 * i] = hexdigits[digest[i] >> 4];
+        hex[2 * i + 1] = hexdigits[digest[i] & 0x0f];
+    }
+    return PyUnicode_FromStringAndSize(hex, BLAKE3_OUT_LEN * 2);
+}
+
+static PyObject *BLAKE3_copy(BLAKE3Object *self, PyObject *unused) {
+    PyTypeObject    *tp = Py_TYPE(self);
+
+    if (scan_claim(&self->busy, "blake3") < 0) {
+        return NULL;
+    }
+    BLAKE3Object    *copy = (BLAKE3Object *)tp->tp_alloc(tp, 0);
+    if (copy != NULL) {
+        copy->hasher = self->hasher;
+        copy->threads = self->threads;
+        copy->busy = 0;
+    }
+    scan_release(&self->busy);
+    return (PyObject *)copy;
+}
+
+static PyObject *BLAKE3_get_name(BLAKE3Object *self, void *closure) {
+    return PyUnicode_FromString("blake3");
+}
+
+static PyObject *BLAKE3_get_digest_size(BLAKE3Object *self, void *closure) {
+    return PyLong_FromLong(BLAKE3_OUT_LEN);
+}
+
+static PyObject *BLAKE3_get_block_size(BLAKE3Object *self, void *closure) {
+    return PyLong_FromLong(BLAKE3_BLOCK_LEN);
+}
+
+static PyMethodDef BLAKE3_methods[] = {
+    {"update", (PyCFunction)BLAKE3_update, METH_O,
+        "Add the bytes-like data to the hash."},
+    {"digest", (PyCFunction)BLAKE3_digest, METH_NOARGS,
+        "Return the digest of the data so far as bytes."},
+    {"hexdigest", (PyCFunction)BLAKE3_hexdigest, METH_NOARGS,
+        "Return the digest of the data so far as hexadecimal text."},
+    {"copy", (PyCFunction)BLAKE3_copy, METH_NOARGS,
+        "Return a copy of the hash object."},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyGetSetDef BLAKE3_getset[] = {
+    {"name", (getter)BLAKE3_get_name, NULL, "The hash name.", NULL},
+    {"digest_size", (getter)BLAKE3_get_digest_size, NULL,
+        "The size of the digest in bytes.", NULL},
+    {"block_size", (getter)BLAKE3_get_block_size, NULL,
+        "The internal block size in bytes.", NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static PyType_Slot BLAKE3_slots[] = {
+    {Py_tp_doc, (void *)BLAKE3_docstring},
+    {Py_tp_new, (void *)BLAKE3_new},
+    {Py_tp_dealloc, (void *)BLAKE3_dealloc},
+    {Py_tp_methods, BLAKE3_methods},
+    {Py_tp_getset, BLAKE3_getset},
+    {0, NULL},
+};
+
+static PyType_Spec BLAKE3_spec = {
+    .name = "cs.vt._scan.blake3",
+    .basicsize = sizeof(BLAKE3Object),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = BLAKE3_slots,
+};
+
+static PyObject *scan_scanbuf(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_scanbuf_array(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_scanbuf_v(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_digest_chunks(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_digests_sort(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_digests_bisect(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_digests_union(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_digests_difference(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_digests_intersection(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_data_records(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_scan_prefixes(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_scan_boxes(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_scan_mp3_frames(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_scan_vtd_records(PyObject *self, PyObject *args, PyObject *kwargs);
+static PyObject *scan_scan_vtd_file(PyObject *self, PyObject *args, PyObject *kwargs);
+
+static PyMethodDef module_methods[] = {
+    {"scanbuf", (PyCFunction)(void(*)(void))scan_scanbuf,
+        METH_VARARGS | METH_KEYWORDS, scanbuf_docstring},
+    {"scanbuf_array", (PyCFunction)(void(*)(void))scan_scanbuf_array,
+        METH_VARARGS | METH_KEYWORDS, scanbuf_array_docstring},
+    {"scanbuf_v", (PyCFunction)(void(*)(void))scan_scanbuf_v,
+        METH_VARARGS | METH_KEYWORDS, scanbuf_v_docstring},
+    {"digest_chunks", (PyCFunction)(void(*)(void))scan_digest_chunks,
+        METH_VARARGS | METH_KEYWORDS, digest_chunks_docstring},
+    {"digests_sort", (PyCFunction)(void(*)(void))scan_digests_sort,
+        METH_VARARGS | METH_KEYWORDS, digests_sort_docstring},
+    {"digests_bisect", (PyCFunction)(void(*)(void))scan_digests_bisect,
+        METH_VARARGS | METH_KEYWORDS, digests_bisect_docstring},
+    {"digests_union", (PyCFunction)(void(*)(void))scan_digests_union,
+        METH_VARARGS | METH_KEYWORDS, digests_union_docstring},
+    {"digests_difference", (PyCFunction)(void(*)(void))scan_digests_difference,
+        METH_VARARGS | METH_KEYWORDS, digests_difference_docstring},
+    {"digests_intersection", (PyCFunction)(void(*)(void))scan_digests_intersection,
+        METH_VARARGS | METH_KEYWORDS, digests_intersection_docstring},
+    {"data_records", (PyCFunction)(void(*)(void))scan_data_records,
+        METH_VARARGS | METH_KEYWORDS, data_records_docstring},
+    {"scan_prefixes", (PyCFunction)(void(*)(void))scan_scan_prefixes,
+        METH_VARARGS | METH_KEYWORDS, scan_prefixes_docstring},
+    {"scan_boxes", (PyCFunction)(void(*)(void))scan_scan_boxes,
+        METH_VARARGS | METH_KEYWORDS, scan_boxes_docstring},
+    {"scan_mp3_frames", (PyCFunction)(void(*)(void))scan_scan_mp3_frames,
+        METH_VARARGS | METH_KEYWORDS, scan_mp3_frames_docstring},
+    {"scan_vtd_records", (PyCFunction)(void(*)(void))scan_scan_vtd_records,
+        METH_VARARGS | METH_KEYWORDS, scan_vtd_records_docstring},
+    {"scan_vtd_file", (PyCFunction)(void(*)(void))scan_scan_vtd_file,
+        METH_VARARGS | METH_KEYWORDS, scan_vtd_file_docstring},
+    {NULL, NULL, 0, NULL},
+};
+
+/*
+ * Set up the process wide tables once,
+ * however many interpreters import the module.
+ */
+static void scan_tables_init(void) {
+    scan_test_init(&default_test, SCAN_DIVISOR, SCAN_REMAINDER);
+    scan_kernels_init();
+    scan_algorithms_init();
+    scan_digests_init();
+    blake3_init_impl();
+#ifdef SCAN_THREADS
+    long        ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    scan_ncpus = ncpus < 1 ? 1 : ncpus > SCAN_MAX_THREADS ? SCAN_MAX_THREADS : (int)ncpus;
+#endif
+}
+
+#ifdef SCAN_THREADS
+static pthread_once_t   scan_tables_once = PTHREAD_ONCE_INIT;
+#else
+static int              scan_tables_done = 0;
+#endif
+
+/* a new tuple of the n names from the table at names with the given stride */
+static PyObject *scan_names_tuple(const char *const *names, size_t n, size_t stride) {
+    PyObject    *tuple = PyTuple_New((Py_ssize_t)n);
+    if (tuple == NULL) {
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const char  *const *namep = (const char *const *)((const char *)names + i * stride);
+        PyObject    *name = PyUnicode_FromString(*namep);
+        if (name == NULL) {
+            Py_DECREF(tuple);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(tuple, (Py_ssize_t)i, name);
+    }
+    return tuple;
+}
+
+/* add the tuple of names to the module m as attribute attr */
+static int scan_add_names(PyObject *m, const char *attr,
+                          const char *const *names, size_t n, size_t stride) {
+    PyObject    *tuple = scan_names_tuple(names, n, stride);
+    if (tuple == NULL) {
+        return -1;
+    }
+    if (PyModule_AddObject(m, attr, tuple) < 0) {
+        Py_DECREF(tuple);
+        return -1;
+    }
+    return 0;
+}
+
+static int scan_module_exec(PyObject *m) {
+    scan_module_state   *state = PyModule_GetState(m);
+
+#ifdef SCAN_THREADS
+    pthread_once(&scan_tables_once, scan_tables_init);
+#else
+    if (!scan_tables_done) {
+        scan_tables_init();
+        scan_tables_done = 1;
+    }
+#endif
+
+    PyObject    *array_module = PyImport_ImportModule("array");
+    if (array_module == NULL) {
+        return -1;
+    }
+    state->array_type = PyObject_GetAttrString(array_module, "array");
+    Py_DECREF(array_module);
+    if (state->array_type == NULL) {
+        return -1;
+    }
+
+    state->scanner_type = PyType_FromModuleAndSpec(m, &Scanner_spec, NULL);
+    if (state->scanner_type == NULL) {
+        return -1;
+    }
+    Py_INCREF(state->scanner_type);
+    if (PyModule_AddObject(m, "Scanner", state->scanner_type) < 0) {
+        Py_DECREF(state->scanner_type);
+        return -1;
+    }
+    state->blake3_type = PyType_FromModuleAndSpec(m, &BLAKE3_spec, NULL);
+    if (state->blake3_type == NULL) {
+        return -1;
+    }
+    Py_INCREF(state->blake3_type);
+    if (PyModule_AddObject(m, "blake3", state->blake3_type) < 0) {
+        Py_DECREF(state->blake3_type);
+        return -1;
+    }
+    if (PyModule_AddStringConstant(m, "blake3_impl", blake3_impl) < 0) {
+        return -1;
+    }
+    /* the available kernel names, the default first */
+    if (scan_add_names(m, "kernels", &scan_kernels[0].name,
+                       (size_t)scan_nkernels, sizeof scan_kernels[0]) < 0) {
+        return -1;
+    }
+    if (PyModule_AddStringConstant(m, "kernel", scan_kernels[0].name) < 0) {
+        return -1;
+    }
+    /* the rolling hash algorithm names, the default first */
+    if (scan_add_names(m, "algorithms", &scan_algorithms[0].name,
+                       SCAN_NALGORITHMS, sizeof scan_algorithms[0]) < 0) {
+        return -1;
+    }
+    /* the block digest names and the implementation in use */
+    if (scan_add_names(m, "digests", &scan_digests[0].name,
+                       SCAN_NDIGESTS, sizeof scan_digests[0]) < 0) {
+        return -1;
+    }
+    if (PyModule_AddStringConstant(m, "digest_impl", scan_digest_impl) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static int scan_module_traverse(PyObject *m, visitproc visit, void *arg) {
+    scan_module_state   *state = PyModule_GetState(m);
+
+    Py_VISIT(state->array_type);
+    Py_VISIT(state->scanner_type);
+    Py_VISIT(state->blake3_type);
+    return 0;
+}
+
+static int scan_module_clear(PyObject *m) {
+    scan_module_state   *state = PyModule_GetState(m);
+
+    Py_CLEAR(state->array_type);
+    Py_CLEAR(state->scanner_type);
+    Py_CLEAR(state->blake3_type);
+    return 0;
+}
+
+static void scan_module_free(void *m) {
+    scan_module_clear((PyObject *)m);
+}
+
+static PyModuleDef_Slot module_slots[] = {
+    {Py_mod_exec, (void *)scan_module_exec},
+#ifdef Py_MOD_PER_INTERPRETER_GIL_SUPPORTED
+    /* Python 3.12+: no process wide Python objects */
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_MOD_GIL_NOT_USED
+    /* Python 3.13+ free threaded builds: Scanners are claimed atomically */
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL},
+};
+
+static struct PyModuleDef module_defn = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "_scan",
+    .m_doc = module_docstring,
+    .m_size = sizeof(scan_module_state),
+    .m_methods = module_methods,
+    .m_slots = module_slots,
+    .m_traverse = scan_module_traverse,
+    .m_clear = scan_module_clear,
+    .m_free = scan_module_free,
+};
+
+PyMODINIT_FUNC PyInit__scan(void)
+{
+    return PyModuleDef_Init(&module_defn);
+}
+
+/*
+ * Common code for scanbuf, scanbuf_array and scanbuf_v:
+ * validate the kernel and threads arguments into *kernelp and *threadsp.
+ * Return 0 on success, or -1 with an exception set.
+ */
+static int scan_kernel_args(
+    const char *kernel_name, PyObject *threads_obj,
+    const scan_kernel_entry **kernelp, long *threadsp)
+{
+    long            threads;
+    if (scan_threads_arg(threads_obj, &threads) < 0) {
+        return -1;
+    }
+
+    const scan_kernel_entry *kernel = &scan_kernels[0];
+    if (kernel_name != NULL) {
+        kernel = scan_kernel_named(kernel_name);
+        if (kernel == NULL) {
+            PyErr_Format(PyExc_ValueError, "unsupported kernel: %s", kernel_name);
+            return -1;
+        }
+    }
+    *kernelp = kernel;
+    *threadsp = threads;
+    return 0;
+}
+
+/*
+ * Common code for scanbuf and scanbuf_array:
+ * validate the kernel and threads arguments, scan the buffer view
+ * into ov and update *hash_valuep.
+ * Return 0 on success, or -1 with an exception set.
+ */
+static int scan_view(
+    unsigned long *hash_valuep, Py_buffer *view,
+    const char *kernel_name, PyObject *threads_obj, scan_offsets *ov)
+{
+    const scan_kernel_entry *kernel;
+    long            threads;
+    if (scan_kernel_args(kernel_name, threads_obj, &kernel, &threads) < 0) {
+        return -1;
+    }
+
+    size_t          buflen = (size_t)view->len;
+    if (buflen == 0) {
+        return 0;
+    }
+    /* size for the expected hit rate of random data, the vector grows if needed */
+    scan_offsets_reserve(ov, buflen / SCAN_DIVISOR + 16);
+    /* scanbuf always uses vt28, whose hash carries its own history */
+    const scan_algorithm *alg = &scan_algorithms[0];
+    /* only the low 21 bits of the incoming hash survive the first step */
+    uint64_t        hash_value = *hash_valuep & 0x001fffff;
+    int             nthreads = scan_nthreads(buflen, threads, alg->window);
+    Py_BEGIN_ALLOW_THREADS
+    scan_parallel(alg, kernel->kernel, &hash_value, scan_zeros, view->buf, buflen,
+                  &default_test, ov, nthreads);
+    Py_END_ALLOW_THREADS
+    if (ov->failed) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    *hash_valuep = (unsigned long)hash_value;
+    return 0;
+}
+
+static PyObject *scan_scanbuf(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"hash_value", "data", "kernel", "threads", NULL};
+    unsigned long   hash_value;
+    Py_buffer       view;
+    const char      *kernel_name = NULL;
+    PyObject        *threads_obj = Py_None;
+    scan_offsets    ov = SCAN_OFFSETS_INIT;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ky*|zO", kwlist,
+                                     &hash_value, &view,
+                                     &kernel_name, &threads_obj)) {
+        return NULL;
+    }
+    int             status = scan_view(&hash_value, &view, kernel_name, threads_obj, &ov);
+    PyBuffer_Release(&view);
+    if (status < 0) {
+        scan_offsets_free(&ov);
+        return NULL;
+    }
+
+    /* compose a Python list containing the offsets */
+    PyObject        *offset_list = PyList_New(ov.n);
+    if (offset_list == NULL) {
+        scan_offsets_free(&ov);
+        return NULL;
+    }
+    for (size_t offset_ndx=0; offset_ndx < ov.n; offset_ndx++) {
+        PyObject *py_offset = PyLong_FromUnsignedLongLong(ov.offsets[offset_ndx]);
+        if (py_offset == NULL) {
+            Py_DECREF(offset_list);
+            scan_offsets_free(&ov);
+            return NULL;
+        }
+        PyList_SET_ITEM(offset_list, offset_ndx, py_offset);
+    }
+    scan_offsets_free(&ov);
+
+    PyObject    *ret_list = PyList_New(2);
+    if (ret_list == NULL) {
+        Py_DECREF(offset_list);
+        return NULL;
+    }
+    PyObject    *hash_value_long = PyLong_FromUnsignedLong(hash_value);
+    if (hash_value_long == NULL) {
+        Py_DECREF(offset_list);
+        Py_DECREF(ret_list);
+        return NULL;
+    }
+    PyList_SET_ITEM(ret_list, 0, hash_value_long);
+    PyList_SET_ITEM(ret_list, 1, offset_list);
+
+    return ret_list;
+}
+
+static PyObject *scan_scanbuf_array(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"hash_value", "data", "out", "kernel", "threads", NULL};
+    unsigned long   hash_value;
+    Py_buffer       view;
+    PyObject        *out_obj = Py_None;
+    const char      *kernel_name = NULL;
+    PyObject        *threads_obj = Py_None;
+    Py_buffer       out;
+    scan_offsets    ov = SCAN_OFFSETS_INIT;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ky*|OzO", kwlist,
+                                     &hash_value, &view, &out_obj,
+                                     &kernel_name, &threads_obj)) {
+        return NULL;
+    }
+    if (out_obj != Py_None) {
+        if (PyObject_GetBuffer(out_obj, &out, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS) < 0) {
+            PyBuffer_Release(&view);
+            return NULL;
+        }
+    }
+    int             status = scan_view(&hash_value, &view, kernel_name, threads_obj, &ov);
+    PyBuffer_Release(&view);
+    if (status < 0) {
+        if (out_obj != Py_None) {
+            PyBuffer_Release(&out);
+        }
+        scan_offsets_free(&ov);
+        return NULL;
+    }
+
+    PyObject        *result;
+    if (out_obj == Py_None) {
+        scan_module_state   *state = PyModule_GetState(self);
+        result = scan_offsets_array(state->array_type, &ov);
+    } else {
+        /* fill out as far as it will go, report the full count */
+        size_t      room = (size_t)out.len / sizeof(uint64_t);
+        size_t      ncopy = ov.n < room ? ov.n : room;
+        if (ncopy > 0) {
+            memcpy(out.buf, ov.offsets, ncopy * sizeof(uint64_t));
+        }
+        PyBuffer_Release(&out);
+        result = PyLong_FromSize_t(ov.n);
+    }
+    scan_offsets_free(&ov);
+    if (result == NULL) {
+        return NULL;
+    }
+    return Py_BuildValue("(kN)", hash_value, result);
+}
 
-static PyObject *scan_scanbuf(PyObject *self, PyObject *args);
+static PyObject *scan_scanbuf_v(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"hash_value", "buffers", "per_buffer", "kernel", "threads", NULL};
+    unsigned long   hash_value;
+    PyObject        *buffers_obj;
+    int             per_buffer = 0;
+    const char      *kernel_name = NULL;
+    PyObject        *threads_obj = Py_None;
+    const scan_kernel_entry *kernel;
+    long            threads;
+    scan_offsets    ov = SCAN_OFFSETS_INIT;
+    scan_offsets    ends = SCAN_OFFSETS_INIT;
 
-static PyMethodDef module_methods[] = {
-    {"scanbuf", scan_scanbuf, METH_VARARGS, scanbuf_docstring},
-    {NULL, NULL, 0, NULL},
-};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "kO|pzO", kwlist,
+                                     &hash_value, &buffers_obj, &per_buffer,
+                                     &kernel_name, &threads_obj)) {
+        return NULL;
+    }
+    if (scan_kernel_args(kernel_name, threads_obj, &kernel, &threads) < 0) {
+        return NULL;
+    }
+    PyObject        *buffers = PySequence_Fast(buffers_obj, "buffers must be iterable");
+    if (buffers == NULL) {
+        return NULL;
+    }
 
-static struct PyModuleDef module_defn = {
-    PyModuleDef_HEAD_INIT,
-    "_scan",    /* name of module */
-    module_docstring,
-    -1,          /* size of per-interpreter state of the module, or -1 if the module keeps state in global variables. */
-    module_methods,
-};
+    Py_ssize_t      nbufs = PySequence_Fast_GET_SIZE(buffers);
+    Py_buffer       *views = PyMem_Calloc(nbufs ? nbufs : 1, sizeof(Py_buffer));
+    Py_ssize_t      nviews = 0;
+    PyObject        *result = NULL;
+    if (views == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    size_t          total = 0;
+    for (; nviews < nbufs; nviews++) {
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(buffers, nviews),
+                               &views[nviews], PyBUF_SIMPLE) < 0) {
+            goto done;
+        }
+        total += (size_t)views[nviews].len;
+    }
 
-PyMODINIT_FUNC PyInit__scan(void)
-{
-    return PyModule_Create(&module_defn);
+    /* size for the expected hit rate of random data, the vectors grow if needed */
+    scan_offsets_reserve(&ov, total / SCAN_DIVISOR + 16);
+    if (per_buffer) {
+        scan_offsets_reserve(&ends, (size_t)nbufs + 1);
+    }
+    /* scanbuf_v always uses vt28, whose hash carries its own history */
+    const scan_algorithm *alg = &scan_algorithms[0];
+    /* only the low 21 bits of the incoming hash survive the first step */
+    uint64_t        hash_state = hash_value & 0x001fffff;
+    Py_BEGIN_ALLOW_THREADS
+    uint64_t        base = 0;
+    for (Py_ssize_t i = 0; i < nbufs; i++) {
+        size_t      buflen = (size_t)views[i].len;
+        size_t      n0 = ov.n;
+        if (buflen > 0) {
+            scan_parallel(alg, kernel->kernel, &hash_state, scan_zeros,
+                          views[i].buf, buflen, &default_test, &ov,
+                          scan_nthreads(buflen, threads, alg->window));
+        }
+        if (per_buffer) {
+            scan_offsets_add(&ends, ov.n);
+        } else {
+            for (size_t j = n0; j < ov.n; j++) {
+                ov.offsets[j] += base;
+            }
+        }
+        base += buflen;
+    }
+    Py_END_ALLOW_THREADS
+    if (ov.failed || ends.failed) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    if (total > 0) {
+        hash_value = (unsigned long)hash_state;
+    }
+
+    scan_module_state   *state = PyModule_GetState(self);
+    PyObject        *offsets_array = scan_offsets_array(state->array_type, &ov);
+    if (offsets_array == NULL) {
+        goto done;
+    }
+    PyObject        *ends_obj;
+    if (per_buffer) {
+        ends_obj = scan_offsets_array(state->array_type, &ends);
+        if (ends_obj == NULL) {
+            Py_DECREF(offsets_array);
+            goto done;
+        }
+    } else {
+        Py_INCREF(Py_None);
+        ends_obj = Py_None;
+    }
+    result = Py_BuildValue("(kNN)", hash_value, offsets_array, ends_obj);
+
+  done:
+    for (Py_ssize_t i = 0; i < nviews; i++) {
+        PyBuffer_Release(&views[i]);
+    }
+    PyMem_Free(views);
+    Py_DECREF(buffers);
+    scan_offsets_free(&ov);
+    scan_offsets_free(&ends);
+    return result;
 }
 
-static PyObject *scan_scanbuf(PyObject *self, PyObject *args) {
-    unsigned long   hash_value;
-    unsigned char   *buf;
-#ifdef PY_SSIZE_T_CLEAN
-    Py_ssize_t      buflen;
-#else
-    int             buflen;
-#endif
+static PyObject *scan_digest_chunks(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"hashname", "chunks", "threads", NULL};
+    const char      *hashname;
+    PyObject        *chunks_obj;
+    PyObject        *threads_obj = Py_None;
+    long            threads = 0;
 
-    if (!PyArg_ParseTuple(args, "ky#", &hash_value, &buf, &buflen)) {
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|O", kwlist,
+                                     &hashname, &chunks_obj, &threads_obj)) {
         return NULL;
     }
+    const scan_digest_algorithm *dalg = scan_digest_named(hashname);
+    if (dalg == NULL) {
+        PyErr_Format(PyExc_ValueError, "unsupported hashname: %s", hashname);
+        return NULL;
+    }
+    if (scan_threads_arg(threads_obj, &threads) < 0) {
+        return NULL;
+    }
+    PyObject        *chunks = PySequence_Fast(chunks_obj, "chunks must be iterable");
+    if (chunks == NULL) {
+        return NULL;
+    }
+
+    Py_ssize_t      nchunks = PySequence_Fast_GET_SIZE(chunks);
+    Py_buffer       *views = PyMem_Calloc(nchunks ? nchunks : 1, sizeof(Py_buffer));
+    PyObject        *result = NULL;
+    Py_ssize_t      nviews = 0;
+    size_t          total = 0;
+
+    if (views == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (; nviews < nchunks; nviews++) {
+        if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(chunks, nviews),
+                               &views[nviews], PyBUF_C_CONTIGUOUS) < 0) {
+            goto done;
+        }
+        total += (size_t)views[nviews].len;
+    }
+    /* the digests are written directly into the result */
+    result = PyBytes_FromStringAndSize(NULL, nchunks * (Py_ssize_t)dalg->digest_size);
+    if (result == NULL) {
+        goto done;
+    }
+    unsigned char   *digests = (unsigned char *)PyBytes_AS_STRING(result);
+
+    size_t          nthreads = threads;
+    if (nthreads == 0) {
+        nthreads = total / SCAN_DIGEST_THREAD_MIN;
+        if (nthreads > (size_t)scan_ncpus) {
+            nthreads = scan_ncpus;
+        }
+    }
+    if (nthreads > SCAN_MAX_THREADS) {
+        nthreads = SCAN_MAX_THREADS;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    scan_digest_views_parallel(dalg, views, nchunks, total, digests,
+                               nthreads < 1 ? 1 : (int)nthreads);
+    Py_END_ALLOW_THREADS
 
-    unsigned long   *offsets = NULL;
-    int             noffsets = 0;
+  done:
+    for (Py_ssize_t i = 0; i < nviews; i++) {
+        PyBuffer_Release(&views[i]);
+    }
+    PyMem_Free(views);
+    Py_DECREF(chunks);
+    return result;
+}
+
+/*
+ * Get a read only view of the packed digests obj of hashlen bytes each,
+ * return the number of digests or -1 on error.
+ */
+static Py_ssize_t digests_view(PyObject *obj, Py_ssize_t hashlen, Py_buffer *view) {
+    if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS) < 0) {
+        return -1;
+    }
+    if (view->len % hashlen != 0) {
+        PyErr_Format(PyExc_ValueError,
+                     "length %zd is not a multiple of hashlen %zd", view->len, hashlen);
+        PyBuffer_Release(view);
+        return -1;
+    }
+    return view->len / hashlen;
+}
+
+static PyObject *scan_digests_sort(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"digests", "hashlen", "threads", NULL};
+    PyObject        *digests_obj;
+    Py_ssize_t      hashlen;
+    PyObject        *threads_obj = Py_None;
+    long            threads = 0;
+    Py_buffer       view;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "On|O", kwlist,
+                                     &digests_obj, &hashlen, &threads_obj)) {
+        return NULL;
+    }
+    if (hashlen < 1) {
+        PyErr_Format(PyExc_ValueError, "hashlen < 1: %zd", hashlen);
+        return NULL;
+    }
+    if (scan_threads_arg(threads_obj, &threads) < 0) {
+        return NULL;
+    }
+    Py_ssize_t      n = digests_view(digests_obj, hashlen, &view);
+    if (n < 0) {
+        return NULL;
+    }
+    /* the digests are sorted in place in the result */
+    PyObject        *result = PyBytes_FromStringAndSize(view.buf, view.len);
+    unsigned char   *tmp = PyMem_Malloc(view.len ? (size_t)view.len : 1);
+    PyBuffer_Release(&view);
+    if (result == NULL || tmp == NULL) {
+        Py_XDECREF(result);
+        PyMem_Free(tmp);
+        return PyErr_NoMemory();
+    }
 
-    if (buflen > 0) {
-        offsets = malloc(buflen * sizeof(unsigned long));
-        if (offsets == NULL) {
-            return PyErr_NoMemory();
+    size_t          nthreads = threads;
+    if (nthreads == 0) {
+        nthreads = (size_t)n / DIGESTS_THREAD_MIN;
+        if (nthreads > (size_t)scan_ncpus) {
+            nthreads = scan_ncpus;
         }
+    }
+    if (nthreads > SCAN_MAX_THREADS) {
+        nthreads = SCAN_MAX_THREADS;
+    }
+    size_t          kept;
+    Py_BEGIN_ALLOW_THREADS
+    kept = digests_sort_parallel((unsigned char *)PyBytes_AS_STRING(result), (size_t)n,
+                                 (size_t)hashlen, tmp, nthreads < 1 ? 1 : (int)nthreads);
+    Py_END_ALLOW_THREADS
+    PyMem_Free(tmp);
+    if ((Py_ssize_t)kept < n && _PyBytes_Resize(&result, (Py_ssize_t)kept * hashlen) < 0) {
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *scan_digests_bisect(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"digests", "hashlen", "key", "right", NULL};
+    PyObject        *digests_obj;
+    Py_ssize_t      hashlen;
+    Py_buffer       key;
+    int             right = 0;
+    Py_buffer       view;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Ony*|p", kwlist,
+                                     &digests_obj, &hashlen, &key, &right)) {
+        return NULL;
+    }
+    if (hashlen < 1 || key.len != hashlen) {
+        PyErr_Format(PyExc_ValueError, "key length %zd != hashlen %zd", key.len, hashlen);
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    Py_ssize_t      n = digests_view(digests_obj, hashlen, &view);
+    if (n < 0) {
+        PyBuffer_Release(&key);
+        return NULL;
+    }
+    size_t          index = digests_bisect(view.buf, (size_t)n, (size_t)hashlen, key.buf, right);
+    PyBuffer_Release(&view);
+    PyBuffer_Release(&key);
+    return PyLong_FromSize_t(index);
+}
+
+/* the digests_union, digests_difference and digests_intersection functions */
+static PyObject *scan_digests_op(PyObject *args, PyObject *kwargs, int op) {
+    static char     *kwlist[] = {"digests1", "digests2", "hashlen", NULL};
+    PyObject        *a_obj;
+    PyObject        *b_obj;
+    Py_ssize_t      hashlen;
+    Py_buffer       a;
+    Py_buffer       b;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OOn", kwlist, &a_obj, &b_obj, &hashlen)) {
+        return NULL;
+    }
+    if (hashlen < 1) {
+        PyErr_Format(PyExc_ValueError, "hashlen < 1: %zd", hashlen);
+        return NULL;
+    }
+    Py_ssize_t      na = digests_view(a_obj, hashlen, &a);
+    if (na < 0) {
+        return NULL;
+    }
+    Py_ssize_t      nb = digests_view(b_obj, hashlen, &b);
+    if (nb < 0) {
+        PyBuffer_Release(&a);
+        return NULL;
+    }
+
+    Py_ssize_t      most = op == DIGESTS_UNION ? na + nb
+                           : op == DIGESTS_DIFFERENCE || na < nb ? na : nb;
+    PyObject        *result = PyBytes_FromStringAndSize(NULL, most * hashlen);
+    size_t          kept = 0;
+    if (result != NULL) {
+        unsigned char   *out = (unsigned char *)PyBytes_AS_STRING(result);
+
         Py_BEGIN_ALLOW_THREADS
-        unsigned long   offset = 0;
-        unsigned char   *cp = buf;
-        for (; buflen; cp++, buflen--, offset++) {
-            unsigned char b = *cp;
-            hash_value = ( ( ( hash_value & 0x001fffff ) << 7
-                           )
-                         | ( ( b & 0x7f )^( (b & 0x80)>>7 )
-                           )
-                         );
-            if (hash_value % 4093 == 4091) {
-                offsets[noffsets++] = offset;
+        kept = digests_merge(a.buf, (size_t)na, b.buf, (size_t)nb, (size_t)hashlen, op, out);
+        Py_END_ALLOW_THREADS
+    }
+    PyBuffer_Release(&a);
+    PyBuffer_Release(&b);
+    if (result != NULL && (Py_ssize_t)kept < most
+        && _PyBytes_Resize(&result, (Py_ssize_t)kept * hashlen) < 0) {
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject *scan_digests_union(PyObject *self, PyObject *args, PyObject *kwargs) {
+    return scan_digests_op(args, kwargs, DIGESTS_UNION);
+}
+
+static PyObject *scan_digests_difference(PyObject *self, PyObject *args, PyObject *kwargs) {
+    return scan_digests_op(args, kwargs, DIGESTS_DIFFERENCE);
+}
+
+static PyObject *scan_digests_intersection(PyObject *self, PyObject *args, PyObject *kwargs) {
+    return scan_digests_op(args, kwargs, DIGESTS_INTERSECTION);
+}
+
+static PyObject *scan_data_records(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"blocks", "level", "threads", NULL};
+    PyObject        *blocks_obj;
+    int             level = Z_DEFAULT_COMPRESSION;
+    PyObject        *threads_obj = Py_None;
+    long            threads = 0;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iO", kwlist,
+                                     &blocks_obj, &level, &threads_obj)) {
+        return NULL;
+    }
+    if (level < Z_DEFAULT_COMPRESSION || level > Z_BEST_COMPRESSION) {
+        PyErr_Format(PyExc_ValueError, "invalid compression level: %d", level);
+        return NULL;
+    }
+    if (scan_threads_arg(threads_obj, &threads) < 0) {
+        return NULL;
+    }
+    PyObject        *blocks = PySequence_Fast(blocks_obj, "blocks must be iterable");
+    if (blocks == NULL) {
+        return NULL;
+    }
+
+    Py_ssize_t      nrecords = PySequence_Fast_GET_SIZE(blocks);
+    Py_buffer       *views = PyMem_Calloc(nrecords ? nrecords : 1, sizeof(Py_buffer));
+    scan_record     *records = PyMem_Calloc(nrecords ? nrecords : 1, sizeof(scan_record));
+    PyObject        *result = NULL;
+    Py_ssize_t      nviews = 0;
+    size_t          total = 0;
+    int             failed = 0;
+
+    if (views == NULL || records == NULL) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (; nviews < nrecords; nviews++) {
+        PyObject    *block = PySequence_Fast_GET_ITEM(blocks, nviews);
+        scan_record *rec = &records[nviews];
+
+        if (PyObject_GetBuffer(block, &views[nviews], PyBUF_C_CONTIGUOUS) < 0) {
+            goto done;
+        }
+        rec->data = views[nviews].buf;
+        rec->len = (size_t)views[nviews].len;
+        rec->out = PyMem_Malloc(
+                      SCAN_RECORD_HEADER_MAX
+                      + (rec->len < SCAN_RECORD_MIN_COMPRESS ? rec->len : compressBound(rec->len)));
+        if (rec->out == NULL) {
+            nviews++;
+            PyErr_NoMemory();
+            goto done;
+        }
+        total += rec->len;
+    }
+
+    size_t          nthreads = threads;
+    if (nthreads == 0) {
+        nthreads = total / SCAN_RECORD_THREAD_MIN;
+        if (nthreads > (size_t)scan_ncpus) {
+            nthreads = scan_ncpus;
+        }
+    }
+    if (nthreads > SCAN_MAX_THREADS) {
+        nthreads = SCAN_MAX_THREADS;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    scan_record_parallel(records, nrecords, total, level, nthreads < 1 ? 1 : (int)nthreads);
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New(nrecords);
+    if (result == NULL) {
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < nrecords; i++) {
+        scan_record *rec = &records[i];
+
+        if (rec->zstatus != Z_OK) {
+            if (rec->zstatus == Z_MEM_ERROR) {
+                PyErr_NoMemory();
+            } else {
+                PyErr_Format(PyExc_RuntimeError, "compress2: zlib error %d", rec->zstatus);
             }
+            failed = 1;
+            break;
         }
-        Py_END_ALLOW_THREADS
+        PyObject    *item = Py_BuildValue(
+                          "(y#nni)",
+                          (const char *)rec->out + rec->record_offset,
+                          (Py_ssize_t)rec->record_len,
+                          (Py_ssize_t)rec->data_offset,
+                          (Py_ssize_t)rec->data_length,
+                          rec->flags);
+        if (item == NULL) {
+            failed = 1;
+            break;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+    if (failed) {
+        Py_CLEAR(result);
     }
 
-    /* compose a Python list containing the offsets */
-    PyObject        *offset_list = PyList_New(noffsets);
-    if (offset_list == NULL) {
+  done:
+    for (Py_ssize_t i = 0; i < nviews; i++) {
+        PyBuffer_Release(&views[i]);
+        PyMem_Free(records[i].out);
+    }
+    PyMem_Free(views);
+    PyMem_Free(records);
+    Py_DECREF(blocks);
+    return result;
+}
+
+static PyObject *scan_scan_prefixes(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"data", "prefixes", "at_start", NULL};
+    Py_buffer       view;
+    PyObject        *prefixes_obj;
+    int             at_start = 1;
+    scan_trie       trie;
+    scan_offsets    ov = SCAN_OFFSETS_INIT;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*O|p", kwlist,
+                                     &view, &prefixes_obj, &at_start)) {
+        return NULL;
+    }
+    PyObject        *prefixes = PySequence_Fast(prefixes_obj, "prefixes must be iterable");
+    if (prefixes == NULL) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    Py_ssize_t      nprefixes = PySequence_Fast_GET_SIZE(prefixes);
+    size_t          total = 0;
+    for (Py_ssize_t i = 0; i < nprefixes; i++) {
+        PyObject    *prefix = PySequence_Fast_GET_ITEM(prefixes, i);
+        if (!PyBytes_Check(prefix)) {
+            PyErr_Format(PyExc_TypeError, "prefixes[%zd]: expected bytes, got %s",
+                         i, Py_TYPE(prefix)->tp_name);
+            Py_DECREF(prefixes);
+            PyBuffer_Release(&view);
+            return NULL;
+        }
+        total += (size_t)PyBytes_GET_SIZE(prefix);
+    }
+    if (!scan_trie_init(&trie, total)) {
+        Py_DECREF(prefixes);
+        PyBuffer_Release(&view);
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i = 0; i < nprefixes; i++) {
+        PyObject    *prefix = PySequence_Fast_GET_ITEM(prefixes, i);
+        scan_trie_add(&trie, (const unsigned char *)PyBytes_AS_STRING(prefix),
+                      (size_t)PyBytes_GET_SIZE(prefix));
+    }
+    Py_DECREF(prefixes);
+
+    size_t          pending;
+    Py_BEGIN_ALLOW_THREADS
+    pending = scan_prefixes_buffer(&trie, view.buf, (size_t)view.len, at_start, &ov);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    free(trie.nodes);
+
+    PyObject        *result = NULL;
+    if (ov.failed) {
+        PyErr_NoMemory();
+    } else {
+        scan_module_state   *state = PyModule_GetState(self);
+        PyObject    *offsets = scan_offsets_array(state->array_type, &ov);
         if (offsets != NULL) {
-            free(offsets);
+            if (pending == SIZE_MAX) {
+                result = Py_BuildValue("(NO)", offsets, Py_None);
+            } else {
+                result = Py_BuildValue("(Nn)", offsets, (Py_ssize_t)pending);
+            }
         }
+    }
+    scan_offsets_free(&ov);
+    return result;
+}
+
+/* check that data at stream offset base does not start after pos */
+static int scan_check_base(unsigned long long base, unsigned long long pos) {
+    if (pos < base) {
+        PyErr_Format(PyExc_ValueError, "pos:%llu < base:%llu", pos, base);
+        return 0;
+    }
+    return 1;
+}
+
+static PyObject *scan_scan_boxes(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char         *kwlist[] = {"data", "base", "pos", "ends", NULL};
+    Py_buffer           view;
+    unsigned long long  base;
+    unsigned long long  pos;
+    PyObject            *ends_obj = NULL;
+    uint64_t            ends[SCAN_BOX_DEPTH];
+    int                 nends = 0;
+    scan_offsets        ov = SCAN_OFFSETS_INIT;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*KK|O", kwlist,
+                                     &view, &base, &pos, &ends_obj)) {
         return NULL;
     }
-    for (int offset_ndx=0; offset_ndx < noffsets; offset_ndx++) {
-        PyObject *py_offset = PyLong_FromUnsignedLong(offsets[offset_ndx]);
-        if (py_offset == NULL) {
-            Py_DECREF(offset_list);
-            if (offsets != NULL) {
-                free(offsets);
-            }
+    if (!scan_check_base(base, pos)) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+    if (ends_obj != NULL) {
+        PyObject    *seq = PySequence_Fast(ends_obj, "ends must be iterable");
+        if (seq == NULL) {
+            PyBuffer_Release(&view);
             return NULL;
         }
-        PyList_SET_ITEM(offset_list, offset_ndx, py_offset);
+        Py_ssize_t  n = PySequence_Fast_GET_SIZE(seq);
+        if (n > SCAN_BOX_DEPTH) {
+            PyErr_Format(PyExc_ValueError, "len(ends):%zd > %d", n, SCAN_BOX_DEPTH);
+        }
+        for (Py_ssize_t i = 0; i < n && !PyErr_Occurred(); i++) {
+            ends[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+        }
+        Py_DECREF(seq);
+        if (PyErr_Occurred()) {
+            PyBuffer_Release(&view);
+            return NULL;
+        }
+        nends = (int)n;
     }
 
-    if (offsets != NULL) {
-        free(offsets);
+    uint64_t        next = pos;
+    int             ok;
+    Py_BEGIN_ALLOW_THREADS
+    ok = scan_boxes_buffer(view.buf, (size_t)view.len, base, &next, ends, &nends, &ov);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+
+    PyObject        *result = NULL;
+    if (ov.failed) {
+        PyErr_NoMemory();
+    } else {
+        scan_module_state   *state = PyModule_GetState(self);
+        PyObject    *offsets = scan_offsets_array(state->array_type, &ov);
+        PyObject    *ends_tuple = offsets == NULL ? NULL : PyTuple_New(ok ? nends : 0);
+        for (int i = 0; ok && ends_tuple != NULL && i < nends; i++) {
+            PyObject    *end = PyLong_FromUnsignedLongLong(ends[i]);
+            if (end == NULL) {
+                Py_CLEAR(ends_tuple);
+                break;
+            }
+            PyTuple_SET_ITEM(ends_tuple, i, end);
+        }
+        if (ends_tuple == NULL) {
+            Py_XDECREF(offsets);
+        } else if (ok) {
+            result = Py_BuildValue("(NKN)", offsets, (unsigned long long)next, ends_tuple);
+        } else {
+            result = Py_BuildValue("(NON)", offsets, Py_None, ends_tuple);
+        }
     }
+    scan_offsets_free(&ov);
+    return result;
+}
 
-    PyObject    *ret_list = PyList_New(2);
-    if (ret_list == NULL) {
-        Py_DECREF(offset_list);
+static PyObject *scan_scan_mp3_frames(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char         *kwlist[] = {"data", "base", "pos", NULL};
+    Py_buffer           view;
+    unsigned long long  base;
+    unsigned long long  pos;
+    scan_offsets        ov = SCAN_OFFSETS_INIT;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*KK", kwlist,
+                                     &view, &base, &pos)) {
         return NULL;
     }
-    PyObject    *hash_value_long = PyLong_FromUnsignedLong(hash_value);
-    if (hash_value_long == NULL) {
-        Py_DECREF(offset_list);
-        Py_DECREF(ret_list);
+    if (!scan_check_base(base, pos)) {
+        PyBuffer_Release(&view);
         return NULL;
     }
-    PyList_SET_ITEM(ret_list, 0, hash_value_long);
-    PyList_SET_ITEM(ret_list, 1, offset_list);
 
-    return ret_list;
+    uint64_t        next = pos;
+    Py_BEGIN_ALLOW_THREADS
+    scan_mp3_buffer(view.buf, (size_t)view.len, base, &next, &ov);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+
+    PyObject        *result = NULL;
+    if (ov.failed) {
+        PyErr_NoMemory();
+    } else {
+        scan_module_state   *state = PyModule_GetState(self);
+        PyObject    *offsets = scan_offsets_array(state->array_type, &ov);
+        if (offsets != NULL) {
+            result = Py_BuildValue("(NK)", offsets, (unsigned long long)next);
+        }
+    }
+    scan_offsets_free(&ov);
+    return result;
+}
+
+static PyObject *scan_scan_vtd_records(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char         *kwlist[] = {"data", "base", "pos", NULL};
+    Py_buffer           view;
+    unsigned long long  base;
+    unsigned long long  pos;
+    scan_offsets        ov = SCAN_OFFSETS_INIT;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y*KK", kwlist,
+                                     &view, &base, &pos)) {
+        return NULL;
+    }
+    if (!scan_check_base(base, pos)) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    uint64_t        next = pos;
+    int             status;
+    Py_BEGIN_ALLOW_THREADS
+    status = scan_vtd_buffer(view.buf, (size_t)view.len, base, &next, 0, &ov, NULL, NULL, NULL);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+
+    PyObject        *result = NULL;
+    if (ov.failed) {
+        PyErr_NoMemory();
+    } else {
+        scan_module_state   *state = PyModule_GetState(self);
+        PyObject    *offsets = scan_offsets_array(state->array_type, &ov);
+        if (offsets != NULL) {
+            if (status < 0) {
+                result = Py_BuildValue("(NO)", offsets, Py_None);
+            } else {
+                result = Py_BuildValue("(NK)", offsets, (unsigned long long)next);
+            }
+        }
+    }
+    scan_offsets_free(&ov);
+    return result;
+}
+
+static PyObject *scan_scan_vtd_file(PyObject *self, PyObject *args, PyObject *kwargs) {
+    static char     *kwlist[] = {"fd", "start", "end", "hashname", "threads", NULL};
+    int             fd;
+    long long       start = 0;
+    PyObject        *end_obj = Py_None;
+    const char      *hashname = NULL;
+    PyObject        *threads_obj = Py_None;
+    long long       end;
+    long            threads = 0;
+    const scan_digest_algorithm *dalg = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|LOzO", kwlist,
+                                     &fd, &start, &end_obj, &hashname, &threads_obj)) {
+        return NULL;
+    }
+    if (start < 0) {
+        PyErr_Format(PyExc_ValueError, "start < 0: %lld", start);
+        return NULL;
+    }
+    if (hashname != NULL) {
+        dalg = scan_digest_named(hashname);
+        if (dalg == NULL) {
+            PyErr_Format(PyExc_ValueError, "unknown hashname: %s", hashname);
+            return NULL;
+        }
+    }
+    if (scan_threads_arg(threads_obj, &threads) < 0) {
+        return NULL;
+    }
+#ifndef SCAN_MMAP
+    (void)end_obj;
+    (void)end;
+    (void)self;
+    PyErr_SetString(PyExc_NotImplementedError, "scan_vtd_file requires mmap");
+    return NULL;
+#else
+    struct stat     st;
+
+    if (fstat(fd, &st) < 0) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (end_obj == Py_None) {
+        end = st.st_size;
+    } else {
+        end = PyLong_AsLongLong(end_obj);
+        if (end == -1 && PyErr_Occurred()) {
+            return NULL;
+        }
+    }
+    if (end < start) {
+        PyErr_Format(PyExc_ValueError, "end:%lld < start:%lld", end, start);
+        return NULL;
+    }
+    /* a mapping beyond the end of the file would fault */
+    if (end > (long long)st.st_size) {
+        PyErr_Format(PyExc_ValueError, "end:%lld > file size:%lld",
+                     end, (long long)st.st_size);
+        return NULL;
+    }
+
+    scan_offsets    offsets = SCAN_OFFSETS_INIT;
+    scan_offsets    data_offsets = SCAN_OFFSETS_INIT;
+    scan_offsets    data_lengths = SCAN_OFFSETS_INIT;
+    scan_offsets    flags = SCAN_OFFSETS_INIT;
+    unsigned char   *digests = NULL;
+    uint64_t        pos = (uint64_t)start;
+    long            pagesize = sysconf(_SC_PAGESIZE);
+    int             status = 0;
+    int             map_errno = 0;
+    int             zstatus = Z_OK;
+    size_t          zfailed = 0;
+    uint64_t        bad_flags = 0;
+    size_t          bad_record = 0;
+
+    if (pagesize < 1) {
+        pagesize = 4096;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    if (start < end) {
+        long long   map_start = start - start % pagesize;
+        size_t      map_len = (size_t)(end - map_start);
+        void        *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, (off_t)map_start);
+
+        if (map == MAP_FAILED) {
+            map_errno = errno;
+            status = -1;
+        } else {
+            const unsigned char *buf = (const unsigned char *)map + (start - map_start);
+
+            madvise(map, map_len, MADV_SEQUENTIAL);
+            status = scan_vtd_buffer(buf, (size_t)(end - start), (uint64_t)start, &pos, 1,
+                                     &offsets, &data_offsets, &data_lengths, &flags);
+            for (size_t i = 0; status == 0 && i < flags.n; i++) {
+                if (flags.offsets[i] & ~(uint64_t)SCAN_RECORD_COMPRESSED) {
+                    bad_flags = flags.offsets[i];
+                    bad_record = i;
+                    status = -1;
+                }
+            }
+            if (status == 0 && dalg != NULL && !flags.failed && flags.n > 0) {
+                digests = malloc(flags.n * dalg->digest_size);
+                if (digests == NULL) {
+                    flags.failed = 1;
+                } else {
+                    size_t  nthreads = (size_t)threads;
+
+                    if (nthreads == 0) {
+                        nthreads = (size_t)(end - start) / SCAN_RECORD_THREAD_MIN;
+                        if (nthreads > (size_t)scan_ncpus) {
+                            nthreads = scan_ncpus;
+                        }
+                    }
+                    if (nthreads > SCAN_MAX_THREADS) {
+                        nthreads = SCAN_MAX_THREADS;
+                    }
+                    zstatus = scan_vtd_digest_parallel(
+                                dalg, buf, (uint64_t)start, &data_offsets, &data_lengths,
+                                &flags, digests, nthreads < 1 ? 1 : (int)nthreads, &zfailed);
+                }
+            }
+            munmap(map, map_len);
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    PyObject        *result = NULL;
+    if (map_errno != 0) {
+        errno = map_errno;
+        PyErr_SetFromErrno(PyExc_OSError);
+    } else if (bad_flags != 0) {
+        PyErr_Format(PyExc_ValueError, "offset %llu: unsupported flags: 0x%02llx",
+                     (unsigned long long)offsets.offsets[bad_record],
+                     (unsigned long long)bad_flags);
+    } else if (status < 0) {
+        PyErr_Format(PyExc_ValueError, "offset %llu: invalid record framing",
+                     (unsigned long long)pos);
+    } else if (offsets.failed || data_offsets.failed || data_lengths.failed || flags.failed) {
+        PyErr_NoMemory();
+    } else if (zstatus != Z_OK) {
+        if (zstatus == Z_MEM_ERROR) {
+            PyErr_NoMemory();
+        } else {
+            PyErr_Format(PyExc_ValueError, "offset %llu: inflate: zlib error %d",
+                         (unsigned long long)offsets.offsets[zfailed], zstatus);
+        }
+    } else {
+        scan_module_state   *state = PyModule_GetState(self);
+        const scan_offsets  *vectors[4] = {&offsets, &data_offsets, &data_lengths, &flags};
+        PyObject    *arrays[4] = {NULL, NULL, NULL, NULL};
+        PyObject    *digests_obj = NULL;
+        int         ok = 1;
+
+        for (int i = 0; ok && i < 4; i++) {
+            arrays[i] = scan_offsets_array(state->array_type, vectors[i]);
+            ok = arrays[i] != NULL;
+        }
+        if (ok) {
+            if (dalg == NULL) {
+                digests_obj = Py_None;
+                Py_INCREF(digests_obj);
+            } else {
+                digests_obj = PyBytes_FromStringAndSize(
+                                (const char *)digests, (Py_ssize_t)(flags.n * dalg->digest_size));
+            }
+            ok = digests_obj != NULL;
+        }
+        if (ok) {
+            result = Py_BuildValue("(NNNNKN)", arrays[0], arrays[1], arrays[2], arrays[3],
+                                   (unsigned long long)pos, digests_obj);
+        } else {
+            for (int i = 0; i < 4; i++) {
+                Py_XDECREF(arrays[i]);
+            }
+        }
+    }
+    free(digests);
+    scan_offsets_free(&offsets);
+    scan_offsets_free(&data_offsets);
+    scan_offsets_free(&data_lengths);
+    scan_offsets_free(&flags);
+    return result;
+#endif
 }
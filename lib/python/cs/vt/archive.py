@@ -9,6 +9,15 @@
 
     where unixtime is UNIX time (seconds since epoch) and dirent is the text
     transcription of a Dirent.
+
+    Lines commencing with `#` are comments.
+    When the default Store has non-default scan settings
+    (which affect where block boundaries fall)
+    they are recorded in a comment line of the form:
+
+      # scan name=value...
+
+    before the first entry made with them.
 '''
 
 from __future__ import print_function
@@ -26,8 +35,12 @@ from cs.lex import unctrl, get_ini_clause_entryname
 from cs.logutils import warning, exception, debug
 from cs.pfx import Pfx, pfx
 from cs.py.func import prop
+from . import defaults
 from .dir import _Dirent, DirentRecord
 from .meta import NOUSERID, NOGROUPID
+from .scan import scan_settings
+
+SCAN_SETTINGS_PREFIX = '# scan'
 
 CopyModes = Flags('delete', 'do_mkdir', 'trust_size_mtime')
 
@@ -78,6 +91,7 @@ class BaseArchive(ABC):
   def __init__(self):
     self._last = None
     self._last_s = None
+    self._scan_settings_s = None
     self.notify_update = []
 
   @abstractmethod
@@ -158,11 +172,57 @@ class BaseArchive(ABC):
     fp.flush()
     return Es
 
+  @staticmethod
+  def scan_settings_line(settings):
+    ''' Return the comment line recording the scan `settings`.
+    '''
+    return ' '.join(
+        [SCAN_SETTINGS_PREFIX] +
+        ['%s=%s' % (k, v) for k, v in sorted(settings.items())]
+    )
+
+  @staticmethod
+  def parse_scan_settings(line):
+    ''' Parse a scan settings comment line, return a `dict`
+        or `None` if `line` is not a scan settings line.
+    '''
+    line = line.strip()
+    fields = line.split()
+    if ' '.join(fields[:2]) != SCAN_SETTINGS_PREFIX:
+      return None
+    return dict(field.split('=', 1) for field in fields[2:] if '=' in field)
+
+  @property
+  def scan_settings(self):
+    ''' The most recently recorded scan settings, `{}` if none.
+        This base implementation knows only those recorded by this instance.
+    '''
+    if self._scan_settings_s is None:
+      return {}
+    return self.parse_scan_settings(self._scan_settings_s)
+
   def append(self, E, when, etc):
     ''' The append method should add an update to the Archive.
     '''
     raise NotImplementedError("no .append")
 
+  def append_comment(self, comment):
+    ''' Append a comment line to the Archive.
+        This base implementation discards it,
+        suitable for Archives which cannot hold comments.
+    '''
+
+  def _record_scan_settings(self):
+    ''' Record the scan settings of the default Store if they differ
+        from those most recently recorded.
+    '''
+    settings = scan_settings(getattr(defaults, 'S', None))
+    if settings == self.scan_settings:
+      return
+    settings_s = self.scan_settings_line(settings)
+    self.append_comment(settings_s)
+    self._scan_settings_s = settings_s
+
   def update(self, E, *, when=None, previous=None, force=False, source=None):
     ''' Save the supplied Dirent `E` with timestamp `when`.
         Return the Dirent transcription.
@@ -190,6 +250,7 @@ class BaseArchive(ABC):
           return Es
     if when is None:
       when = time.time()
+    self._record_scan_settings()
     s = self.append(E, when, etc)
     self._last = when, E
     self._last_s = s
@@ -231,6 +292,23 @@ class FilePathArchive(BaseArchive):
           return
         raise
 
+  @property
+  def scan_settings(self):
+    ''' The most recently recorded scan settings, `{}` if none.
+    '''
+    if self._scan_settings_s is None:
+      settings_s = self.scan_settings_line({})
+      try:
+        with open(self.path) as fp:
+          for line in fp:
+            if self.parse_scan_settings(line) is not None:
+              settings_s = line.strip()
+      except OSError as e:
+        if e.errno != errno.ENOENT:
+          raise
+      self._scan_settings_s = settings_s
+    return self.parse_scan_settings(self._scan_settings_s)
+
   def append(self, E, when, etc):
     ''' Append an update to the fle.
     '''
@@ -240,6 +318,15 @@ class FilePathArchive(BaseArchive):
         s = self.write(fp, E, when=when, etc=etc)
     return s
 
+  def append_comment(self, comment):
+    ''' Append a comment line to the file.
+    '''
+    path = self.path
+    with lockfile(path):
+      with open(path, "a") as fp:
+        fp.write(unctrl(comment))
+        fp.write('\n')
+
 class FileOutputArchive(BaseArchive):
   ''' An Archive which just writes updates to an open file.
   '''
@@ -260,6 +347,13 @@ class FileOutputArchive(BaseArchive):
     s = self.write(self.fp, E, when=when, etc=etc)
     return s
 
+  def append_comment(self, comment):
+    ''' Write a comment line to the file.
+    '''
+    self.fp.write(unctrl(comment))
+    self.fp.write('\n')
+    self.fp.flush()
+
 def apply_posix_stat(src_st, ospath):
   ''' Apply a stat object to the POSIX OS object at `ospath`.
   '''
@@ -0,0 +1,229 @@
+#!/usr/bin/env python3
+#
+# Benchmarks for the block scanning code.
+#   - Cameron Simpson <cs@cskk.id.au>
+#
+
+''' Benchmarks for the block scanning code.
+
+    `bench_scan` measures the throughput of `scanbuf` and `scanbuf_v`,
+    of the C and pure Python `Scanner`s and of `blocked_chunks_of` end to end
+    over one input at one buffer size, and collates the block sizes.
+    `bench_inputs` supplies the standard inputs: random, zero filled
+    and text data and the leading data of real files.
+    `bench_report` writes the results as a table
+    followed by the block size distribution for each input.
+    These are the guts of the `vt bench scan` subcommand.
+'''
+
+from collections import defaultdict
+from glob import glob
+from os.path import basename, dirname, join as joinpath
+from random import Random
+import time
+from .blockify import blocked_chunks_of, new_scanner, DEFAULT_SCAN_SIZE
+from .parsers import scan_text, scanner_from_filename
+from .scan import py_scanbuf, scanbuf, scanbuf_v, scan_kernel, PyScanner
+
+# the amount of each input to scan
+BENCH_SIZE = 16 * 1024 * 1024
+# the amount of each input for the pure Python scanners, which are slow
+BENCH_PY_SIZE = 256 * 1024
+# the buffer sizes to feed the scanners
+BENCH_BUFSIZES = (4096, 65536, DEFAULT_SCAN_SIZE)
+# timings are the best of this many runs
+BENCH_REPEAT = 3
+
+def bench_inputs(size, paths=()):
+  ''' Yield `(name,data,scanner)` for the benchmark inputs:
+      random, zero filled and text data of `size` bytes
+      and up to `size` bytes from the start of each file in `paths`.
+      `scanner` is the parser `blocked_chunks_of` should use
+      for the input, or `None`.
+  '''
+  yield 'random', Random(size).randbytes(size), None
+  yield 'zeros', bytes(size), None
+  # the text is our own source code, repeated
+  texts = []
+  for path in sorted(glob(joinpath(dirname(__file__), '*.py'))):
+    with open(path, 'rb') as f:
+      texts.append(f.read())
+  text = b''.join(texts)
+  yield 'text', (text * (size // len(text) + 1))[:size], scan_text
+  for path in paths:
+    with open(path, 'rb') as f:
+      data = f.read(size)
+    yield basename(path), data, scanner_from_filename(path)
+
+def pieces_of(data, bufsize):
+  ''' Return a list of `memoryview`s of `data` of length `bufsize`,
+      the last possibly shorter.
+  '''
+  mv = memoryview(data)
+  return [mv[i:i + bufsize] for i in range(0, len(data), bufsize)]
+
+def throughput(nbytes, func, repeat=BENCH_REPEAT):
+  ''' Call `func()` `repeat` times, return the best rate in MB/s
+      for processing `nbytes` bytes.
+  '''
+  best = None
+  for _ in range(repeat):
+    start = time.perf_counter()
+    func()
+    elapsed = time.perf_counter() - start
+    if best is None or elapsed < best:
+      best = elapsed
+  return nbytes / max(best, 1e-9) / 1e6
+
+def bench_scan(data, bufsize, scanner=None, python=True, **scan_settings):
+  ''' Benchmark the scanners over `data` fed in pieces of `bufsize` bytes.
+      Return a `dict` with the MB/s rates `scanbuf`, `scanbuf_v`, `Scanner`,
+      `blockify` and, if `python`, `py_scanbuf` and `PyScanner`,
+      and the `histogram` from `blocked_chunks_of`.
+      The `scanbuf` functions always use the default rolling hash.
+
+      Parameters:
+      * `data`: the input data
+      * `bufsize`: the size of the pieces fed to the scanners
+      * `scanner`: optional parser for `blocked_chunks_of`
+      * `python`: also time the pure Python scanners,
+        over the first `BENCH_PY_SIZE` bytes of `data`
+      Other keyword arguments are block boundary settings
+      for `new_scanner` and `blocked_chunks_of`.
+  '''
+  pieces = pieces_of(data, bufsize)
+
+  def run_scanbuf(scan, pieces):
+    hash_value = 0
+    for piece in pieces:
+      hash_value, _ = scan(hash_value, piece)
+
+  def run_scanner(scanner, pieces):
+    for piece in pieces:
+      scanner.scan(piece)
+
+  histogram = defaultdict(int)
+
+  def run_blockify():
+    histogram.clear()
+    for _ in blocked_chunks_of(pieces, scanner, histogram=histogram,
+                               **scan_settings):
+      pass
+
+  result = dict(
+      scanbuf=throughput(len(data), lambda: run_scanbuf(scanbuf, pieces)),
+      scanbuf_v=throughput(len(data), lambda: scanbuf_v(0, pieces)),
+      Scanner=throughput(
+          len(data),
+          lambda: run_scanner(new_scanner(**scan_settings), pieces)
+      ),
+      blockify=throughput(len(data), run_blockify),
+      histogram=dict(histogram),
+  )
+  if python:
+    py_data = data[:BENCH_PY_SIZE]
+    py_pieces = pieces_of(py_data, bufsize)
+    result.update(
+        py_scanbuf=throughput(
+            len(py_data),
+            lambda: run_scanbuf(py_scanbuf, py_pieces),
+            repeat=1
+        ),
+        PyScanner=throughput(
+            len(py_data),
+            lambda: run_scanner(py_scanner(**scan_settings), py_pieces),
+            repeat=1
+        ),
+    )
+  return result
+
+def py_scanner(**scan_settings):
+  ''' Return a `PyScanner` with the same settings as `new_scanner(**scan_settings)`.
+  '''
+  C = new_scanner(**scan_settings)
+  return PyScanner(
+      C.min_block,
+      C.max_block,
+      normalised=C.normalised,
+      target=C.target if C.normalised else None,
+      algorithm=C.algorithm,
+      divisor=None if C.normalised else C.divisor,
+      min_run=C.min_run,
+  )
+
+def histogram_summary(histogram):
+  ''' Summarise a `blocked_chunks_of` `histogram`.
+      Return a `dict` with the block count `blocks`,
+      the `mean`, `p10`, `p50` and `p90` block sizes
+      and `forced`, the percentage of blocks cut at `max_block`
+      because no boundary was found.
+  '''
+  sizes = sorted(
+      (size, count) for size, count in histogram.items()
+      if isinstance(size, int)
+  )
+  nblocks = sum(count for _, count in sizes)
+  summary = dict(blocks=nblocks, mean=0, p10=0, p50=0, p90=0, forced=0.0)
+  if nblocks:
+    summary['mean'] = sum(size * count for size, count in sizes) // nblocks
+    for key, fraction in ('p10', 0.1), ('p50', 0.5), ('p90', 0.9):
+      seen = 0
+      for size, count in sizes:
+        seen += count
+        if seen >= nblocks * fraction:
+          summary[key] = size
+          break
+    summary['forced'] = (
+        100.0 * histogram.get('buffer_overflow_chunks', 0) / nblocks
+    )
+  return summary
+
+def histogram_buckets(histogram):
+  ''' Return a list of `(low,high,count)` counting the blocks
+      with sizes in `[low,high)` for power of 2 bucket bounds.
+  '''
+  buckets = defaultdict(int)
+  for size, count in histogram.items():
+    if isinstance(size, int):
+      buckets[size.bit_length()] += count
+  return [
+      ((1 << bits) >> 1, 1 << bits, buckets[bits])
+      for bits in sorted(buckets)
+  ]
+
+def bench_report(results, fp, python=True):
+  ''' Write a report of the benchmark `results` to the file `fp`.
+      `results` is a list of `(input_name,bufsize,bench_scan_result)`.
+  '''
+  columns = ['scanbuf', 'scanbuf_v', 'Scanner', 'blockify']
+  if python:
+    columns.extend(('py_scanbuf', 'PyScanner'))
+  print("scan kernel: %s, rates in MB/s" % (scan_kernel,), file=fp)
+  print(
+      "%-16s %8s " % ('input', 'bufsize') +
+      ' '.join('%10s' % (column,) for column in columns) +
+      " %8s %6s %6s %6s %6s %7s" %
+      ('blocks', 'mean', 'p10', 'p50', 'p90', 'forced'),
+      file=fp
+  )
+  for name, bufsize, result in results:
+    summary = histogram_summary(result['histogram'])
+    print(
+        "%-16.16s %8d " % (name, bufsize) +
+        ' '.join('%10.1f' % (result[column],) for column in columns) +
+        " %8d %6d %6d %6d %6d %6.2f%%" % (
+            summary['blocks'], summary['mean'], summary['p10'],
+            summary['p50'], summary['p90'], summary['forced']
+        ),
+        file=fp
+    )
+  # the block sizes are much the same for any buffer size
+  reported = set()
+  for name, bufsize, result in results:
+    if name in reported:
+      continue
+    reported.add(name)
+    print(file=fp)
+    print("%s: block sizes at bufsize %d" % (name, bufsize), file=fp)
+    for low, high, count in histogram_buckets(result['histogram']):
+      print("  %8d..%-8d %d" % (low, high - 1, count), file=fp)
@@ -60,6 +60,12 @@ F_BLOCK_INDIRECT = 0x01  # indirect block
 F_BLOCK_TYPED = 0x02  # block type provided, otherwise BT_HASHCODE
 F_BLOCK_TYPE_FLAGS = 0x04  # type-specific flags follow type
 
+# RLEBlock.datafrom yields its data in pieces of at most this size
+RLE_DATAFROM_SIZE = 1024 * 1024
+
+# Block() makes a LiteralBlock for data of at most this size
+MAX_LITERAL_SIZE = 32
+
 @uniqueEnum
 class BlockType(IntEnum):
   ''' Block type codes used in binary serialisation.
@@ -733,7 +739,7 @@ def Block(*, hashcode=None, data=None, span=None, added=False):
       raise ValueError(
           "span(%d) does not match data (%d bytes)" % (span, len(data))
       )
-    if len(data) > 32:
+    if len(data) > MAX_LITERAL_SIZE:
       B = HashCodeBlock(data=data, hashcode=hashcode, span=span, added=added)
     else:
       B = LiteralBlock(data=data)
@@ -904,7 +910,8 @@ class RLEBlock(_Block):
     return self.octet * self.span
 
   def datafrom(self, start=0, end=None):
-    ''' Yield the data from `start` to `end`.
+    ''' Yield the data from `start` to `end`
+        in pieces of at most `RLE_DATAFROM_SIZE` bytes.
     '''
     if end is None:
       end = self.span
@@ -913,7 +920,14 @@ class RLEBlock(_Block):
     length = end - start
     if length < 0:
       raise ValueError("end(%s) < start(%s)" % (end, start))
-    yield self.octet * length
+    piece = self.octet * min(length, RLE_DATAFROM_SIZE)
+    while True:
+      if length < len(piece):
+        piece = piece[:length]
+      yield piece
+      length -= len(piece)
+      if length <= 0:
+        break
 
   def transcribe_inner(self, T, fp):
     return T.transcribe_mapping({'span': self.span, 'octet': self.octet}, fp)
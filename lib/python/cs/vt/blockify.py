@@ -6,25 +6,43 @@
 ''' Utility routines to parse data streams into Blocks and Block streams into IndirectBlocks.
 '''
 
-from heapq import heappush, heappop
+from collections import deque
+from contextlib import nullcontext
 from itertools import chain
+import os
 import sys
+from threading import Condition
 from cs.buffer import CornuCopyBuffer
 from cs.deco import fmtdoc
 from cs.logutils import warning, exception
 from cs.pfx import Pfx
-from cs.queues import IterableQueue
-from cs.seq import tee
 from cs.threads import bg as bg_thread
-from .block import Block, IndirectBlock
-from .scan import scanbuf
+from . import defaults
+from .block import (
+    Block, HashCodeBlock, IndirectBlock, RLEBlock, MAX_LITERAL_SIZE
+)
+from .scan import (
+    Scanner, CHUNKING_NORMALISED, CHUNKING_MODES, DEFAULT_CHUNKING,
+    ROLLING_HASHES, DEFAULT_ROLLING_HASH, DEFAULT_MIN_RUN, SCAN_DIGESTS,
+    SCAN_FILE_CHUNK
+)
 
 # constraints on the chunk sizes yields from blocked_chunks_of
 MIN_BLOCKSIZE = 80  # less than this seems silly
 MAX_BLOCKSIZE = 16383  # fits in 2 octets BS-encoded
+MAX_MAX_BLOCKSIZE = 1024 * 1024 - 1  # upper limit for a configured max_block
 
-# default read size for file scans
-DEFAULT_SCAN_SIZE = 1024 * 1024
+# default read size for file scans, the same size as Scanner.scan_file uses
+DEFAULT_SCAN_SIZE = SCAN_FILE_CHUNK
+
+# blockify stores blocks in batches of about this many bytes
+ADD_BATCH_SIZE = 4 * 1024 * 1024
+
+# blockify_fd scans files in spans of this size
+SCAN_FILE_SPAN = 64 * SCAN_FILE_CHUNK
+
+# each blockify pipeline stage runs at most this much data ahead of the next
+PIPELINE_BUFFER_SIZE = 16 * 1024 * 1024
 
 def top_block_for(blocks):
   ''' Return a top Block for a stream of Blocks.
@@ -94,12 +112,267 @@ def indirect_blocks(blocks):
       block = IndirectBlock.from_subblocks(subblocks)
     yield block
 
-def blockify(chunks, scanner=None, min_block=None, max_block=None):
+def blockify(
+    chunks,
+    scanner=None,
+    min_block=None,
+    max_block=None,
+    chunking=None,
+    rolling_hash=None,
+    avg_block=None,
+    min_run=None,
+    hashclass=None,
+):
   ''' Wrapper for `blocked_chunks_of` which yields `Block`s from the data chunks.
+      If `max_block`, `avg_block`, `chunking`, `rolling_hash` or `min_run`
+      is `None` it comes from the current default Store,
+      `min_run` defaulting to `DEFAULT_MIN_RUN`.
+
+      Runs of at least `min_run` repeats of one octet become `RLEBlock`s,
+      which are neither hashed nor stored.
+
+      If the Store supports `add_hashed` and its hash function is one
+      of `SCAN_DIGESTS`, the hashcodes are computed during the scan
+      instead of hashing each block again when it is stored.
+      An explicit `hashclass` requires this; it must be the Store's.
+      If the Store also supports `add_hashed_many` the blocks are stored
+      in batches of about `ADD_BATCH_SIZE` bytes,
+      letting a `DataDir` compress each batch in parallel.
+
+      The chunks are scanned in a separate pipeline stage
+      from the hashing and storage of the blocks,
+      so that the two overlap: see `pipeline_stage`.
   '''
-  for chunk in blocked_chunks_of(chunks, scanner, min_block=min_block,
-                                 max_block=max_block):
-    yield Block(data=chunk)
+  S = getattr(defaults, 'S', None)
+  max_block, avg_block, chunking, rolling_hash, min_run = _store_scan_settings(
+      S, max_block, avg_block, chunking, rolling_hash, min_run
+  )
+  hashclass = _scan_hashclass(S, hashclass)
+  if hashclass is None:
+    # scan in a separate stage from hashing and storing the blocks
+    for chunk in pipelined(
+        blocked_chunks_of(chunks, scanner, min_block=min_block,
+                          max_block=max_block, avg_block=avg_block,
+                          chunking=chunking, rolling_hash=rolling_hash,
+                          min_run=min_run),
+        "blockify:scan",
+        sizeof=lambda chunk: 0 if isinstance(chunk, RLEBlock) else len(chunk),
+    ):
+      yield chunk if isinstance(chunk, RLEBlock) else Block(data=chunk)
+  else:
+
+    def block_chunks():
+      ''' Yield `(Block,chunk)` for the scanned chunks.
+      '''
+      for chunk, hashcode in blocked_chunks_of(
+          chunks, scanner, min_block=min_block, max_block=max_block,
+          avg_block=avg_block, chunking=chunking, rolling_hash=rolling_hash,
+          min_run=min_run, hashclass=hashclass):
+        if isinstance(chunk, RLEBlock):
+          yield chunk, None
+        else:
+          B = Block(data=chunk, hashcode=hashcode, added=True)
+          yield B, chunk
+
+    # scan and hash in a separate stage from storing the blocks
+    yield from _store_blocks(
+        S, pipelined(block_chunks(), "blockify:scan", sizeof=_pair_size)
+    )
+
+def blockify_fd(
+    fd,
+    start=0,
+    end=None,
+    *,
+    min_block=None,
+    max_block=None,
+    chunking=None,
+    rolling_hash=None,
+    avg_block=None,
+    min_run=None,
+    hashclass=None,
+):
+  ''' Yield `Block`s for the range `[start:end)` of the file descriptor `fd`,
+      `end` defaulting to the file size.
+      The blocks are the same as those from `blockify`
+      of the range read in pieces of `DEFAULT_SCAN_SIZE` bytes.
+
+      The block boundaries, and the hashcodes if `blockify` would
+      compute them during the scan, come from `Scanner.scan_file`,
+      which memory maps the file instead of reading it.
+      `hashclass` is as for `blockify`.
+      Blocks whose hashcodes are already in the Store are not read at all,
+      nor are runs, which become `RLEBlock`s;
+      the others are read with `os.pread` and stored as by `blockify`.
+  '''
+  S = getattr(defaults, 'S', None)
+  max_block, avg_block, chunking, rolling_hash, min_run = _store_scan_settings(
+      S, max_block, avg_block, chunking, rolling_hash, min_run
+  )
+  hashclass = _scan_hashclass(S, hashclass)
+  scanner = new_scanner(
+      min_block=min_block,
+      max_block=max_block,
+      avg_block=avg_block,
+      chunking=chunking,
+      rolling_hash=rolling_hash,
+      hashname=None if hashclass is None else hashclass.HASHNAME,
+      min_run=min_run,
+  )
+  if end is None:
+    end = os.fstat(fd).st_size
+
+  def read_block(offset, length):
+    ''' Read the block data at `offset`.
+    '''
+    data = os.pread(fd, length, offset)
+    if len(data) != length:
+      raise EOFError(
+          "short read at offset %d: expected %d bytes, got %d" %
+          (offset, length, len(data))
+      )
+    return data
+
+  if hashclass is None:
+    last = start
+    for span_start in range(start, end, SCAN_FILE_SPAN):
+      span_end = min(end, span_start + SCAN_FILE_SPAN)
+      cuts = scanner.scan_file(fd, span_start, span_end)
+      runs = dict(scanner.runs())
+      for cutndx, cut in enumerate(cuts):
+        length = span_start + cut - last
+        octet = runs.get(cutndx)
+        if octet is None:
+          yield Block(data=read_block(last, length))
+        else:
+          yield RLEBlock(length, octet)
+        last = span_start + cut
+    if last < end:
+      octet = scanner.pending_run()
+      if octet is None:
+        yield Block(data=read_block(last, end - last))
+      else:
+        yield RLEBlock(end - last, octet)
+    return
+
+  hashlen = hashclass.HASHLEN
+
+  def block_chunks():
+    ''' Yield `(Block,chunk)` for the blocks of the file,
+        with `chunk=None` for blocks already in the Store and for runs.
+    '''
+
+    def file_block(offset, length, hashbytes):
+      hashcode = hashclass.from_hashbytes(hashbytes)
+      if length > MAX_LITERAL_SIZE and hashcode in S:
+        return HashCodeBlock(hashcode=hashcode, span=length), None
+      chunk = read_block(offset, length)
+      return Block(data=chunk, hashcode=hashcode, added=True), chunk
+
+    last = start
+    for span_start in range(start, end, SCAN_FILE_SPAN):
+      span_end = min(end, span_start + SCAN_FILE_SPAN)
+      cuts, digests = scanner.scan_file_digests(fd, span_start, span_end)
+      runs = dict(scanner.runs())
+      for cutndx, cut in enumerate(cuts):
+        length = span_start + cut - last
+        octet = runs.get(cutndx)
+        if octet is None:
+          yield file_block(
+              last, length, digests[cutndx * hashlen:(cutndx + 1) * hashlen]
+          )
+        else:
+          yield RLEBlock(length, octet), None
+        last = span_start + cut
+    if last < end:
+      octet = scanner.pending_run()
+      if octet is None:
+        yield file_block(last, end - last, scanner.pending_digest())
+      else:
+        yield RLEBlock(end - last, octet), None
+
+  # scan, hash and read in a separate stage from storing the blocks
+  yield from _store_blocks(
+      S, pipelined(block_chunks(), "blockify_fd:scan", sizeof=_pair_size)
+  )
+
+def _store_scan_settings(S, max_block, avg_block, chunking, rolling_hash,
+                         min_run):
+  ''' Return `(max_block,avg_block,chunking,rolling_hash,min_run)`,
+      filling in those which are `None` from the Store `S`
+      and `min_run` from `DEFAULT_MIN_RUN` if the Store has none.
+  '''
+  if max_block is None:
+    max_block = getattr(S, 'max_block', None)
+  if avg_block is None:
+    avg_block = getattr(S, 'avg_block', None)
+  if chunking is None:
+    chunking = getattr(S, 'chunking', None)
+  if rolling_hash is None:
+    rolling_hash = getattr(S, 'rolling_hash', None)
+  if min_run is None:
+    min_run = getattr(S, 'min_run', None)
+    if min_run is None:
+      min_run = DEFAULT_MIN_RUN
+  return max_block, avg_block, chunking, rolling_hash, min_run
+
+def _scan_hashclass(S, hashclass=None):
+  ''' Return the hash class of the Store `S` if the `Scanner` can
+      compute its hashcodes and `S` supports `add_hashed`, otherwise `None`.
+      If `hashclass` is not `None` it must be such a hash class
+      or a `ValueError` is raised.
+  '''
+  S_hashclass = getattr(S, 'hashclass', None)
+  if (getattr(S, 'add_hashed', None) is None or S_hashclass is None
+      or S_hashclass.HASHNAME not in SCAN_DIGESTS):
+    S_hashclass = None
+  if hashclass is not None and hashclass is not S_hashclass:
+    raise ValueError(
+        "hashclass %s: the Store %s cannot take scanned %s hashcodes" %
+        (hashclass.HASHNAME, S, hashclass.HASHNAME)
+    )
+  return S_hashclass
+
+def _store_blocks(S, block_chunks):
+  ''' Store the `(Block,chunk)` pairs from `block_chunks`
+      in the Store `S` by hashcode and yield the `Block`s in order.
+      Pairs whose `Block` is not a `HashCodeBlock` or whose `chunk`
+      is `None` are not stored.
+  '''
+  add_hashed_many = getattr(S, 'add_hashed_many', None)
+  if add_hashed_many is None:
+    for B, chunk in block_chunks:
+      if chunk is not None and isinstance(B, HashCodeBlock):
+        S.add_hashed(chunk, B.hashcode)
+      yield B
+    return
+  # blocks awaiting storage, and their total size
+  batch = []
+  batch_size = 0
+  for B, chunk in block_chunks:
+    if not isinstance(B, HashCodeBlock):
+      # stored inline, not in the Store
+      chunk = None
+    batch.append((B, chunk))
+    if chunk is not None:
+      batch_size += len(chunk)
+      if batch_size >= ADD_BATCH_SIZE:
+        yield from _add_batch(add_hashed_many, batch)
+        batch = []
+        batch_size = 0
+  if batch:
+    yield from _add_batch(add_hashed_many, batch)
+
+def _add_batch(add_hashed_many, batch):
+  ''' Store the `(Block,chunk)` pairs in `batch` with a single call
+      to `add_hashed_many`, then yield the `Block`s in order.
+      Pairs with a `chunk` of `None` are not stored.
+  '''
+  add_hashed_many(
+      [(chunk, B.hashcode) for B, chunk in batch if chunk is not None]
+  )
+  for B, _ in batch:
+    yield B
 
 def spliced_blocks(B, new_blocks):
   ''' Splice an iterable of `(offset,Block)` into the data of the `Block` `B`.
@@ -118,52 +391,235 @@ def spliced_blocks(B, new_blocks):
     # yield high level Blocks for the data which follow
     yield from B.top_blocks(upto, len(B))
 
-class _PendingBuffer:
-  ''' Class to manage the unbound chunks accrued by `blocked_chunks_of` below.
+@fmtdoc
+def new_scanner(
+    *,
+    min_block=None,
+    max_block=None,
+    avg_block=None,
+    chunking=None,
+    rolling_hash=None,
+    hashname=None,
+    min_run=None,
+):
+  ''' Return a new `Scanner` for the supplied block boundary settings.
+      Raise `ValueError` if the settings are invalid.
+
+      Parameters:
+      * `min_block`: the smallest block size,
+        default from `MIN_BLOCKSIZE` (`{MIN_BLOCKSIZE}`)
+      * `max_block`: the largest block size,
+        default from `MAX_BLOCKSIZE` (`{MAX_BLOCKSIZE}`),
+        at most `MAX_MAX_BLOCKSIZE` (`{MAX_MAX_BLOCKSIZE}`)
+      * `avg_block`: optional target average block size,
+        greater than `min_block` and less than `max_block`;
+        this is the normalised chunking target and sets the rolling hash
+        divisor for classic chunking;
+        the default gives blocks of about 4 KiB
+      * `chunking`: the chunking mode, one of `CHUNKING_MODES`,
+        default from `DEFAULT_CHUNKING` (`{DEFAULT_CHUNKING}`)
+      * `rolling_hash`: the name of the rolling hash, one of `ROLLING_HASHES`,
+        default from `DEFAULT_ROLLING_HASH` (`{DEFAULT_ROLLING_HASH}`)
+      * `hashname`: optional name of a block digest for the `Scanner`
+        to compute, one of `SCAN_DIGESTS`
+      * `min_run`: optional shortest run of one octet for the `Scanner`
+        to cut out as a block of its own, at least `min_block`;
+        the default `0` cuts out no runs
+  '''
+  if min_block is None:
+    min_block = MIN_BLOCKSIZE
+  elif min_block < 8:
+    raise ValueError("rejecting min_block < 8: %s" % (min_block,))
+  if max_block is None:
+    max_block = MAX_BLOCKSIZE
+  elif max_block > MAX_MAX_BLOCKSIZE:
+    raise ValueError(
+        "rejecting max_block > %d: %s" % (MAX_MAX_BLOCKSIZE, max_block)
+    )
+  if min_block >= max_block:
+    raise ValueError(
+        "rejecting min_block:%d >= max_block:%d" % (min_block, max_block)
+    )
+  if avg_block is not None and not min_block < avg_block < max_block:
+    raise ValueError(
+        "rejecting avg_block:%d not between min_block:%d and max_block:%d" %
+        (avg_block, min_block, max_block)
+    )
+  if min_run is None:
+    min_run = 0
+  elif min_run != 0 and min_run < min_block:
+    raise ValueError(
+        "rejecting min_run:%d < min_block:%d" % (min_run, min_block)
+    )
+  if chunking is None:
+    chunking = DEFAULT_CHUNKING
+  elif chunking not in CHUNKING_MODES:
+    raise ValueError(
+        "rejecting unknown chunking %r, expected one of %r" %
+        (chunking, CHUNKING_MODES)
+    )
+  if rolling_hash is None:
+    rolling_hash = DEFAULT_ROLLING_HASH
+  elif rolling_hash not in ROLLING_HASHES:
+    raise ValueError(
+        "rejecting unknown rolling_hash %r, expected one of %r" %
+        (rolling_hash, ROLLING_HASHES)
+    )
+  if chunking == CHUNKING_NORMALISED:
+    return Scanner(
+        min_block,
+        max_block,
+        normalised=True,
+        target=avg_block,
+        algorithm=rolling_hash,
+        hashname=hashname,
+        min_run=min_run,
+    )
+  # classic blocks average about min_block+divisor bytes
+  divisor = None if avg_block is None else max(3, (avg_block - min_block) | 1)
+  return Scanner(
+      min_block,
+      max_block,
+      algorithm=rolling_hash,
+      divisor=divisor,
+      hashname=hashname,
+      min_run=min_run,
+  )
+
+class PipelineQueue:
+  ''' A FIFO queue between two stages of a pipeline,
+      holding items up to a total size of `capacity`.
+
+      `put` blocks while the queue is full, so that a fast producing
+      stage waits for the consuming stage instead of reading ahead
+      without limit. An item larger than `capacity` is accepted
+      when the queue is empty.
+      Iterating over the queue yields the items until it is closed;
+      if it was closed with an exception that is then raised.
+      `cancel` discards the queue contents and makes further `put`s
+      fail, telling the producer to stop.
   '''
 
-  def __init__(self, max_block, offset=0):
-    if max_block < 1:
-      raise ValueError("max_block must be >= 1, received: %s" % (max_block,))
-    self.max_block = max_block
-    self.pending = []
-    self.pending_room = self.max_block
-    self.offset = offset
-
-  def flush(self):
-    ''' Yield the pending chunks joined together, if any.
-        Advance the offset.
+  def __init__(self, capacity=PIPELINE_BUFFER_SIZE):
+    self.capacity = capacity
+    self.size = 0
+    self.closed = False
+    self.cancelled = False
+    self._items = deque()
+    self._error = None
+    self._cond = Condition()
+
+  def put(self, item, size=0):
+    ''' Append `item` of size `size` to the queue,
+        waiting while the queue is full.
+        Return `False` if the queue has been cancelled, otherwise `True`.
     '''
-    if self.pending:
-      assert self.pending_room < self.max_block
-      chunk = b''.join(self.pending)
-      self.pending = []
-      self.pending_room = self.max_block
-      self.offset += len(chunk)
-      yield chunk
-
-  def append(self, chunk):
-    ''' Append `chunk` to the pending buffer.
-        Yield any overflow.
+    with self._cond:
+      while (not self.cancelled and self.size > 0
+             and self.size + size > self.capacity):
+        self._cond.wait()
+      if self.cancelled:
+        return False
+      assert not self.closed
+      self._items.append((item, size))
+      self.size += size
+      self._cond.notify_all()
+    return True
+
+  def close(self, error=None):
+    ''' Mark the end of the items,
+        with an optional exception `error` to raise in the consumer.
     '''
-    pending_room = self.pending_room
-    while len(chunk) >= pending_room:
-      self.pending.append(chunk[:pending_room])
-      self.pending_room = 0
-      yield from self.flush()
-      chunk = chunk[pending_room:]
-      pending_room = self.pending_room
-    if chunk:
-      self.pending.append(chunk)
-      self.pending_room -= len(chunk)
+    with self._cond:
+      self.closed = True
+      self._error = error
+      self._cond.notify_all()
+
+  def cancel(self):
+    ''' Discard the queue contents and stop further `put`s.
+    '''
+    with self._cond:
+      self.cancelled = True
+      self._items.clear()
+      self.size = 0
+      self._cond.notify_all()
+
+  def __iter__(self):
+    cond = self._cond
+    items = self._items
+    while True:
+      with cond:
+        while not items and not self.closed and not self.cancelled:
+          cond.wait()
+        if self.cancelled:
+          return
+        if not items:
+          if self._error is not None:
+            raise self._error
+          return
+        item, size = items.popleft()
+        self.size -= size
+        cond.notify_all()
+      yield item
+
+def pipeline_stage(items, name, sizeof=len, capacity=PIPELINE_BUFFER_SIZE):
+  ''' Iterate over `items` in a separate `Thread`, putting them
+      onto a new `PipelineQueue` of size `capacity`, and return the queue.
+      The size of each item is `sizeof(item)`.
+      The `Thread` uses the current default Store.
+
+      The consumer should iterate over the queue
+      and call its `cancel` method if it stops early.
+  '''
+  S = getattr(defaults, 'S', None)
+  Q = PipelineQueue(capacity)
+
+  def run_stage():
+    ''' Thread body to copy the items to the queue.
+    '''
+    try:
+      with (nullcontext() if S is None else S):
+        for item in items:
+          if not Q.put(item, sizeof(item)):
+            break
+    except Exception as e:  # pylint: disable=broad-except
+      Q.close(e)
+    else:
+      Q.close()
+
+  bg_thread(run_stage, name=name, daemon=True)
+  return Q
+
+def pipelined(items, name, sizeof=len, capacity=PIPELINE_BUFFER_SIZE):
+  ''' Generator yielding the items from the iterable `items`,
+      which is iterated in a separate pipeline stage:
+      see `pipeline_stage`.
+      The stage is cancelled if this generator is abandoned.
+  '''
+  Q = pipeline_stage(items, name, sizeof=sizeof, capacity=capacity)
+  try:
+    yield from Q
+  finally:
+    Q.cancel()
+
+def _pair_size(pair):
+  ''' The size of a `(Block,chunk)` pair for a `PipelineQueue`:
+      the length of `chunk`, or `0` if it is `None`.
+  '''
+  chunk = pair[1]
+  return 0 if chunk is None else len(chunk)
 
-@fmtdoc
 def blocked_chunks_of(
     chunks,
     scanner=None,
     min_block=None,
     max_block=None,
     histogram=None,
+    chunking=None,
+    rolling_hash=None,
+    avg_block=None,
+    hashclass=None,
+    min_run=None,
 ):
   ''' Generator which connects to a scanner of a chunk stream in
       order to emit low level edge aligned data chunks.
@@ -175,53 +631,95 @@ def blocked_chunks_of(
         may be `None`, in which case only the rolling hash is used
         to locate boundaries.
       * `min_block`: the smallest amount of data that will be used
-        to create a Block, default from `MIN_BLOCKSIZE` (`{MIN_BLOCKSIZE}`)
+        to create a Block, default from `MIN_BLOCKSIZE`
       * `max_block`: the largest amount of data that will be used to
-        create a Block, default from `MAX_BLOCKSIZE` (`{MAX_BLOCKSIZE}`)
+        create a Block, default from `MAX_BLOCKSIZE`
       * `histogram`: if not `None`, a `defaultdict(int)` to collate counts.
         Integer indices count block sizes and string indices are used
         for `'bytes_total'` and `'bytes_hash_scanned'`.
+      * `chunking`: the chunking mode, one of `CHUNKING_MODES`,
+        default from `DEFAULT_CHUNKING`;
+        `CHUNKING_NORMALISED` ignores the rolling hash until `min_block`
+        bytes into a block and aims for blocks of about
+        `NORMALISED_TARGET` bytes
+      * `rolling_hash`: the name of the rolling hash, one of `ROLLING_HASHES`,
+        default from `DEFAULT_ROLLING_HASH`
+      * `avg_block`: optional target average block size
+      * `hashclass`: optional hash class whose `HASHNAME` is one of
+        `SCAN_DIGESTS`; if supplied, yield `(chunk,hashcode)`
+        with the hashcodes computed by the `Scanner` in the same pass
+      * `min_run`: optional shortest run of one octet to yield
+        as an `RLEBlock` in place of a chunk
+        (with a `hashcode` of `None`), default `0` for none;
+        the data of a run are not gathered up
+
+      The block size settings are validated by `new_scanner`.
 
       The iterable returned from `scanner(chunks)` yields `int`s which are
       considered desirable block boundaries.
+
+      The source chunks are fetched and the `scanner` is run
+      in their own pipeline stages, each running at most
+      `PIPELINE_BUFFER_SIZE` bytes ahead of the next:
+      see `pipeline_stage`.
   '''
   # pylint: disable=too-many-nested-blocks,too-many-statements
   # pylint: disable=too-many-branches,too-many-locals
   with Pfx("blocked_chunks_of"):
-    if min_block is None:
-      min_block = MIN_BLOCKSIZE
-    elif min_block < 8:
-      raise ValueError("rejecting min_block < 8: %s" % (min_block,))
-    if max_block is None:
-      max_block = MAX_BLOCKSIZE
-    elif max_block >= 1024 * 1024:
-      raise ValueError("rejecting max_block >= 1024*1024: %s" % (max_block,))
-    if min_block >= max_block:
-      raise ValueError(
-          "rejecting min_block:%d >= max_block:%d" % (min_block, max_block)
-      )
-    # obtain iterator of chunks; this avoids accidentally reusing the chunks
-    # if for example chunks is a sequence
-    chunk_iter = iter(chunks)
-    # Set up parseQ, an iterable yielding a mix of source data and
-    # offsets representing desirable block boundaries.
-    # If there is no scanner, this is just chunk_iter.
-    # If there is a scanner we dispatch the scanner in a separate
-    # Thread and feed it a tee() of chunk_iter, which copies chunks
-    # to the parseQ when chunks are obtained by the scanner. The
-    # Thread runs the scanner and copies its output offsets to the
-    # parseQ.
-    # The tee() arranges that chunks arrive before any offsets within them.
+    # The Scanner keeps the rolling hash, the pending parser offsets
+    # and the block size constraints, and returns the block ends
+    # within each chunk.
+    scanner_state = new_scanner(
+        min_block=min_block,
+        max_block=max_block,
+        avg_block=avg_block,
+        chunking=chunking,
+        rolling_hash=rolling_hash,
+        hashname=None if hashclass is None else hashclass.HASHNAME,
+        min_run=min_run,
+    )
+    hashlen = None if hashclass is None else hashclass.HASHLEN
+    # The pipeline stages, each running ahead of the next by at most
+    # PIPELINE_BUFFER_SIZE bytes:
+    # - read: a Thread fetching the source chunks into readQ
+    # - parse: if there is a scanner, a Thread running it over the
+    #   chunks from readQ, passing the chunks and then the offsets
+    #   found in them to parseQ
+    # - scan and cut: this generator, feeding the chunks and offsets
+    #   to the Scanner, which also computes the hashcodes if requested
+    # blockify adds another stage to store the blocks.
+    # The stages wait for each other when their queues are full,
+    # so a fast reader cannot fill memory.
+    readQ = pipeline_stage(chunks, "blocked_chunks_of:read")
     if scanner is None:
       # No scanner, consume the chunks directly.
-      parseQ = chunk_iter
+      parseQ = None
+      items = iter(readQ)
     else:
-      # Consume the chunks and offsets via a queue.
-      # The scanner puts offsets onto the queue.
-      # When the scanner fetches from the chunks, those chunks are copied to the queue.
-      # When the scanner terminates, any remaining chunks are also copied to the queue.
-      parseQ = IterableQueue()
-      chunk_iter = tee(chunk_iter, parseQ)
+      # The parser reads the chunks from readQ;
+      # each chunk is put onto parseQ before the parser sees it.
+      # The parser puts its offsets onto parseQ.
+      # When the parser terminates, any remaining chunks are also
+      # copied to parseQ.
+      parseQ = PipelineQueue()
+      # an exception from the source chunks, to pass on to the consumer
+      read_error = None
+
+      def copied_chunks():
+        ''' Yield the chunks from `readQ`, copying them to `parseQ` first.
+        '''
+        nonlocal read_error
+        try:
+          for chunk in readQ:
+            if not parseQ.put(chunk, len(chunk)):
+              # cancelled
+              break
+            yield chunk
+        except Exception as e:
+          read_error = e
+          raise
+
+      chunk_iter = copied_chunks()
 
       def run_parser():
         ''' Thread body to run the supplied scanner against the input data.
@@ -235,168 +733,150 @@ def blocked_chunks_of(
               warning(
                   "discarding non-int from scanner %s: %s", scanner, offset
               )
-            else:
-              parseQ.put(offset)
+            elif not parseQ.put(offset):
+              break
         except Exception as e:
-          exception("exception from scanner %s: %s", scanner, e)
-        # Consume the remainder of chunk_iter; the tee() will copy it to parseQ.
-        for _ in chunk_iter:
+          if read_error is None:
+            exception("exception from scanner %s: %s", scanner, e)
+        # Consume the remainder of chunk_iter, which copies it to parseQ.
+        try:
+          for _ in chunk_iter:
+            pass
+        except Exception:  # pylint: disable=broad-except
           pass
         # end of offsets and chunks
-        parseQ.close()
+        parseQ.close(read_error)
 
-      bg_thread(run_parser)
-    # inbound chunks and offsets
-    in_offsets = []  # heap of unprocessed edge offsets
-    # prime `available_chunk` with the first data chunk, ready for get_next_chunk
+      bg_thread(run_parser, name="blocked_chunks_of:parse", daemon=True)
+      items = iter(parseQ)
     try:
-      available_chunk = next(parseQ)
-    except StopIteration:
-      # no data! just return
-      return
-
-    def get_next_chunk():
-      ''' Fetch and return the next data chunk from the `parseQ`.
-          Return None at end of input.
-          Also gather all the following offsets from the queue before return.
-          Because this inherently means collecting the chunk beyond
-          these offsets, we keep that in `available_chunk` for the
-          next call.
-          Sets parseQ to None if the end of the iterable is reached.
-      '''
-      nonlocal parseQ, in_offsets, hash_value, available_chunk
-      if parseQ is None:
-        assert available_chunk is None
-        return None
-      next_chunk = available_chunk
-      available_chunk = None
-      assert not isinstance(next_chunk, int)
-      # scan the new chunk and load potential edges into the offset heap
-      hash_value, chunk_scan_offsets = scanbuf(hash_value, next_chunk)
-      for cso in chunk_scan_offsets:
-        heappush(in_offsets, offset + cso)
-      # gather items from the parseQ until the following chunk
-      # or end of input
-      while True:
-        try:
-          item = next(parseQ)
-        except StopIteration:
-          parseQ = None
-          break
-        else:
-          if isinstance(item, int):
-            heappush(in_offsets, item)
-          else:
-            available_chunk = item
-            break
-      return next_chunk
-
-    last_offset = None
-    first_possible_point = None
-    max_possible_point = None
-
-    def recompute_offsets():
-      ''' Recompute relevant offsets from the block parameters.
-          The first_possible_point is last_offset+min_block,
-            the earliest point at which we will accept a block boundary.
-          The max_possible_point is last_offset+max_block,
-            the latest point at which we will accept a block boundary;
-            we will choose this if no next_offset or hash offset
-            is found earlier.
-      '''
-      nonlocal last_offset, first_possible_point, max_possible_point
-      first_possible_point = last_offset + min_block
-      max_possible_point = last_offset + max_block
-      ##X("recomputed offsets: last_offset=%d, first_possible_point=%d, max_possible_point=%d",
-      ##  last_offset, first_possible_point, max_possible_point)
-
-    # prepare initial state
-    last_offset = 0  # latest released boundary
-    recompute_offsets()  # compute first_possible_point and max_possible_point
-    hash_value = 0
-    offset = 0
-    chunk0 = None
-    offset0 = None
-    # unblocked outbound data
-    pending = _PendingBuffer(max_block)
-    # Read data chunks and locate desired boundaries.
+      yield from _cut_chunks(
+          items, scanner_state, histogram, hashclass, hashlen, min_run
+      )
+    finally:
+      # stop the earlier stages if we are abandoned
+      readQ.cancel()
+      if parseQ is not None:
+        parseQ.cancel()
+
+def _cut_chunks(items, scanner_state, histogram, hashclass, hashlen, min_run):
+  ''' The cutting stage of `blocked_chunks_of`:
+      feed the data chunks and parser offsets from the iterator `items`
+      to the `Scanner` `scanner_state` and yield the chunks between its cuts.
+  '''
+  # pylint: disable=too-many-statements,too-many-branches,too-many-locals
+  # prime `available_chunk` with the first data chunk, ready for get_next_chunk
+  try:
+    available_chunk = next(items)
+  except StopIteration:
+    # no data! just return
+    return
+
+  def get_next_chunk():
+    ''' Fetch the next data chunk from `items`
+        and the parser offsets which follow it.
+        Return `(chunk,offsets)`, or `(None,None)` at end of input.
+        Because gathering the offsets inherently means collecting
+        the chunk beyond them, we keep that in `available_chunk`
+        for the next call.
+        Sets items to None if the end of the iterable is reached.
+    '''
+    nonlocal items, available_chunk
+    if items is None:
+      assert available_chunk is None
+      return None, None
+    next_chunk = available_chunk
+    available_chunk = None
+    assert not isinstance(next_chunk, int)
+    # gather items until the following chunk or end of input
+    parser_offsets = []
     while True:
-      chunk = get_next_chunk()
-      if chunk is None:
+      try:
+        item = next(items)
+      except StopIteration:
+        items = None
         break
-      # verify current chunk start offset against end of previous chunk
-      assert chunk0 is None or offset == offset0 + len(chunk0), \
-          "offset0=%d, len(chunk0)=%d: sum(%d) != current offset %d" \
-          % (offset0, len(chunk0), offset0 + len(chunk0), offset)
-      chunk0 = chunk
-      offset0 = offset
-      chunk = memoryview(chunk)
-      chunk_end_offset = offset + len(chunk)
-      # process current chunk
-      advance_by = 0  # how much data to add to the pending buffer
-      release = False  # whether we hit a boundary ==> flush the buffer
-      while chunk:
-        if advance_by > 0:
-          # advance through this chunk
-          # buffer the advance
-          # release ==> flush the buffer and update last_offset
-          assert advance_by is not None
-          assert advance_by >= 0
-          assert advance_by <= len(chunk)
-          # save the advance bytes and yield any overflow
-          for out_chunk in pending.append(chunk[:advance_by]):
-            yield out_chunk
-            if histogram is not None:
-              out_chunk_size = len(out_chunk)
-              histogram['bytes_total'] += out_chunk_size
-              histogram[out_chunk_size] += 1
-              histogram['buffer_overflow_chunks'] += 1
-          offset += advance_by
-          chunk = chunk[advance_by:]
-          if last_offset != pending.offset:
-            # if the flush discarded a full buffer we need to adjust our boundaries
-            last_offset = pending.offset
-            recompute_offsets()
-          if release:
-            release = False  # becomes true if we should flush after taking data
-            # yield the current pending data
-            for out_chunk in pending.flush():
-              yield out_chunk
-              if histogram is not None:
-                out_chunk_size = len(out_chunk)
-                histogram['bytes_total'] += out_chunk_size
-                histogram[out_chunk_size] += 1
-            last_offset = pending.offset
-            recompute_offsets()
-          if not chunk:
-            # consumed the end of the chunk, need a new one
-            break
-        advance_by = None
-        # fetch the next available edge, None if nothing available or suitable
-        while True:
-          if in_offsets:
-            next_offset = heappop(in_offsets)
-            if next_offset > offset and next_offset >= first_possible_point:
-              break
-          else:
-            next_offset = None
-            break
-        if next_offset is None or next_offset > chunk_end_offset:
-          # no suitable edge: consume the chunk and advance
-          take_to = chunk_end_offset
+      else:
+        if isinstance(item, int):
+          parser_offsets.append(item)
         else:
-          # edge before end of chunk: use it
-          take_to = next_offset
-          release = True
-        advance_by = take_to - offset
-        assert advance_by > 0
-    # yield any left over data
-    for out_chunk in pending.flush():
-      yield out_chunk
+          available_chunk = item
+          break
+    return next_chunk, parser_offsets
+
+  # unblocked outbound data, memoryviews of the source chunks
+  pending = []
+  # the length of the unblocked outbound data if they are a run
+  run_span = 0
+  nforced = 0
+  # Read data chunks and cut them at the boundaries chosen by the Scanner.
+  while True:
+    chunk, parser_offsets = get_next_chunk()
+    if chunk is None:
+      break
+    if hashclass is None:
+      cuts = scanner_state.scan(chunk, parser_offsets)
+    else:
+      cuts, digests = scanner_state.scan_digests(chunk, parser_offsets)
+    runs = dict(scanner_state.runs()) if min_run else {}
+    chunk = memoryview(chunk)
+    cut0 = 0
+    for cutndx, cut in enumerate(cuts):
+      octet = runs.get(cutndx)
+      if octet is not None:
+        # a run, which follows a cut
+        assert not pending
+        out_chunk = RLEBlock(run_span + cut - cut0, octet)
+        run_span = 0
+        if hashclass is None:
+          yield out_chunk
+        else:
+          yield out_chunk, None
+      else:
+        pending.append(chunk[cut0:cut])
+        out_chunk = b''.join(pending)
+        pending = []
+        if hashclass is None:
+          yield out_chunk
+        else:
+          yield out_chunk, hashclass.from_hashbytes(
+              digests[cutndx * hashlen:(cutndx + 1) * hashlen]
+          )
       if histogram is not None:
         out_chunk_size = len(out_chunk)
         histogram['bytes_total'] += out_chunk_size
         histogram[out_chunk_size] += 1
+      cut0 = cut
+    if cut0 < len(chunk):
+      if min_run and scanner_state.pending_run() is not None:
+        run_span += len(chunk) - cut0
+      else:
+        pending.append(chunk[cut0:])
+    if histogram is not None and scanner_state.nforced > nforced:
+      histogram['buffer_overflow_chunks'] += scanner_state.nforced - nforced
+      nforced = scanner_state.nforced
+  # yield any left over data
+  if run_span:
+    out_chunk = RLEBlock(run_span, scanner_state.pending_run())
+    if hashclass is None:
+      yield out_chunk
+    else:
+      yield out_chunk, None
+    if histogram is not None:
+      histogram['bytes_total'] += run_span
+      histogram[run_span] += 1
+  elif pending:
+    out_chunk = b''.join(pending)
+    if hashclass is None:
+      yield out_chunk
+    else:
+      yield out_chunk, hashclass.from_hashbytes(
+          scanner_state.pending_digest()
+      )
+    if histogram is not None:
+      out_chunk_size = len(out_chunk)
+      histogram['bytes_total'] += out_chunk_size
+      histogram[out_chunk_size] += 1
 
 if __name__ == '__main__':
   from .blockify_tests import selftest
@@ -11,15 +11,20 @@ from collections import defaultdict
 from itertools import chain
 import os
 import os.path
+from random import randint
 import sys
+from tempfile import NamedTemporaryFile
 import time
 import unittest
 from cs.buffer import chunky, CornuCopyBuffer
 from cs.fileutils import read_from
-from cs.randutils import randomish_chunks
-from .blockify import blockify, blocked_chunks_of, \
-                      MAX_BLOCKSIZE, DEFAULT_SCAN_SIZE
+from cs.randutils import make_randblock, randomish_chunks
+from .blockify import blockify, blockify_fd, blocked_chunks_of, \
+                      pipelined, MAX_BLOCKSIZE, DEFAULT_SCAN_SIZE
+from .block import HashCodeBlock, RLEBlock
+from .hash import Hash_SHA1, Hash_SHA256, Hash_BLAKE3
 from .parsers import scan_text, scan_mp3, scan_mp4
+from .scan import CHUNKING_MODES, ROLLING_HASHES
 from .store import MappingStore
 
 from cs.x import X
@@ -155,20 +160,225 @@ class TestAll(unittest.TestCase):
   def test03blockifyAndRetrieve(self):
     ''' Blockify some data and ensure that the blocks match the data.
     '''
-    with MappingStore("TestAll.test00blockifyAndRetrieve", {}):
-      with open(__file__, 'rb') as f:
-        data = f.read()
-      blocks = list(blockify([data]))
-      data2 = b''.join(chain(*[B.datafrom() for B in blocks]))
-      self.assertEqual(
-          len(data), len(data2), "data mismatch: len(data)=%d, len(data2)=%d" %
-          (len(data), len(data2))
-      )
-      self.assertEqual(
-          data, data2,
-          "data mismatch: data and data2 same length but contents differ"
+    for chunking in CHUNKING_MODES:
+      with self.subTest(chunking=chunking):
+        with MappingStore("TestAll.test00blockifyAndRetrieve", {}) as S:
+          S.chunking = chunking
+          with open(__file__, 'rb') as f:
+            data = f.read()
+          blocks = list(blockify([data]))
+          data2 = b''.join(chain(*[B.datafrom() for B in blocks]))
+          self.assertEqual(
+              len(data), len(data2),
+              "data mismatch: len(data)=%d, len(data2)=%d" %
+              (len(data), len(data2))
+          )
+          self.assertEqual(
+              data, data2,
+              "data mismatch: data and data2 same length but contents differ"
+          )
+    with self.assertRaises(ValueError):
+      list(blocked_chunks_of([b'abc'], chunking='no-such-chunking'))
+    for rolling_hash in ROLLING_HASHES:
+      with self.subTest(rolling_hash=rolling_hash):
+        with MappingStore("TestAll.test03blockifyAndRetrieve", {}) as S:
+          S.rolling_hash = rolling_hash
+          data = make_randblock(100000) * 3
+          blocks = list(blockify([data]))
+          data2 = b''.join(chain(*[B.datafrom() for B in blocks]))
+          self.assertEqual(data, data2)
+    with self.assertRaises(ValueError):
+      list(blocked_chunks_of([b'abc'], rolling_hash='no-such-hash'))
+
+  def test04blockSizes(self):
+    ''' Larger average and maximum block sizes from the Store.
+    '''
+    data = make_randblock(2 * 1024 * 1024)
+    for chunking in CHUNKING_MODES:
+      with self.subTest(chunking=chunking):
+        with MappingStore("TestAll.test04blockSizes", {}) as S:
+          S.chunking = chunking
+          S.avg_block = 65536
+          S.max_block = 262144
+          blocks = list(blockify([data]))
+          data2 = b''.join(chain(*[B.datafrom() for B in blocks]))
+          self.assertEqual(data, data2)
+          self.assertTrue(all(len(B) <= 262144 for B in blocks))
+          average = len(data) / len(blocks)
+          self.assertTrue(32768 < average < 131072, average)
+    for bad_sizes in (
+        dict(max_block=1024 * 1024),
+        dict(avg_block=80),
+        dict(avg_block=16383),
+        dict(avg_block=65536),
+    ):
+      with self.subTest(**bad_sizes):
+        with self.assertRaises(ValueError):
+          list(blocked_chunks_of([b'abc'], **bad_sizes))
+
+  def test05fusedDigests(self):
+    ''' Hashcodes computed during the scan match those of the Store.
+    '''
+    data = make_randblock(1024 * 1024)
+    for hashclass in Hash_SHA1, Hash_SHA256, Hash_BLAKE3:
+      with self.subTest(hashclass=hashclass.HASHNAME):
+        pieces = list(randomish_chunks_of(data))
+        chunks = list(blocked_chunks_of(pieces))
+        pairs = list(blocked_chunks_of(pieces, hashclass=hashclass))
+        self.assertEqual(chunks, [chunk for chunk, _ in pairs])
+        for chunk, hashcode in pairs:
+          self.assertEqual(hashcode, hashclass.from_chunk(chunk))
+        mapping = {}
+        with MappingStore("TestAll.test05fusedDigests", mapping,
+                          hashclass=hashclass) as S:
+          blocks = list(blockify([data]))
+          data2 = b''.join(chain(*[B.datafrom() for B in blocks]))
+          self.assertEqual(data, data2)
+          for B in blocks:
+            if isinstance(B, HashCodeBlock):
+              self.assertEqual(B.hashcode, S.hash(mapping[B.hashcode]))
+
+  def test06blockifyFd(self):
+    ''' Blocks from a file descriptor match those from its data.
+    '''
+    data = make_randblock(3 * 1024 * 1024 + 12345)
+    with NamedTemporaryFile() as f:
+      f.write(data)
+      f.flush()
+      fd = f.fileno()
+      for hashclass in Hash_SHA1, Hash_SHA256:
+        with self.subTest(hashclass=hashclass.HASHNAME):
+          with MappingStore("TestAll.test06blockifyFd", {},
+                            hashclass=hashclass):
+            for start, end in (0, None), (5000, 3000000):
+              span = data[start:end]
+              blocks = list(
+                  blockify(
+                      span[pos:pos + DEFAULT_SCAN_SIZE]
+                      for pos in range(0, len(span), DEFAULT_SCAN_SIZE)
+                  )
+              )
+              fd_blocks = list(blockify_fd(fd, start, end))
+              self.assertEqual(
+                  [B.span for B in fd_blocks], [B.span for B in blocks]
+              )
+              self.assertEqual(
+                  [
+                      B.hashcode
+                      for B in fd_blocks
+                      if isinstance(B, HashCodeBlock)
+                  ],
+                  [B.hashcode for B in blocks if isinstance(B, HashCodeBlock)],
+              )
+              data2 = b''.join(chain(*[B.datafrom() for B in fd_blocks]))
+              self.assertEqual(data2, span)
+
+  def test07runs(self):
+    ''' Long runs of one octet become RLEBlocks which are not stored,
+        from blockify and from blockify_fd alike.
+    '''
+
+    def randblock(size):
+      ''' Random data which neither extends nor joins the runs.
+      '''
+      return b'\x55' + make_randblock(size - 2) + b'\x55'
+
+    data = b''.join(
+        (
+            randblock(100000),
+            bytes(3000000),
+            randblock(50000),
+            b'\xff' * 5000,
+            b'\xff' * 4000 + randblock(10),
+            bytes(3000),
+            randblock(70000),
+            bytes(200000),
+        )
+    )
+    with NamedTemporaryFile() as f:
+      f.write(data)
+      f.flush()
+      fd = f.fileno()
+      for hashclass in Hash_SHA1, Hash_SHA256:
+        with self.subTest(hashclass=hashclass.HASHNAME):
+          mapping = {}
+          with MappingStore("TestAll.test07runs", mapping,
+                            hashclass=hashclass):
+            blocks = list(
+                blockify(
+                    (
+                        data[pos:pos + DEFAULT_SCAN_SIZE]
+                        for pos in range(0, len(data), DEFAULT_SCAN_SIZE)
+                    ),
+                    hashclass=hashclass,
+                )
+            )
+            fd_blocks = list(blockify_fd(fd, hashclass=hashclass))
+            self.assertEqual(
+                [(type(B), B.span) for B in fd_blocks],
+                [(type(B), B.span) for B in blocks]
+            )
+            runs = [B for B in blocks if isinstance(B, RLEBlock)]
+            self.assertEqual(
+                [(B.octet, B.span) for B in runs],
+                [(b'\0', 3000000), (b'\xff', 9000), (b'\0', 200000)]
+            )
+            self.assertLess(sum(len(data) for data in mapping.values()), 600000)
+            for Bs in blocks, fd_blocks:
+              data2 = b''.join(chain(*[B.datafrom() for B in Bs]))
+              self.assertEqual(data2, data)
+            without_runs = list(blockify([data], min_run=0))
+            self.assertFalse(
+                [B for B in without_runs if isinstance(B, RLEBlock)]
+            )
+    # the Store must be able to take the scanned hashcodes
+    with MappingStore("TestAll.test07runs", {}, hashclass=Hash_SHA1):
+      self.assertRaises(
+          ValueError, list, blockify([data], hashclass=Hash_SHA256)
       )
 
+  def test08pipeline(self):
+    ''' Pipeline stages are bounded, pass on errors and stop if abandoned.
+    '''
+    produced = []
+
+    def source(n, size, fail_at=None):
+      for i in range(n):
+        if i == fail_at:
+          raise IOError("source failure at chunk %d" % (i,))
+        produced.append(i)
+        yield make_randblock(size)
+
+    # the stage runs no more than its capacity ahead of the consumer
+    items = pipelined(source(100, 1000), "test08pipeline", capacity=10000)
+    next(items)
+    time.sleep(0.2)
+    self.assertLessEqual(len(produced), 12)
+    self.assertEqual(len(list(items)), 99)
+    self.assertEqual(len(produced), 100)
+    # abandoning the consumer stops the producer
+    produced.clear()
+    items = pipelined(source(100, 1000), "test08pipeline", capacity=10000)
+    next(items)
+    items.close()
+    time.sleep(0.2)
+    self.assertLessEqual(len(produced), 12)
+    # source errors reach the consumer, with or without a parser
+    for scanner in None, scan_text:
+      with self.subTest(scanner=scanner):
+        with self.assertRaises(IOError):
+          for _ in blocked_chunks_of(source(10, 10000, fail_at=5), scanner):
+            pass
+
+def randomish_chunks_of(data):
+  ''' Yield `data` in pieces of random size.
+  '''
+  offset = 0
+  while offset < len(data):
+    size = randint(1, 16384)
+    yield data[offset:offset + size]
+    offset += size
+
 def selftest(argv):
   ''' Run the unit tests.
   '''
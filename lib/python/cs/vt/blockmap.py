@@ -365,7 +365,7 @@ class BlockMap(RunStateMixin):
             h = leaf.hashcode
           except AttributeError:
             # make a conventional HashCodeBlock and index that
-            data = leaf.data
+            data = leaf.get_direct_data()
             if len(data) >= 65536:
               warning(
                   "promoting %d bytes from %s to a new HashCodeBlock",
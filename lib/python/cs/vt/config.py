@@ -45,6 +45,8 @@ from .convert import (
 from .dir import Dir
 from .store import PlatonicStore, ProxyStore, DataDirStore
 from .socket import TCPClientStore, UNIXSocketClientStore
+from .blockify import new_scanner
+from .scan import CHUNKING_MODES, ROLLING_HASHES
 from .transcribe import parse
 
 def Store(spec, config, runstate=None, hashclass=None):
@@ -340,6 +342,32 @@ class Config(SingletonMixin):
     # process general purpose params
     # blockmapdir: location to store persistent blockmaps
     blockmapdir = params.pop('blockmapdir', None)
+    # chunking: how new data are divided into blocks
+    chunking = params.pop('chunking', None)
+    if chunking is not None and chunking not in CHUNKING_MODES:
+      raise ValueError(
+          "invalid chunking %r, expected one of %r" %
+          (chunking, CHUNKING_MODES)
+      )
+    # rolling_hash: the rolling hash used to find block edges
+    rolling_hash = params.pop('rolling_hash', None)
+    if rolling_hash is not None and rolling_hash not in ROLLING_HASHES:
+      raise ValueError(
+          "invalid rolling_hash %r, expected one of %r" %
+          (rolling_hash, ROLLING_HASHES)
+      )
+    # avg_block, max_block: the target average and maximum block sizes
+    # min_run: the shortest run of one octet to store as an RLEBlock
+    block_sizes = {}
+    for size_param in 'avg_block', 'max_block', 'min_run':
+      size = params.pop(size_param, None)
+      if size is not None:
+        if isinstance(size, str):
+          size = scaled_value(size)
+        block_sizes[size_param] = size
+    if block_sizes:
+      # check the block sizes against the other settings
+      new_scanner(chunking=chunking, **block_sizes)
     if store_name is None:
       store_name = str(self) + '[' + clause_name + ']'
     constructor_name = store_type + '_Store'
@@ -353,6 +381,12 @@ class Config(SingletonMixin):
       S.config = self
     if blockmapdir is not None:
       S.blockmapdir = blockmapdir
+    if chunking is not None:
+      S.chunking = chunking
+    if rolling_hash is not None:
+      S.rolling_hash = rolling_hash
+    for size_param, size in block_sizes.items():
+      setattr(S, size_param, size)
     return S
 
   @require(lambda clause_name: isinstance(clause_name, str))
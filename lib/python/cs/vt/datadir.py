@@ -57,6 +57,7 @@ import sys
 import time
 from types import SimpleNamespace
 from uuid import uuid4
+from zlib import decompress
 from icontract import require
 from cs.app.flag import DummyFlags, FlaggedMixin
 from cs.cache import LRU_Cache
@@ -76,7 +77,7 @@ from cs.py.func import prop as property  # pylint: disable=redefined-builtin
 from cs.queues import IterableQueue
 from cs.resources import MultiOpenMixin, RunStateMixin
 from cs.seq import imerge
-from cs.threads import locked, bg as bg_thread
+from cs.threads import bg as bg_thread
 from cs.units import transcribe_bytes_geek, BINARY_BYTES_SCALE
 from cs.upd import Upd, upd_proxy, state as upd_state
 from . import MAX_FILE_SIZE, Lock, RLock
@@ -85,12 +86,14 @@ from .block import Block
 from .blockify import (
     DEFAULT_SCAN_SIZE, blocked_chunks_of, spliced_blocks, top_block_for
 )
-from .datafile import DataRecord, DATAFILE_DOT_EXT
+from .datafile import DataRecord, DataFlag, DATAFILE_DOT_EXT, scan_datafile
 from .dir import Dir, FileDirent
 from .hash import HashCode, HashCodeUtilsMixin, MissingHashcodeError
 from .index import choose as choose_indexclass, FileDataIndexEntry
 from .parsers import scanner_from_filename
-from .util import buffer_from_pathname, createpath, openfd_read, openfd_append
+from .rangetree import RangeTree
+from .scan import data_records, SCAN_DIGESTS
+from .util import createpath, openfd_read, openfd_append
 
 DEFAULT_DATADIR_STATE_NAME = 'default'
 
@@ -102,6 +105,30 @@ DEFAULT_ROLLOVER = MAX_FILE_SIZE
 # flush the index after this many updates in the index updater worker thread
 INDEX_FLUSH_RATE = 16384
 
+# hash the blocks of a PlatonicDir scan in batches of about this many bytes
+HASH_BATCH_SIZE = 4 * 1024 * 1024
+
+def hashed_scan(scan, hashclass, batch_size=HASH_BATCH_SIZE):
+  ''' Yield `(pre_offset,data,post_offset,hashcode)` for each
+      `(pre_offset,data,post_offset)` from `scan`,
+      hashing the data in batches of about `batch_size` bytes
+      with `hashclass.from_chunks`.
+  '''
+  batch = []
+  batch_bytes = 0
+  for item in scan:
+    batch.append(item)
+    batch_bytes += len(item[1])
+    if batch_bytes >= batch_size:
+      hashcodes = hashclass.from_chunks([data for _, data, _ in batch])
+      for (pre_offset, data, post_offset), hashcode in zip(batch, hashcodes):
+        yield pre_offset, data, post_offset, hashcode
+      batch = []
+      batch_bytes = 0
+  hashcodes = hashclass.from_chunks([data for _, data, _ in batch])
+  for (pre_offset, data, post_offset), hashcode in zip(batch, hashcodes):
+    yield pre_offset, data, post_offset, hashcode
+
 class DataFileState(SimpleNamespace):
   ''' General state information about a data file
       in use by a files based data dir
@@ -173,6 +200,9 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
 
   STATE_FILENAME_FORMAT = 'index-{hashname}-state.sqlite'
   INDEX_FILENAME_BASE_FORMAT = 'index-{hashname}'
+  RANGETREE_FILENAME_FORMAT = 'index-{hashname}-rangetree'
+  # the RangeTree is maintained by _index_updater
+  has_range_tree = True
   DATA_ROLLOVER = DEFAULT_ROLLOVER
 
   _FD_Singleton_Key_Tuple = namedtuple(
@@ -299,6 +329,7 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
     )
     self._filemap = None
     self._unindexed = None
+    self._range_tree = None
     self._cache = None
     self._indexQ = None
     self._index_Thread = None
@@ -341,6 +372,7 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
         self.pathto(self.INDEX_FILENAME_BASE_FORMAT.format(hashname=hashname))
     )
     self.index.open()
+    self._range_tree = self._load_range_tree()
     self.runstate.start()
     # cache of open DataFiles
     self._cache = LRU_Cache(
@@ -383,6 +415,8 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
       self._index_Thread = None
     if self._unindexed:
       error("UNINDEXED BLOCKS: %r", self._unindexed)
+    self._save_range_tree()
+    self._range_tree = None
     # update state to substrate
     self._cache = None
     self._filemap.close()
@@ -401,6 +435,18 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
     del self._rfds
     self.runstate.stop()
 
+  def get_setting(self, setting, default=None):
+    ''' Return the value of the persistent `setting`, or `default`.
+        Settings are strings kept in the state file;
+        they are available while the `FilesDir` is open.
+    '''
+    return self._filemap.settings.get(setting, default)
+
+  def set_setting(self, setting, value):
+    ''' Set the persistent `setting` to `value`, which is stored as a string.
+    '''
+    self._filemap.set_setting(setting, str(value))
+
   def pathto(self, rpath):
     ''' Return the path to `rpath`, which is relative to the `topdirpath`.
     '''
@@ -447,13 +493,46 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
   def add(self, data):
     ''' Add the supplied data chunk to the current save `DataFile`,
         return the hashcode.
+    '''
+    return self.add_hashed(data, self.hashclass.from_chunk(data))
+
+  def add_hashed(self, data, hashcode):
+    ''' Add the supplied data chunk, whose `hashcode` has already been
+        computed, to the current save `DataFile`, return the hashcode.
+        The `hashcode` is trusted, not checked.
         Roll the internal state over to a new file if the current
         datafile has reached the rollover threshold.
 
         Subclasses must define the `data_save_information(data)` method.
     '''
     # pretranscribe the in-file data record
-    bs, data_offset, data_length, flags = self.data_save_information(data)
+    return self._add_saved(hashcode, *self.data_save_information(data))
+
+  def add_hashed_many(self, data_hashcodes):
+    ''' Add the supplied `(data,hashcode)` pairs like `add_hashed`,
+        return a list of the hashcodes.
+
+        The save information for all the chunks is prepared together
+        by the `data_save_informations(datas)` method,
+        which for a `DataDir` compresses them in parallel.
+    '''
+    data_hashcodes = list(data_hashcodes)
+    infos = self.data_save_informations([data for data, _ in data_hashcodes])
+    return [
+        self._add_saved(hashcode, *info)
+        for (_, hashcode), info in zip(data_hashcodes, infos)
+    ]
+
+  def data_save_informations(self, datas):
+    ''' Return a list of the `data_save_information(data)` for each of `datas`.
+        Subclasses may override this to prepare the chunks together.
+    '''
+    return [self.data_save_information(data) for data in datas]
+
+  def _add_saved(self, hashcode, bs, data_offset, data_length, flags):
+    ''' Append the pretranscribed data record `bs` to the current save
+        `DataFile` and index it under `hashcode`, return the hashcode.
+    '''
     with self._lock:
       wfd = self._wfd
       filenum = self._WDFstate.filenum
@@ -478,7 +557,6 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
         flags=flags,
     )
     post_offset = offset + length
-    hashcode = self.hashclass.from_chunk(data)
     self._queue_index(hashcode, entry, post_offset)
     return hashcode
 
@@ -518,6 +596,7 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
     index = self.index
     unindexed = self._unindexed
     filemap = self._filemap
+    range_tree = self._range_tree
     old_DFstate = None
     indexQ = self._indexQ
     for item in indexQ:
@@ -530,6 +609,9 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
       hashcode, entry, post_offset = item
       entry_bs = bytes(entry)
       with self._lock:
+        # count each hashcode in the tree once, however often it is stored
+        if hashcode not in index:
+          range_tree.add(hashcode)
         index[hashcode] = entry_bs
         try:
           del unindexed[hashcode]
@@ -546,13 +628,77 @@ class FilesDir(SingletonMixin, HashCodeUtilsMixin, MultiOpenMixin,
     if old_DFstate is not None:
       filemap.set_indexed_to(old_DFstate.filenum, old_DFstate.indexed_to)
 
-  @locked
+  @property
+  def range_tree_path(self):
+    ''' The path of the saved `RangeTree`.
+    '''
+    return self.pathto(
+        self.RANGETREE_FILENAME_FORMAT.format(hashname=self.hashname)
+    )
+
+  def _load_range_tree(self):
+    ''' Load the `RangeTree` saved at the last shutdown,
+        or rebuild it from the index if it is missing or stale.
+        The saved tree is removed once loaded
+        so that a crash before the next shutdown forces a rebuild.
+    '''
+    path = self.range_tree_path
+    tree = None
+    try:
+      with open(path, 'rb') as f:
+        tree = RangeTree.load(self.hashclass, f)
+    except FileNotFoundError:
+      pass
+    except ValueError as e:
+      warning("%s: %s", shortpath(path), e)
+    if isfilepath(path):
+      with Pfx("remove %r", path):
+        os.remove(path)
+    if tree is not None:
+      # not every index kind can count its entries cheaply
+      try:
+        nindex = len(self.index)
+      except TypeError:
+        pass
+      else:
+        if len(tree) != nindex:
+          warning(
+              "%s: %d hashcodes, but the index has %d", shortpath(path),
+              len(tree), nindex
+          )
+          tree = None
+    if tree is None:
+      info("%s: rebuild the range tree from the index", self)
+      tree = RangeTree.from_hashcodes(
+          self.hashclass, self.index.sorted_keys()
+      )
+    return tree
+
+  def _save_range_tree(self):
+    ''' Save the `RangeTree` for the next startup.
+    '''
+    tree = self._range_tree
+    if tree is not None:
+      path = self.range_tree_path
+      with Pfx("save %r", path):
+        with open(path, 'wb') as f:
+          tree.save(f)
+
+  def range_tree(self):
+    ''' The `RangeTree` of the hashcodes, maintained as blocks are indexed.
+        Like `hashcodes_from` it does not yet include
+        the `len(self._unindexed)` blocks queued for indexing.
+    '''
+    return self._range_tree
+
   def flush(self):
     ''' Flush all the components.
     '''
+    # not under the lock: the index updater needs it to drain the queue
     self._queue_index_flush()
-    self._cache.flush()
-    self.index.flush()
+    with self._lock:
+      self._cache.flush()
+      self.index.flush()
 
   def __setitem__(self, hashcode, data):
     h = self.add(data)
@@ -731,6 +877,21 @@ class SqliteFilemap:
       for filenum, path, indexed_to in c.fetchall():
         self._map(path, filenum, indexed_to)
       c.close()
+      c = self._execute('SELECT setting, value FROM settings')
+      for setting, value in c.fetchall():
+        self.settings[setting] = value
+      c.close()
+
+  def set_setting(self, setting, value):
+    ''' Set the persistent `setting` to the string `value`.
+    '''
+    with Pfx("set_setting(%r,%r)", setting, value):
+      with self._lock:
+        self._modify(
+            'INSERT OR REPLACE INTO settings(`setting`, `value`) VALUES (?, ?)',
+            (setting, value)
+        )
+        self.settings[setting] = value
 
   @require(lambda new_path: new_path is not None)
   ##@require(lambda new_path: isfilepath(new_path))
@@ -829,12 +990,31 @@ class DataDir(FilesDir):
     DR = DataRecord(data)
     return bytes(DR), DR.data_offset, DR.raw_data_length, DR.flags
 
+  @staticmethod
+  def data_save_informations(datas):
+    ''' Return a list of the `data_save_information(data)` for each of `datas`.
+
+        The `DataRecord`s are prepared by `data_records`,
+        which compresses the chunks in parallel.
+    '''
+    return data_records(datas)
+
   @staticmethod
   def scanfrom(filepath, offset=0):
-    ''' Scan the specified `filepath` from `offset`, yielding `DataRecord`s.
+    ''' Scan the specified `filepath` from `offset`,
+        yielding `(pre_offset,DataRecord,post_offset)`.
+
+        The record framing is walked by `scan_datafile`
+        and only the stored data are read.
     '''
-    bfr = buffer_from_pathname(filepath, offset=offset)
-    yield from DataRecord.scan_with_offsets(bfr)
+    with open(filepath, 'rb') as f:
+      fd = f.fileno()
+      for pre_offset, data_offset, data_length, flags, _, post_offset in scan_datafile(
+          fd, offset):
+        yield pre_offset, DataRecord(
+            os.pread(fd, data_length, data_offset),
+            is_compressed=bool(flags & DataFlag.COMPRESSED)
+        ), post_offset
 
   @upd_proxy
   def _monitor_datafiles(self):
@@ -848,7 +1028,6 @@ class DataDir(FilesDir):
     proxy = upd_state.proxy
     proxy.prefix = str(self) + " monitor "
     filemap = self._filemap
-    indexQ = self._indexQ
     datadirpath = self.pathto('data')
     while not self.cancelled:
       if self.flag_scan_disable:
@@ -898,29 +1077,42 @@ class DataDir(FilesDir):
           if new_size > DFstate.scanned_to:
             offset = DFstate.scanned_to
             hashclass = self.hashclass
-            for pre_offset, DR, post_offset in progressbar(
-                DFstate.scanfrom(offset=offset),
-                "%s: scan %s" % (self, relpath(datadirpath, DFstate.filename)),
-                position=offset,
-                total=new_size,
-                units_scale=BINARY_BYTES_SCALE,
-                itemlenfunc=lambda t3: t3[2] - t3[0],
-            ):
-              hashcode = hashclass.from_chunk(DR.data)
-              indexQ.put(
-                  (
-                      hashcode,
-                      FileDataIndexEntry(
-                          filenum=filenum,
-                          data_offset=pre_offset + DR.data_offset,
-                          data_length=DR.raw_data_length,
-                          flags=DR.flags,
-                      ), post_offset
-                  )
-              )
-              DFstate.scanned_to = post_offset
-              if self.cancelled:
-                break
+            # hash natively during the scan if possible
+            hashname = (
+                hashclass.HASHNAME
+                if hashclass.HASHNAME in SCAN_DIGESTS else None
+            )
+            with open(DFstate.pathname, 'rb') as f:
+              fd = f.fileno()
+              for (pre_offset, data_offset, data_length, flags, digest,
+                   post_offset) in progressbar(
+                       scan_datafile(fd, offset, new_size, hashname=hashname),
+                       "%s: scan %s" %
+                       (self, relpath(datadirpath, DFstate.filename)),
+                       position=offset,
+                       total=new_size,
+                       units_scale=BINARY_BYTES_SCALE,
+                       itemlenfunc=lambda t6: t6[5] - t6[0],
+              ):
+                if digest is None:
+                  data = os.pread(fd, data_length, data_offset)
+                  if flags & DataFlag.COMPRESSED:
+                    data = decompress(data)
+                  hashcode = hashclass.from_chunk(data)
+                else:
+                  hashcode = hashclass.from_hashbytes(digest)
+                self._queue_index(
+                    hashcode,
+                    FileDataIndexEntry(
+                        filenum=filenum,
+                        data_offset=data_offset,
+                        data_length=data_length,
+                        flags=flags,
+                    ), post_offset
+                )
+                DFstate.scanned_to = post_offset
+                if self.cancelled:
+                  break
             self.flush()
         self.flush()
       time.sleep(1)
@@ -1144,7 +1336,6 @@ class PlatonicDir(FilesDir):
     proxy.prefix = str(self) + " monitor "
     meta_store = self.meta_store
     filemap = self._filemap
-    indexQ = self._indexQ
     datadirpath = self.pathto('data')
     if meta_store is not None:
       topdir = self.topdir
@@ -1276,26 +1467,26 @@ class PlatonicDir(FilesDir):
                           )
                         scan_from = DFstate.scanned_to
                         scan_start = time.time()
-                        for pre_offset, data, post_offset in progressbar(
-                            DFstate.scanfrom(offset=DFstate.scanned_to),
-                            "scan " + rfilepath,
-                            position=DFstate.scanned_to,
-                            total=new_size,
-                            units_scale=BINARY_BYTES_SCALE,
-                            itemlenfunc=lambda t3: t3[2] - t3[0],
-                            update_frequency=128,
+                        for pre_offset, data, post_offset, hashcode in hashed_scan(
+                            progressbar(
+                                DFstate.scanfrom(offset=DFstate.scanned_to),
+                                "scan " + rfilepath,
+                                position=DFstate.scanned_to,
+                                total=new_size,
+                                units_scale=BINARY_BYTES_SCALE,
+                                itemlenfunc=lambda t3: t3[2] - t3[0],
+                                update_frequency=128,
+                            ),
+                            self.hashclass,
                         ):
-                          hashcode = self.hashclass.from_chunk(data)
-                          indexQ.put(
-                              (
-                                  hashcode,
-                                  FileDataIndexEntry(
-                                      filenum=DFstate.filenum,
-                                      data_offset=pre_offset,
-                                      data_length=len(data),
-                                      flags=0,
-                                  ), post_offset
-                              )
+                          self._queue_index(
+                              hashcode,
+                              FileDataIndexEntry(
+                                  filenum=DFstate.filenum,
+                                  data_offset=pre_offset,
+                                  data_length=len(data),
+                                  flags=0,
+                              ), post_offset
                           )
                           if meta_store is not None:
                             B = Block(data=data, hashcode=hashcode, added=True)
@@ -10,6 +10,7 @@
 '''
 
 from enum import IntFlag
+import os
 import sys
 from zlib import compress, decompress
 from icontract import require
@@ -17,10 +18,14 @@ from cs.binary import BSUInt, BSData, SimpleBinary
 from cs.buffer import CornuCopyBuffer
 from cs.fileutils import datafrom
 from .block import Block
+from .scan import scan_vtd_file
 
 DATAFILE_EXT = 'vtd'
 DATAFILE_DOT_EXT = '.' + DATAFILE_EXT
 
+# the amount of a datafile examined by each scan_vtd_file call
+SCAN_DATAFILE_WINDOW = 64 * 1024 * 1024
+
 class DataFlag(IntFlag):
   ''' Flag values for DataFile records.
 
@@ -128,6 +133,50 @@ class DataRecord(SimpleBinary):
     '''
     return len(self._data)
 
+def scan_datafile(fd, offset=0, end=None, hashname=None):
+  ''' Scan the `DataRecord`s of the open `.vtd` file descriptor `fd`
+      from `offset` to `end` (default the file size), yielding
+      `(pre_offset,data_offset,data_length,flags,digest,post_offset)`
+      for each complete record, where `data_offset` and `data_length`
+      locate the stored data in the file.
+
+      Only the record framing is decoded, by `scan_vtd_file`,
+      a window of `SCAN_DATAFILE_WINDOW` bytes at a time.
+      If `hashname`, one of `cs.vt.scan.SCAN_DIGESTS`, is supplied
+      then `digest` is the digest of the uncompressed data,
+      computed in parallel without the GIL; otherwise it is `None`.
+      An incomplete record at `end`, such as one still being written,
+      ends the scan.
+  '''
+  if end is None:
+    end = os.fstat(fd).st_size
+  window = SCAN_DATAFILE_WINDOW
+  while offset < end:
+    upto = min(end, offset + window)
+    (
+        pre_offsets, data_offsets, data_lengths, flagss, post_offset, digests
+    ) = scan_vtd_file(
+        fd, offset, upto, hashname=hashname
+    )
+    if post_offset == offset:
+      if upto == end:
+        break
+      # a record larger than the window
+      window *= 2
+      continue
+    digest_size = len(digests) // len(pre_offsets) if digests else 0
+    for i, pre_offset in enumerate(pre_offsets):
+      data_offset = data_offsets[i]
+      data_length = data_lengths[i]
+      yield (
+          pre_offset, data_offset, data_length, flagss[i],
+          None if digests is None else
+          digests[i * digest_size:(i + 1) * digest_size],
+          data_offset + data_length
+      )
+    offset = post_offset
+    window = SCAN_DATAFILE_WINDOW
+
 class DataFilePushable:
   ''' Read access to a data file, which stores data chunks in compressed form.
       This is the usual file based persistence layer of a local Store.
@@ -25,7 +25,7 @@ from cs.queues import MultiOpenMixin
 from cs.threads import locked
 from . import PATHSEP, defaults, RLock
 from .block import Block, _Block, BlockRecord
-from .blockify import top_block_for, blockify
+from .blockify import top_block_for, blockify, blockify_fd
 from .file import RWBlockFile
 from .hash import io_fail
 from .meta import Meta, DEFAULT_DIR_ACL, DEFAULT_FILE_ACL
@@ -792,6 +792,13 @@ class FileDirent(_Dirent, MultiOpenMixin, FileLike):
     '''
     return cls('', block=top_block_for(blockify(chunks)))
 
+  @classmethod
+  def from_fd(cls, fd):
+    ''' Create a FileDirent from the file descriptor `fd`,
+        which is scanned in place by `blockify_fd`.
+    '''
+    return cls('', block=top_block_for(blockify_fd(fd)))
+
   @property
   def block(self):
     ''' Obtain the top level Block.
@@ -1157,6 +1164,13 @@ class Dir(_Dirent, DirLike):
     self[name] = E
     return E
 
+  def file_fromfd(self, name, fd):
+    if name in self:
+      raise KeyError("name already exists: %r" % (name,))
+    E = FileDirent.from_fd(fd)
+    self[name] = E
+    return E
+
   def chdir1(self, name):
     ''' Change directory to the immediate entry `name`.
         Return the entry.
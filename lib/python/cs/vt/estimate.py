@@ -0,0 +1,388 @@
+#!/usr/bin/env python3
+#
+# Dedupe estimation.
+#   - Cameron Simpson <cs@cskk.id.au>
+#
+
+''' Estimate the deduplication of data before storing it.
+
+    `estimate_paths` blocks and hashes files as they would be stored,
+    keeping only a compact record of the distinct blocks seen,
+    and returns a `DedupeEstimate` from which `estimate_report`
+    reports the projected unique data, block count and index size.
+    Nothing is written to a Store.
+
+    A `DedupeEstimate` records the distinct hashcodes in one of three ways:
+    * exactly, keeping the leading 8 bytes of every distinct hashcode
+      and its block size in sorted packed arrays, 12 bytes per block
+    * by sampling, keeping only the hashcodes whose leading `sample_bits`
+      bits are zero and scaling the results up accordingly;
+      since the sample is chosen by content it sees the same blocks
+      every time they occur
+    * with a HyperLogLog sketch of `2**hll_bits` registers,
+      which uses constant memory but estimates only the number
+      of distinct blocks; the unique data size is then estimated
+      from the mean block size
+'''
+
+from array import array
+from bisect import bisect_left
+from collections import defaultdict
+from math import log
+import os
+from os.path import isdir as isdirpath, isfile as isfilepath, join as joinpath
+from queue import Queue
+from threading import Lock
+from cs.fileutils import file_data
+from cs.logutils import warning
+from cs.pfx import Pfx
+from cs.threads import bg as bg_thread
+from . import MAX_FILE_SIZE
+from .bench import histogram_buckets, histogram_summary
+from .block import RLEBlock
+from .blockify import blocked_chunks_of
+from .index import FileDataIndexEntry
+from .parsers import scanner_from_filename
+from .scan import SCAN_DIGESTS
+
+# the default number of HyperLogLog register index bits;
+# the leading bits of a hashcode select a register,
+# which keeps the longest run of leading zero bits seen in the rest
+HLL_BITS = 14
+
+class DedupeEstimate:
+  ''' A collation of the blocks of some data
+      for estimating how much of it is unique.
+
+      The distinct blocks are kept as their leading 8 hashcode bytes
+      in the sorted array `seen_keys` with their sizes in `seen_sizes`.
+      New blocks are gathered in a small `dict`
+      and merged into the arrays every `SEEN_BATCH` distinct blocks.
+  '''
+
+  # the number of new blocks gathered before merging into the arrays
+  SEEN_BATCH = 65536
+
+  def __init__(self, hashclass, *, sample_bits=0, hll_bits=None):
+    ''' Initialise the estimate.
+
+        Parameters:
+        * `hashclass`: the hash class for the hashcodes
+        * `sample_bits`: keep only the hashcodes whose leading
+          `sample_bits` bits are zero, default `0` to keep them all
+        * `hll_bits`: if not `None`, record the distinct hashcodes
+          in a HyperLogLog sketch of `2**hll_bits` registers instead
+    '''
+    if not 0 <= sample_bits < 32:
+      raise ValueError("sample_bits should be in [0,32): %d" % (sample_bits,))
+    if hll_bits is not None:
+      if sample_bits:
+        raise ValueError("sample_bits and hll_bits are mutually exclusive")
+      if not 4 <= hll_bits <= 20:
+        raise ValueError("hll_bits should be in [4,20]: %d" % (hll_bits,))
+    self.hashclass = hashclass
+    self.sample_bits = sample_bits
+    self.hll_bits = hll_bits
+    self.nfiles = 0
+    self.nblocks = 0
+    self.total_bytes = 0
+    # runs of one octet, which are stored inline and not indexed
+    self.nruns = 0
+    self.run_bytes = 0
+    self.histogram = defaultdict(int)
+    # the leading hashcode bytes and sizes of the distinct blocks
+    self.seen_keys = array('Q')
+    self.seen_sizes = array('I')
+    self._pending = {}
+    self.registers = None if hll_bits is None else bytearray(1 << hll_bits)
+
+  def add(self, hashbytes, size):
+    ''' Record a block of `size` bytes with hashcode bytes `hashbytes`.
+    '''
+    self.nblocks += 1
+    self.total_bytes += size
+    key = int.from_bytes(hashbytes[:8], 'big')
+    if self.registers is not None:
+      rest_bits = 64 - self.hll_bits
+      rest = key & ((1 << rest_bits) - 1)
+      rank = rest_bits - rest.bit_length() + 1
+      index = key >> rest_bits
+      if rank > self.registers[index]:
+        self.registers[index] = rank
+    elif key >> (64 - self.sample_bits) == 0:
+      pending = self._pending
+      pending[key] = size
+      if len(pending) >= self.SEEN_BATCH:
+        self._merge_pending()
+
+  def _merge_pending(self):
+    ''' Merge the gathered blocks into the packed arrays.
+    '''
+    pending = self._pending
+    if pending:
+      keys = sorted(pending)
+      self._merge_seen(keys, [pending[key] for key in keys])
+      pending.clear()
+
+  def _merge_seen(self, keys, sizes):
+    ''' Merge the blocks with the ascending `keys` and their `sizes`
+        into `seen_keys` and `seen_sizes`, skipping those already seen.
+        The existing arrays are copied in slices between the new keys,
+        so the cost is a bisection per new key and one array copy.
+    '''
+    seen_keys = self.seen_keys
+    seen_sizes = self.seen_sizes
+    nseen = len(seen_keys)
+    merged_keys = array('Q')
+    merged_sizes = array('I')
+    pos = 0
+    for key, size in zip(keys, sizes):
+      index = bisect_left(seen_keys, key, pos)
+      merged_keys.extend(seen_keys[pos:index])
+      merged_sizes.extend(seen_sizes[pos:index])
+      pos = index
+      if index < nseen and seen_keys[index] == key:
+        continue
+      merged_keys.append(key)
+      merged_sizes.append(size)
+    merged_keys.extend(seen_keys[pos:])
+    merged_sizes.extend(seen_sizes[pos:])
+    self.seen_keys = merged_keys
+    self.seen_sizes = merged_sizes
+
+  def add_run(self, size):
+    ''' Record a run of one octet of `size` bytes.
+    '''
+    self.nruns += 1
+    self.run_bytes += size
+    self.total_bytes += size
+
+  def update(self, other):
+    ''' Merge another `DedupeEstimate` with the same settings into this one.
+    '''
+    if (other.hashclass, other.sample_bits,
+        other.hll_bits) != (self.hashclass, self.sample_bits, self.hll_bits):
+      raise ValueError("mismatched DedupeEstimate settings")
+    self.nfiles += other.nfiles
+    self.nblocks += other.nblocks
+    self.total_bytes += other.total_bytes
+    self.nruns += other.nruns
+    self.run_bytes += other.run_bytes
+    for key, count in other.histogram.items():
+      self.histogram[key] += count
+    other._merge_pending()
+    self._merge_pending()
+    self._merge_seen(other.seen_keys, other.seen_sizes)
+    if self.registers is not None:
+      self.registers = bytearray(map(max, self.registers, other.registers))
+
+  @property
+  def unique_blocks(self):
+    ''' The estimated number of distinct blocks.
+    '''
+    if self.registers is None:
+      self._merge_pending()
+      return len(self.seen_keys) << self.sample_bits
+    m = len(self.registers)
+    alpha = 0.7213 / (1 + 1.079 / m)
+    estimate = alpha * m * m / sum(2.0**-rank for rank in self.registers)
+    nzeros = self.registers.count(0)
+    if estimate <= 2.5 * m and nzeros:
+      # small range correction: linear counting
+      estimate = m * log(m / nzeros)
+    return min(int(round(estimate)), self.nblocks)
+
+  @property
+  def unique_bytes(self):
+    ''' The estimated size of the distinct blocks.
+    '''
+    if self.registers is None:
+      self._merge_pending()
+      return sum(self.seen_sizes) << self.sample_bits
+    if not self.nblocks:
+      return 0
+    return (self.total_bytes - self.run_bytes) * self.unique_blocks \
+        // self.nblocks
+
+  @property
+  def dedupe_ratio(self):
+    ''' The ratio of the total data size to the unique data size.
+    '''
+    unique_bytes = self.unique_bytes
+    return self.total_bytes / unique_bytes if unique_bytes else 1.0
+
+  def index_entry_size(self):
+    ''' The approximate size of an index entry for a unique block:
+        the hashcode and a `FileDataIndexEntry`
+        for a block of the mean unique size in the middle of a data file.
+    '''
+    unique_blocks = self.unique_blocks
+    mean = self.unique_bytes // unique_blocks if unique_blocks else 0
+    entry = FileDataIndexEntry(
+        filenum=1,
+        data_offset=MAX_FILE_SIZE // 2,
+        data_length=mean,
+        flags=FileDataIndexEntry.FLAG_COMPRESSED,
+    )
+    return self.hashclass.HASHLEN + len(bytes(entry))
+
+  def estimate_file(self, path, **scan_settings):
+    ''' Block and hash the file at `path`, recording its blocks.
+        The keyword arguments are block boundary settings
+        for `blocked_chunks_of`.
+    '''
+    hashclass = self.hashclass
+    histogram = self.histogram
+    with open(path, 'rb') as fp:
+      chunks = file_data(fp, None)
+      scanner = scanner_from_filename(path)
+      if hashclass.HASHNAME in SCAN_DIGESTS:
+        # the Scanner computes the hashcodes as it goes
+        for chunk, hashcode in blocked_chunks_of(chunks, scanner,
+                                                 histogram=histogram,
+                                                 hashclass=hashclass,
+                                                 **scan_settings):
+          if isinstance(chunk, RLEBlock):
+            self.add_run(len(chunk))
+          else:
+            self.add(hashcode, len(chunk))
+      else:
+        hashfunc = hashclass.HASHFUNC
+        for chunk in blocked_chunks_of(chunks, scanner, histogram=histogram,
+                                       **scan_settings):
+          if isinstance(chunk, RLEBlock):
+            self.add_run(len(chunk))
+          else:
+            self.add(hashfunc(chunk).digest(), len(chunk))
+    self.nfiles += 1
+
+def walk_files(paths):
+  ''' Yield the pathnames of the regular files in or under `paths`.
+      Symbolic links are not followed.
+  '''
+  for path in paths:
+    if isdirpath(path) and not os.path.islink(path):
+      for dirpath, dirnames, filenames in os.walk(path):
+        dirnames.sort()
+        for filename in sorted(filenames):
+          filepath = joinpath(dirpath, filename)
+          if isfilepath(filepath) and not os.path.islink(filepath):
+            yield filepath
+    elif isfilepath(path):
+      yield path
+    else:
+      warning("%s: not a file or directory, skipped", path)
+
+def estimate_paths(
+    paths, hashclass, *, threads=None, sample_bits=0, hll_bits=None,
+    **scan_settings
+):
+  ''' Estimate the deduplication of the files in or under `paths`.
+      Return a `DedupeEstimate`.
+
+      Parameters:
+      * `paths`: the files and directories to examine
+      * `hashclass`: the hash class for the block hashcodes
+      * `threads`: the number of files to examine in parallel,
+        default from `os.cpu_count()`
+      * `sample_bits`, `hll_bits`: passed to `DedupeEstimate`
+      Other keyword arguments are block boundary settings
+      for `blocked_chunks_of`.
+
+      Files which cannot be read are reported and skipped.
+      Any other exception, such as an invalid block boundary setting,
+      stops the estimate and is raised once the workers have finished.
+  '''
+  if threads is None:
+    threads = os.cpu_count() or 1
+  estimate = DedupeEstimate(
+      hashclass, sample_bits=sample_bits, hll_bits=hll_bits
+  )
+  lock = Lock()
+  Q = Queue(threads * 4)
+  # the first unexpected exception from a worker, raised by the caller
+  errors = []
+
+  def worker():
+    ''' Estimate the files from the queue, then merge the results.
+        After an unexpected exception the queue is drained
+        without further work so that the caller never blocks.
+    '''
+    local = DedupeEstimate(
+        hashclass, sample_bits=sample_bits, hll_bits=hll_bits
+    )
+    while True:
+      path = Q.get()
+      if path is None:
+        break
+      if errors:
+        continue
+      with Pfx(path):
+        try:
+          local.estimate_file(path, **scan_settings)
+        except OSError as e:
+          warning("%s", e)
+        except Exception as e:  # pylint: disable=broad-except
+          with lock:
+            errors.append(e)
+    with lock:
+      estimate.update(local)
+
+  workers = [
+      bg_thread(worker, name="estimate_paths[%d]" % (i,))
+      for i in range(threads)
+  ]
+  for path in walk_files(paths):
+    Q.put(path)
+  for _ in workers:
+    Q.put(None)
+  for T in workers:
+    T.join()
+  if errors:
+    raise errors[0]
+  return estimate
+
+def estimate_report(estimate, fp):
+  ''' Write a report of the `DedupeEstimate` `estimate` to the file `fp`.
+  '''
+  estimated = estimate.sample_bits or estimate.hll_bits is not None
+  approx = "~" if estimated else ""
+  unique_blocks = estimate.unique_blocks
+  entry_size = estimate.index_entry_size()
+  if estimate.hll_bits is not None:
+    print(
+        "mode: HyperLogLog, %d registers" % (1 << estimate.hll_bits,),
+        file=fp
+    )
+  elif estimate.sample_bits:
+    print(
+        "mode: sampled 1 in %d hashcodes" % (1 << estimate.sample_bits,),
+        file=fp
+    )
+  else:
+    print("mode: exact", file=fp)
+  print("files:         %d" % (estimate.nfiles,), file=fp)
+  print("total bytes:   %d" % (estimate.total_bytes,), file=fp)
+  print("blocks:        %d" % (estimate.nblocks,), file=fp)
+  print(
+      "runs:          %d, %d bytes" % (estimate.nruns, estimate.run_bytes),
+      file=fp
+  )
+  print("unique blocks: %s%d" % (approx, unique_blocks), file=fp)
+  print("unique bytes:  %s%d" % (approx, estimate.unique_bytes), file=fp)
+  print("dedupe ratio:  %s%.2f" % (approx, estimate.dedupe_ratio), file=fp)
+  print(
+      "index entries: %s%d bytes (%d bytes each, excluding index overhead)" %
+      (approx, unique_blocks * entry_size, entry_size),
+      file=fp
+  )
+  summary = histogram_summary(estimate.histogram)
+  print(
+      "block sizes:   mean %d, p10 %d, p50 %d, p90 %d, forced %.2f%%" % (
+          summary['mean'], summary['p10'], summary['p50'], summary['p90'],
+          summary['forced']
+      ),
+      file=fp
+  )
+  for low, high, count in histogram_buckets(estimate.histogram):
+    print("  %8d..%-8d %d" % (low, high - 1, count), file=fp)
@@ -0,0 +1,108 @@
+#!/usr/bin/python
+#
+# Dedupe estimation tests.
+#       - Cameron Simpson <cs@cskk.id.au>
+#
+
+''' Dedupe estimation tests.
+'''
+
+import os
+from os.path import join as joinpath
+import random
+import sys
+from tempfile import TemporaryDirectory
+import unittest
+from .estimate import DedupeEstimate, estimate_paths
+from .hash import Hash_SHA1, Hash_SHA256
+
+class TestDedupeEstimate(unittest.TestCase):
+  ''' Tests for `DedupeEstimate` and `estimate_paths`.
+  '''
+
+  def _add_blocks(self, estimate, nblocks, ncopies):
+    ''' Add `ncopies` copies of `nblocks` distinct 100 byte blocks.
+    '''
+    for _ in range(ncopies):
+      for n in range(nblocks):
+        estimate.add(Hash_SHA1.HASHFUNC(b'%d' % (n,)).digest(), 100)
+
+  def test00exact(self):
+    ''' Exact counts of duplicated blocks, also merged.
+    '''
+    E = DedupeEstimate(Hash_SHA1)
+    self._add_blocks(E, 1000, 3)
+    E.add_run(5000)
+    self.assertEqual(E.nblocks, 3000)
+    self.assertEqual(E.unique_blocks, 1000)
+    self.assertEqual(E.unique_bytes, 100000)
+    self.assertEqual(E.total_bytes, 305000)
+    self.assertAlmostEqual(E.dedupe_ratio, 3.05)
+    E2 = DedupeEstimate(Hash_SHA1)
+    # merge into the packed arrays in several batches
+    E2.SEEN_BATCH = 64
+    self._add_blocks(E2, 2000, 1)
+    E.update(E2)
+    self.assertEqual(E.unique_blocks, 2000)
+    self.assertEqual(E.unique_bytes, 200000)
+    self.assertEqual(list(E.seen_keys), sorted(set(E.seen_keys)))
+    self.assertRaises(ValueError, E.update, DedupeEstimate(Hash_SHA256))
+
+  def test01approximate(self):
+    ''' Sampled and HyperLogLog counts are near the exact counts.
+    '''
+    for kw in dict(sample_bits=3), dict(hll_bits=12):
+      with self.subTest(**kw):
+        E = DedupeEstimate(Hash_SHA1, **kw)
+        self._add_blocks(E, 20000, 2)
+        self.assertEqual(E.nblocks, 40000)
+        self.assertLess(abs(E.unique_blocks - 20000), 2000)
+        self.assertLess(abs(E.unique_bytes - 2000000), 200000)
+        # merging a copy of itself changes nothing
+        E2 = DedupeEstimate(Hash_SHA1, **kw)
+        self._add_blocks(E2, 20000, 1)
+        unique_blocks = E.unique_blocks
+        E.update(E2)
+        self.assertEqual(E.unique_blocks, unique_blocks)
+    self.assertRaises(
+        ValueError, DedupeEstimate, Hash_SHA1, sample_bits=2, hll_bits=12
+    )
+
+  def test02paths(self):
+    ''' Copies of a file are unique data only once.
+    '''
+    rand = random.Random(17)
+    data = bytes(rand.getrandbits(8) for _ in range(200000))
+    with TemporaryDirectory() as tmpdirpath:
+      for subdir in 'a', 'b':
+        os.mkdir(joinpath(tmpdirpath, subdir))
+        for filename in 'x', 'y':
+          with open(joinpath(tmpdirpath, subdir, filename), 'wb') as f:
+            f.write(data)
+      for hashclass in Hash_SHA1, Hash_SHA256:
+        with self.subTest(hashclass=hashclass.HASHNAME):
+          E = estimate_paths([tmpdirpath], hashclass, threads=2)
+          self.assertEqual(E.nfiles, 4)
+          self.assertEqual(E.total_bytes, 4 * len(data))
+          self.assertEqual(E.unique_bytes, len(data))
+          self.assertEqual(E.nblocks, 4 * E.unique_blocks)
+          self.assertAlmostEqual(E.dedupe_ratio, 4.0)
+          self.assertGreater(E.index_entry_size(), hashclass.HASHLEN)
+
+  def test03errors(self):
+    ''' An exception in a worker is raised, it does not hang the caller.
+    '''
+    with TemporaryDirectory() as tmpdirpath:
+      for n in range(40):
+        with open(joinpath(tmpdirpath, str(n)), 'wb') as f:
+          f.write(b'%d' % (n,) * 1000)
+      with self.assertRaises(ValueError):
+        estimate_paths([tmpdirpath], Hash_SHA1, threads=2, min_block=2)
+
+def selftest(argv):
+  ''' Run the unit tests.
+  '''
+  unittest.main(__name__, None, argv)
+
+if __name__ == '__main__':
+  selftest(sys.argv)
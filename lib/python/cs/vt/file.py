@@ -7,7 +7,7 @@
 '''
 
 from __future__ import print_function, absolute_import
-from io import RawIOBase
+from io import RawIOBase, UnsupportedOperation
 from os import SEEK_SET
 import sys
 from cs.fileutils import BackedFile, ReadMixin, datafrom
@@ -16,7 +16,7 @@ from cs.result import bg
 from cs.threads import locked, LockableMixin
 from . import defaults, RLock
 from .block import Block, IndirectBlock, RLEBlock
-from .blockify import top_block_for, blockify
+from .blockify import top_block_for, blockify, blockify_fd
 
 # arbitrary threshold to generate blockmaps
 AUTO_BLOCKMAP_THRESHOLD = 1024 * 1024
@@ -307,7 +307,21 @@ def filedata(f, start, end):
 
 def file_top_block(f, start, end, scanner=None):
   ''' Return a top Block for the data from an open file.
+
+      If there is no parser `scanner` and `f` has a file descriptor,
+      the file is scanned in place by `blockify_fd`
+      instead of being read into memory.
   '''
+  if scanner is None:
+    try:
+      fd = f.fileno()
+    except (AttributeError, OSError, UnsupportedOperation):
+      pass
+    else:
+      flush = getattr(f, 'flush', None)
+      if flush is not None:
+        flush()
+      return top_block_for(blockify_fd(fd, start, end))
   return top_block_for(blockify(filedata(f, start, end), scanner=scanner))
 
 if __name__ == '__main__':
@@ -5,7 +5,6 @@
 '''
 
 from binascii import unhexlify
-from bisect import bisect_left
 from hashlib import sha1, sha256
 from os.path import splitext
 import sys
@@ -16,6 +15,11 @@ from cs.excutils import exc_fold
 from cs.lex import get_identifier, hexify
 from cs.resources import MultiOpenMixin
 from .pushpull import missing_hashcodes
+from .rangetree import RangeTree
+from .scan import (
+    SCAN_DIGESTS, blake3, digest_chunks, digests_sort, digests_bisect,
+    digests_union, digests_difference, digests_intersection
+)
 from .transcribe import Transcriber, transcribe_s, register as register_transcriber
 
 class MissingHashcodeError(KeyError):
@@ -223,6 +227,36 @@ class HashCode(bytes, Transcriber, HasDotHashclassMixin):
     hashbytes = cls.HASHFUNC(chunk).digest()  # pylint: disable=not-callable
     return cls.from_hashbytes(hashbytes)
 
+  @classmethod
+  def digests_of_chunks(cls, chunks, threads=None):
+    ''' Return the hash bytes of each of the `chunks`
+        concatenated in a single `bytes`, `HASHLEN` bytes per chunk.
+
+        If the hash function is one of `SCAN_DIGESTS` the chunks
+        are hashed natively in parallel with the GIL released,
+        using up to `threads` threads, default from the data size.
+        Otherwise they are hashed one at a time with `HASHFUNC`.
+    '''
+    if cls.HASHNAME in SCAN_DIGESTS:
+      return digest_chunks(cls.HASHNAME, chunks, threads=threads)
+    return b''.join(
+        cls.HASHFUNC(chunk).digest()  # pylint: disable=not-callable
+        for chunk in chunks
+    )
+
+  @classmethod
+  def from_chunks(cls, chunks, threads=None):
+    ''' Return a list of `HashCode`s for the `chunks`,
+        the same as calling `from_chunk` for each
+        but computed in a batch by `digests_of_chunks`.
+    '''
+    digests = cls.digests_of_chunks(chunks, threads=threads)
+    hashlen = cls.HASHLEN
+    return [
+        cls(digests[offset:offset + hashlen])
+        for offset in range(0, len(digests), hashlen)
+    ]
+
   @property
   def hashfunc(self):
     ''' Convenient hook to this Hash's class' .from_chunk method.
@@ -291,14 +325,218 @@ HASHCLASS_BY_ENUM = HashCode.by_enum
 # enums for hash types; TODO: remove and use names throughout
 HASH_SHA1_T = 0
 HASH_SHA256_T = 1
+HASH_BLAKE3_T = 2
 
 Hash_SHA1 = HashCode.new_class('sha1', HASH_SHA1_T, hashfunc=sha1, hashlen=20)
 Hash_SHA256 = HashCode.new_class(
     'sha256', HASH_SHA256_T, hashfunc=sha256, hashlen=32
 )
+Hash_BLAKE3 = HashCode.new_class(
+    'blake3', HASH_BLAKE3_T, hashfunc=blake3, hashlen=32
+)
 
 DEFAULT_HASHCLASS = Hash_SHA1
 
+class HashCodeArray:
+  ''' A sorted set of hashcodes of a single hash class,
+      stored as their hash bytes packed end to end in a single `bytes`.
+
+      This costs `HASHLEN` bytes per hashcode instead of a `HashCode`
+      object each, and the sorting, bisection and set operations
+      are done natively by the `cs.vt.scan` `digests_*` functions.
+      Indexing and iteration produce `HashCode`s;
+      slices, `|`, `-` and `&` produce `HashCodeArray`s.
+  '''
+
+  __slots__ = ('hashclass', 'digests')
+
+  def __init__(self, hashclass, digests=b'', *, is_sorted=False, threads=None):
+    ''' Initialise the array.
+
+        Parameters:
+        * `hashclass`: the hash class of the hashcodes
+        * `digests`: the hash bytes of the hashcodes packed end to end
+        * `is_sorted`: if true `digests` is known to be sorted
+          without duplicates; otherwise it is sorted
+          and the duplicates removed
+        * `threads`: the number of threads for the sort,
+          default from the data size
+    '''
+    if is_sorted:
+      digests = bytes(digests)
+      if len(digests) % hashclass.HASHLEN:
+        raise ValueError(
+            "length %d is not a multiple of %s.HASHLEN %d" %
+            (len(digests), hashclass.__name__, hashclass.HASHLEN)
+        )
+    else:
+      digests = digests_sort(digests, hashclass.HASHLEN, threads=threads)
+    self.hashclass = hashclass
+    self.digests = digests
+
+  @classmethod
+  def from_hashcodes(cls, hashclass, hashcodes, *, is_sorted=False):
+    ''' Return a `HashCodeArray` of the `HashCode`s from the iterable
+        `hashcodes`, which must all be of class `hashclass`.
+        If `is_sorted` the hashcodes are known to be in order
+        without duplicates.
+    '''
+    digests = bytearray()
+    for hashcode in hashcodes:
+      if type(hashcode) is not hashclass:  # pylint: disable=unidiomatic-typecheck
+        raise TypeError(
+            "expected %s, got %s" % (hashclass.__name__, type(hashcode).__name__)
+        )
+      digests += hashcode
+    return cls(hashclass, digests, is_sorted=is_sorted)
+
+  @classmethod
+  def from_fields(cls, hashclass, data):
+    ''' Return a `HashCodeArray` from `data`, a concatenation of
+        `HashCodeField` encodings of hashcodes of class `hashclass`.
+    '''
+    prefix = hashclass.HASHENUM_BS
+    stride = hashclass.HASHLEN_ENCODED
+    if len(data) % stride:
+      raise ValueError(
+          "length %d is not a multiple of %s.HASHLEN_ENCODED %d" %
+          (len(data), hashclass.__name__, stride)
+      )
+    mv = memoryview(data)
+    digests = bytearray()
+    for offset in range(0, len(data), stride):
+      if mv[offset:offset + len(prefix)] != prefix:
+        raise ValueError(
+            "offset %d: expected hashenum %d" % (offset, hashclass.HASHENUM)
+        )
+      digests += mv[offset + len(prefix):offset + stride]
+    return cls(hashclass, digests)
+
+  def encode(self):
+    ''' Return the `HashCodeField` encodings of the hashcodes concatenated,
+        the inverse of `from_fields`.
+    '''
+    prefix = self.hashclass.HASHENUM_BS
+    hashlen = self.hashclass.HASHLEN
+    digests = self.digests
+    return b''.join(
+        prefix + digests[offset:offset + hashlen]
+        for offset in range(0, len(digests), hashlen)
+    )
+
+  def __repr__(self):
+    return "%s(%s,%d)" % (
+        type(self).__name__, self.hashclass.HASHNAME, len(self)
+    )
+
+  def __bytes__(self):
+    return self.digests
+
+  def __len__(self):
+    return len(self.digests) // self.hashclass.HASHLEN
+
+  def __eq__(self, other):
+    return (
+        isinstance(other, HashCodeArray) and other.hashclass is self.hashclass
+        and other.digests == self.digests
+    )
+
+  def __getitem__(self, index):
+    hashlen = self.hashclass.HASHLEN
+    if isinstance(index, slice):
+      start, stop, step = index.indices(len(self))
+      if step != 1:
+        raise ValueError("slice step must be 1, got %d" % (step,))
+      return type(self)(
+          self.hashclass,
+          self.digests[start * hashlen:max(start, stop) * hashlen],
+          is_sorted=True
+      )
+    n = len(self)
+    if index < 0:
+      index += n
+    if not 0 <= index < n:
+      raise IndexError(index)
+    return self.hashclass(self.digests[index * hashlen:(index + 1) * hashlen])
+
+  def __iter__(self):
+    hashclass = self.hashclass
+    hashlen = hashclass.HASHLEN
+    digests = self.digests
+    for offset in range(0, len(digests), hashlen):
+      yield hashclass(digests[offset:offset + hashlen])
+
+  def bisect_left(self, hashcode):
+    ''' Return the index of the first hashcode `>=hashcode`.
+    '''
+    return digests_bisect(self.digests, self.hashclass.HASHLEN, hashcode)
+
+  def bisect_right(self, hashcode):
+    ''' Return the index of the first hashcode `>hashcode`.
+    '''
+    return digests_bisect(
+        self.digests, self.hashclass.HASHLEN, hashcode, right=True
+    )
+
+  def __contains__(self, hashcode):
+    if type(hashcode) is not self.hashclass:  # pylint: disable=unidiomatic-typecheck
+      return False
+    index = self.bisect_left(hashcode)
+    hashlen = self.hashclass.HASHLEN
+    return self.digests[index * hashlen:(index + 1) * hashlen] == bytes(hashcode)
+
+  def _other_digests(self, other):
+    ''' Return the digests of the `HashCodeArray` `other`,
+        which must have the same hash class.
+    '''
+    if not isinstance(other, HashCodeArray):
+      raise TypeError("expected HashCodeArray, got %s" % (type(other).__name__,))
+    if other.hashclass is not self.hashclass:
+      raise ValueError(
+          "hashclass mismatch: %s vs %s" %
+          (self.hashclass.__name__, other.hashclass.__name__)
+      )
+    return other.digests
+
+  def union(self, other):
+    ''' Return a `HashCodeArray` of the hashcodes in `self` or `other`.
+    '''
+    return type(self)(
+        self.hashclass,
+        digests_union(
+            self.digests, self._other_digests(other), self.hashclass.HASHLEN
+        ),
+        is_sorted=True
+    )
+
+  __or__ = union
+
+  def difference(self, other):
+    ''' Return a `HashCodeArray` of the hashcodes in `self` not in `other`.
+    '''
+    return type(self)(
+        self.hashclass,
+        digests_difference(
+            self.digests, self._other_digests(other), self.hashclass.HASHLEN
+        ),
+        is_sorted=True
+    )
+
+  __sub__ = difference
+
+  def intersection(self, other):
+    ''' Return a `HashCodeArray` of the hashcodes in both `self` and `other`.
+    '''
+    return type(self)(
+        self.hashclass,
+        digests_intersection(
+            self.digests, self._other_digests(other), self.hashclass.HASHLEN
+        ),
+        is_sorted=True
+    )
+
+  __and__ = intersection
+
 class HashCodeUtilsMixin:
   ''' Utility methods for classes which use `HashCode`s as keys.
 
@@ -318,10 +556,18 @@ class HashCodeUtilsMixin:
         is roughly as efficient or inefficient.
         Classes like `StreamStore` provide their own implementation,
         but this is usually not necessary.
+      * `.hashcode_array`: the hashcodes from `.hashcodes`
+        as a compact `HashCodeArray`
       * `.hash_of_hashcodes`: used for comparing Store contents efficiently
+      * `.range_tree`, `.range_digests`: likewise, by hashcode prefix ranges
       * `.hashcodes_missing`: likewise
+      * `.set_digest`: a digest of all the hashcodes, for a quick equality test
   '''
 
+  # true if `.range_tree()` is maintained as hashcodes are added,
+  # making `.range_digests` and `.set_digest` cheap
+  has_range_tree = False
+
   def hash_of_byteses(self, bss):
     ''' Compute a `HashCode` from an iterable of `bytes`.
 
@@ -351,16 +597,38 @@ class HashCodeUtilsMixin:
       raise ValueError(
           "after=%s but start_hashcode=%s" % (after, start_hashcode)
       )
-    hs = list(
-        self.hashcodes(
-            start_hashcode=start_hashcode, after=after, length=length
-        )
+    hs = self.hashcode_array(
+        start_hashcode=start_hashcode, after=after, length=length
     )
     if hs:
       h_final = hs[-1]
     else:
       h_final = None
-    return self.hash_of_byteses(hs), h_final
+    return self.hash_of_byteses((bytes(hs),)), h_final
+
+  def range_tree(self):
+    ''' Return a `RangeTree` of the hashcodes.
+
+        This default builds a new tree from `.hashcodes_from()`
+        on every call; classes which index their hashcodes
+        should maintain one as they go and set `.has_range_tree`.
+    '''
+    return RangeTree.from_hashcodes(self.hashclass, self.hashcodes_from())
+
+  def range_digests(self, level, indices):
+    ''' Return a list of the `(count,sum)` digests
+        of the `RangeTree` nodes at `level` with the `indices`;
+        used for comparing remote Stores.
+    '''
+    return self.range_tree().digests(level, indices)
+
+  def set_digest(self):
+    ''' Return the `(count,sum)` digest of all the hashcodes,
+        the digest of the `RangeTree` root.
+        Stores with the same digest almost certainly hold the same hashcodes.
+        This is cheap only if `.has_range_tree`.
+    '''
+    return self.range_digests(0, [0])[0]
 
   def hashcodes_missing(self, other, *, window_size=None):
     ''' Generator yielding hashcodes in `other` which are missing in `self`.
@@ -380,8 +648,8 @@ class HashCodeUtilsMixin:
         See the `hashcodes()` method for a wrapper with more features.
 
         This implementation starts by fetching and sorting all the
-        keys, so for large mappings this implementation is memory
-        expensive and also runtime expensive if only a few hashcodes
+        keys into a `HashCodeArray`, so for large mappings this
+        implementation is runtime expensive if only a few hashcodes
         are desired.
 
         Parameters:
@@ -389,25 +657,12 @@ class HashCodeUtilsMixin:
           the returned hashcodes are `>=start_hashcode`;
           if `None` start the sequences from the smallest hashcode
     '''
-    ks = sorted(self.keys())
-    if not ks:
-      return
+    ks = HashCodeArray.from_hashcodes(self.hashclass, self.keys())
     if start_hashcode is None:
       ndx = 0
     else:
-      ndx = bisect_left(ks, start_hashcode)
-      if ndx == len(ks):
-        # start_hashcode > max hashcode
-        # nothing to return
-        return
-    # yield keys until we're not wanted
-    while True:
-      try:
-        hashcode = ks[ndx]
-      except IndexError:
-        break
-      yield hashcode
-      ndx += 1
+      ndx = ks.bisect_left(start_hashcode)
+    yield from ks[ndx:]
 
   @require(
       lambda self, start_hashcode: start_hashcode is None or
@@ -451,6 +706,24 @@ class HashCodeUtilsMixin:
         if length < 1:
           break
 
+  @require(
+      lambda self, start_hashcode: start_hashcode is None or
+      type(start_hashcode) is self.hashclass
+  )  # pylint: disable=unidiomatic-typecheck
+  def hashcode_array(self, *, start_hashcode=None, after=False, length=None):
+    ''' Return a `HashCodeArray` of the hashcodes from `.hashcodes`
+        with the same parameters.
+        This is how Store comparison fetches hashcodes in bulk;
+        subclasses may override it with something more direct.
+    '''
+    return HashCodeArray.from_hashcodes(
+        self.hashclass,
+        self.hashcodes(
+            start_hashcode=start_hashcode, after=after, length=length
+        ),
+        is_sorted=True
+    )
+
   @require(
       lambda self, start_hashcode: start_hashcode is None or
       isinstance(start_hashcode, type(self))
@@ -7,12 +7,21 @@
 ''' Hash tests.
 '''
 
+from bisect import bisect_left, bisect_right
 import random
 import sys
 import unittest
 from cs.binary_tests import _TestPacketFields
 from . import hash as hash_module
-from .hash import HASHCLASS_BY_NAME, decode as decode_hash
+from .hash import (
+    HASHCLASS_BY_NAME, Hash_BLAKE3, HashCodeArray, decode as decode_hash
+)
+from .scan import (
+    blake3, digest_chunks, py_blake3, py_digest_chunks, SCAN_DIGESTS,
+    digests_sort, digests_bisect, digests_union, digests_difference,
+    digests_intersection, py_digests_sort, py_digests_bisect,
+    py_digests_union, py_digests_difference, py_digests_intersection
+)
 from .transcribe import Transcriber, parse
 
 class TestDataFilePacketFields(_TestPacketFields, unittest.TestCase):
@@ -53,6 +62,126 @@ class TestHashing(unittest.TestCase):
           self.assertEqual(offset, len(Hencode))
           self.assertEqual(H, H2)
 
+  def testFromChunks(self):
+    ''' Test batched hashing against hashing each chunk.
+    '''
+    chunks = [
+        bytes(random.randint(0, 255) for _ in range(length))
+        for length in (0, 1, 55, 56, 63, 64, 65, 1000, 300000)
+    ]
+    for hash_name, cls in sorted(HASHCLASS_BY_NAME.items()):
+      with self.subTest(hash_name=hash_name):
+        hashcodes = [cls.from_chunk(chunk) for chunk in chunks]
+        for threads in None, 1, 4:
+          Hs = cls.from_chunks(chunks, threads=threads)
+          self.assertEqual(Hs, hashcodes)
+          self.assertTrue(all(type(H) is cls for H in Hs))
+        self.assertEqual(
+            cls.digests_of_chunks(iter(chunks)), b''.join(hashcodes)
+        )
+        self.assertEqual(cls.from_chunks([]), [])
+    for hash_name in SCAN_DIGESTS:
+      self.assertEqual(
+          digest_chunks(hash_name, chunks, threads=3),
+          py_digest_chunks(hash_name, chunks)
+      )
+    self.assertRaises(ValueError, digest_chunks, 'md5', chunks)
+    self.assertRaises(TypeError, digest_chunks, 'sha1', [b'', 'abc'])
+
+  def testBLAKE3(self):
+    ''' Test the native BLAKE3 against the reference vectors
+        and the pure Python implementation.
+    '''
+    for data, hexdigest in (
+        (b'',
+         'af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262'),
+        (b'abc',
+         '6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85'),
+        # the official test vector input, bytes(i % 251)
+        (bytes(i % 251 for i in range(1025)),
+         'd00278ae47eb27b34faecf67b4fe263f82d5412916c1ffd97c8cb7fb814b8444'),
+        (bytes(i % 251 for i in range(102400)),
+         'bc3e3d41a1146b069abffad3c0d44860cf664390afce4d9661f7902e7943e085'),
+    ):
+      for hashfunc in blake3, py_blake3:
+        with self.subTest(hashfunc=hashfunc, length=len(data)):
+          self.assertEqual(hashfunc(data).hexdigest(), hexdigest)
+    for length in 0, 1, 63, 64, 65, 1023, 1024, 1025, 8192, 8193, 33000:
+      with self.subTest(length=length):
+        data = random.randbytes(length)
+        digest = py_blake3(data).digest()
+        self.assertEqual(bytes(Hash_BLAKE3.from_chunk(data)), digest)
+        h = blake3()
+        for pos in range(0, length, 700):
+          h.update(data[pos:pos + 700])
+        h2 = h.copy()
+        self.assertEqual(h.digest(), digest)
+        h2.update(b'x')
+        self.assertEqual(h2.digest(), py_blake3(data + b'x').digest())
+    # large data is hashed in tree parallel mode
+    data = random.randbytes(8 * 1024 * 1024 + 12345)
+    digest = blake3(data, threads=1).digest()
+    for threads in None, 2, 5:
+      self.assertEqual(blake3(data, threads=threads).digest(), digest)
+    h = blake3()
+    h.update(data[:3000000])
+    h.update(data[3000000:])
+    self.assertEqual(h.digest(), digest)
+
+  def testHashCodeArray(self):
+    ''' Test `HashCodeArray` against sets of `HashCode`s.
+    '''
+    for hash_name, cls in sorted(HASHCLASS_BY_NAME.items()):
+      with self.subTest(hash_name=hash_name):
+        hs1 = [cls.from_chunk(b'%d' % (n,)) for n in range(0, 3000, 2)]
+        hs2 = [cls.from_chunk(b'%d' % (n,)) for n in range(0, 3000, 3)]
+        random.shuffle(hs1)
+        A1 = HashCodeArray.from_hashcodes(cls, hs1 + hs1[:100])
+        A2 = HashCodeArray.from_hashcodes(cls, hs2)
+        self.assertEqual(len(A1), len(hs1))
+        self.assertEqual(list(A1), sorted(hs1))
+        self.assertTrue(all(type(H) is cls for H in A1))
+        self.assertEqual(A1[0], min(hs1))
+        self.assertEqual(A1[-1], max(hs1))
+        self.assertEqual(list(A1[10:20]), sorted(hs1)[10:20])
+        self.assertEqual(list(A1 | A2), sorted(set(hs1) | set(hs2)))
+        self.assertEqual(list(A1 - A2), sorted(set(hs1) - set(hs2)))
+        self.assertEqual(list(A1 & A2), sorted(set(hs1) & set(hs2)))
+        for H in hs1[:50] + hs2[:50]:
+          self.assertEqual(H in A1, H in hs1)
+          ks = sorted(hs1)
+          self.assertEqual(A1.bisect_left(H), bisect_left(ks, H))
+          self.assertEqual(A1.bisect_right(H), bisect_right(ks, H))
+        self.assertEqual(HashCodeArray.from_fields(cls, A1.encode()), A1)
+        self.assertEqual(A1.encode(), b''.join(H.encode() for H in A1))
+        self.assertFalse(HashCodeArray(cls))
+        self.assertRaises(TypeError, HashCodeArray.from_hashcodes, cls, [b'x'])
+    # the native functions match the pure Python ones
+    hashlen = 20
+    digests = bytes(random.randint(0, 3) for _ in range(hashlen * 5000))
+    other = bytes(random.randint(0, 3) for _ in range(hashlen * 3000))
+    sorted1 = digests_sort(digests, hashlen)
+    self.assertEqual(sorted1, py_digests_sort(digests, hashlen))
+    for threads in 1, 3, 8:
+      self.assertEqual(digests_sort(digests, hashlen, threads=threads), sorted1)
+    sorted2 = digests_sort(other, hashlen)
+    for func, py_func in (
+        (digests_union, py_digests_union),
+        (digests_difference, py_digests_difference),
+        (digests_intersection, py_digests_intersection),
+    ):
+      self.assertEqual(
+          func(sorted1, sorted2, hashlen), py_func(sorted1, sorted2, hashlen)
+      )
+    for offset in range(0, len(other), hashlen * 97):
+      key = other[offset:offset + hashlen]
+      for right in False, True:
+        self.assertEqual(
+            digests_bisect(sorted1, hashlen, key, right),
+            py_digests_bisect(sorted1, hashlen, key, right)
+        )
+    self.assertRaises(ValueError, digests_sort, b'abc', 2)
+
 def selftest(argv):
   ''' Run the unit tests.
   '''
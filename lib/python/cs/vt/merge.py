@@ -10,7 +10,7 @@ from cs.logutils import warning
 from cs.pfx import Pfx
 from cs.resources import RunState
 from .dir import Dir, FileDirent
-from .paths import DirLike
+from .paths import DirLike, OSFile
 
 @require(lambda target_root: isinstance(target_root, DirLike))
 @require(lambda source_root: isinstance(source_root, DirLike))
@@ -76,6 +76,10 @@ def merge(target_root, source_root, runstate):
             if isinstance(target, Dir) and isinstance(sourcef, FileDirent):
               # create FileDirent from block
               target[name] = FileDirent(sourcef.block)
+            elif isinstance(sourcef, OSFile):
+              # scan the OS file in place
+              with open(sourcef.path, 'rb') as f:
+                targetf = target.file_fromfd(name, f.fileno())
             else:
               # copy data
               targetf = target.file_fromchunks(name, sourcef.datafrom())
@@ -14,7 +14,9 @@ from cs.buffer import chunky
 from cs.logutils import warning, exception
 from cs.pfx import Pfx, PfxThread
 from cs.queues import IterableQueue
-from .datafile import DataRecord
+from .scan import (
+    scan_prefixes, scan_boxes, scan_mp3_frames, scan_vtd_records
+)
 
 def linesof(chunks):
   ''' Process binary chunks, yield binary lines ending in '\n'.
@@ -42,11 +44,14 @@ def linesof(chunks):
 def scan_text(bfr, prefixes=None):
   ''' Scan textual data, yielding offsets of lines starting with
       useful prefixes, such as function definitions.
+
+      The lines are found and matched by `scan_prefixes`,
+      a chunk at a time.
   '''
   with Pfx("scan_text"):
     if prefixes is None:
       prefixes = PREFIXES_ALL
-    prefixes = [
+    prefixes = tuple(
         (
             prefix if isinstance(prefix, bytes) else (
                 bytes(prefix) if isinstance(prefix, memoryview) else (
@@ -55,17 +60,26 @@ def scan_text(bfr, prefixes=None):
                 )
             )
         ) for prefix in prefixes
-    ]
+    )
+    # offset is the stream offset of data[0];
+    # carry holds an undecided line start for the next chunk,
+    # which cannot match if the data end there
     offset = 0
-    for line in linesof(bfr):
-      next_offset = None
-      for prefix in prefixes:
-        if line.startswith(prefix):
-          next_offset = offset
-          break
-      if next_offset is not None:
-        yield next_offset
-      offset += len(line)
+    carry = b''
+    at_start = True
+    for chunk in bfr:
+      data = carry + chunk if carry else chunk
+      offsets, pending = scan_prefixes(data, prefixes, at_start)
+      for line_offset in offsets:
+        yield offset + line_offset
+      if pending is None:
+        carry = b''
+        at_start = False
+        offset += len(data)
+      else:
+        carry = bytes(data[pending:])
+        at_start = True
+        offset += pending
 
 scan_text_from_chunks = chunky(scan_text)
 
@@ -107,40 +121,56 @@ report_offsets_from_chunks = chunky(report_offsets)
 
 def scan_vtd(bfr):
   ''' Scan a datafile from `bfr` and yield chunk start offsets.
+      The record framing is walked by `scan_vtd_records`
+      without parsing the records.
   '''
   with Pfx("scan_vtd"):
+    yield from scan_headers(bfr, scan_vtd_records)
 
-    def run_parser(bfr):
-      for offset, _, _ in DataRecord.parse_buffer_with_offsets(bfr):
-        bfr.report_offset(offset)
+def scan_headers(bfr, scan, *state):
+  ''' Walk the headers in the data from `bfr` with `scan`,
+      yield the offsets it finds.
 
-    return report_offsets(bfr, run_parser)
+      `scan(data,base,pos,*state)` is a walker like `scan_boxes`
+      or `scan_mp3_frames`, returning `(offsets,pos,*state)`.
+      An incomplete header is carried into the next chunk
+      and chunks before the next header are passed over.
+  '''
+  # the stream offset of data[0]
+  base = 0
+  pos = 0
+  carry = b''
+  for chunk in bfr:
+    data = carry + chunk if carry else chunk
+    offsets, pos, *state = scan(data, base, pos, *state)
+    yield from offsets
+    if pos is None:
+      break
+    limit = base + len(data)
+    if pos < limit:
+      carry = bytes(data[pos - base:])
+      base = pos
+    else:
+      carry = b''
+      base = limit
 
 def scan_mp3(bfr):
   ''' Scan MP3 data from `bfr` and yield frame start offsets.
+      The frame headers are walked by `scan_mp3_frames`
+      without parsing the frames.
   '''
-  from cs.mp3 import framesof as parse_mp3_from_buffer
   with Pfx("scan_mp3"):
-
-    def run_parser(bfr):
-      for _ in parse_mp3_from_buffer(bfr):
-        pass
-
-    return report_offsets(bfr, run_parser)
+    yield from scan_headers(bfr, scan_mp3_frames)
 
 scan_mp3_from_chunks = chunky(scan_mp3)
 
 def scan_mp4(bfr):
   ''' Scan ISO14496 input and yield Box start offsets.
+      The box headers are walked by `scan_boxes`
+      without parsing the boxes.
   '''
-  from cs.iso14496 import Box
-  with Pfx("parse_mp4"):
-
-    def run_parser(bfr):
-      for _ in Box.scan(bfr):
-        pass
-
-    return report_offsets(bfr, run_parser)
+  with Pfx("scan_mp4"):
+    yield from scan_headers(bfr, scan_boxes, ())
 
 parse_mp4_from_chunks = chunky(scan_mp4)
 
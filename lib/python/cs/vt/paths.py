@@ -176,6 +176,12 @@ class DirLike(ABC):
     '''
     return self.file_frombuffer(name, CornuCopyBuffer(chunks))
 
+  def file_fromfd(self, name, fd):
+    ''' Create a new file named `name` from the data in the open
+        file descriptor `fd`, from offset 0 to the end of the file.
+    '''
+    return self.file_fromchunks(name, datafrom(fd, 0))
+
   def resolve(self, rpath):
     ''' Resolve `rpath` relative to `self`, return resolved node or `None`.
 
@@ -8,6 +8,7 @@ import sys
 from icontract import require
 from cs.deco import fmtdoc
 from cs.result import OnDemandFunction
+from .rangetree import DEPTH, FANOUT, RangeTree
 
 DEFAULT_WINDOW_SIZE = 1024
 
@@ -55,55 +56,41 @@ def missing_hashcodes(S1, S2, window_size=None):
       * `window_size`: number of hashcodes to fetch at a time for comparison,
         default from `DEFAULT_WINDOW_SIZE` (`{DEFAULT_WINDOW_SIZE}`).
 
-      This relies on both Stores supporting the `.hashcodes` method;
+      This relies on both Stores supporting the `.hashcode_array` method;
       dumb unordered Stores do not.
+      Each window of hashcodes is fetched as a `HashCodeArray`
+      and the windows compared with `HashCodeArray.difference`.
+      If both Stores maintain a `RangeTree`, nothing is fetched
+      if they have the same `.set_digest()`.
   '''
+  if (S1.has_range_tree and S2.has_range_tree
+      and S1.set_digest() == S2.set_digest()):
+    return
   if window_size is None:
     window_size = DEFAULT_WINDOW_SIZE
-  hashcodes1 = None
-  last_hashcode1 = None
-  hashcodes2 = list(S2.hashcodes(length=window_size))
-  while hashcodes2 and (hashcodes1 is None or hashcodes1):
-    # note end of S2 window so that we can fetch the next window
-    last_hashcode2 = hashcodes2[-1]
-    # test each S2 hashcode for presence in S1
-    for ndx, hashcode in enumerate(hashcodes2):
-      if hashcodes1 is None or hashcode > last_hashcode1:
-        # past the end of S1 hashcode window
-        # fetch new window starting at current hashcode
-        hashcodes1 = list(
-            S1.hashcodes(start_hashcode=hashcode, length=window_size)
-        )
-        if not hashcodes1:
-          # no more S1 hashcodes, cease scan
-          # keep the unscanned hashcodes (including current)
-          # to yield in the post-scan loop, where we don't bother consulting S1
-          hashcodes2 = hashcodes2[ndx:]
-          break
-        # note highest hashcode as top of window
-        last_hashcode1 = hashcodes1[-1]
-        # convert to set for fast membership lookup
-        hashcodes1 = set(hashcodes1)
-      if hashcode not in hashcodes1:
-        yield hashcode
+  hashcodes2 = S2.hashcode_array(length=window_size)
+  while hashcodes2:
+    # the S1 window starting at the first S2 hashcode
+    hashcodes1 = S1.hashcode_array(
+        start_hashcode=hashcodes2[0], length=window_size
+    )
     if not hashcodes1:
+      # no more S1 hashcodes, everything else in S2 is missing
       break
-    # fetch next batch of hashcodes from S2
-    hashcodes2 = list(
-        S2.hashcodes(
-            start_hashcode=last_hashcode2, length=window_size, after=True
-        )
-    )
+    # compare the S2 hashcodes covered by the S1 window
+    covered = hashcodes2.bisect_right(hashcodes1[-1])
+    yield from hashcodes2[:covered] - hashcodes1
+    if covered < len(hashcodes2):
+      hashcodes2 = hashcodes2[covered:]
+    else:
+      hashcodes2 = S2.hashcode_array(
+          start_hashcode=hashcodes2[-1], length=window_size, after=True
+      )
   # no more hashcodes in S1 - gather everything else in S2
-  while True:
-    hashcode = None
-    for hashcode in hashcodes2:
-      yield hashcode
-    if hashcode is None:
-      break
-    # fetch next bunch of hashcodes
-    hashcodes2 = S2.hashcodes(
-        start_hashcode=hashcode, length=window_size, after=True
+  while hashcodes2:
+    yield from hashcodes2
+    hashcodes2 = S2.hashcode_array(
+        start_hashcode=hashcodes2[-1], length=window_size, after=True
     )
 
 # pylint: disable=too-many-branches
@@ -111,7 +98,7 @@ def missing_hashcodes(S1, S2, window_size=None):
 @require(lambda S1, S2: S1.hashclass is S2.hashclass)
 def missing_hashcodes_by_checksum(S1, S2, window_size=None):
   ''' Scan Stores `S1` and `S2` and yield hashcodes in `S2` but not in `S1`.
-      This relies on both Stores supporting the .hashcodes and
+      This relies on both Stores supporting the .hashcode_array and
       .hash_of_hashcodes methods; dumb unordered Stores do not.
 
       Parameters:
@@ -153,58 +140,111 @@ def missing_hashcodes_by_checksum(S1, S2, window_size=None):
       window_size //= 2
       continue
     # fetch the actual hashcodes
-    hashcodes2 = list(
-        S2.hashcodes(
-            start_hashcode=start_hashcode, length=window_size, after=after
-        )
+    hashcodes2 = S2.hashcode_array(
+        start_hashcode=start_hashcode, length=window_size, after=after
     )
     if not hashcodes2:
       # maybe some entires removed? - anyway, no more S2 so return
       return
-    hashcodes1 = set(
-        S1.hashcodes(
-            start_hashcode=start_hashcode, length=window_size, after=after
-        )
-    )
-    if not hashcodes1:
-      # maybe some entries removed?
-      # anyway, no more S1 so return all following S2 hashcodes
-      break
-    # in case things changed since earlier checksum
-    h_final1 = max(hashcodes1)
-    for ndx, hashcode in enumerate(hashcodes2):
-      # note that if we fetch more hashcodes then we may get am empty window
-      # just keep running with that if so - do not check h_final1
-      if hashcodes1 and h_final1 < hashcode:
-        # hashcodes1 does not cover this point in hashcodes2, fetch more
-        hashcodes1 = set(
-            S1.hashcodes(
-                start_hashcode=hashcode, length=len(hashcodes2) - ndx
-            )
-        )
-        if hashcodes1:
-          h_final1 = max(hashcodes1)
-        else:
-          h_final1 = None
-      if hashcode not in hashcodes1:
-        yield hashcode
+    # compare against the S1 hashcodes covering hashcodes2,
+    # fetching more if the S1 window ends first
+    pending = hashcodes2
+    while pending:
+      hashcodes1 = S1.hashcode_array(
+          start_hashcode=pending[0], length=len(pending)
+      )
+      if not hashcodes1:
+        # maybe some entries removed?
+        # anyway, no more S1 so all following S2 hashcodes are missing
+        yield from pending
+        break
+      covered = pending.bisect_right(hashcodes1[-1])
+      yield from pending[:covered] - hashcodes1
+      pending = pending[covered:]
     # resume scan from here
     start_hashcode = hashcodes2[-1]
     after = True
+    if not hashcodes1:
+      break
   # collect all following S2 hashcodes
   while True:
-    hashcodes2 = list(
-        S2.hashcodes(
-            start_hashcode=start_hashcode, length=window_size, after=after
-        )
+    hashcodes2 = S2.hashcode_array(
+        start_hashcode=start_hashcode, length=window_size, after=after
     )
     if not hashcodes2:
       break
-    for hashcode in hashcodes2:
-      yield hashcode
+    yield from hashcodes2
     start_hashcode = hashcodes2[-1]
     after = True
 
+def _walk_range_digests(S):
+  ''' Return a `range_digests(level,indices)` function for a walk over `S`:
+      its own if it maintains a `RangeTree`,
+      otherwise that of a tree built once now.
+  '''
+  if S.has_range_tree:
+    return S.range_digests
+  return S.range_tree().digests
+
+@require(lambda S1, S2: S1.hashclass is S2.hashclass)
+def missing_hashcodes_by_range(S1, S2):
+  ''' Scan Stores `S1` and `S2` and yield hashcodes in `S2` but not in `S1`.
+      This relies on both Stores supporting the `.range_digests`
+      and `.hashcode_array` methods.
+
+      The `RangeTree` digests of both Stores are compared a level
+      at a time from the root, descending only into the nodes which differ,
+      one `.range_digests` call per Store per level.
+      The root digest is the `.set_digest()`,
+      so Stores with the same hashcodes are dismissed with one call each.
+      Then the hashcodes of each differing leaf range are fetched
+      from both Stores and compared.
+      For Stores which mostly agree this costs in proportion
+      to the differences, not the Store sizes.
+      A Store without `.has_range_tree` has its tree built once for the walk,
+      costing a full enumeration of its hashcodes.
+  '''
+  range_digests1 = _walk_range_digests(S1)
+  range_digests2 = _walk_range_digests(S2)
+  # (index,count1,count2) for the differing nodes with S2 hashcodes
+  differing = [(0, None, None)]
+  for level in range(DEPTH + 1):
+    if level == 0:
+      indices = [0]
+    else:
+      # the children of the differing nodes
+      indices = [
+          index * FANOUT + child for index, _, _ in differing
+          for child in range(FANOUT)
+      ]
+    digests1 = range_digests1(level, indices)
+    digests2 = range_digests2(level, indices)
+    differing = [
+        (index, digest1[0], digest2[0])
+        for index, digest1, digest2 in zip(indices, digests1, digests2)
+        if digest1 != digest2 and digest2[0] > 0
+    ]
+    if not differing:
+      return
+  tree = RangeTree(S2.hashclass)
+  nleaves = FANOUT**DEPTH
+  for leaf, count1, count2 in differing:
+    start_hashcode = tree.start_hashcode(DEPTH, leaf)
+    # the leaf's hashcodes are the next count hashcodes from its start
+    hashcodes2 = S2.hashcode_array(
+        start_hashcode=start_hashcode, length=count2
+    )
+    if leaf + 1 < nleaves:
+      # in case the Store changed since its digests were taken
+      hashcodes2 = hashcodes2[:hashcodes2.bisect_left(
+          tree.start_hashcode(DEPTH, leaf + 1)
+      )]
+    if count1:
+      hashcodes2 = hashcodes2 - S1.hashcode_array(
+          start_hashcode=start_hashcode, length=count1
+      )
+    yield from hashcodes2
+
 if __name__ == '__main__':
   from .pushpull_tests import selftest
   selftest(sys.argv)
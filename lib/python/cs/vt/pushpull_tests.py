@@ -8,7 +8,9 @@ from random import randint
 from cs.randutils import rand0, make_randblock
 from cs.x import X
 from .hash import HashUtilDict
-from .pushpull import missing_hashcodes, missing_hashcodes_by_checksum
+from .pushpull import (
+    missing_hashcodes, missing_hashcodes_by_checksum, missing_hashcodes_by_range
+)
 from cs.x import X
 import cs.x
 cs.x.X_via_tty = True
@@ -103,6 +105,17 @@ class TestMissingHashCodes_Missing_hashcodes_checksum(_TestMissingHashCodes,
     self.miss_generator = missing_hashcodes_by_checksum
     unittest.TestCase.__init__(self, *a, **kw)
 
+class TestMissingHashCodes_Missing_hashcodes_range(_TestMissingHashCodes,
+                                                   unittest.TestCase):
+  ''' Test range digest based missing hashcodes function.
+  '''
+
+  def __init__(self, *a, **kw):
+    self.miss_generator = (
+        lambda S1, S2, window_size=None: missing_hashcodes_by_range(S1, S2)
+    )
+    unittest.TestCase.__init__(self, *a, **kw)
+
 if __name__ == '__main__':
   from cs.debug import selftest
   selftest('__main__')
@@ -0,0 +1,176 @@
+#!/usr/bin/env python3
+#
+# Range digests over the hashcode space of a Store.
+#   - Cameron Simpson <cs@cskk.id.au>
+#
+
+''' A `RangeTree` is a fixed shape tree of digests over the sorted
+    hashcode space of a Store, for comparing Stores cheaply.
+
+    The hashcodes are divided by their leading `LEVEL_BITS * DEPTH` bits
+    into `FANOUT ** DEPTH` leaf ranges.
+    Each node at `level` covers the hashcodes whose leading
+    `LEVEL_BITS * level` bits are its `index`, and its digest
+    is the pair `(count,sum)`: the number of hashcodes in the range
+    and the sum modulo `2**64` of their trailing 8 bytes.
+    Because the digest is a sum, adding a hashcode updates
+    one node per level, and a node's digest is always the
+    combination of its children's.
+
+    Two Stores with the same digest for a node almost certainly
+    have the same hashcodes in its range, so comparing Stores
+    need only descend into the nodes whose digests differ
+    and list the hashcodes of the differing leaves:
+    see `cs.vt.pushpull.missing_hashcodes_by_range`.
+    The root digest, the count and sum of all the hashcodes,
+    serves as a digest of the whole Store for a quick equality test.
+    This is not proof against deliberately constructed hashcode sets,
+    only against accident.
+'''
+
+from array import array
+from struct import Struct
+import sys
+from threading import Lock
+
+# bits of hashcode prefix per tree level
+LEVEL_BITS = 4
+# children per node
+FANOUT = 1 << LEVEL_BITS
+# the leaf level; the root is level 0
+DEPTH = 4
+
+SUM_MASK = (1 << 64) - 1
+
+# the saved tree: magic, LEVEL_BITS, DEPTH, hashcode count,
+# then the leaf counts and sums as big endian 64 bit values
+RANGETREE_MAGIC = b'VTRT'
+RANGETREE_HEADER = Struct('>4sBBQ')
+
+class RangeTree:
+  ''' Range digests over the hashcode space for a hash class.
+      See the module documentation.
+  '''
+
+  def __init__(self, hashclass):
+    self.hashclass = hashclass
+    # per level arrays of node counts and sums
+    self.counts = [
+        array('Q', bytes(8 << (LEVEL_BITS * level)))
+        for level in range(DEPTH + 1)
+    ]
+    self.sums = [
+        array('Q', bytes(8 << (LEVEL_BITS * level)))
+        for level in range(DEPTH + 1)
+    ]
+    self._lock = Lock()
+
+  def __repr__(self):
+    return "%s(%s,%d)" % (
+        type(self).__name__, self.hashclass.HASHNAME, len(self)
+    )
+
+  def __len__(self):
+    return self.counts[0][0]
+
+  @classmethod
+  def from_hashcodes(cls, hashclass, hashcodes):
+    ''' Return a new `RangeTree` of the distinct `hashcodes`.
+    '''
+    tree = cls(hashclass)
+    for hashcode in hashcodes:
+      tree.add(hashcode)
+    return tree
+
+  @staticmethod
+  def leaf_index(hashcode):
+    ''' The index of the leaf range containing `hashcode`.
+    '''
+    return int.from_bytes(hashcode[:(LEVEL_BITS * DEPTH + 7) // 8],
+                          'big') >> ((8 - LEVEL_BITS * DEPTH) % 8)
+
+  def add(self, hashcode):
+    ''' Add `hashcode`, which should not already be present.
+    '''
+    leaf = self.leaf_index(hashcode)
+    value = int.from_bytes(hashcode[-8:], 'big')
+    counts = self.counts
+    sums = self.sums
+    with self._lock:
+      for level in range(DEPTH, -1, -1):
+        index = leaf >> (LEVEL_BITS * (DEPTH - level))
+        counts[level][index] += 1
+        sums[level][index] = (sums[level][index] + value) & SUM_MASK
+
+  def digests(self, level, indices):
+    ''' Return a list of the `(count,sum)` digests of the nodes
+        at `level` with the `indices`.
+    '''
+    if not 0 <= level <= DEPTH:
+      raise ValueError("level should be in [0,%d]: %r" % (DEPTH, level))
+    counts = self.counts[level]
+    sums = self.sums[level]
+    with self._lock:
+      return [(counts[index], sums[index]) for index in indices]
+
+  def start_hashcode(self, level, index):
+    ''' The lowest possible hashcode in the range of node `index` at `level`,
+        which is not necessarily present.
+    '''
+    hashlen = self.hashclass.HASHLEN
+    prefix = index << (8 * hashlen - LEVEL_BITS * level)
+    return self.hashclass(prefix.to_bytes(hashlen, 'big'))
+
+  def save(self, f):
+    ''' Write the tree to the binary file `f`.
+    '''
+    with self._lock:
+      f.write(
+          RANGETREE_HEADER.pack(RANGETREE_MAGIC, LEVEL_BITS, DEPTH, len(self))
+      )
+      for values in self.counts[DEPTH], self.sums[DEPTH]:
+        values = array('Q', values)
+        if sys.byteorder == 'little':
+          values.byteswap()
+        f.write(values.tobytes())
+
+  @classmethod
+  def load(cls, hashclass, f):
+    ''' Read a tree saved by `save` from the binary file `f`.
+    '''
+    header = f.read(RANGETREE_HEADER.size)
+    if len(header) < RANGETREE_HEADER.size:
+      raise ValueError("short header")
+    magic, level_bits, depth, count = RANGETREE_HEADER.unpack(header)
+    if (magic, level_bits, depth) != (RANGETREE_MAGIC, LEVEL_BITS, DEPTH):
+      raise ValueError(
+          "unsupported tree: magic=%r level_bits=%d depth=%d" %
+          (magic, level_bits, depth)
+      )
+    tree = cls(hashclass)
+    nleaves = 1 << (LEVEL_BITS * DEPTH)
+    for leaves in tree.counts[DEPTH], tree.sums[DEPTH]:
+      data = f.read(8 * nleaves)
+      if len(data) < 8 * nleaves:
+        raise ValueError("short leaf data")
+      leaves.frombytes(data)
+      del leaves[:nleaves]
+      if sys.byteorder == 'little':
+        leaves.byteswap()
+    # compute the upper levels from the leaves
+    for level in range(DEPTH - 1, -1, -1):
+      below_counts = tree.counts[level + 1]
+      below_sums = tree.sums[level + 1]
+      counts = tree.counts[level]
+      sums = tree.sums[level]
+      for index in range(len(counts)):
+        first = index * FANOUT
+        counts[index] = sum(below_counts[first:first + FANOUT])
+        sums[index] = sum(below_sums[first:first + FANOUT]) & SUM_MASK
+    if len(tree) != count:
+      raise ValueError("leaf counts sum to %d, expected %d" % (len(tree), count))
+    return tree
+
+if __name__ == '__main__':
+  from .rangetree_tests import selftest
+  selftest(sys.argv)
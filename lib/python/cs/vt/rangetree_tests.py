@@ -0,0 +1,188 @@
+#!/usr/bin/python
+#
+# RangeTree tests.
+#       - Cameron Simpson <cs@cskk.id.au>
+#
+
+''' RangeTree tests.
+'''
+
+from io import BytesIO
+import os
+from os.path import exists as existspath
+import random
+import sys
+from tempfile import TemporaryDirectory
+import unittest
+from .hash import Hash_SHA1, HashUtilDict
+from .pushpull import missing_hashcodes, missing_hashcodes_by_range
+from .rangetree import RangeTree, DEPTH, FANOUT
+from .store import DataDirStore, MappingStore, StoreError
+from .stream import StreamStore
+
+class TestRangeTree(unittest.TestCase):
+  ''' Tests for `RangeTree`.
+  '''
+
+  def test00digests(self):
+    ''' Node digests combine their children's and survive a save and load.
+    '''
+    hashcodes = [Hash_SHA1.from_chunk(b'%d' % (n,)) for n in range(5000)]
+    tree = RangeTree.from_hashcodes(Hash_SHA1, hashcodes)
+    self.assertEqual(len(tree), len(hashcodes))
+    for level in range(DEPTH):
+      for index in sorted({0, FANOUT**level // 2, FANOUT**level - 1}):
+        count, total = tree.digests(level, [index])[0]
+        children = tree.digests(
+            level + 1, range(index * FANOUT, (index + 1) * FANOUT)
+        )
+        self.assertEqual(count, sum(c for c, _ in children))
+        self.assertEqual(total, sum(t for _, t in children) % (1 << 64))
+    # each hashcode falls in the range of its leaf
+    for hashcode in hashcodes[:100]:
+      leaf = RangeTree.leaf_index(hashcode)
+      self.assertLessEqual(tree.start_hashcode(DEPTH, leaf), hashcode)
+      if leaf + 1 < FANOUT**DEPTH:
+        self.assertLess(hashcode, tree.start_hashcode(DEPTH, leaf + 1))
+    f = BytesIO()
+    tree.save(f)
+    f.seek(0)
+    tree2 = RangeTree.load(Hash_SHA1, f)
+    for level in range(DEPTH + 1):
+      self.assertEqual(tree2.counts[level], tree.counts[level])
+      self.assertEqual(tree2.sums[level], tree.sums[level])
+    self.assertRaises(ValueError, RangeTree.load, Hash_SHA1, BytesIO(b'VTRT'))
+
+  def test01missing(self):
+    ''' `missing_hashcodes_by_range` matches set difference.
+    '''
+    S1 = HashUtilDict()
+    S2 = HashUtilDict()
+    for n in range(3000):
+      data = b'%d' % (n,)
+      choice = random.randint(0, 9)
+      if choice < 9:
+        S1.add(data)
+      if choice > 0:
+        S2.add(data)
+    self.assertEqual(
+        set(missing_hashcodes_by_range(S1, S2)),
+        set(S2.keys()) - set(S1.keys())
+    )
+    self.assertEqual(
+        set(missing_hashcodes_by_range(S2, S1)),
+        set(S1.keys()) - set(S2.keys())
+    )
+    self.assertEqual(list(missing_hashcodes_by_range(S1, S1)), [])
+
+  def test02datadir(self):
+    ''' A `DataDir` maintains its tree and saves it across opens.
+    '''
+    with TemporaryDirectory() as tmpdirpath:
+      S = DataDirStore('test02datadir', tmpdirpath, hashclass=Hash_SHA1)
+      with S:
+        for n in range(200):
+          S.add(b'%d' % (n,))
+          # adding again does not count twice
+          S.add(b'%d' % (n,))
+        path = S.mapping.range_tree_path
+      # the tree is complete once the index queue is drained at close
+      self.assertTrue(existspath(path))
+      S = DataDirStore('test02datadir', tmpdirpath, hashclass=Hash_SHA1)
+      with S:
+        self.assertFalse(existspath(path))
+        tree = S.range_tree()
+        self.assertEqual(len(tree), 200)
+        expected = RangeTree.from_hashcodes(Hash_SHA1, S.hashcodes_from())
+        self.assertEqual(tree.counts, expected.counts)
+        self.assertEqual(tree.sums, expected.sums)
+        S.add(b'new')
+      S = DataDirStore('test02datadir', tmpdirpath, hashclass=Hash_SHA1)
+      with S:
+        self.assertEqual(len(S.range_tree()), 201)
+
+  def test03set_digest(self):
+    ''' A `MappingStore` maintains its set digest as data are added.
+    '''
+    S1 = MappingStore('S1', {}, hashclass=Hash_SHA1)
+    S2 = MappingStore('S2', {}, hashclass=Hash_SHA1)
+    self.assertFalse(S1.has_range_tree)
+    with S1:
+      with S2:
+        self.assertTrue(S1.has_range_tree)
+        for n in range(100):
+          S1.add(b'%d' % (n,))
+        self.assertEqual(S1.set_digest()[0], 100)
+        for n in range(99, -1, -1):
+          S2.add(b'%d' % (n,))
+        self.assertEqual(S1.set_digest(), S2.set_digest())
+        self.assertEqual(list(missing_hashcodes(S1, S2)), [])
+        # adding again does not count twice
+        S2.add(b'new')
+        S2.add(b'new')
+        S1.add_hashed(b'0', Hash_SHA1.from_chunk(b'0'))
+        self.assertEqual(S2.set_digest()[0], 101)
+        self.assertNotEqual(S1.set_digest(), S2.set_digest())
+        self.assertEqual(
+            S2.range_tree().sums,
+            RangeTree.from_hashcodes(Hash_SHA1, S2.hashcodes_from()).sums
+        )
+        self.assertEqual(
+            list(missing_hashcodes(S1, S2)), [Hash_SHA1.from_chunk(b'new')]
+        )
+    # the tree is rebuilt from the mapping when the Store is reopened
+    with S2:
+      self.assertEqual(S2.set_digest()[0], 101)
+
+  def test04stream(self):
+    ''' A `StreamStore` compares range digests if both Stores maintain
+        a `RangeTree`, otherwise it falls back to comparing checksums.
+    '''
+    for has_range_tree in False, True:
+      with self.subTest(has_range_tree=has_range_tree):
+        # a MappingStore over a HashUtilDict uses its unmaintained tree
+        local_store = MappingStore(
+            'local',
+            {} if has_range_tree else HashUtilDict(Hash_SHA1),
+            hashclass=Hash_SHA1
+        )
+        other = MappingStore('other', {}, hashclass=Hash_SHA1)
+        upstream_rd, upstream_wr = os.pipe()
+        downstream_rd, downstream_wr = os.pipe()
+        remote_S = StreamStore(
+            'remote_S',
+            upstream_rd,
+            downstream_wr,
+            local_store=local_store,
+            hashclass=Hash_SHA1
+        )
+        S = StreamStore(
+            'S', downstream_rd, upstream_wr, hashclass=Hash_SHA1
+        )
+        with local_store, remote_S, S, other:
+          self.assertEqual(local_store.has_range_tree, has_range_tree)
+          self.assertTrue(other.has_range_tree)
+          for n in range(1000):
+            local_store.add(b'%d' % (n,))
+            other.add(b'%d' % (n,))
+          self.assertEqual(S.has_range_tree, has_range_tree)
+          if has_range_tree:
+            self.assertEqual(S.set_digest(), local_store.set_digest())
+          else:
+            self.assertIsNone(S.set_digest())
+            # the remote answers that it has no tree, it does not fail
+            with self.assertRaisesRegex(StoreError, 'no RangeTree'):
+              S.range_digests(0, [0])
+          self.assertEqual(list(S.hashcodes_missing(other)), [])
+          other.add(b'new')
+          self.assertEqual(
+              list(S.hashcodes_missing(other)), [Hash_SHA1.from_chunk(b'new')]
+          )
+
+def selftest(argv):
+  ''' Run the unit tests.
+  '''
+  unittest.main(__name__, None, argv)
+
+if __name__ == '__main__':
+  selftest(sys.argv)
@@ -7,18 +7,1404 @@
 
 ''' The byte scanning function scanbuf.
     In C by choice, in Python if not.
+
+    The C version selects a vectorised kernel for the running CPU
+    at import time; `scan_kernel` names the chosen kernel
+    and `scan_kernels` names all the kernels available.
+    Large buffers are split across several threads with the GIL released.
+
+    `scanbuf` accepts any contiguous buffer (`bytes`, `bytearray`,
+    `memoryview`, `mmap`) without copying it.
+    `scanbuf_array` returns the offsets as a compact `array('Q')`
+    or writes them into a caller supplied buffer.
+    `scanbuf_v` scans a sequence of buffers as one stream
+    in a single call, returning their offsets in one `array('Q')`.
+
+    `Scanner` is a stateful scanner implementing the block boundary
+    rules of `blocked_chunks_of`: fed successive chunks and parser
+    offsets it returns the positions where blocks end.
+    Its rolling hash is chosen by name from `ROLLING_HASHES`:
+    the original 4 byte `vt28` hash, or the 48 and 64 byte window
+    `gear`, `buzhash` and `rabin` hashes which are far less
+    sensitive to short repeated patterns in the data.
+    A `Scanner` with a `hashname` from `SCAN_DIGESTS` also computes
+    the SHA-1, SHA-256 or BLAKE3 digest of each block in the same pass:
+    see `Scanner.scan_digests`.
+    `Scanner.scan_file` scans a range of a file descriptor,
+    memory mapping the file instead of reading it into Python objects.
+    A `Scanner` with a `min_run` cuts out long runs of one repeated octet
+    as blocks of their own, which `blockify` emits as `RLEBlock`s:
+    see `Scanner.runs`.
+
+    `blake3` is a `hashlib` style BLAKE3 hash object for `Hash_BLAKE3`:
+    large updates hash whole 1KiB chunks in the lanes of SIMD vectors,
+    named by `blake3_impl`, and the subtrees of the BLAKE3 hash tree
+    in parallel on several threads with the GIL released.
+    `new_digest` returns a hash object for any of `SCAN_DIGESTS`.
+
+    `digest_chunks` computes the SHA-1, SHA-256 or BLAKE3 digests of a batch
+    of separate buffers in parallel with the GIL released,
+    for `HashCode.from_chunks`.
+    `digests_sort`, `digests_bisect`, `digests_union`,
+    `digests_difference` and `digests_intersection` work on sorted
+    arrays of digests packed end to end in a `bytes`,
+    for `cs.vt.hash.HashCodeArray`.
+    `data_records` prepares the `.vtd` `DataRecord`s for a batch of
+    blocks, compressing them in parallel with the GIL released.
+    `scan_vtd_file` walks the `DataRecord` framing of a `.vtd` file
+    in place, optionally hashing the records' data in parallel,
+    and `scan_vtd_records` walks it in a stream for `scan_vtd`.
+
+    `scan_prefixes` finds the lines of a buffer which start with
+    any of a set of prefixes, for `cs.vt.parsers.scan_text`.
+    `scan_boxes` and `scan_mp3_frames` walk ISO14496 box headers
+    and MP3 frame headers for `cs.vt.parsers.scan_mp4` and `scan_mp3`.
+
+    If the C version cannot be built, `scanbuf`, `scanbuf_array`
+    and `scanbuf_v` are vectorised with NumPy if it is available,
+    as is the `vt28` rolling hash of the pure Python `Scanner`
+    for classic chunking; otherwise they are pure Python.
 '''
 
+from array import array
+from bisect import bisect_left, bisect_right
+import hashlib
+from heapq import heappush, heappop
+
 from distutils.core import setup, Extension
+import os
 from os import chdir, getcwd
 from os.path import dirname, join as joinpath
+import re
 import sys
 ##from time import sleep
+from zlib import compress, decompress
+try:
+  import numpy
+except ImportError:
+  numpy = None
+from cs.binary import BSUInt
 from cs.logutils import error, warning
 from cs.x import X
 
+# chunking modes for block boundaries
+CHUNKING_CLASSIC = 'classic'  # every rolling hash hit is a candidate edge
+CHUNKING_NORMALISED = 'normalised'  # FastCDC style normalised chunking
+CHUNKING_MODES = CHUNKING_CLASSIC, CHUNKING_NORMALISED
+DEFAULT_CHUNKING = CHUNKING_CLASSIC
+
+# the default target block size for normalised chunking
+NORMALISED_TARGET = 4096
+
+# the default divisor for classic chunking:
+# the rolling hash indicates an edge where hash % divisor == divisor - 2
+CLASSIC_DIVISOR = 4093
+MAX_DIVISOR = (1 << 24) + 1
+
+# Scanner.scan_file scans files in pieces of this size
+SCAN_FILE_CHUNK = 1024 * 1024
+
+# the block digests which a Scanner can compute
+SCAN_DIGESTS = 'sha1', 'sha256', 'blake3'
+
+# BLAKE3 constants
+BLAKE3_IV = (
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+    0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+)
+BLAKE3_PERMUTATION = (2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8)
+BLAKE3_BLOCK_LEN = 64
+BLAKE3_CHUNK_LEN = 1024
+BLAKE3_CHUNK_START = 1
+BLAKE3_CHUNK_END = 2
+BLAKE3_PARENT = 4
+BLAKE3_ROOT = 8
+
+def _blake3_words(data):
+  ''' The little endian 32 bit words of `data`.
+  '''
+  return [int.from_bytes(data[i:i + 4], 'little') for i in range(0, len(data), 4)]
+
+def _blake3_bytes(words):
+  ''' The little endian bytes of the 32 bit `words`.
+  '''
+  return b''.join(w.to_bytes(4, 'little') for w in words)
+
+def _blake3_compress(cv, block, block_len, counter, flags):
+  ''' The BLAKE3 compression function.
+      Return the 16 word output for the chaining value `cv`
+      and the `block`, padded with zeroes to 64 bytes;
+      the leading 8 words are the next chaining value.
+  '''
+  m = _blake3_words(block.ljust(BLAKE3_BLOCK_LEN, b'\0'))
+  v = list(cv) + list(BLAKE3_IV[:4]) + [
+      counter & 0xffffffff, counter >> 32, block_len, flags
+  ]
+
+  def g(a, b, c, d, x, y):
+    v[a] = (v[a] + v[b] + x) & 0xffffffff
+    v[d] ^= v[a]
+    v[d] = ((v[d] >> 16) | (v[d] << 16)) & 0xffffffff
+    v[c] = (v[c] + v[d]) & 0xffffffff
+    v[b] ^= v[c]
+    v[b] = ((v[b] >> 12) | (v[b] << 20)) & 0xffffffff
+    v[a] = (v[a] + v[b] + y) & 0xffffffff
+    v[d] ^= v[a]
+    v[d] = ((v[d] >> 8) | (v[d] << 24)) & 0xffffffff
+    v[c] = (v[c] + v[d]) & 0xffffffff
+    v[b] ^= v[c]
+    v[b] = ((v[b] >> 7) | (v[b] << 25)) & 0xffffffff
+
+  for r in range(7):
+    g(0, 4, 8, 12, m[0], m[1])
+    g(1, 5, 9, 13, m[2], m[3])
+    g(2, 6, 10, 14, m[4], m[5])
+    g(3, 7, 11, 15, m[6], m[7])
+    g(0, 5, 10, 15, m[8], m[9])
+    g(1, 6, 11, 12, m[10], m[11])
+    g(2, 7, 8, 13, m[12], m[13])
+    g(3, 4, 9, 14, m[14], m[15])
+    if r < 6:
+      m = [m[i] for i in BLAKE3_PERMUTATION]
+  return [v[i] ^ v[i + 8] for i in range(8)] + [
+      v[i + 8] ^ cv[i] for i in range(8)
+  ]
+
+class py_blake3:
+  ''' Pure Python BLAKE3, used if there's no C version.
+      This is a `hashlib` style hash object with a 32 byte digest.
+      `threads` is ignored.
+  '''
+
+  name = 'blake3'
+  digest_size = 32
+  block_size = BLAKE3_BLOCK_LEN
+
+  def __init__(self, data=b'', *, threads=None):
+    # the chaining values of the completed subtrees
+    self._cv_stack = []
+    # the number of completed chunks
+    self._chunk_counter = 0
+    # the data of the current chunk, at most a whole chunk
+    self._chunk = b''
+    if data:
+      self.update(data)
+
+  def copy(self):
+    ''' Return a copy of the hash object.
+    '''
+    other = py_blake3()
+    other._cv_stack = list(self._cv_stack)
+    other._chunk_counter = self._chunk_counter
+    other._chunk = self._chunk
+    return other
+
+  def _chunk_output(self):
+    ''' Return `(cv,block,counter,flags)` for the last compression
+        of the current chunk.
+    '''
+    chunk = self._chunk
+    counter = self._chunk_counter
+    cv = BLAKE3_IV
+    nblocks = max(1, (len(chunk) + BLAKE3_BLOCK_LEN - 1) // BLAKE3_BLOCK_LEN)
+    flags = BLAKE3_CHUNK_START
+    for i in range(nblocks - 1):
+      cv = _blake3_compress(
+          cv, chunk[i * BLAKE3_BLOCK_LEN:(i + 1) * BLAKE3_BLOCK_LEN],
+          BLAKE3_BLOCK_LEN, counter, flags
+      )[:8]
+      flags = 0
+    block = chunk[(nblocks - 1) * BLAKE3_BLOCK_LEN:]
+    return cv, block, counter, flags | BLAKE3_CHUNK_END
+
+  def update(self, data):
+    ''' Add the bytes-like `data` to the hash.
+    '''
+    data = bytes(data)
+    while data:
+      if len(self._chunk) == BLAKE3_CHUNK_LEN:
+        # the current chunk is full and more data follows: complete it
+        cv, block, counter, flags = self._chunk_output()
+        cv = _blake3_compress(cv, block, len(block), counter, flags)[:8]
+        self._chunk_counter += 1
+        # merge the completed subtrees, one per trailing 0 bit
+        total = self._chunk_counter
+        while total & 1 == 0:
+          cv = _blake3_compress(
+              BLAKE3_IV, _blake3_bytes(self._cv_stack.pop() + cv),
+              BLAKE3_BLOCK_LEN, 0, BLAKE3_PARENT
+          )[:8]
+          total >>= 1
+        self._cv_stack.append(cv)
+        self._chunk = b''
+      take = BLAKE3_CHUNK_LEN - len(self._chunk)
+      self._chunk += data[:take]
+      data = data[take:]
+
+  def digest(self):
+    ''' Return the digest of the data so far as `bytes`.
+    '''
+    cv, block, counter, flags = self._chunk_output()
+    for left in reversed(self._cv_stack):
+      right = _blake3_compress(cv, block, len(block), counter, flags)[:8]
+      cv, block, counter, flags = (
+          BLAKE3_IV, _blake3_bytes(left + right), 0, BLAKE3_PARENT
+      )
+    return _blake3_bytes(
+        _blake3_compress(cv, block, len(block), counter,
+                         flags | BLAKE3_ROOT)[:8]
+    )
+
+  def hexdigest(self):
+    ''' Return the digest of the data so far as hexadecimal text.
+    '''
+    return self.digest().hex()
+
+def new_digest(hashname, data=b''):
+  ''' Return a new `hashlib` style hash object for the hash function
+      `hashname`, which may also be `'blake3'`, primed with `data`.
+  '''
+  if hashname == 'blake3':
+    return blake3(data)
+  return hashlib.new(hashname, data)
+
+def py_scanbuf(hash_value, chunk):
+  ''' Pure Python scanbuf, used if there's no C version.
+      This is also the reference implementation for the C kernels.
+  '''
+  offsets = []
+  for offset, b in enumerate(memoryview(chunk).cast('B')):
+    hash_value = (
+        ((hash_value & 0x001fffff) << 7)
+        | ((b & 0x7f) ^ ((b & 0x80) >> 7))
+    )
+    if hash_value % 4093 == 4091:
+      offsets.append(offset)
+  return hash_value, offsets
+
+def py_scanbuf_array(hash_value, chunk, out=None):
+  ''' Pure Python scanbuf_array, used if there's no C version.
+      Return `(hash_value,array('Q'))` if `out` is `None`,
+      otherwise fill the writable buffer `out` with as many
+      native unsigned 64 bit offsets as fit
+      and return `(hash_value,count)` where `count` is the
+      total number of offsets found.
+  '''
+  hash_value, offsets = py_scanbuf(hash_value, chunk)
+  if out is None:
+    return hash_value, array('Q', offsets)
+  outB = memoryview(out).cast('B')
+  outQ = outB[:len(outB) // 8 * 8].cast('Q')
+  ncopy = min(len(offsets), len(outQ))
+  outQ[:ncopy] = array('Q', offsets[:ncopy])
+  return hash_value, len(offsets)
+
+def py_scanbuf_v(hash_value, buffers, per_buffer=False, scan=py_scanbuf):
+  ''' Pure Python scanbuf_v, used if there's no C version.
+      Scan the `buffers` in order as successive parts of one stream
+      with `scan`, default `py_scanbuf`.
+      Return `(hash_value,offsets,ends)` where `offsets` is an `array('Q')`.
+      If `per_buffer` is false the offsets are relative to the start
+      of the first buffer and `ends` is `None`;
+      otherwise they are relative to the start of each buffer
+      and `ends` is an `array('Q')` where `ends[i]` is the index
+      in `offsets` after the last offset in `buffers[i]`.
+  '''
+  offsets = array('Q')
+  ends = array('Q') if per_buffer else None
+  base = 0
+  for buf in buffers:
+    hash_value, buf_offsets = scan(hash_value, buf)
+    if per_buffer:
+      offsets.extend(buf_offsets)
+      ends.append(len(offsets))
+    else:
+      offsets.extend(base + offset for offset in buf_offsets)
+      base += memoryview(buf).nbytes
+  return hash_value, offsets, ends
+
+# NumPy vectorised scanbuf, used if there's no C version
+# the vt28 hash at each position is computed from the last 4 bytes
+# in pieces of this size, bounding the size of the working arrays
+NP_SCAN_CHUNK = 1024 * 1024
+
+def np_vt28_hashes(hash_value, chunk):
+  ''' Return a `numpy` `uint32` array of the vt28 rolling hash
+      after each byte of `chunk`, starting from `hash_value`.
+
+      Each hash is 7 bits from each of the last 4 bytes,
+      so it is computed for every position at once
+      from shifted views of the 7 bit byte values,
+      with the leading 3 bytes' values taken from `hash_value`.
+  '''
+  b = numpy.frombuffer(memoryview(chunk).cast('B'), dtype=numpy.uint8)
+  n = len(b)
+  v = numpy.empty(n + 3, dtype=numpy.uint32)
+  v[0] = (hash_value >> 14) & 0x7f
+  v[1] = (hash_value >> 7) & 0x7f
+  v[2] = hash_value & 0x7f
+  v[3:] = (b & 0x7f) ^ (b >> 7)
+  return (v[:n] << 21) | (v[1:n + 1] << 14) | (v[2:n + 2] << 7) | v[3:]
+
+def np_scanbuf(hash_value, chunk):
+  ''' NumPy scanbuf, used if there's no C version.
+      This produces the same results as `py_scanbuf`.
+  '''
+  mv = memoryview(chunk).cast('B')
+  offsets = []
+  for base in range(0, len(mv), NP_SCAN_CHUNK):
+    hashes = np_vt28_hashes(hash_value, mv[base:base + NP_SCAN_CHUNK])
+    offsets.extend((numpy.flatnonzero(hashes % 4093 == 4091) + base).tolist())
+    hash_value = int(hashes[-1])
+  return hash_value, offsets
+
+def np_scanbuf_array(hash_value, chunk, out=None):
+  ''' NumPy scanbuf_array, used if there's no C version.
+      This produces the same results as `py_scanbuf_array`.
+  '''
+  hash_value, offsets = np_scanbuf(hash_value, chunk)
+  if out is None:
+    return hash_value, array('Q', offsets)
+  outB = memoryview(out).cast('B')
+  outQ = outB[:len(outB) // 8 * 8].cast('Q')
+  ncopy = min(len(offsets), len(outQ))
+  outQ[:ncopy] = array('Q', offsets[:ncopy])
+  return hash_value, len(offsets)
+
+def np_scanbuf_v(hash_value, buffers, per_buffer=False):
+  ''' NumPy scanbuf_v, used if there's no C version.
+      This produces the same results as `py_scanbuf_v`.
+  '''
+  return py_scanbuf_v(hash_value, buffers, per_buffer, scan=np_scanbuf)
+
+# the DataRecord flag for zlib compressed data
+DATA_RECORD_COMPRESSED = 0x01
+
+def py_digest_chunks(hashname, chunks, threads=None):
+  ''' Pure Python digest_chunks, used if there's no C version.
+      Return the digests of the `chunks` with the hash function `hashname`,
+      one of `SCAN_DIGESTS`, concatenated in a `bytes`.
+      `threads` is ignored.
+  '''
+  if hashname not in SCAN_DIGESTS:
+    raise ValueError("unsupported hashname: %s" % (hashname,))
+  return b''.join(new_digest(hashname, chunk).digest() for chunk in chunks)
+
+def _digests_list(digests, hashlen):
+  ''' Return a list of the `hashlen` byte digests packed in `digests`.
+  '''
+  if len(digests) % hashlen:
+    raise ValueError(
+        "length %d is not a multiple of hashlen %d" % (len(digests), hashlen)
+    )
+  digests = bytes(digests)
+  return [digests[i:i + hashlen] for i in range(0, len(digests), hashlen)]
+
+def py_digests_sort(digests, hashlen, threads=None):
+  ''' Pure Python digests_sort, used if there's no C version.
+      Return the packed digests of `hashlen` bytes each in `digests`
+      sorted and without duplicates.
+      `threads` is ignored.
+  '''
+  return b''.join(sorted(set(_digests_list(digests, hashlen))))
+
+def py_digests_bisect(digests, hashlen, key, right=False):
+  ''' Pure Python digests_bisect, used if there's no C version.
+      Return the index of the first of the sorted packed `digests`
+      which is not less than `key`, or which is greater than `key` if `right`.
+  '''
+  if len(key) != hashlen:
+    raise ValueError("key length %d != hashlen %d" % (len(key), hashlen))
+  digests = _digests_list(digests, hashlen)
+  return (bisect_right if right else bisect_left)(digests, bytes(key))
+
+def py_digests_union(digests1, digests2, hashlen):
+  ''' Pure Python digests_union, used if there's no C version.
+  '''
+  return b''.join(
+      sorted(
+          set(_digests_list(digests1, hashlen))
+          | set(_digests_list(digests2, hashlen))
+      )
+  )
+
+def py_digests_difference(digests1, digests2, hashlen):
+  ''' Pure Python digests_difference, used if there's no C version.
+  '''
+  exclude = set(_digests_list(digests2, hashlen))
+  return b''.join(
+      digest for digest in _digests_list(digests1, hashlen)
+      if digest not in exclude
+  )
+
+def py_digests_intersection(digests1, digests2, hashlen):
+  ''' Pure Python digests_intersection, used if there's no C version.
+  '''
+  include = set(_digests_list(digests2, hashlen))
+  return b''.join(
+      digest for digest in _digests_list(digests1, hashlen)
+      if digest in include
+  )
+
+def py_data_records(blocks, level=-1, threads=None):
+  ''' Pure Python data_records, used if there's no C version.
+      Return a list of `(record,data_offset,data_length,flags)`
+      for the `.vtd` `DataRecord`s storing `blocks`,
+      where `record` is the serialised `DataRecord`,
+      `data_offset` the offset of the stored data within it,
+      `data_length` the length of the stored data
+      and `flags` the `DataRecord` flags.
+      `threads` is ignored.
+
+      As with `DataRecord`, blocks of 16 bytes or more are compressed
+      and the compressed form kept if it achieves more than 10% compression.
+  '''
+  records = []
+  for data in blocks:
+    flags = 0
+    if len(data) >= 16:
+      zdata = compress(data, level)
+      if len(zdata) < len(data) * 0.9:
+        data = zdata
+        flags = DATA_RECORD_COMPRESSED
+    header = bytes((flags,)) + BSUInt.transcribe_value(len(data))
+    records.append((header + data, len(header), len(data), flags))
+  return records
+
+def vtd_walk(data, base, pos, whole):
+  ''' Walk the `.vtd` `DataRecord` framing in `data`,
+      whose first byte is at stream offset `base`,
+      from the record at stream offset `pos`.
+      Return `(records,pos,ok)` where `records` is a list of
+      `(offset,data_offset,data_length,flags)` and `ok` is false
+      if the framing at `pos` is invalid.
+      If `whole`, only records whose data are all in `data` are taken
+      and `pos` is left at the first incomplete record;
+      otherwise a record is taken once its header is complete
+      and `pos` may be beyond `data`.
+      This is the reference implementation for the walk in `_scan.c`.
+  '''
+  limit = base + len(data)
+  records = []
+  while pos < limit:
+    p = pos - base
+    values = []
+    while len(values) < 2:
+      value = 0
+      while p < len(data):
+        if value >> 57:
+          return records, pos, False
+        b = data[p]
+        p += 1
+        value = (value << 7) | (b & 0x7f)
+        if not b & 0x80:
+          values.append(value)
+          break
+      else:
+        return records, pos, True
+    flags, length = values
+    data_offset = base + p
+    if whole and data_offset + length > limit:
+      break
+    records.append((pos, data_offset, length, flags))
+    pos = data_offset + length
+  return records, pos, True
+
+def py_scan_vtd_records(data, base, pos):
+  ''' Pure Python scan_vtd_records, used if there's no C version.
+      Walk the `.vtd` `DataRecord` framing in `data`,
+      whose first byte is at stream offset `base`,
+      from the record at stream offset `pos`.
+      Return `(offsets,pos)` where `offsets` is an `array('Q')`
+      of the record start offsets and `pos` is the state for the next call:
+      if `pos<base+len(data)` the record header at `pos` is incomplete,
+      otherwise `pos` is the next record in later data.
+      `pos` is `None` if the framing is invalid.
+  '''
+  if pos < base:
+    raise ValueError("pos:%d < base:%d" % (pos, base))
+  records, pos, ok = vtd_walk(memoryview(data).cast('B'), base, pos, False)
+  return array('Q', [record[0] for record in records]), (pos if ok else None)
+
+def py_scan_vtd_file(fd, start=0, end=None, hashname=None, threads=None):
+  ''' Pure Python scan_vtd_file, used if there's no C version.
+      Walk the `DataRecord`s of the `.vtd` file `fd`
+      from offset `start` to `end`, default the file size.
+      Return `(offsets,data_offsets,data_lengths,flags,post_offset,digests)`
+      where the first four are `array('Q')`s with the record start offsets,
+      the file offsets and lengths of the stored data and the record flags,
+      and `post_offset` is the offset after the last complete record.
+      If `hashname`, one of `SCAN_DIGESTS`, is supplied then `digests`
+      holds the digests of the uncompressed data of each record,
+      otherwise it is `None`.
+      `threads` is ignored.
+  '''
+  if start < 0:
+    raise ValueError("start < 0: %d" % (start,))
+  if hashname is not None and hashname not in SCAN_DIGESTS:
+    raise ValueError("unknown hashname: %s" % (hashname,))
+  size = os.fstat(fd).st_size
+  if end is None:
+    end = size
+  if end < start:
+    raise ValueError("end:%d < start:%d" % (end, start))
+  if end > size:
+    raise ValueError("end:%d > file size:%d" % (end, size))
+  data = os.pread(fd, end - start, start)
+  records, pos, ok = vtd_walk(data, start, start, True)
+  if not ok:
+    raise ValueError("offset %d: invalid record framing" % (pos,))
+  columns = [array('Q', column) for column in zip(*records)
+             ] if records else [array('Q') for _ in range(4)]
+  for offset, _, _, flags in records:
+    if flags & ~DATA_RECORD_COMPRESSED:
+      raise ValueError(
+          "offset %d: unsupported flags: 0x%02x" % (offset, flags)
+      )
+  digests = None
+  if hashname is not None:
+    digest_list = []
+    for _, data_offset, length, flags in records:
+      stored = data[data_offset - start:data_offset - start + length]
+      if flags & DATA_RECORD_COMPRESSED:
+        stored = decompress(stored)
+      digest_list.append(new_digest(hashname, stored).digest())
+    digests = b''.join(digest_list)
+  return (*columns, pos, digests)
+
+def py_scan_prefixes(data, prefixes, at_start=True):
+  ''' Pure Python scan_prefixes, used if there's no C version.
+      Return `(offsets,pending)` where `offsets` is an `array('Q')`
+      of the offsets of the lines in `data` starting with any of
+      the `bytes` `prefixes` and `pending` is `None` or the offset
+      of a line start which cannot be decided because `data` ends
+      before a match is complete, including a line start at `len(data)`.
+      If `at_start` is false, `data[0]` is within a line
+      and the first line considered starts after the first newline.
+  '''
+  data = bytes(data)
+  prefixes = tuple(prefixes)
+  maxlen = max(map(len, prefixes), default=0)
+  offsets = array('Q')
+  if at_start:
+    pos = 0
+  else:
+    pos = data.find(b'\n') + 1
+    if pos == 0:
+      return offsets, None
+  while True:
+    if pos == len(data):
+      return offsets, pos
+    if data.startswith(prefixes, pos):
+      offsets.append(pos)
+    elif pos + maxlen > len(data):
+      tail = data[pos:]
+      if any(len(prefix) > len(tail) and prefix.startswith(tail)
+             for prefix in prefixes):
+        return offsets, pos
+    pos = data.find(b'\n', pos) + 1
+    if pos == 0:
+      return offsets, None
+
+# the ISO14496 box types whose bodies are boxes
+BOX_CONTAINERS = frozenset((
+    b'dinf', b'edts', b'mdia', b'meta', b'mfra', b'minf', b'moof', b'moov',
+    b'mvex', b'schi', b'sinf', b'stbl', b'traf', b'trak', b'tref', b'udta'
+))
+# how deeply container boxes are followed
+BOX_DEPTH = 32
+
+def py_scan_boxes(data, base, pos, ends=()):
+  ''' Pure Python scan_boxes, used if there's no C version.
+      Walk the ISO14496 box headers in `data`, whose first byte
+      is at stream offset `base`, from the header at stream offset `pos`,
+      descending into the container boxes;
+      `ends` is the stack of end offsets of the enclosing containers.
+      Return `(offsets,pos,ends)` where `offsets` is an `array('Q')`
+      of the box start offsets and `pos` and `ends` are the state
+      for the next call: if `pos<base+len(data)` the header at `pos`
+      is incomplete, otherwise `pos` is the next header in later data.
+      `pos` is `None` if the remaining data cannot be walked.
+  '''
+  if pos < base:
+    raise ValueError("pos:%d < base:%d" % (pos, base))
+  if len(ends) > BOX_DEPTH:
+    raise ValueError("len(ends):%d > %d" % (len(ends), BOX_DEPTH))
+  data = memoryview(data).cast('B')
+  limit = base + len(data)
+  ends = list(ends)
+  offsets = array('Q')
+  while True:
+    # leave the containers which end here, or which a child overran
+    if ends and pos >= ends[-1]:
+      pos = ends.pop()
+      continue
+    if pos >= limit or limit - pos < 8:
+      break
+    p = pos - base
+    size = int.from_bytes(data[p:p + 4], 'big')
+    box_type = bytes(data[p + 4:p + 8])
+    header = 8
+    if size == 1:
+      if limit - pos < 16:
+        break
+      size = int.from_bytes(data[p + 8:p + 16], 'big')
+      header = 16
+    elif size == 0:
+      # the box extends to the end of its container or of the data
+      if not ends:
+        offsets.append(pos)
+        return offsets, None, ()
+      size = ends[-1] - pos
+    if size < header:
+      # invalid: resume after the container or give up
+      if not ends:
+        return offsets, None, ()
+      pos = ends.pop()
+      continue
+    if len(ends) < BOX_DEPTH and box_type in BOX_CONTAINERS:
+      # an ISO meta box is a full box: 4 zero bytes of version and flags
+      if box_type == b'meta':
+        if limit - pos < header + 4:
+          break
+        if not any(data[p + header:p + header + 4]):
+          header += 4
+      offsets.append(pos)
+      ends.append(pos + size)
+      pos += header
+    else:
+      offsets.append(pos)
+      pos += size
+  return offsets, pos, tuple(ends)
+
+# MPEG audio bitrates in kbps by [MPEG1?][layer-1][index]
+MP3_BITRATES = (
+    (
+        (0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0),
+        (0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0),
+        (0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0),
+    ),
+    (
+        (0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0),
+        (0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0),
+        (0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0),
+    ),
+)
+# MPEG audio sample rates in Hz by [version field][index]
+MP3_SAMPLERATES = (
+    (11025, 12000, 8000, 0),
+    (0, 0, 0, 0),
+    (22050, 24000, 16000, 0),
+    (44100, 48000, 32000, 0),
+)
+
+def mp3_frame_length(header):
+  ''' Return the length of the MPEG audio frame
+      with the 4 byte `header`, or `0` if it is invalid.
+  '''
+  b0, b1, b2 = header[:3]
+  if b0 != 0xff or b1 & 0xe0 != 0xe0:
+    return 0
+  version = (b1 >> 3) & 3
+  layer = 4 - ((b1 >> 1) & 3)
+  mpeg1 = 1 if version == 3 else 0
+  kbps = 0 if layer > 3 else MP3_BITRATES[mpeg1][layer - 1][b2 >> 4]
+  rate = MP3_SAMPLERATES[version][(b2 >> 2) & 3]
+  padding = (b2 >> 1) & 1
+  if not kbps or not rate:
+    return 0
+  if layer == 1:
+    return (12 * kbps * 1000 // rate + padding) * 4
+  if layer == 3 and not mpeg1:
+    return 72 * kbps * 1000 // rate + padding
+  return 144 * kbps * 1000 // rate + padding
+
+def py_scan_mp3_frames(data, base, pos):
+  ''' Pure Python scan_mp3_frames, used if there's no C version.
+      Walk the MP3 frames and ID3 tags in `data`, whose first byte
+      is at stream offset `base`, from stream offset `pos`,
+      resynchronising on the next frame sync word after an invalid header.
+      Return `(offsets,pos)` where `offsets` is an `array('Q')`
+      of the frame and tag start offsets and `pos` is the state
+      for the next call: if `pos<base+len(data)` the header at `pos`
+      is incomplete, otherwise `pos` is the next frame in later data.
+  '''
+  if pos < base:
+    raise ValueError("pos:%d < base:%d" % (pos, base))
+  data = bytes(data)
+  limit = base + len(data)
+  offsets = array('Q')
+  while pos < limit:
+    p = pos - base
+    avail = limit - pos
+    if avail < 4:
+      break
+    length = 0
+    if data.startswith(b'TAG+', p):
+      length = 227
+    elif data.startswith(b'TAG', p):
+      length = 128
+    elif data.startswith(b'ID3', p):
+      if avail < 10:
+        break
+      size_bs = data[p + 6:p + 10]
+      if not any(b & 0x80 for b in size_bs):
+        # a syncsafe size, excluding the header and any footer
+        length = (
+            10 + ((size_bs[0] << 21) | (size_bs[1] << 14) |
+                  (size_bs[2] << 7) | size_bs[3]) +
+            (10 if data[p + 5] & 0x10 else 0)
+        )
+    else:
+      length = mp3_frame_length(data[p:p + 4])
+    if length:
+      offsets.append(pos)
+      pos += length
+      continue
+    # resynchronise on the next sync word
+    q = p + 1
+    while True:
+      q = data.find(b'\xff', q)
+      if q < 0:
+        q = len(data)
+        break
+      if len(data) - q < 4 or mp3_frame_length(data[q:q + 4]):
+        break
+      q += 1
+    pos = base + q
+  return offsets, pos
+
+# The rolling hash algorithms.
+# The hash at any position depends only on the last `window` bytes.
+# A stream is treated as though preceded by `window` zero bytes.
+# The boundary test applies to a fingerprint of the hash:
+# the 28 bit vt28 hash itself, or the top 31 bits of the others.
+# These are the reference implementations for those in _scan.c.
+
+_M64 = (1 << 64) - 1
+
+def _splitmix64(state):
+  ''' Generator yielding the SplitMix64 sequence from `state`,
+      used for reproducible hash tables.
+  '''
+  while True:
+    state = (state + 0x9E3779B97F4A7C15) & _M64
+    z = state
+    z = ((z ^ (z >> 30)) * 0xBF58476D1CE4E5B9) & _M64
+    z = ((z ^ (z >> 27)) * 0x94D049BB133111EB) & _M64
+    yield z ^ (z >> 31)
+
+def _rotl64(x, n):
+  ''' Rotate the 64 bit value `x` left by `n` bits.
+  '''
+  return ((x << n) | (x >> (64 - n))) & _M64
+
+class _RollingHash:
+  ''' Base class for the pure Python rolling hashes.
+  '''
+
+  name = None
+  window = None
+
+  def __init__(self):
+    self.initial = self.scan(0, bytes(self.window), bytes(self.window))[0]
+
+  @staticmethod
+  def step(hash_value, b_in, b_out):
+    ''' Advance the hash by the byte `b_in`, with `b_out` leaving the window.
+    '''
+    raise NotImplementedError
+
+  @staticmethod
+  def fingerprint(hash_value):
+    ''' The value to which the boundary test applies.
+    '''
+    return hash_value >> 33
+
+  def scan(self, hash_value, hist, data, start=0, end=None, test=None):
+    ''' Scan `data[start:end]` advancing `hash_value`,
+        where `hist` holds the `window` bytes before `data[0]`.
+        `test` is an optional `(divisor,remainder)`.
+        Return `(hash_value,hits)` where `hits` lists the offsets
+        where `fingerprint(hash_value) % divisor == remainder`.
+    '''
+    if end is None:
+      end = len(data)
+    window = self.window
+    step = self.step
+    fingerprint = self.fingerprint
+    hits = []
+    for pos in range(start, end):
+      b_out = data[pos - window] if pos >= window else hist[pos]
+      hash_value = step(hash_value, data[pos], b_out)
+      if test is not None and fingerprint(hash_value) % test[0] == test[1]:
+        hits.append(pos)
+    return hash_value, hits
+
+  def resync(self, hist, data, pos):
+    ''' The hash after `data[pos-1]`, computed from the `window` bytes
+        before `pos`; `hist` holds the `window` bytes before `data[0]`.
+    '''
+    window = self.window
+    if pos >= window:
+      wdata = bytes(data[pos - window:pos])
+    else:
+      wdata = bytes(hist[pos:]) + bytes(data[:pos])
+    return self.scan(self.initial, bytes(window), wdata)[0]
+
+class _VT28(_RollingHash):
+  ''' The original 28 bit rolling hash, 7 bits from each of the last 4 bytes.
+  '''
+
+  name = 'vt28'
+  window = 4
+
+  @staticmethod
+  def step(hash_value, b_in, b_out):
+    return (
+        ((hash_value & 0x001fffff) << 7)
+        | ((b_in & 0x7f) ^ ((b_in & 0x80) >> 7))
+    )
+
+  @staticmethod
+  def fingerprint(hash_value):
+    return hash_value
+
+  def scan(self, hash_value, hist, data, start=0, end=None, test=None):
+    ''' Scan `data[start:end]` as for `_RollingHash.scan`,
+        using `np_vt28_hashes` if NumPy is available.
+    '''
+    if numpy is None:
+      return super().scan(hash_value, hist, data, start, end, test)
+    if end is None:
+      end = len(data)
+    hits = []
+    mv = memoryview(data).cast('B')
+    for base in range(start, end, NP_SCAN_CHUNK):
+      hashes = np_vt28_hashes(
+          hash_value, mv[base:min(end, base + NP_SCAN_CHUNK)]
+      )
+      if test is not None:
+        hits.extend(
+            (numpy.flatnonzero(hashes % test[0] == test[1]) + base).tolist()
+        )
+      hash_value = int(hashes[-1])
+    return hash_value, hits
+
+class _Gear(_RollingHash):
+  ''' Gear: shift and add a random value per byte.
+  '''
+
+  name = 'gear'
+  window = 64
+  _seed = 0x67656172
+
+  def __init__(self):
+    table_values = _splitmix64(self._seed)
+    self.table = [next(table_values) for _ in range(256)]
+    super().__init__()
+
+  def step(self, hash_value, b_in, b_out):
+    return ((hash_value << 1) + self.table[b_in]) & _M64
+
+class _Buzhash(_RollingHash):
+  ''' Buzhash: a cyclic polynomial over a 48 byte window.
+  '''
+
+  name = 'buzhash'
+  window = 48
+  _seed = 0x62757a68
+
+  def __init__(self):
+    table_values = _splitmix64(self._seed)
+    self.table = [next(table_values) for _ in range(256)]
+    self.out_table = [_rotl64(t, self.window) for t in self.table]
+    super().__init__()
+    # buzhash removes outgoing bytes, so sum the zero window directly
+    initial = 0
+    for i in range(self.window):
+      initial ^= _rotl64(self.table[0], i)
+    self.initial = initial
+
+  def step(self, hash_value, b_in, b_out):
+    return (
+        _rotl64(hash_value, 1) ^ self.out_table[b_out] ^ self.table[b_in]
+    )
+
+class _Rabin(_RollingHash):
+  ''' Rabin fingerprint modulo an irreducible polynomial of degree 53
+      over a 64 byte window.
+  '''
+
+  name = 'rabin'
+  window = 64
+  polynomial = 0x3DA3358B4DC173
+  degree = 53
+
+  def __init__(self):
+    self.mod_table = [
+        self._mod(b << self.degree) | (b << self.degree) for b in range(256)
+    ]
+    self.out_table = []
+    for b in range(256):
+      h = b
+      for _ in range(self.window - 1):
+        h = self._mod(h << 8)
+      self.out_table.append(h)
+    super().__init__()
+
+  def _mod(self, x):
+    ''' The remainder of `x` modulo the polynomial.
+    '''
+    for bit in range(63, self.degree - 1, -1):
+      if x & (1 << bit):
+        x ^= self.polynomial << (bit - self.degree)
+    return x
+
+  def step(self, hash_value, b_in, b_out):
+    hash_value ^= self.out_table[b_out]
+    top = hash_value >> (self.degree - 8)
+    return ((hash_value << 8) | b_in) ^ self.mod_table[top]
+
+  def fingerprint(self, hash_value):
+    return hash_value >> (self.degree - 31)
+
+# the rolling hash algorithms by name
+PY_ROLLING_HASHES = {
+    alg.name: alg
+    for alg in (_VT28(), _Gear(), _Buzhash(), _Rabin())
+}
+ROLLING_HASHES = tuple(PY_ROLLING_HASHES.keys())
+DEFAULT_ROLLING_HASH = 'vt28'
+
+# the default shortest run of one octet which blockify stores as an RLEBlock
+DEFAULT_MIN_RUN = 4096
+
+# The Store scan settings, which affect where the block boundaries fall,
+# mapping the setting name to its type and default value.
+SCAN_SETTINGS = {
+    'chunking': (str, DEFAULT_CHUNKING),
+    'rolling_hash': (str, DEFAULT_ROLLING_HASH),
+    'avg_block': (int, None),
+    'max_block': (int, None),
+    'min_run': (int, DEFAULT_MIN_RUN),
+}
+
+def scan_settings(S):
+  ''' Return a `dict` of the non-default scan settings of the Store `S`,
+      which may be `None`.
+  '''
+  settings = {}
+  for setting, (_, default) in SCAN_SETTINGS.items():
+    value = getattr(S, setting, None)
+    if value is not None and value != default:
+      settings[setting] = value
+  return settings
+
+class PyScanner:
+  ''' Pure Python `Scanner`, used if there's no C version.
+      This is also the reference implementation for the C `Scanner`.
+
+      Candidate edges from the rolling hash and from a parser are
+      considered in ascending order. A candidate is used if it lies
+      beyond the current position and at least `min_block` past the
+      latest cut; smaller candidates are discarded. If the first usable
+      candidate lies beyond the end of the current chunk it is also
+      discarded. A block is cut unconditionally when it reaches `max_block`.
+
+      In normalised mode the hash is not examined until `min_block`
+      bytes past the latest cut. Up to the `target` block size a
+      stricter divisor (4 times `target`) is used, and after it a
+      looser one (a quarter of `target`). Parser offsets are kept
+      until used or passed.
+
+      In classic mode the hash indicates an edge where its fingerprint
+      modulo `divisor` is `divisor-2`; the average block size is
+      about `min_block+divisor`.
+
+      `algorithm` names the rolling hash, one of `ROLLING_HASHES`.
+
+      If `hashname`, one of `SCAN_DIGESTS`, is supplied the scanner
+      also computes the digest of each block: see `scan_digests`.
+
+      If `min_run` is not `0`, each run of at least `min_run` repeats
+      of one octet is cut out as a block of its own, with no cuts or
+      hashing within it: see `runs`. A run is cut where it starts,
+      regardless of `min_block`, and where it ends, regardless of
+      `max_block`. A run is recognised once it is `min_run` bytes long;
+      if it began in an earlier chunk it is cut from the start of the
+      current chunk.
+  '''
+
+  def __init__(
+      self,
+      min_block,
+      max_block,
+      normalised=False,
+      target=None,
+      algorithm=None,
+      divisor=None,
+      hashname=None,
+      min_run=0,
+  ):
+    if hashname is not None and hashname not in SCAN_DIGESTS:
+      raise ValueError("unsupported hashname: %s" % (hashname,))
+    if min_run < 0 or min_run == 1:
+      raise ValueError("min_run should be 0 or at least 2: %d" % (min_run,))
+    if algorithm is None:
+      algorithm = DEFAULT_ROLLING_HASH
+    try:
+      alg = PY_ROLLING_HASHES[algorithm]
+    except KeyError:
+      raise ValueError("unknown algorithm: %s" % (algorithm,))
+    if min_block < 1:
+      raise ValueError("min_block < 1: %s" % (min_block,))
+    if min_block >= max_block:
+      raise ValueError(
+          "min_block:%d >= max_block:%d" % (min_block, max_block)
+      )
+    if normalised:
+      if target is None:
+        target = max(min_block, min(NORMALISED_TARGET, max_block // 2))
+      elif not min_block <= target < max_block:
+        raise ValueError(
+            "target:%d not in min_block:%d..max_block:%d" %
+            (target, min_block, max_block)
+        )
+      if target > 1 << 24:
+        raise ValueError("target too large: %d" % (target,))
+      self.strict_divisor = (target << 2) | 1
+      self.loose_divisor = max(3, (target >> 2) | 1)
+    elif target is not None:
+      raise ValueError("target requires normalised mode")
+    else:
+      target = 0
+    if divisor is not None:
+      if normalised:
+        raise ValueError("divisor requires classic mode")
+      if divisor < 3 or divisor > MAX_DIVISOR or divisor % 2 == 0:
+        raise ValueError(
+            "divisor:%d should be odd and in the range 3..%d" %
+            (divisor, MAX_DIVISOR)
+        )
+    elif not normalised:
+      divisor = CLASSIC_DIVISOR
+    else:
+      divisor = 0
+    self.min_block = min_block
+    self.max_block = max_block
+    self.normalised = bool(normalised)
+    self.target = target
+    self.divisor = divisor
+    self.algorithm = algorithm
+    self.hashname = hashname
+    self._pending = None if hashname is None else new_digest(hashname)
+    self._digests = b''
+    self._alg = alg
+    self._hist = bytes(alg.window)
+    self.hash_value = alg.initial
+    self.offset = 0
+    self.last_offset = 0
+    self.nforced = 0
+    self._parser_offsets = []
+    self.min_run = min_run
+    self._run_re = (
+        re.compile(rb'(.)\1{%d}' % (min_run - 1,), re.DOTALL)
+        if min_run else None
+    )
+    self._in_run = False
+    self._run_octet = 0
+    self._streak = 0
+    self._runs = ()
+
+  def scan(self, data, offsets=None):
+    ''' Scan the next chunk `data` of the stream, return an `array('Q')`
+        of the positions within `data` where blocks end.
+        `offsets` is an optional iterable of desirable stream offsets
+        from a parser.
+    '''
+    heap = self._parser_offsets
+    if offsets is not None:
+      for parser_offset in offsets:
+        heappush(heap, parser_offset)
+    data = memoryview(data).cast('B')
+    cuts = array('Q')
+    runs = []
+    digests = []
+    pos = 0
+    while True:
+      if self._in_run:
+        rest = bytes(data[pos:])
+        run_end = pos + len(rest) - len(rest.lstrip(bytes((self._run_octet,))))
+        self._advance(data[pos:run_end])
+        if run_end == len(data):
+          break
+        # the run ends at run_end: cut, and resume hashing after it
+        self._cut_here(run_end, cuts, digests, runs)
+        self._in_run = False
+        self._streak = 0
+        self.hash_value = self._alg.resync(self._hist, b'', 0)
+        pos = run_end
+      run_start = self._run_find(data, pos)
+      segment = data[pos:run_start]
+      if self.normalised:
+        segment_cuts = self._scan_normalised(segment)
+      else:
+        segment_cuts = self._scan_classic(segment)
+      self._advance(segment)
+      if self.hashname is not None:
+        digests.extend(self._digest(segment, segment_cuts))
+      cuts.extend(pos + cut for cut in segment_cuts)
+      if run_start == len(data):
+        break
+      # a run starts at run_start: cut before it
+      if self.offset > self.last_offset:
+        self._cut_here(run_start, cuts, digests)
+      self._in_run = True
+      pos = run_start
+    self._digests = b''.join(digests)
+    self._runs = tuple(runs)
+    return cuts
+
+  def _advance(self, data):
+    ''' Advance the history and offset past `data`.
+    '''
+    self._hist = (self._hist + bytes(data))[-self._alg.window:]
+    self.offset += len(data)
+
+  def _cut_here(self, pos, cuts, digests, runs=None):
+    ''' Cut at the current offset, at `pos` in the current chunk.
+        If `runs` is not `None` the block is a run: record it in `runs`
+        and give it an all zero digest.
+    '''
+    self.last_offset = self.offset
+    if runs is not None:
+      runs.append((len(cuts), self._run_octet))
+    cuts.append(pos)
+    if self.hashname is not None:
+      if runs is None:
+        digests.append(self._pending.digest())
+        self._pending = new_digest(self.hashname)
+      else:
+        digests.append(bytes(self._pending.digest_size))
+
+  def _run_find(self, data, pos):
+    ''' Return the start of the first run of at least `min_run`
+        repeats of one octet in `data[pos:]`, noting its octet,
+        or `len(data)` if none, noting the repeats at the end of `data`.
+        A run continuing the repeats before `pos` starts at `pos`.
+    '''
+    if not self.min_run:
+      return len(data)
+    rest = bytes(data[pos:])
+    i = 0
+    if self._streak > 0:
+      i = len(rest) - len(rest.lstrip(bytes((self._run_octet,))))
+      if self._streak + i >= self.min_run:
+        return pos
+      if i == len(rest):
+        self._streak += i
+        return len(data)
+    m = self._run_re.search(rest, i)
+    if m:
+      self._run_octet = rest[m.start()]
+      return pos + m.start()
+    tail = rest[i:]
+    self._streak = len(tail) - len(tail.rstrip(tail[-1:]))
+    if tail:
+      self._run_octet = tail[-1]
+    return len(data)
+
+  def _digest(self, data, cuts):
+    ''' Return the digests of the blocks ending at `cuts`
+        and add the data after the last cut to the pending digest.
+    '''
+    digests = []
+    cut0 = 0
+    for cut in cuts:
+      self._pending.update(data[cut0:cut])
+      digests.append(self._pending.digest())
+      self._pending = new_digest(self.hashname)
+      cut0 = cut
+    self._pending.update(data[cut0:])
+    return digests
+
+  def scan_digests(self, data, offsets=None):
+    ''' Scan the next chunk like `scan`, return `(cuts,digests)`
+        where `digests` holds the concatenated digests of the blocks
+        ending at `cuts`.
+    '''
+    if self.hashname is None:
+      raise ValueError("Scanner has no hashname")
+    cuts = self.scan(data, offsets)
+    return cuts, self._digests
+
+  def pending_digest(self):
+    ''' The digest of the data after the latest cut.
+    '''
+    if self.hashname is None:
+      raise ValueError("Scanner has no hashname")
+    return self._pending.digest()
+
+  def runs(self):
+    ''' The blocks which are runs among the cuts from the latest
+        scan call, a tuple of `(index,octet)` where `index` indexes the cuts.
+        Their digests are all zero bytes.
+    '''
+    return self._runs
+
+  def pending_run(self):
+    ''' The octet if the data after the latest cut are a run, otherwise `None`.
+    '''
+    return self._run_octet if self._in_run else None
+
+  def scan_file(self, fd, start=0, end=None):
+    ''' Scan the range `[start:end)` of the file `fd` as the next part
+        of the stream, `end` defaulting to the file size.
+        Return an `array('Q')` of the cut positions relative to `start`.
+
+        The range is scanned in pieces of `SCAN_FILE_CHUNK` bytes.
+        The C version memory maps the file instead of reading it.
+    '''
+    return self._scan_file(fd, start, end)[0]
+
+  def scan_file_digests(self, fd, start=0, end=None):
+    ''' Scan a file range like `scan_file`, return `(cuts,digests)`
+        like `scan_digests`.
+    '''
+    if self.hashname is None:
+      raise ValueError("Scanner has no hashname")
+    return self._scan_file(fd, start, end)
+
+  def _scan_file(self, fd, start, end):
+    ''' Scan a file range, return `(cuts,digests)`.
+    '''
+    if start < 0:
+      raise ValueError("start < 0: %d" % (start,))
+    size = os.fstat(fd).st_size
+    if end is None:
+      end = size
+    elif end < start:
+      raise ValueError("end:%d < start:%d" % (end, start))
+    elif end > size:
+      raise ValueError("end:%d > file size:%d" % (end, size))
+    cuts = array('Q')
+    digests = []
+    runs = []
+    pos = start
+    while pos < end:
+      data = os.pread(fd, min(SCAN_FILE_CHUNK, end - pos), pos)
+      if not data:
+        raise EOFError("unexpected EOF at offset %d" % (pos,))
+      data_cuts = self.scan(data)
+      runs.extend((len(cuts) + index, octet) for index, octet in self._runs)
+      cuts.extend(pos - start + cut for cut in data_cuts)
+      digests.append(self._digests)
+      pos += len(data)
+    self._runs = tuple(runs)
+    return cuts, b''.join(digests)
+
+  def _scan_classic(self, data):
+    ''' Scan `data` using every hash hit as a candidate edge.
+    '''
+    heap = self._parser_offsets
+    start = self.offset
+    end = start + len(data)
+    self.hash_value, hits = self._alg.scan(
+        self.hash_value, self._hist, data, test=(self.divisor, self.divisor - 2)
+    )
+    hits = [start + hit for hit in hits]
+    hit_ndx = 0
+    min_block = self.min_block
+    max_block = self.max_block
+    last = self.last_offset
+    pos = start
+    cuts = array('Q')
+    while pos < end:
+      edge = None
+      while True:
+        if hit_ndx < len(hits) and (not heap or hits[hit_ndx] <= heap[0]):
+          candidate = hits[hit_ndx]
+          hit_ndx += 1
+        elif heap:
+          candidate = heappop(heap)
+        else:
+          break
+        if candidate > pos and candidate >= last + min_block:
+          edge = candidate
+          break
+      release = edge is not None and edge <= end
+      take_to = edge if release else end
+      while take_to - last >= max_block:
+        last += max_block
+        cuts.append(last - start)
+        self.nforced += 1
+      pos = take_to
+      if release and pos > last:
+        last = pos
+        cuts.append(last - start)
+    self.last_offset = last
+    return cuts
+
+  def _scan_normalised(self, data):
+    ''' Scan `data` using normalised chunking.
+    '''
+    heap = self._parser_offsets
+    start = self.offset
+    end = start + len(data)
+    alg = self._alg
+    hist = self._hist
+
+    def first_hit(from_offset, upto, divisor):
+      ''' The stream offset of the first hit in `[from_offset:upto)`, or `None`.
+      '''
+      hash_value = alg.resync(hist, data, from_offset - start)
+      window = alg.window
+      for rel in range(from_offset - start, upto - start):
+        b_out = data[rel - window] if rel >= window else hist[rel]
+        hash_value = alg.step(hash_value, data[rel], b_out)
+        if alg.fingerprint(hash_value) % divisor == divisor - 2:
+          return start + rel
+      return None
+
+    min_block = self.min_block
+    max_block = self.max_block
+    last = self.last_offset
+    pos = start
+    cuts = array('Q')
+    while pos < end:
+      while heap and (heap[0] < pos or heap[0] < last + min_block):
+        heappop(heap)
+      limit = last + max_block
+      parser_cut = False
+      if heap and heap[0] <= limit:
+        limit = heap[0]
+        parser_cut = True
+      from_offset = max(pos, last + min_block)
+      upto = min(limit, end)
+      mid = last + self.target
+      edge = None
+      if from_offset < upto and from_offset < mid:
+        edge = first_hit(from_offset, min(mid, upto), self.strict_divisor)
+      if edge is None and mid < upto:
+        edge = first_hit(max(from_offset, mid), upto, self.loose_divisor)
+      if edge is None:
+        if limit > end:
+          break
+        edge = limit
+        if parser_cut:
+          heappop(heap)
+        else:
+          self.nforced += 1
+      last = pos = edge
+      cuts.append(last - start)
+    self.last_offset = last
+    self.hash_value = alg.resync(hist, data, len(data))
+    return cuts
+
+_scan = None
 try:
-  from ._scan import scanbuf
+  from . import _scan
 except ImportError:
   warning("building _scan from _scan.c")
 
@@ -29,7 +1415,12 @@ except ImportError:
     pkgdir = dirname(__file__)
     chdir(dirname(dirname(pkgdir)))
     return setup(
-        ext_modules=[Extension("cs.vt._scan", [joinpath(pkgdir, '_scan.c')])],
+        ext_modules=[
+            Extension(
+                "cs.vt._scan", [joinpath(pkgdir, '_scan.c')],
+                libraries=['z']
+            )
+        ],
     )
 
   ### delay, seemingly needed to make the C version look "new"
@@ -42,32 +1433,54 @@ except ImportError:
   except SystemExit as e:
     chdir(owd)
     error("SETUP FAILS: %s:%s", type(e), e)
-    scanbuf = None
   else:
     chdir(owd)
     try:
-      from ._scan import scanbuf
+      from . import _scan
     except ImportError as e:
       error("import fails after setup: %s", e)
-      scanbuf = None
   finally:
     sys.argv = oargv
 
-if scanbuf is None:
-  warning("using pure Python scanbuf")
+if _scan is None:
+  if numpy is None:
+    warning("using pure Python scanbuf")
+    _scanbufs = py_scanbuf, py_scanbuf_array, py_scanbuf_v, 'python'
+  else:
+    warning("using NumPy scanbuf")
+    _scanbufs = np_scanbuf, np_scanbuf_array, np_scanbuf_v, 'numpy'
+else:
+  _scanbufs = None, None, None, None
 
-  def scanbuf(hash_value, chunk):
-    ''' Pure Python scanbuf if there's no C version.
-    '''
-    offsets = []
-    for offset, b in enumerate(chunk):
-      hash_value = (
-          ((hash_value & 0x001fffff) << 7)
-          | ((b & 0x7f) ^ ((b & 0x80) >> 7))
-      )
-      if hash_value % 4093 == 4091:
-        offsets.append(offset)
-    return hash_value, offsets
+# The public names, their names in _scan and their pure Python fallbacks.
+_SCAN_BINDINGS = (
+    ('scanbuf', 'scanbuf', _scanbufs[0]),
+    ('scanbuf_array', 'scanbuf_array', _scanbufs[1]),
+    ('scanbuf_v', 'scanbuf_v', _scanbufs[2]),
+    ('scan_kernel', 'kernel', _scanbufs[3]),
+    ('scan_kernels', 'kernels', (_scanbufs[3],)),
+    ('Scanner', 'Scanner', PyScanner),
+    ('scan_digest_impl', 'digest_impl', 'hashlib'),
+    ('digest_chunks', 'digest_chunks', py_digest_chunks),
+    ('blake3', 'blake3', py_blake3),
+    ('blake3_impl', 'blake3_impl', 'python'),
+    ('digests_sort', 'digests_sort', py_digests_sort),
+    ('digests_bisect', 'digests_bisect', py_digests_bisect),
+    ('digests_union', 'digests_union', py_digests_union),
+    ('digests_difference', 'digests_difference', py_digests_difference),
+    ('digests_intersection', 'digests_intersection', py_digests_intersection),
+    ('data_records', 'data_records', py_data_records),
+    ('scan_prefixes', 'scan_prefixes', py_scan_prefixes),
+    ('scan_boxes', 'scan_boxes', py_scan_boxes),
+    ('scan_mp3_frames', 'scan_mp3_frames', py_scan_mp3_frames),
+    ('scan_vtd_records', 'scan_vtd_records', py_scan_vtd_records),
+    ('scan_vtd_file', 'scan_vtd_file', py_scan_vtd_file),
+)
+for _name, _scan_name, _fallback in _SCAN_BINDINGS:
+  globals()[_name] = (
+      _fallback if _scan is None else getattr(_scan, _scan_name)
+  )
+del _name, _scan_name, _fallback, _scanbufs
 
 if False:
   # debugging wrapper
@@ -80,3 +1493,7 @@ if False:
     h2, offsets = scanbuf0(h, data)
     ##X("scan => %r", offsets)
     return h2, offsets
+
+if __name__ == '__main__':
+  from .scan_tests import selftest
+  selftest(sys.argv)
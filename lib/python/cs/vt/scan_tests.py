@@ -0,0 +1,805 @@
+#!/usr/bin/python
+#
+# Scan tests.
+#       - Cameron Simpson <cs@cskk.id.au>
+#
+
+''' Unit tests for cs.vt.scan.
+'''
+
+from array import array
+import hashlib
+import mmap
+import random
+import sys
+import tempfile
+from threading import Thread
+import unittest
+from .scan import (
+    py_scanbuf, scanbuf, scanbuf_array, scan_kernels, PyScanner, Scanner,
+    ROLLING_HASHES, SCAN_DIGESTS, SCAN_FILE_CHUNK, data_records,
+    py_data_records, scan_prefixes, py_scan_prefixes, scan_boxes,
+    py_scan_boxes, scan_mp3_frames, py_scan_mp3_frames, scan_vtd_records,
+    py_scan_vtd_records, scan_vtd_file, py_scan_vtd_file, numpy, np_scanbuf,
+    np_scanbuf_array, py_scanbuf_array, PY_ROLLING_HASHES, NP_SCAN_CHUNK,
+    scanbuf_v, py_scanbuf_v, new_digest
+)
+from .datafile import DataRecord
+from .parsers import linesof, scan_text, scan_headers, PREFIXES_ALL
+
+class TestScan(unittest.TestCase):
+  ''' Tests for the scanbuf implementations.
+  '''
+
+  def setUp(self):
+    ''' Initialise the pseudorandom number generator.
+    '''
+    random.seed()
+
+  @staticmethod
+  def _kernel_scanbuf(kernel):
+    ''' Return a scanbuf function using `kernel`.
+    '''
+    if kernel == 'python':
+      return py_scanbuf
+    if kernel == 'numpy':
+      return np_scanbuf
+    return lambda hash_value, data: scanbuf(hash_value, data, kernel=kernel)
+
+  def test00kernels(self):
+    ''' Compare every kernel against the pure Python scanbuf.
+    '''
+    for kernel in scan_kernels:
+      kscanbuf = self._kernel_scanbuf(kernel)
+      with self.subTest(kernel=kernel):
+        for length in list(range(40)) + [1023, 4099, 65536]:
+          data = bytes(random.randint(0, 255) for _ in range(length))
+          hash_value = random.randint(0, 0xffffffff)
+          h1, offsets1 = py_scanbuf(hash_value, data)
+          h2, offsets2 = kscanbuf(hash_value, data)
+          self.assertEqual(list(offsets1), list(offsets2))
+          if length > 0:
+            self.assertEqual(h1, h2)
+
+  def test01chunked(self):
+    ''' Scanning in chunks must match scanning in one piece.
+    '''
+    data = bytes(random.randint(0, 255) for _ in range(200000))
+    _, offsets = py_scanbuf(0, data)
+    for kernel in scan_kernels:
+      kscanbuf = self._kernel_scanbuf(kernel)
+      with self.subTest(kernel=kernel):
+        hash_value = 0
+        chunk_offsets = []
+        pos = 0
+        while pos < len(data):
+          chunk = data[pos:pos + random.randint(1, 9000)]
+          hash_value, coffsets = kscanbuf(hash_value, chunk)
+          chunk_offsets.extend(pos + offset for offset in coffsets)
+          pos += len(chunk)
+        self.assertEqual(offsets, chunk_offsets)
+
+  def test02threads(self):
+    ''' Threaded scans must match the serial scan exactly.
+    '''
+    if scan_kernels == ('python',):
+      raise unittest.SkipTest("no C scanbuf")
+    for length in 0, 3, 4, 7, 8, 100, 4093, 100000:
+      data = bytes(random.randint(0, 255) for _ in range(length))
+      hash_value = random.randint(0, 0xffffffff)
+      h1, offsets1 = py_scanbuf(hash_value, data)
+      for threads in None, 0, 1, 2, 3, 5, 8, 64:
+        with self.subTest(length=length, threads=threads):
+          h2, offsets2 = scanbuf(hash_value, data, threads=threads)
+          self.assertEqual(list(offsets1), list(offsets2))
+          if length > 0:
+            self.assertEqual(h1, h2)
+    with self.assertRaises(ValueError):
+      scanbuf(0, b'abc', threads=-1)
+
+  def test03buffers(self):
+    ''' Scan the same data presented as various buffer types.
+    '''
+    data = bytes(random.randint(0, 255) for _ in range(100000))
+    hash_value = random.randint(0, 0xffffffff)
+    h1, offsets1 = py_scanbuf(hash_value, data)
+    mm = mmap.mmap(-1, len(data))
+    mm[:] = data
+    try:
+      for buf in (
+          bytearray(data),
+          memoryview(data),
+          memoryview(data)[0:],
+          mm,
+      ):
+        with self.subTest(type=type(buf).__name__):
+          h2, offsets2 = scanbuf(hash_value, buf)
+          self.assertEqual(h1, h2)
+          self.assertEqual(offsets1, list(offsets2))
+    finally:
+      mm.close()
+
+  def test04array(self):
+    ''' Compact offset output from scanbuf_array.
+    '''
+    data = bytes(random.randint(0, 255) for _ in range(200000))
+    hash_value = random.randint(0, 0xffffffff)
+    h1, offsets1 = py_scanbuf(hash_value, data)
+    self.assertGreater(len(offsets1), 4)
+    h2, offsets2 = scanbuf_array(hash_value, data)
+    self.assertIsInstance(offsets2, array)
+    self.assertEqual(offsets2.typecode, 'Q')
+    self.assertEqual(h1, h2)
+    self.assertEqual(offsets1, offsets2.tolist())
+    h2, offsets2 = scanbuf_array(hash_value, b'')
+    self.assertEqual(len(offsets2), 0)
+    # caller supplied output: exact, oversized and truncated
+    for room in len(offsets1), len(offsets1) + 3, len(offsets1) // 2, 0:
+      with self.subTest(room=room):
+        out = array('Q', [0xdeadbeef] * room)
+        h2, count = scanbuf_array(hash_value, bytearray(data), out=out)
+        self.assertEqual(h1, h2)
+        self.assertEqual(count, len(offsets1))
+        ncopy = min(room, count)
+        self.assertEqual(out[:ncopy].tolist(), offsets1[:ncopy])
+        self.assertTrue(all(o == 0xdeadbeef for o in out[ncopy:]))
+    # a raw byte buffer holds len//8 offsets
+    out = bytearray(8 * 3 + 5)
+    h2, count = scanbuf_array(hash_value, data, out=out)
+    self.assertEqual(count, len(offsets1))
+    self.assertEqual(
+        memoryview(out)[:24].cast('Q').tolist(), offsets1[:3]
+    )
+    with self.assertRaises((BufferError, TypeError)):
+      scanbuf_array(hash_value, data, out=bytes(64))
+
+  def test05scanner(self):
+    ''' Compare the Scanner against the pure Python PyScanner.
+    '''
+    for min_block, max_block in (8, 9), (80, 16383), (1000, 1100):
+      data = bytes(random.randint(0, 255) for _ in range(300000))
+      scanners = Scanner(min_block, max_block), PyScanner(min_block, max_block)
+      ends = [[], []]
+      pos = 0
+      while pos < len(data):
+        chunk = data[pos:pos + random.choice((0, 1, 3, 100, 5000, 70000))]
+        # parser offsets, some stale, some beyond this chunk
+        offsets = [
+            pos + random.randint(-5000, len(chunk) + 5000)
+            for _ in range(random.randint(0, 5))
+        ]
+        for scanner, scanner_ends in zip(scanners, ends):
+          cuts = scanner.scan(chunk, offsets)
+          self.assertIsInstance(cuts, array)
+          scanner_ends.extend(pos + cut for cut in cuts)
+        pos += len(chunk)
+      with self.subTest(min_block=min_block, max_block=max_block):
+        self.assertEqual(ends[0], ends[1])
+        for attr in 'hash_value', 'offset', 'last_offset', 'nforced':
+          self.assertEqual(
+              getattr(scanners[0], attr), getattr(scanners[1], attr), attr
+          )
+        self.assertEqual(scanners[0].offset, len(data))
+        prev = 0
+        for end in ends[0]:
+          self.assertTrue(0 < end - prev <= max_block)
+          prev = end
+    for scanner_class in Scanner, PyScanner:
+      with self.subTest(scanner_class=scanner_class):
+        with self.assertRaises(ValueError):
+          scanner_class(0, 100)
+        with self.assertRaises(ValueError):
+          scanner_class(100, 100)
+
+  def test06normalised(self):
+    ''' Compare the normalised Scanner against PyScanner,
+        and check that the cuts do not depend on the chunk sizes.
+    '''
+    for min_block, max_block in (8, 9), (80, 16383), (300, 2000):
+      data = bytes(random.randint(0, 255) for _ in range(200000))
+      whole = Scanner(min_block, max_block, normalised=True)
+      whole_ends = list(whole.scan(data))
+      scanners = (
+          Scanner(min_block, max_block, normalised=True),
+          PyScanner(min_block, max_block, normalised=True),
+      )
+      ends = [[], []]
+      pos = 0
+      while pos < len(data):
+        chunk = data[pos:pos + random.choice((0, 1, 3, 100, 5000, 70000))]
+        for scanner, scanner_ends in zip(scanners, ends):
+          scanner_ends.extend(pos + cut for cut in scanner.scan(chunk))
+        pos += len(chunk)
+      with self.subTest(min_block=min_block, max_block=max_block):
+        self.assertEqual(ends[0], ends[1])
+        self.assertEqual(ends[0], whole_ends)
+        for attr in 'hash_value', 'offset', 'last_offset', 'nforced', 'target':
+          self.assertEqual(
+              getattr(scanners[0], attr), getattr(scanners[1], attr), attr
+          )
+        prev = 0
+        for end in ends[0]:
+          self.assertTrue(min_block <= end - prev <= max_block)
+          prev = end
+    # parser offsets are honoured
+    for scanner_class in Scanner, PyScanner:
+      with self.subTest(scanner_class=scanner_class):
+        scanner = scanner_class(80, 16383, normalised=True)
+        self.assertEqual(
+            list(scanner.scan(bytes(1000), [10, 500, 550, 700, 5000])),
+            [500, 700]
+        )
+        self.assertEqual(list(scanner.scan(bytes(5000))), [4000])
+        with self.assertRaises(ValueError):
+          scanner_class(80, 16383, normalised=True, target=79)
+        with self.assertRaises(ValueError):
+          scanner_class(80, 16383, target=1000)
+
+  def test07algorithms(self):
+    ''' Compare the Scanner against PyScanner for each rolling hash.
+    '''
+    data = bytes(random.randint(0, 255) for _ in range(120000))
+    for algorithm in ROLLING_HASHES:
+      for normalised in False, True:
+        whole = Scanner(80, 16383, normalised=normalised, algorithm=algorithm)
+        self.assertEqual(whole.algorithm, algorithm)
+        whole_ends = list(whole.scan(data))
+        scanners = (
+            Scanner(80, 16383, normalised=normalised, algorithm=algorithm),
+            PyScanner(80, 16383, normalised=normalised, algorithm=algorithm),
+        )
+        ends = [[], []]
+        pos = 0
+        while pos < len(data):
+          chunk = data[pos:pos + random.choice((0, 1, 3, 63, 100, 5000, 70000))]
+          for scanner, scanner_ends in zip(scanners, ends):
+            scanner_ends.extend(pos + cut for cut in scanner.scan(chunk))
+          pos += len(chunk)
+        with self.subTest(algorithm=algorithm, normalised=normalised):
+          self.assertEqual(ends[0], ends[1])
+          if normalised:
+            # classic mode ignores a hash hit on the first byte of a chunk,
+            # so only normalised cuts are independent of the chunking
+            self.assertEqual(ends[0], whole_ends)
+          self.assertGreater(len(whole_ends), 5)
+          for attr in 'hash_value', 'offset', 'last_offset', 'nforced':
+            self.assertEqual(
+                getattr(scanners[0], attr), getattr(scanners[1], attr), attr
+            )
+    # a large scan runs threaded, it must match a piecewise serial scan
+    data = bytes(random.randint(0, 255) for _ in range(3 * 1024 * 1024))
+    for algorithm in ROLLING_HASHES:
+      with self.subTest(algorithm=algorithm, threaded=True):
+        whole = Scanner(80, 16383, algorithm=algorithm)
+        whole_ends = list(whole.scan(data))
+        # start the pieces just past a cut, where min_block rejects
+        # the hash hit on the first byte which classic mode would ignore
+        piece_starts = sorted(
+            {0} | {
+                min(end for end in whole_ends if end >= pos) + 1
+                for pos in range(0, whole_ends[-1], 100000)
+            }
+        )
+        pieces = Scanner(80, 16383, algorithm=algorithm)
+        piece_ends = []
+        for pos, next_pos in zip(piece_starts, piece_starts[1:] + [len(data)]):
+          piece_ends.extend(
+              pos + cut for cut in pieces.scan(data[pos:next_pos])
+          )
+        self.assertEqual(whole_ends, piece_ends)
+        self.assertEqual(whole.hash_value, pieces.hash_value)
+    for scanner_class in Scanner, PyScanner:
+      with self.subTest(scanner_class=scanner_class):
+        self.assertEqual(scanner_class(80, 16383).algorithm, 'vt28')
+        with self.assertRaises(ValueError):
+          scanner_class(80, 16383, algorithm='no-such-hash')
+
+  def test08divisor(self):
+    ''' Classic chunking with a larger divisor gives larger blocks.
+    '''
+    data = bytes(random.randint(0, 255) for _ in range(400000))
+    for divisor in 3, 4093, 16385:
+      with self.subTest(divisor=divisor):
+        scanners = (
+            Scanner(80, 131071, divisor=divisor),
+            PyScanner(80, 131071, divisor=divisor),
+        )
+        ends = [[], []]
+        pos = 0
+        while pos < len(data):
+          chunk = data[pos:pos + random.choice((1, 100, 5000, 70000))]
+          for scanner, scanner_ends in zip(scanners, ends):
+            scanner_ends.extend(pos + cut for cut in scanner.scan(chunk))
+          pos += len(chunk)
+        self.assertEqual(ends[0], ends[1])
+        self.assertEqual(scanners[0].divisor, divisor)
+        self.assertEqual(scanners[0].hash_value, scanners[1].hash_value)
+        # expect about min_block+divisor bytes per block
+        average = ends[0][-1] / len(ends[0])
+        self.assertTrue(
+            (80 + divisor) / 2 < average < (80 + divisor) * 2, average
+        )
+    for scanner_class in Scanner, PyScanner:
+      with self.subTest(scanner_class=scanner_class):
+        self.assertEqual(scanner_class(80, 16383).divisor, 4093)
+        self.assertEqual(scanner_class(80, 16383, normalised=True).divisor, 0)
+        for divisor in 1, 4096, (1 << 24) + 3:
+          with self.assertRaises(ValueError):
+            scanner_class(80, 16383, divisor=divisor)
+        with self.assertRaises(ValueError):
+          scanner_class(80, 16383, normalised=True, divisor=4093)
+
+  def test09digests(self):
+    ''' Block digests computed by the Scanner in the same pass.
+    '''
+    data = bytes(random.randint(0, 255) for _ in range(300000))
+    for hashname in SCAN_DIGESTS:
+      digest_size = new_digest(hashname).digest_size
+      for normalised in False, True:
+        with self.subTest(hashname=hashname, normalised=normalised):
+          scanners = (
+              Scanner(80, 16383, normalised=normalised, hashname=hashname),
+              PyScanner(80, 16383, normalised=normalised, hashname=hashname),
+          )
+          for scanner in scanners:
+            self.assertEqual(scanner.hashname, hashname)
+            ends = []
+            digests = []
+            pos = 0
+            while pos < len(data):
+              chunk = data[pos:pos + random.choice((0, 1, 100, 5000, 70000))]
+              cuts, chunk_digests = scanner.scan_digests(chunk)
+              self.assertEqual(len(chunk_digests), len(cuts) * digest_size)
+              ends.extend(pos + cut for cut in cuts)
+              digests.extend(
+                  chunk_digests[i:i + digest_size]
+                  for i in range(0, len(chunk_digests), digest_size)
+              )
+              pos += len(chunk)
+            self.assertGreater(len(ends), 5)
+            prev = 0
+            for end, digest in zip(ends, digests):
+              self.assertEqual(
+                  digest,
+                  new_digest(hashname, data[prev:end]).digest()
+              )
+              prev = end
+            self.assertEqual(
+                scanner.pending_digest(),
+                new_digest(hashname, data[prev:]).digest()
+            )
+    for scanner_class in Scanner, PyScanner:
+      with self.subTest(scanner_class=scanner_class):
+        # a short stream with no cuts is all pending
+        scanner = scanner_class(80, 16383, hashname='sha1')
+        self.assertEqual(scanner.scan_digests(b'abc'), (array('Q'), b''))
+        self.assertEqual(scanner.pending_digest(), hashlib.sha1(b'abc').digest())
+        with self.assertRaises(ValueError):
+          scanner_class(80, 16383, hashname='md5')
+        scanner = scanner_class(80, 16383)
+        self.assertIsNone(scanner.hashname)
+        with self.assertRaises(ValueError):
+          scanner.scan_digests(b'abc')
+
+  def test10dataRecords(self):
+    ''' DataRecords prepared in batches match those made by DataRecord.
+    '''
+    blocks = [
+        b'',
+        b'short',
+        bytes(16),
+        bytes(random.randint(0, 255) for _ in range(5000)),
+        b'abcdefgh' * 2000,
+        bytearray(b'x' * 200000),
+        memoryview(bytes(random.randint(0, 3) for _ in range(70000))),
+    ] + [bytes(random.randint(0, 15) for _ in range(4000)) for _ in range(50)]
+    for threads in None, 1, 3:
+      with self.subTest(threads=threads):
+        records = data_records(blocks, threads=threads)
+        self.assertEqual(records, py_data_records(blocks))
+        self.assertEqual(len(records), len(blocks))
+        for data, (record, data_offset, data_length, flags) in zip(blocks,
+                                                                   records):
+          DR = DataRecord(bytes(data))
+          self.assertEqual(record, bytes(DR))
+          self.assertEqual(data_offset, DR.data_offset)
+          self.assertEqual(data_length, DR.raw_data_length)
+          self.assertEqual(flags, DR.flags)
+          self.assertEqual(DataRecord.from_bytes(record).data, data)
+    self.assertEqual(data_records([]), [])
+    with self.assertRaises(TypeError):
+      data_records([b'abc', 'abc'])
+    with self.assertRaises(ValueError):
+      data_records([b'abc'], level=10)
+
+  def test11scanFile(self):
+    ''' Scanning a file range matches scanning its data in 1MiB pieces.
+    '''
+    data = bytes(random.randint(0, 255) for _ in range(1300000))
+    with tempfile.TemporaryFile() as f:
+      f.write(data)
+      f.flush()
+      fd = f.fileno()
+      for start, end in (0, None), (12345, 1250000), (0, 0), (100, 200):
+        span = data[start:end]
+        for scanner_class in Scanner, PyScanner:
+          with self.subTest(scanner_class=scanner_class, start=start, end=end):
+            scanner = scanner_class(80, 16383, hashname='sha1')
+            expected = array('Q')
+            digests = []
+            for pos in range(0, len(span), SCAN_FILE_CHUNK):
+              cuts, chunk_digests = scanner.scan_digests(
+                  span[pos:pos + SCAN_FILE_CHUNK]
+              )
+              expected.extend(pos + cut for cut in cuts)
+              digests.append(chunk_digests)
+            pending = scanner.pending_digest()
+            scanner = scanner_class(80, 16383, hashname='sha1')
+            cuts, file_digests = scanner.scan_file_digests(fd, start, end)
+            self.assertEqual(cuts, expected)
+            self.assertEqual(file_digests, b''.join(digests))
+            self.assertEqual(scanner.pending_digest(), pending)
+            self.assertEqual(
+                scanner_class(80, 16383).scan_file(fd, start, end), expected
+            )
+      for scanner_class in Scanner, PyScanner:
+        with self.subTest(scanner_class=scanner_class):
+          with self.assertRaises(ValueError):
+            scanner_class(80, 16383).scan_file(fd, 10, 5)
+          with self.assertRaises(ValueError):
+            scanner_class(80, 16383).scan_file(fd, 0, len(data) + 1)
+          with self.assertRaises(ValueError):
+            scanner_class(80, 16383).scan_file_digests(fd)
+
+  def test12threadedScanners(self):
+    ''' Scanners used concurrently from several threads
+        agree with the same scans run serially,
+        and a Scanner in use by another call is refused.
+    '''
+    datas = [
+        bytes(random.randint(0, 255) for _ in range(200000)) for _ in range(4)
+    ]
+
+    def scan(data):
+      scanner = Scanner(80, 16383, hashname='sha256')
+      cuts = array('Q')
+      digests = []
+      for pos in range(0, len(data), 65536):
+        chunk_cuts, chunk_digests = scanner.scan_digests(
+            data[pos:pos + 65536]
+        )
+        cuts.extend(pos + cut for cut in chunk_cuts)
+        digests.append(chunk_digests)
+      return cuts, b''.join(digests), scanner.pending_digest()
+
+    expected = [scan(data) for data in datas]
+    results = [None] * len(datas)
+
+    def run(i):
+      results[i] = scan(datas[i])
+
+    threads = [Thread(target=run, args=(i,)) for i in range(len(datas))]
+    for T in threads:
+      T.start()
+    for T in threads:
+      T.join()
+    self.assertEqual(results, expected)
+    # a single Scanner shared between threads is either used or refused
+    scanner = Scanner(80, 16383)
+    errors = []
+
+    def share():
+      for _ in range(20):
+        try:
+          scanner.scan(datas[0])
+        except RuntimeError as e:
+          errors.append(e)
+
+    threads = [Thread(target=share) for _ in range(4)]
+    for T in threads:
+      T.start()
+    for T in threads:
+      T.join()
+    for e in errors:
+      self.assertEqual(str(e), "Scanner in use")
+
+  def test13subinterpreters(self):
+    ''' The native module can be imported and used in a subinterpreter.
+    '''
+    if Scanner is PyScanner:
+      raise unittest.SkipTest("no native Scanner")
+    try:
+      import _interpreters as interpreters
+    except ImportError:
+      try:
+        import _xxsubinterpreters as interpreters
+      except ImportError:
+        raise unittest.SkipTest("no subinterpreter support")
+    interp = interpreters.create()
+    try:
+      interpreters.run_string(
+          interp, '\n'.join(
+              (
+                  'import sys',
+                  'sys.path[:] = %r' % (sys.path,),
+                  'import random',
+                  'from cs.vt._scan import Scanner, scanbuf_array',
+                  'data = random.Random(1).randbytes(100000)',
+                  'assert len(Scanner(80, 16383).scan(data)) > 0',
+                  'assert len(scanbuf_array(0, data)[1]) > 0',
+              )
+          )
+      )
+    finally:
+      interpreters.destroy(interp)
+
+  def test14runs(self):
+    ''' Runs of one octet are cut out alike by the C and Python Scanners.
+    '''
+    rnd = random.Random()
+    parts = []
+    for _ in range(12):
+      if rnd.random() < 0.4:
+        parts.append(bytes((rnd.choice((0, 0, 255)),)) * rnd.randint(1, 9000))
+      else:
+        parts.append(rnd.randbytes(rnd.randint(1, 20000)))
+    data = b''.join(parts)
+    pieces = []
+    pos = 0
+    while pos < len(data):
+      size = rnd.choice((1, 100, 4096, 65536))
+      pieces.append(data[pos:pos + size])
+      pos += size
+    for normalised in False, True:
+      for min_run in 0, 100, 4096:
+        with self.subTest(normalised=normalised, min_run=min_run):
+          results = []
+          for scanner_class in Scanner, PyScanner:
+            scanner = scanner_class(
+                80,
+                16383,
+                normalised=normalised,
+                hashname='sha1',
+                min_run=min_run
+            )
+            result = []
+            for piece in pieces:
+              cuts, digests = scanner.scan_digests(piece)
+              result.append((cuts, digests, scanner.runs()))
+            result.append(scanner.pending_run())
+            results.append(result)
+            # check the blocks against the data
+            offset = 0
+            last = 0
+            for piece, (cuts, digests, runs) in zip(pieces, result):
+              runs = dict(runs)
+              for cutndx, cut in enumerate(cuts):
+                block = data[last:offset + cut]
+                digest = digests[cutndx * 20:(cutndx + 1) * 20]
+                if cutndx in runs:
+                  # a run which began in an earlier piece is cut from
+                  # the piece start, so count the repeats before the block
+                  start = last
+                  while start > 0 and data[start - 1] == runs[cutndx]:
+                    start -= 1
+                  self.assertGreaterEqual(offset + cut - start, min_run)
+                  self.assertEqual(block, bytes((runs[cutndx],)) * len(block))
+                  self.assertEqual(digest, bytes(20))
+                else:
+                  self.assertLessEqual(len(block), 16383)
+                  self.assertEqual(digest, hashlib.sha1(block).digest())
+                last = offset + cut
+              offset += len(piece)
+          self.assertEqual(results[0], results[1])
+    with self.assertRaises(ValueError):
+      Scanner(80, 16383, min_run=1)
+
+  def test15prefixes(self):
+    ''' scan_prefixes and scan_text find the same lines as linesof.
+    '''
+    rnd = random.Random()
+    prefixes = tuple(
+        prefix if isinstance(prefix, bytes) else prefix.encode()
+        for prefix in PREFIXES_ALL
+    )
+    words = prefixes + (b'x', b'  ', b'def', b'From', b'\n', b'\n\n')
+    for _ in range(200):
+      data = b''.join(
+          rnd.choice(words) + rnd.choice((b'\n', b' ', b''))
+          for _ in range(rnd.randrange(200))
+      )
+      expected = []
+      offset = 0
+      for line in linesof([data]):
+        if line.startswith(prefixes):
+          expected.append(offset)
+        offset += len(line)
+      for at_start in True, False:
+        self.assertEqual(
+            scan_prefixes(data, prefixes, at_start),
+            py_scan_prefixes(data, prefixes, at_start)
+        )
+      cuts = sorted(rnd.randrange(len(data) + 1) for _ in range(5))
+      chunks = [data[a:b] for a, b in zip([0] + cuts, cuts + [len(data)])]
+      self.assertEqual(list(scan_text(chunks, prefixes)), expected)
+    self.assertEqual(
+        scan_prefixes(b'From x\nFro', (b'From ',)), (array('Q', [0]), 7)
+    )
+
+  def test16media(self):
+    ''' The box and MP3 frame walkers find the same offsets
+        however the data are chunked.
+    '''
+    rnd = random.Random()
+
+    def chunked(data):
+      cuts = sorted(rnd.randrange(len(data) + 1) for _ in range(20))
+      return [data[a:b] for a, b in zip([0] + cuts, cuts + [len(data)])]
+
+    def box(box_type, body, large=False):
+      if large:
+        return (1).to_bytes(4, 'big') + box_type + (16 + len(body)
+                                                    ).to_bytes(8, 'big') + body
+      return (8 + len(body)).to_bytes(4, 'big') + box_type + body
+
+    boxes = []
+    mp4 = b''
+    for box_type, body, large in (
+        (b'ftyp', b'isom' + bytes(4), False),
+        (b'moov', box(b'mvhd', bytes(100)) + box(
+            b'trak',
+            box(b'tkhd', bytes(84)) + box(b'mdia', box(b'stbl', box(b'stsd', bytes(20))))
+        ) + box(b'udta', box(b'meta', bytes(4) + box(b'hdlr', bytes(25)))),
+         False),
+        (b'mdat', rnd.randbytes(70000), True),
+        (b'free', bytes(3), False),
+    ):
+      boxes.append(len(mp4))
+      mp4 += box(box_type, body, large)
+    # the moov contents
+    boxes[2:2] = [24, 132, 140, 232, 240, 248, 276, 284, 296]
+    # a final box extending to the end of the data
+    boxes.append(len(mp4))
+    mp4 += bytes(4) + b'mdat' + rnd.randbytes(5000)
+    for scan in scan_boxes, py_scan_boxes:
+      for _ in range(50):
+        self.assertEqual(list(scan_headers(chunked(mp4), scan, ())), boxes)
+
+    frames = [0]
+    mp3 = b'ID3\x04\x00\x00' + bytes((0, 0, 1, 0)) + bytes(128)
+    for i in range(40):
+      if i == 20:
+        mp3 += b'\x00\xff\x01junk'
+      padding = i % 3 == 0
+      frames.append(len(mp3))
+      # MPEG1 layer III at 128kbps and 44100Hz
+      mp3 += bytes((0xff, 0xfb, 0x92 if padding else 0x90, 0x64))
+      mp3 += rnd.randbytes(413 + padding).replace(b'\xff', b'\x00')
+    frames.append(len(mp3))
+    mp3 += b'TAG' + bytes(125)
+    for scan in scan_mp3_frames, py_scan_mp3_frames:
+      for _ in range(50):
+        self.assertEqual(list(scan_headers(chunked(mp3), scan)), frames)
+
+  def test17vtd(self):
+    ''' The .vtd record walkers agree with the records from data_records.
+    '''
+    rnd = random.Random()
+    blocks = [
+        rnd.randbytes(rnd.randrange(20000))
+        if rnd.random() < 0.5 else bytes(rnd.randrange(20000))
+        for _ in range(200)
+    ]
+    records = data_records(blocks)
+    data = b''.join(record for record, _, _, _ in records)
+    offsets = []
+    offset = 0
+    for record, _, _, _ in records:
+      offsets.append(offset)
+      offset += len(record)
+    with tempfile.TemporaryFile() as f:
+      # an incomplete record at the end is not scanned
+      f.write(data + records[0][0][:5])
+      f.flush()
+      for scan in scan_vtd_file, py_scan_vtd_file:
+        with self.subTest(scan=scan.__name__):
+          (
+              pre_offsets, data_offsets, data_lengths, flags, post_offset,
+              digests
+          ) = scan(f.fileno(), hashname='sha256')
+          self.assertEqual(list(pre_offsets), offsets)
+          self.assertEqual(post_offset, len(data))
+          for i, (record, data_offset, data_length,
+                  record_flags) in enumerate(records):
+            self.assertEqual(data_offsets[i], offsets[i] + data_offset)
+            self.assertEqual(data_lengths[i], data_length)
+            self.assertEqual(flags[i], record_flags)
+          self.assertEqual(
+              digests,
+              b''.join(hashlib.sha256(block).digest() for block in blocks)
+          )
+          self.assertIsNone(scan(f.fileno(), offsets[3], offsets[9])[5])
+      f.seek(0)
+      f.write(b'\x02')
+      f.flush()
+      for scan in scan_vtd_file, py_scan_vtd_file:
+        with self.assertRaises(ValueError):
+          scan(f.fileno())
+    pieces = [data[i:i + 1000] for i in range(0, len(data), 1000)]
+    for scan in scan_vtd_records, py_scan_vtd_records:
+      self.assertEqual(list(scan_headers(pieces, scan)), offsets)
+
+  @unittest.skipIf(numpy is None, "no NumPy")
+  def test18numpy(self):
+    ''' Compare the NumPy scanbuf and vt28 hash with the pure Python ones.
+    '''
+    vt28 = PY_ROLLING_HASHES['vt28']
+    for length in list(range(8)) + [4099, NP_SCAN_CHUNK + 5]:
+      data = bytes(random.randint(0, 255) for _ in range(length))
+      hash_value = random.randint(0, 0xffffffff)
+      with self.subTest(length=length):
+        self.assertEqual(
+            np_scanbuf(hash_value, data), py_scanbuf(hash_value, data)
+        )
+        self.assertEqual(
+            np_scanbuf_array(hash_value, data),
+            py_scanbuf_array(hash_value, data)
+        )
+        for start, end in (0, None), (length // 3, length - length // 4):
+          self.assertEqual(
+              vt28.scan(hash_value, bytes(4), data, start, end, (61, 59)),
+              super(type(vt28), vt28).scan(
+                  hash_value, bytes(4), data, start, end, (61, 59)
+              )
+          )
+
+  def test19scanbuf_v(self):
+    ''' Compare scanbuf_v over some buffers with scanbuf over their concatenation.
+    '''
+    lengths = [0, 1, 3, 4099, 0, 2, 65536, 7, 300000]
+    buffers = [
+        bytes(random.randint(0, 255) for _ in range(length))
+        for length in lengths
+    ]
+    data = b''.join(buffers)
+    hash_value = random.randint(0, 0xffffffff)
+    h0, offsets0 = py_scanbuf(hash_value, data)
+    # the offsets of each buffer relative to its start
+    per_buffer = []
+    base = 0
+    for length in lengths:
+      per_buffer.append(
+          [offset - base for offset in offsets0 if base <= offset < base + length]
+      )
+      base += length
+    for kernel in scan_kernels:
+      if kernel in ('python', 'numpy'):
+        kscanbuf_v = scanbuf_v
+      else:
+        kscanbuf_v = lambda h, bufs, per_buffer=False, kernel=kernel: scanbuf_v(
+            h, bufs, per_buffer, kernel=kernel, threads=4
+        )
+      for func in kscanbuf_v, py_scanbuf_v:
+        with self.subTest(kernel=kernel, func=func.__name__):
+          h, offsets, ends = func(hash_value, buffers)
+          self.assertEqual(h, h0)
+          self.assertIsInstance(offsets, array)
+          self.assertEqual(list(offsets), offsets0)
+          self.assertIsNone(ends)
+          h, offsets, ends = func(hash_value, buffers, per_buffer=True)
+          self.assertEqual(h, h0)
+          self.assertEqual(len(ends), len(buffers))
+          start = 0
+          for end, buf_offsets in zip(ends, per_buffer):
+            self.assertEqual(list(offsets[start:end]), buf_offsets)
+            start = end
+          self.assertEqual(func(hash_value, [b'', b'']), (hash_value, array('Q'), None))
+    self.assertRaises(TypeError, scanbuf_v, 0, [b'abc', 'abc'])
+
+def selftest(argv):
+  ''' Run the unit tests.
+  '''
+  unittest.main(__name__, None, argv)
+
+if __name__ == '__main__':
+  selftest(sys.argv)
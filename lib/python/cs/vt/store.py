@@ -31,6 +31,7 @@ from .hash import (
     HashCode, DEFAULT_HASHCLASS, HASHCLASS_BY_NAME, HashCodeUtilsMixin,
     MissingHashcodeError
 )
+from .scan import SCAN_SETTINGS
 
 class StoreError(Exception):
   ''' Raised by Store operation failures.
@@ -132,6 +133,15 @@ class _BasicStoreCommon(Mapping, MultiOpenMixin, HashCodeUtilsMixin,
       self._archives = {}
       self._blockmapdir = None
       self.block_cache = None
+      # the chunking mode for new data, None for the default
+      self.chunking = None
+      # the rolling hash name for new data, None for the default
+      self.rolling_hash = None
+      # the target average and maximum block sizes, None for the defaults
+      self.avg_block = None
+      self.max_block = None
+      # the shortest run of one octet stored as an RLEBlock, None for the default
+      self.min_run = None
 
   def init(self):
     ''' Method provided to support "vt init".
@@ -509,12 +519,19 @@ class BasicStoreAsync(_BasicStoreCommon):
 
 class MappingStore(BasicStoreSync):
   ''' A Store built on an arbitrary mapping object.
+
+      If the mapping does not supply its own `.range_tree`
+      the Store builds a `RangeTree` when it is opened
+      and keeps it up to date as data are added through the Store.
+      Changes made directly to the mapping are not seen.
   '''
 
   def __init__(self, name, mapping, **kw):
     BasicStoreSync.__init__(self, name, **kw)
     self.mapping = mapping
     self._str_attrs.update(mapping=type(mapping).__name__)
+    self._range_tree = None
+    self._range_tree_lock = Lock()
 
   def startup(self):
     super().startup()
@@ -525,6 +542,9 @@ class MappingStore(BasicStoreSync):
       pass
     else:
       openmap()
+    if not hasattr(mapping, 'range_tree'):
+      # build our tree now so that .has_range_tree holds while we are open
+      self.range_tree()
 
   def shutdown(self):
     mapping = self.mapping
@@ -534,6 +554,8 @@ class MappingStore(BasicStoreSync):
       pass
     else:
       closemap()
+    # the mapping may be changed by others while we are closed
+    self._range_tree = None
     super().shutdown()
 
   def add(self, data):
@@ -541,9 +563,52 @@ class MappingStore(BasicStoreSync):
         Return the hashcode.
     '''
     h = self.hash(data)
-    self.mapping[h] = data
+    self._mapping_add(h, lambda: self.mapping.__setitem__(h, data))
     return h
 
+  def add_hashed(self, data, hashcode):
+    ''' Add `data` whose `hashcode` has already been computed,
+        for example by `Scanner.scan_digests`, return the hashcode.
+        The `hashcode` is trusted, not checked.
+    '''
+    mapping_add_hashed = getattr(self.mapping, 'add_hashed', None)
+    if mapping_add_hashed is None:
+      self._mapping_add(
+          hashcode, lambda: self.mapping.__setitem__(hashcode, data)
+      )
+    else:
+      self._mapping_add(hashcode, lambda: mapping_add_hashed(data, hashcode))
+    return hashcode
+
+  def _mapping_add(self, hashcode, add):
+    ''' Call `add()` to store `hashcode` in the mapping,
+        and add it to our `RangeTree` if we have one and it is new.
+    '''
+    if hasattr(self.mapping, 'range_tree'):
+      # the mapping maintains its own tree
+      add()
+      return
+    with self._range_tree_lock:
+      tree = self._range_tree
+      is_new = tree is not None and hashcode not in self.mapping
+      add()
+      if is_new:
+        tree.add(hashcode)
+
+  def add_hashed_many(self, data_hashcodes):
+    ''' Add `(data,hashcode)` pairs whose hashcodes have already been
+        computed, return a list of the hashcodes.
+        If the mapping has an `add_hashed_many` method, for example
+        a `DataDir` which compresses the data in parallel,
+        the pairs are added in a single call.
+    '''
+    mapping_add_hashed_many = getattr(self.mapping, 'add_hashed_many', None)
+    if mapping_add_hashed_many is None:
+      return [
+          self.add_hashed(data, hashcode) for data, hashcode in data_hashcodes
+      ]
+    return mapping_add_hashed_many(data_hashcodes)
+
   def flush(self):
     ''' Call the .flush method of the underlying mapping, if any.
     '''
@@ -565,6 +630,33 @@ class MappingStore(BasicStoreSync):
       hashcodes_method = super().hashcodes_from
     return hashcodes_method(**kw)
 
+  @property
+  def has_range_tree(self):
+    ''' Whether `.range_tree()` is cheap:
+        the mapping maintains its own or we are open and maintain ours.
+    '''
+    if hasattr(self.mapping, 'range_tree'):
+      return getattr(self.mapping, 'has_range_tree', False)
+    return self._range_tree is not None
+
+  def range_tree(self):
+    ''' Use the mapping's `.range_tree` if present,
+        otherwise our own `RangeTree`, built by `.startup`
+        and maintained by `.add` and `.add_hashed`.
+
+        This lets a mapping which maintains a `RangeTree`,
+        such as a `DataDir`, supply it directly.
+    '''
+    try:
+      range_tree_method = self.mapping.range_tree
+    except AttributeError:
+      with self._range_tree_lock:
+        tree = self._range_tree
+        if tree is None:
+          tree = self._range_tree = super().range_tree()
+      return tree
+    return range_tree_method()
+
   def __len__(self):
     return len(self.mapping)
 
@@ -948,10 +1040,36 @@ class DataDirStore(MappingStore):
     MappingStore.__init__(self, name, self._datadir, hashclass=hashclass, **kw)
 
   def startup(self):
-    ''' Startup: open the internal DataDir.
+    ''' Startup: open the internal DataDir
+        and reconcile the scan settings with those it records.
     '''
     super().startup()
     self._datadir.open()
+    self._sync_scan_settings()
+
+  def _sync_scan_settings(self):
+    ''' Reconcile the scan settings with those recorded in the DataDir,
+        so that later imports choose the same block boundaries.
+
+        Settings not specified for this Store come from the DataDir.
+        Specified settings are recorded in the DataDir,
+        with a warning if they change a recorded setting.
+    '''
+    datadir = self._datadir
+    for setting, (setting_type, _) in SCAN_SETTINGS.items():
+      with Pfx(setting):
+        value = getattr(self, setting)
+        recorded = datadir.get_setting(setting)
+        if value is None:
+          if recorded is not None:
+            setattr(self, setting, setting_type(recorded))
+        elif recorded != str(value):
+          if recorded is not None:
+            warning(
+                "%s: changing recorded %s from %s to %s", self, setting,
+                recorded, value
+            )
+          datadir.set_setting(setting, value)
 
   def shutdown(self):
     ''' Shutdown: close the internal DataDir.
@@ -12,6 +12,7 @@
 from __future__ import with_statement
 from enum import IntEnum
 from functools import lru_cache
+from struct import Struct
 from subprocess import Popen, PIPE
 from threading import Lock
 import time
@@ -26,7 +27,7 @@ from cs.binary import (
     SimpleBinary,
 )
 from cs.buffer import CornuCopyBuffer
-from cs.logutils import debug, warning, error
+from cs.logutils import debug, info, warning, error
 from cs.packetstream import PacketConnection
 from cs.pfx import Pfx, pfx_method
 from cs.py.func import prop
@@ -39,9 +40,12 @@ from .hash import (
     decode as hash_decode,
     HasDotHashclassMixin,
     HashCode,
+    HashCodeArray,
     HashCodeField,
 )
-from .pushpull import missing_hashcodes_by_checksum
+from .pushpull import (
+    missing_hashcodes_by_checksum, missing_hashcodes_by_range
+)
 from .store import StoreError, BasicStoreSync
 from .transcribe import parse
 
@@ -58,6 +62,7 @@ class RqType(IntEnum):
   ARCHIVE_UPDATE = 7  # (archive_name,when,E)
   ARCHIVE_LIST = 8  # (count,archive_name) -> (when,E)...
   LENGTH = 9  # () -> remote-store-length
+  RANGE_DIGESTS = 10  # (level,indices) -> RangeTree node digests
 
 class StreamStore(BasicStoreSync):
   ''' A Store connected to a remote Store via a `PacketConnection`.
@@ -111,6 +116,8 @@ class StreamStore(BasicStoreSync):
     self.mode_addif = addif
     self._local_store = local_store
     self.exports = exports
+    # whether the remote Store supports range digests, probed on demand
+    self._has_range_tree = None
     # parameters controlling connection hysteresis
     self._conn_attempt_last = 0.0
     self._conn_attempt_delay = 10.0
@@ -371,8 +378,83 @@ class StreamStore(BasicStoreSync):
 
   def hashcodes_missing(self, other, **kw):
     ''' Generator yielding hashcodes in `other` which are missing in `self`.
-    '''
-    return missing_hashcodes_by_checksum(self, other, **kw)
+        This compares `RangeTree` digests with `missing_hashcodes_by_range`
+        if both Stores maintain a `RangeTree`,
+        returning at once if their `.set_digest()`s agree,
+        otherwise it uses `missing_hashcodes_by_checksum`.
+    '''
+    if not (self.has_range_tree and other.has_range_tree):
+      return missing_hashcodes_by_checksum(self, other, **kw)
+    if self.set_digest() == other.set_digest():
+      # the same hashcodes: nothing is missing
+      return iter(())
+    return missing_hashcodes_by_range(self, other)
+
+  def set_digest(self):
+    ''' Return the `(count,sum)` digest of all the remote hashcodes
+        in a single `RANGE_DIGESTS` request for the root,
+        or `None` if the remote Store does not maintain a `RangeTree`.
+    '''
+    if not self.has_range_tree:
+      return None
+    return self.range_digests(0, [0])[0]
+
+  @property
+  def has_range_tree(self):
+    ''' Whether the remote Store maintains a `RangeTree`
+        and serves `RANGE_DIGESTS` requests,
+        probed with one request on first use.
+        Only a definite answer from the remote is remembered;
+        if the probe fails this returns `False` and probes again next time.
+    '''
+    if self._has_range_tree is None:
+      try:
+        digests = self._range_digests(0, [0])
+      except StoreError as e:
+        warning("%s: range digests probe failed: %s", self, e)
+        return False
+      self._has_range_tree = digests is not None
+      if not self._has_range_tree:
+        info("%s: the remote Store has no RangeTree", self)
+    return self._has_range_tree
+
+  def range_digests(self, level, indices):
+    ''' Fetch the remote `RangeTree` digests
+        of the nodes at `level` with the `indices`.
+    '''
+    digests = self._range_digests(level, indices)
+    if digests is None:
+      self._has_range_tree = False
+      raise StoreError("the remote Store has no RangeTree")
+    return digests
+
+  def _range_digests(self, level, indices):
+    ''' Fetch the remote `RangeTree` digests
+        of the nodes at `level` with the `indices`,
+        or return `None` if the remote Store does not maintain a `RangeTree`.
+    '''
+    indices = list(indices)
+    flags, payload = self.do(
+        RangeDigestsRequest(
+            hashenum=self.hashclass.HASHENUM,
+            level=level,
+            indices=b''.join(RANGE_INDEX.pack(index) for index in indices),
+        )
+    )
+    served = flags & 0x01
+    if served:
+      flags &= ~0x01
+    if flags:
+      raise StoreError("unexpected flags: 0x%02x" % (flags,))
+    if not served:
+      if payload:
+        raise StoreError("no RangeTree, but payload=%r" % (payload,))
+      return None
+    if len(payload) != len(indices) * RANGE_DIGEST.size:
+      raise StoreError(
+          "expected %d digests, got %d bytes" % (len(indices), len(payload))
+      )
+    return list(RANGE_DIGEST.iter_unpack(payload))
 
   @typechecked
   @require(
@@ -387,13 +469,29 @@ class StreamStore(BasicStoreSync):
       after: bool = False,
       length: Optional[int] = None
   ):
-    hashclass = self.hashclass
-    if length is not None and length < 1:
-      raise ValueError("length should be None or >1, got: %r" % (length,))
-    if after and start_hashcode is None:
-      raise ValueError(
-          "after=%s but start_hashcode=%s" % (after, start_hashcode)
+    return list(
+        self.hashcode_array(
+            start_hashcode=start_hashcode, after=after, length=length
+        )
+    )
+
+  @typechecked
+  @require(
+      lambda self, start_hashcode: (
+          start_hashcode is None or self.hashclass is None or
+          isinstance(start_hashcode, self.hashclass)
       )
+  )
+  def hashcode_array(
+      self,
+      start_hashcode=None,
+      after: bool = False,
+      length: Optional[int] = None
+  ):
+    ''' Fetch the remote hashcodes as a `HashCodeArray`
+        directly from the response payload.
+    '''
+    hashclass = self.hashclass
     if length is not None and length < 1:
       raise ValueError("length should be None or >1, got: %r" % (length,))
     if after and start_hashcode is None:
@@ -410,20 +508,12 @@ class StreamStore(BasicStoreSync):
     )
     if flags:
       raise StoreError("unexpected flags: 0x%02x" % (flags,))
-    bfr = CornuCopyBuffer([payload])
-    hashary = list(HashCodeField.scan_values(bfr))
-    # verify hashcode types
-    mismatches = set(
-        type(hashcode).__name__
-        for hashcode in hashary
-        if not isinstance(hashcode, hashclass)
-    )
-    if mismatches:
+    try:
+      return HashCodeArray.from_fields(hashclass, payload)
+    except ValueError as e:
       raise StoreError(
-          "expected hashcodes of type %s, got %d mismatches of of type %s" %
-          (hashclass.__name__, len(mismatches), sorted(mismatches))
-      )
-    return hashary
+          "expected hashcodes of type %s: %s" % (hashclass.__name__, e)
+      ) from e
 
   @require(
       lambda self, start_hashcode: start_hashcode is None or
@@ -763,13 +853,9 @@ class HashCodesRequest(SimpleBinary, HasDotHashclassMixin):
     length = self.length
     if length == 0:
       length = None
-    return b''.join(
-        h.encode() for h in local_store.hashcodes(
-            start_hashcode=self.start_hashcode,
-            after=self.after,
-            length=length
-        )
-    )
+    return local_store.hashcode_array(
+        start_hashcode=self.start_hashcode, after=self.after, length=length
+    ).encode()
 
 class HashOfHashCodesRequest(HashCodesRequest):
   ''' A request for a hashcode of remote hashcodes.
@@ -849,6 +935,52 @@ class ArchiveUpdateRequest(UnFlaggedPayloadMixin,
     entry = self.entry
     archive.update(entry.dirent, when=entry.when)
 
+# the RANGE_DIGESTS request indices and response digests
+RANGE_INDEX = Struct('>I')
+RANGE_DIGEST = Struct('>QQ')
+
+class RangeDigestsRequest(UnFlaggedPayloadMixin,
+                          BinaryMultiValue('RangeDigestsRequest',
+                                           dict(hashenum=BSUInt,
+                                                level=BSUInt,
+                                                indices=BSData))):
+  ''' Request the `(count,sum)` digests of some nodes
+      of the remote Store's `RangeTree`.
+      The indices are packed as big endian 32 bit values,
+      and the digests are returned the same way as 64 bit values.
+      The response flag `0x01` is set if the digests were returned
+      and clear if the remote Store does not maintain a `RangeTree`.
+  '''
+
+  RQTYPE = RqType.RANGE_DIGESTS
+
+  @property
+  def hashclass(self):
+    ''' The hash class derived from the hashenum.
+    '''
+    return HashCode.by_index(self.hashenum)
+
+  def do(self, stream):
+    ''' Return the digests from the local store,
+        or `0` if it does not maintain a `RangeTree`.
+    '''
+    local_store = stream._local_store
+    if local_store is None:
+      raise ValueError("no local_store, request rejected")
+    if self.hashclass is not local_store.hashclass:
+      raise ValueError(
+          "request hashclass=%s but local store %s.hashclass=%s" %
+          (self.hashclass, local_store, local_store.hashclass)
+      )
+    if not local_store.has_range_tree:
+      # building a tree per request costs more than it saves
+      return 0
+    indices = [index for index, in RANGE_INDEX.iter_unpack(self.indices)]
+    return 1, b''.join(
+        RANGE_DIGEST.pack(count, total) for count, total in
+        local_store.range_digests(self.level, indices)
+    )
+
 RqType.ADD.request_class = AddRequest
 RqType.GET.request_class = GetRequest
 RqType.CONTAINS.request_class = ContainsRequest
@@ -859,6 +991,7 @@ RqType.ARCHIVE_LAST.request_class = ArchiveLastRequest
 RqType.ARCHIVE_LIST.request_class = ArchiveListRequest
 RqType.ARCHIVE_UPDATE.request_class = ArchiveUpdateRequest
 RqType.LENGTH.request_class = LengthRequest
+RqType.RANGE_DIGESTS.request_class = RangeDigestsRequest
 
 def CommandStore(shcmd, addif=False):
   ''' Factory to return a StreamStore talking to a command.